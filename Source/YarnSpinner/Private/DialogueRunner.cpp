@@ -5,6 +5,10 @@
 
 #include "Line.h"
 #include "Option.h"
+#include "Algo/Count.h"
+#include "Async/Async.h"
+#include "Serialization/MemoryReader.h"
+#include "Serialization/MemoryWriter.h"
 #include "YarnSubsystem.h"
 #include "Misc/YSLogging.h"
 
@@ -13,6 +17,17 @@ THIRD_PARTY_INCLUDES_START
 THIRD_PARTY_INCLUDES_END
 
 
+namespace
+{
+    // "YSDR". Data written before there was a header starts with a bool, which serialises as 0 or 1.
+    constexpr uint32 DialogueStateMagic = 0x52445359;
+
+    // 1: the presented line and the VM snapshot, without a header
+    // 2: the runner's local variables as well
+    constexpr uint8 DialogueStateVersion = 2;
+}
+
+
 // Sets default values
 ADialogueRunner::ADialogueRunner()
 {
@@ -24,158 +39,125 @@ void ADialogueRunner::BeginPlay()
 {
     Super::BeginPlay();
 
+    CachedYarnSubsystem = GetGameInstance() ? GetGameInstance()->GetSubsystem<UYarnSubsystem>() : nullptr;
+
     if (!YarnProject)
     {
         UE_LOG(LogYarnSpinner, Error, TEXT("DialogueRunner can't initialize, because it doesn't have a Yarn Asset."));
         return;
     }
     
-    const TSharedPtr<Yarn::Program> Program = YarnProject->GetProgram();
-    if (!Program.IsValid())
+    // The prepared program is shared with every other runner using this project, so this is usually just a lookup
+    const TSharedPtr<const Yarn::RuntimeContext> RuntimeContext = YarnProject->GetRuntimeContext();
+    if (!RuntimeContext.IsValid())
     {
         UE_LOG(LogYarnSpinner, Error, TEXT("DialogueRunner can't initialize, because its Yarn Asset failed to load."));
         return;
     }
 
-    // Create the Library
-    Library = MakeUnique<Yarn::Library>();
+    // Create the VirtualMachine, supplying it with the prepared program and
+    // configuring it to use this ADialogueRunner as the variable storage
+    VirtualMachine = MakeUnique<Yarn::VirtualMachine>(RuntimeContext.ToSharedRef(), *this);
 
-    // Create the VirtualMachine, supplying it with the loaded Program and
-    // configuring it to use our library, plus use this ADialogueRunner as the
-    // logger and the variable storage
-    VirtualMachine = MakeUnique<Yarn::VirtualMachine>(Program.ToSharedRef(), *Library, *this);
-
-    VirtualMachine->OnLine.AddLambda([this](const Yarn::Line& Line)
+    // Content and function calls come straight to this runner rather than through the VM's delegates
+    VirtualMachine->SetDialogueSink(this);
+    VirtualMachine->SetContentBatching(bBatchContent);
+    if (RandomSeed != 0)
     {
-        YS_LOG("Received line %s", *Line.LineID.ToString());
-
-        // Get the Yarn line struct, and make a ULine out of it to use
-        ULine* LineObject = NewObject<ULine>(this);
-        LineObject->LineID = Line.LineID;
-
-        UpdateDisplayTextForLine(LineObject, Line);
+        VirtualMachine->SetRandomSeed(RandomSeed);
+    }
 
-        const TArray<TSoftObjectPtr<UObject>> LineAssets = YarnProject->GetLineAssets(LineObject->LineID);
-        YS_LOG_FUNC("Got %d line assets for line '%s'", LineAssets.Num(), *LineObject->LineID.ToString())
+    LinkLocalVariables(*RuntimeContext);
+}
 
-        OnRunLine(LineObject, LineAssets);
-    });
 
-    VirtualMachine->OnOptions.AddLambda([this](const Yarn::OptionSet& OptionSet)
+void ADialogueRunner::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+    // The game instance may already be gone when the game is shutting down
+    if (UYarnSubsystem* Subsystem = GetGameInstance() ? GetGameInstance()->GetSubsystem<UYarnSubsystem>() : nullptr)
     {
-        YS_LOG("Received %llu options", OptionSet.Options.Num());
-
-        // Build a TArray for every option in this OptionSet
-        TArray<UOption*> Options;
-
-        for (const Yarn::Option& Option : OptionSet.Options)
-        {
-            YS_LOG("- %i: %s", Option.ID, *Option.Line.LineID.ToString());
-
-            UOption* Opt = NewObject<UOption>(this);
-            Opt->OptionID = Option.ID;
-
-            Opt->Line = NewObject<ULine>(Opt);
-            Opt->Line->LineID = Option.Line.LineID;
-
-            UpdateDisplayTextForLine(Opt->Line, Option.Line);
+        Subsystem->GetLatentScheduler().CancelAll(this);
+    }
+    bIsDialogueRunning = false;
 
-            Opt->bIsAvailable = Option.IsAvailable;
+    // Hands the VM's state back to the shared pool now, rather than whenever this actor is collected
+    Prewarm.Reset();
+    VirtualMachine.Reset();
 
-            Opt->SourceDialogueRunner = this;
+    Super::EndPlay(EndPlayReason);
+}
 
-            Options.Add(Opt);
-        }
 
-        OnRunOptions(Options);
-    });
+void ADialogueRunner::OnDialogueStarted_Implementation()
+{
+    // default = no-op
+}
 
-    VirtualMachine->OnCheckFunctionExist.BindLambda([this](const FString& FunctionName) -> bool
-    {
-        return YarnSubsystem()->GetYarnLibraryRegistry()->HasFunction(FName(*FunctionName));
-    });
 
-    VirtualMachine->OnGetFunctionParamNum.BindLambda([this](const FString& FunctionName) -> int
-    {
-        return YarnSubsystem()->GetYarnLibraryRegistry()->GetExpectedFunctionParamCount(FName(*FunctionName));
-    });
+void ADialogueRunner::OnDialogueEnded_Implementation()
+{
+    // default = no-op
+}
 
-    VirtualMachine->OnCallFunction.BindLambda([this](const FString& FunctionName, const TArray<Yarn::FValue>& Parameters) -> Yarn::FValue
-    {
-        return YarnSubsystem()->GetYarnLibraryRegistry()->CallFunction(
-            FName(*FunctionName),
-            Parameters
-        );
-    });
 
-    VirtualMachine->OnCommand.AddLambda([this](const Yarn::Command& Command)
+void ADialogueRunner::OnRunYarnLine_Implementation(const FYarnLine& Line, const TArray<TSoftObjectPtr<UObject>>& LineAssets)
+{
+    // default = hand the line to OnRunLine as a ULine, recycled if bReuseLineObjects is set
+    ULine* LineObject = bReuseLineObjects ? PooledLine.Get() : nullptr;
+    if (!LineObject)
     {
-        YS_LOG("Received command \"%s\"", *Command.Text);
-
-        const FString& CommandText = Command.Text;
-
-        TArray<FString> CommandElements;
-        CommandText.ParseIntoArray(CommandElements, TEXT(" "));
-
-        if (CommandElements.Num() == 0)
-        {
-            UE_LOG(LogYarnSpinner, Error, TEXT("Command received, but was unable to parse it."));
-            OnRunCommand(FString("(unknown)"), TArray<FString>());
-            return;
-        }
-
-        const FName CommandName = FName(CommandElements[0]);
-        CommandElements.RemoveAt(0);
-
-        const UYarnLibraryRegistry* const Lib = YarnSubsystem()->GetYarnLibraryRegistry();
-
-        if (Lib->HasCommand(CommandName))
+        LineObject = NewObject<ULine>(this);
+        if (bReuseLineObjects)
         {
-            return Lib->CallCommand(
-                CommandName,
-                this,
-                CommandElements
-            );
+            PooledLine = LineObject;
         }
+    }
+    LineObject->SetFromYarnLine(Line);
 
-        // Haven't handled the function yet, so call the DialogueRunner's handler
-        OnRunCommand(CommandName.ToString(), CommandElements);
-    });
+    OnRunLine(LineObject, LineAssets);
+}
 
-    VirtualMachine->OnNodeStart.AddLambda( [this](const FString& NodeName)
-    {
-        UE_LOG(LogYarnSpinner, Log, TEXT("Received node start \"%s\""), *NodeName);
-    });
 
-    VirtualMachine->OnNodeComplete.AddLambda([this](const FString& NodeName)
+void ADialogueRunner::OnRunYarnOptions_Implementation(const TArray<FYarnOption>& Options)
+{
+    // default = hand the options to OnRunOptions as UOptions, recycled if bReuseLineObjects is set
+    if (!bReuseLineObjects)
     {
-        UE_LOG(LogYarnSpinner, Log, TEXT("Received node complete \"%s\""), *NodeName);
-    });
-
-    VirtualMachine->OnDialogueComplete.AddLambda([this]()
+        PooledOptions.Reset();
+    }
+    while (PooledOptions.Num() < Options.Num())
     {
-        UE_LOG(LogYarnSpinner, Log, TEXT("Received dialogue complete"));
-        OnDialogueEnded();
-    });
-}
+        UOption* Opt = NewObject<UOption>(this);
+        Opt->Line = NewObject<ULine>(Opt);
+        Opt->SourceDialogueRunner = this;
+        PooledOptions.Add(Opt);
+    }
 
+    TArray<UOption*> OptionObjects;
+    OptionObjects.Reserve(Options.Num());
 
-void ADialogueRunner::OnDialogueStarted_Implementation()
-{
-    // default = no-op
-}
+    for (int32 Index = 0; Index < Options.Num(); ++Index)
+    {
+        UOption* Opt = PooledOptions[Index];
+        Opt->OptionID = Options[Index].OptionID;
+        Opt->Line->SetFromYarnLine(Options[Index].Line);
+        Opt->bIsAvailable = Options[Index].bIsAvailable;
+        OptionObjects.Add(Opt);
+    }
 
+    OnRunOptions(OptionObjects);
 
-void ADialogueRunner::OnDialogueEnded_Implementation()
-{
-    // default = no-op
+    if (!bReuseLineObjects)
+    {
+        PooledOptions.Reset();
+    }
 }
 
 
 void ADialogueRunner::OnRunLine_Implementation(ULine* Line, const TArray<TSoftObjectPtr<UObject>>& LineAssets)
 {
     // default = log and immediately continue
-    UE_LOG(LogYarnSpinner, Warning, TEXT("DialogueRunner received line with ID \"%s\". Implement OnRunLine to customise its behaviour."), *Line->LineID.ToString());
+    UE_LOG(LogYarnSpinner, Warning, TEXT("DialogueRunner received line with ID \"%s\". Implement OnRunYarnLine to customise its behaviour."), *Line->LineID.ToString());
     ContinueDialogue();
 }
 
@@ -183,9 +165,9 @@ void ADialogueRunner::OnRunLine_Implementation(ULine* Line, const TArray<TSoftOb
 void ADialogueRunner::OnRunOptions_Implementation(const TArray<class UOption*>& Options)
 {
     // default = log and choose the first option
-    UE_LOG(LogYarnSpinner, Warning, TEXT("DialogueRunner received %i options. Choosing the first one by default. Implement OnRunOptions to customise its behaviour."), Options.Num());
+    UE_LOG(LogYarnSpinner, Warning, TEXT("DialogueRunner received %i options. Choosing the first one by default. Implement OnRunYarnOptions to customise its behaviour."), Options.Num());
 
-    SelectOption(Options[0]);
+    SelectOptionByIndex(0);
 }
 
 
@@ -197,6 +179,14 @@ void ADialogueRunner::OnRunCommand_Implementation(const FString& Command, const
 }
 
 
+void ADialogueRunner::OnRunYarnContentBatch_Implementation(const TArray<FYarnContent>& Content)
+{
+    // default = present the items one at a time, as if they hadn't been batched
+    ContentBatchIndex = 0;
+    PresentContentBatchItem();
+}
+
+
 /** Starts running dialogue from the given node name. */
 void ADialogueRunner::StartDialogue(FName NodeName)
 {
@@ -206,10 +196,24 @@ void ADialogueRunner::StartDialogue(FName NodeName)
         return;
     }
 
+    // Before the prewarm is checked, so one that read the last conversation's variables isn't used
+    ResetConversationVariables();
+
+    if (Prewarm)
+    {
+        const TUniquePtr<FYarnDialoguePrewarm> Prewarmed = MoveTemp(Prewarm);
+        // The VM can't be swapped out from under one of its own handlers
+        if (!bIsRunningVirtualMachine && Prewarmed->GetNodeName() == NodeName.ToString() && StartPrewarmedDialogue(*Prewarmed))
+        {
+            return;
+        }
+    }
+
     bool bNodeSelected = VirtualMachine->SetNode(NodeName.ToString());
 
     if (bNodeSelected)
     {
+        bIsDialogueRunning = true;
         OnDialogueStarted();
         ContinueDialogue();
     }
@@ -221,138 +225,969 @@ void ADialogueRunner::StartDialogue(FName NodeName)
 }
 
 
-/** Continues running the current dialogue, producing either lines, options, commands, or a dialogue-end signal. */
-void ADialogueRunner::ContinueDialogue()
+void ADialogueRunner::PrewarmDialogue(FName NodeName)
 {
-    YS_LOG_FUNCSIG
+    if (!VirtualMachine.IsValid() || bIsDialogueRunning)
+    {
+        YS_WARN("Can't prewarm node %s while the dialogue runner is busy or has no Yarn project.", *NodeName.ToString());
+        return;
+    }
 
-    if (VirtualMachine->GetCurrentExecutionState() == Yarn::VirtualMachine::ExecutionState::ERROR)
+    if (bBatchContent)
     {
-        UE_LOG(LogYarnSpinner, Error, TEXT("VirtualMachine is in an error state and cannot continue running."));
+        YS_WARN("Can't prewarm node %s, because batched content isn't prewarmed.", *NodeName.ToString());
         return;
     }
 
-    VirtualMachine->Continue();
+    const FString Node = NodeName.ToString();
+    if (Prewarm && Prewarm->GetNodeName() == Node && Prewarm->GetState() != FYarnDialoguePrewarm::EState::Failed)
+    {
+        return;
+    }
 
-    Yarn::VirtualMachine::ExecutionState State = VirtualMachine->GetCurrentExecutionState();
+    const TSharedPtr<const Yarn::RuntimeContext> RuntimeContext = YarnProject->GetRuntimeContext();
+    if (!RuntimeContext.IsValid())
+    {
+        return;
+    }
 
-    if (State == Yarn::VirtualMachine::ExecutionState::ERROR)
+    const UYarnSubsystem* Subsystem = YarnSubsystem();
+    Prewarm = MakeUnique<FYarnDialoguePrewarm>(YarnProject, RuntimeContext.ToSharedRef(), *this, Subsystem ? Subsystem->GetYarnLibraryRegistry() : nullptr, LineTextCache);
+    if (!Prewarm->Start(Node, VirtualMachine->GetRandomSeed()))
     {
-        UE_LOG(LogYarnSpinner, Error, TEXT("VirtualMachine encountered an error."));
+        Prewarm.Reset();
         return;
     }
+
+    RunPrewarm();
 }
 
 
-/** Indicates to the dialogue runner that an option was selected. */
-void ADialogueRunner::SelectOption(UOption* Option)
+void ADialogueRunner::RunPrewarm()
 {
-    Yarn::VirtualMachine::ExecutionState State = this->VirtualMachine->GetCurrentExecutionState();
+    UYarnSubsystem* Subsystem = YarnSubsystem();
+    if (!Subsystem)
+    {
+        Prewarm->Run(0);
+        return;
+    }
 
-    if (State != Yarn::VirtualMachine::ExecutionState::WAITING_ON_OPTION_SELECTION)
+    if (bIsPrewarmQueued)
     {
-        UE_LOG(LogYarnSpinner, Error, TEXT("Dialogue Runner received a call to SelectOption but it wasn't expecting a selection!"));
         return;
     }
 
-    UE_LOG(LogYarnSpinner, Log, TEXT("Selected option %i (%s)"), Option->OptionID, *Option->Line->LineID.ToString());
+    // Ambient, so that prewarming never holds up dialogue that's already running
+    bIsPrewarmQueued = true;
+    Subsystem->GetDialogueScheduler().Enqueue(EYarnDialoguePriority::Ambient, [WeakThis = TWeakObjectPtr<ADialogueRunner>(this)]
+    {
+        if (ADialogueRunner* Runner = WeakThis.Get())
+        {
+            Runner->bIsPrewarmQueued = false;
+            if (Runner->Prewarm && Runner->Prewarm->Run(FYarnDialogueScheduler::GetInstructionSlice()))
+            {
+                Runner->RunPrewarm();
+            }
+        }
+    });
+}
 
-    VirtualMachine->SetSelectedOption(Option->OptionID);
 
-    if (bRunLinesForSelectedOptions)
+bool ADialogueRunner::StartPrewarmedDialogue(FYarnDialoguePrewarm& Prewarmed)
+{
+    // Whatever is left runs now, as it would have without the prewarm
+    if (Prewarmed.GetState() == FYarnDialoguePrewarm::EState::Running)
     {
-        const TArray<TSoftObjectPtr<UObject>> LineAssets = YarnProject->GetLineAssets(Option->Line->LineID);
-        YS_LOG_FUNC("Got %d line assets for line '%s'", LineAssets.Num(), *Option->Line->LineID.ToString())
+        Prewarmed.Run(0);
+    }
 
-        OnRunLine(Option->Line, LineAssets);
+    // Anything drawn since the prewarm started would have moved the random numbers on from where it began
+    if (!Prewarmed.CanCommit() || Prewarmed.GetStartingRandomSeed() != VirtualMachine->GetRandomSeed())
+    {
+        YS_LOG("Prewarmed node %s can't be used, so it's starting again.", *Prewarmed.GetNodeName());
+        return false;
     }
-    else
+
+    const FYarnDialoguePrewarm::EContent Content = Prewarmed.GetContent();
+    VirtualMachine = Prewarmed.Commit(*this);
+    VirtualMachine->SetDialogueSink(this);
+
+    bIsDialogueRunning = true;
+    OnDialogueStarted();
+
+    for (const FYarnDialoguePrewarm::FNodeEvent& NodeEvent : Prewarmed.GetNodeEvents())
     {
-        ContinueDialogue();
+        if (NodeEvent.bIsStart)
+        {
+            HandleNodeStart(NodeEvent.NodeName);
+        }
+        else
+        {
+            HandleNodeComplete(NodeEvent.NodeName);
+        }
     }
-}
 
-void ADialogueRunner::SetValue(const FString& Name, bool bValue)
-{
-    YS_LOG("Setting variable %s to bool %i", *Name, bValue);
-    YarnSubsystem()->SetValue(Name, bValue);
+    switch (Content)
+    {
+    case FYarnDialoguePrewarm::EContent::Line:
+        PresentedLine = Prewarmed.GetYarnLine();
+        bIsPresentingLine = true;
+        OnRunYarnLine(Prewarmed.GetLine(), Prewarmed.GetLineAssets());
+        break;
+    case FYarnDialoguePrewarm::EContent::Options:
+        bIsPresentingLine = false;
+        CurrentOptions = Prewarmed.GetOptions();
+        OnRunYarnOptions(CurrentOptions);
+        break;
+    default:
+        HandleDialogueComplete();
+        break;
+    }
+
+    return true;
 }
 
 
-void ADialogueRunner::SetValue(const FString& Name, float Value)
+/** Continues running the current dialogue, producing either lines, options, commands, or a dialogue-end signal. */
+void ADialogueRunner::ContinueDialogue()
 {
-    YS_LOG("Setting variable %s to float %f", *Name, Value);
-    YarnSubsystem()->SetValue(Name, Value);
-}
+    YS_LOG_FUNCSIG
 
+    if (!VirtualMachine.IsValid())
+    {
+        UE_LOG(LogYarnSpinner, Error, TEXT("DialogueRunner can't continue, because it has no running dialogue."));
+        return;
+    }
 
-void ADialogueRunner::SetValue(const FString& Name, const FString& Value)
-{
-    YS_LOG("Setting variable %s to string %s", *Name, *Value);
-    YarnSubsystem()->SetValue(Name, Value);
+    if (bIsRunningNonBlockingCommand)
+    {
+        YS_LOG("Ignoring a continue from a non-blocking command; the dialogue didn't wait for it.");
+        return;
+    }
+
+    if (ContentBatch.Num() > 0)
+    {
+        // Presenting a batch one item at a time: move on to the next item, or back to the VM once they've all been seen
+        if (ContentBatchIndex != INDEX_NONE && ++ContentBatchIndex < ContentBatch.Num())
+        {
+            PresentContentBatchItem();
+            return;
+        }
+
+        ContentBatch.Reset();
+        ContentBatchIndex = INDEX_NONE;
+    }
+
+    if (bIsRunningVirtualMachine)
+    {
+        // Called from one of our handlers, so the VM picks up again as soon as the handler returns. After an option
+        // selection the VM is already waiting to carry on and there's nothing to do.
+        if (VirtualMachine->GetCurrentExecutionState() == Yarn::VirtualMachine::ExecutionState::DELIVERING_CONTENT)
+        {
+            VirtualMachine->Continue();
+        }
+        return;
+    }
+
+    if (bIsContinueQueued)
+    {
+        return;
+    }
+
+    UYarnSubsystem* Subsystem = YarnSubsystem();
+    if (!Subsystem)
+    {
+        RunVirtualMachine(false);
+        return;
+    }
+
+    // Runs now while the frame's dialogue budget has room, and waits for the scheduler once it's spent
+    FYarnDialogueScheduler& Scheduler = Subsystem->GetDialogueScheduler();
+    if (Scheduler.TryRunNow(Priority, [this] { RunVirtualMachine(true); }))
+    {
+        return;
+    }
+
+    bIsContinueQueued = true;
+    Scheduler.Enqueue(Priority, [WeakThis = TWeakObjectPtr<ADialogueRunner>(this)]
+    {
+        if (ADialogueRunner* Runner = WeakThis.Get())
+        {
+            Runner->bIsContinueQueued = false;
+            Runner->RunVirtualMachine(true);
+        }
+    });
 }
 
 
-bool ADialogueRunner::HasValue(const FString& Name)
+void ADialogueRunner::RunVirtualMachine(const bool bIsScheduled)
 {
-    return YarnSubsystem()->HasValue(Name);
+    // The VM can be gone, or the dialogue stopped, by the time a queued continue runs
+    if (!VirtualMachine.IsValid() || !bIsDialogueRunning)
+    {
+        return;
+    }
+
+    if (VirtualMachine->GetCurrentExecutionState() == Yarn::VirtualMachine::ExecutionState::ERROR)
+    {
+        UE_LOG(LogYarnSpinner, Error, TEXT("VirtualMachine is in an error state and cannot continue running."));
+        return;
+    }
+
+    {
+        // Scheduled runs take one slice at a time, so a long calculation in a script can't take over a frame
+        TGuardValue<bool> RunningGuard(bIsRunningVirtualMachine, true);
+        VirtualMachine->Continue(bIsScheduled ? FYarnDialogueScheduler::GetInstructionSlice() : 0);
+    }
+
+    Yarn::VirtualMachine::ExecutionState State = VirtualMachine->GetCurrentExecutionState();
+
+    if (State == Yarn::VirtualMachine::ExecutionState::ERROR)
+    {
+        UE_LOG(LogYarnSpinner, Error, TEXT("VirtualMachine encountered an error."));
+        return;
+    }
+
+    if (State == Yarn::VirtualMachine::ExecutionState::SUSPENDED)
+    {
+        ContinueDialogue();
+        return;
+    }
+
+    // The end of a burst, so watchers hear about what it changed now rather than at the end of the frame
+    if (UYarnSubsystem* Subsystem = YarnSubsystem())
+    {
+        Subsystem->DispatchVariableChanges();
+    }
 }
 
 
-Yarn::FValue ADialogueRunner::GetValue(const FString& Name)
+void ADialogueRunner::ContinueDialogueAfter(const float Seconds)
 {
-    Yarn::FValue Value = YarnSubsystem()->GetValue(Name);
-    YS_LOG("Retrieving variable %s with value %s", *Name, *Value.ConvertToString());
-    return Value;
+    UYarnSubsystem* Subsystem = YarnSubsystem();
+    if (!Subsystem)
+    {
+        ContinueDialogue();
+        return;
+    }
+
+    Subsystem->GetLatentScheduler().Schedule(Seconds, this, [WeakThis = TWeakObjectPtr<ADialogueRunner>(this)]
+    {
+        if (ADialogueRunner* Runner = WeakThis.Get())
+        {
+            Runner->ContinueDialogue();
+        }
+    });
 }
 
 
-void ADialogueRunner::ClearValue(const FString& Name)
+void ADialogueRunner::StopDialogue()
 {
-    YS_LOG("Clearing variable %s", *Name);
-    YarnSubsystem()->ClearValue(Name);
+    if (UYarnSubsystem* Subsystem = YarnSubsystem())
+    {
+        Subsystem->GetLatentScheduler().CancelAll(this);
+    }
+
+    ContentBatch.Reset();
+    ContentBatchIndex = INDEX_NONE;
+    CurrentOptions.Reset();
+    ++AsyncFunctionSerial;
+
+    if (!bIsDialogueRunning)
+    {
+        return;
+    }
+
+    UE_LOG(LogYarnSpinner, Log, TEXT("Stopping dialogue"));
+
+    bIsDialogueRunning = false;
+    if (VirtualMachine.IsValid())
+    {
+        VirtualMachine->Stop();
+    }
+
+    OnDialogueEnded();
 }
 
 
-UYarnSubsystem* ADialogueRunner::YarnSubsystem() const
+void ADialogueRunner::SetRandomSeed(const int32 Seed)
 {
-    if (!GetGameInstance())
+    RandomSeed = Seed;
+    if (VirtualMachine.IsValid())
     {
-        YS_WARN("Could not retrieve YarnSubsystem because GetGameInstance() returned null")
-        return nullptr;
+        VirtualMachine->SetRandomSeed(Seed);
     }
-    return GetGameInstance()->GetSubsystem<UYarnSubsystem>();
 }
 
 
-void ADialogueRunner::UpdateDisplayTextForLine(ULine* const Line, const Yarn::Line& YarnLine) const
+bool ADialogueRunner::SaveDialogueState(TArray<uint8>& OutData)
 {
-    const FName LineID = YarnLine.LineID;
+    if (!VirtualMachine.IsValid() || bIsRunningVirtualMachine || bIsContinueQueued || ContentBatch.Num() > 0)
+    {
+        YS_WARN("Can't save the dialogue state while content is on its way to the dialogue runner.");
+        return false;
+    }
 
-    // This assumes that we only ever care about lines that actually exist in .yarn files (rather than allowing extra lines in .csv files)
-    if (!IsValid(YarnProject) || !YarnProject->HasLine(LineID))
+    OutData.Reset();
+    FMemoryWriter Writer(OutData);
+
+    uint32 Magic = DialogueStateMagic;
+    uint8 Version = DialogueStateVersion;
+    Writer << Magic << Version;
+
+    bool bSavedLine = bIsDialogueRunning && bIsPresentingLine;
+    Writer << bSavedLine;
+    if (bSavedLine)
     {
-        Line->DisplayText = FText::FromString(TEXT("(missing line!)"));
-        return;
+        Writer << PresentedLine;
+    }
+
+    int32 NumLocalVariables = Algo::CountIf(LocalVariables, [](const FLocalVariable& Variable) { return Variable.Value.IsSet(); });
+    Writer << NumLocalVariables;
+    for (const FLocalVariable& Variable : LocalVariables)
+    {
+        if (Variable.Value.IsSet())
+        {
+            FString Name = Variable.Name;
+            Yarn::FValue Value = Variable.Value.GetValue();
+            Writer << Name << Value;
+        }
     }
 
-    // Try to find the localized string. If not, use the non-localized one from the project itself.
-    const FTextConstDisplayStringPtr FindDisplayStr = FTextLocalizationManager::Get()
-        .FindDisplayString(YarnProject->GetName(), LineID.ToString());
-    const FTextFormat FormatText = FText::FromString(FindDisplayStr.IsValid() ? *FindDisplayStr : YarnProject->GetLine(LineID));
+    if (!VirtualMachine->SaveSnapshot(Writer))
+    {
+        OutData.Reset();
+        return false;
+    }
+    return true;
+}
+
 
-    // Log if we weren't able to find a localized version
-    if (!FindDisplayStr.IsValid())
+bool ADialogueRunner::LoadDialogueState(const TArray<uint8>& Data)
+{
+    if (!VirtualMachine.IsValid() || bIsRunningVirtualMachine || bIsContinueQueued)
     {
-        YS_LOG("Using non-localized version of line with ID '%s' because a localized version was not found.", *LineID.ToString());
+        YS_WARN("Can't load a dialogue state while content is on its way to the dialogue runner.");
+        return false;
     }
 
-    // Apply Substitutions
-    const FText TextWithSubstitutions = FText::Format(FormatText, YarnLine.Substitutions);
+    FMemoryReader Reader(Data);
 
-    // TODO: add support for markup & context (speaker, target)
+    uint32 Magic = 0;
+    uint8 Version = 1;
+    Reader << Magic;
+    if (Magic == DialogueStateMagic)
+    {
+        Reader << Version;
+    }
+    else
+    {
+        Reader.Seek(0);
+    }
 
-    YS_LOG_FUNC("Setting line %s to display text '%s'", *LineID.ToString(), *TextWithSubstitutions.ToString())
+    if (Version > DialogueStateVersion)
+    {
+        YS_WARN("This dialogue state was saved by a newer version of Yarn Spinner and can't be loaded.");
+        return false;
+    }
 
-    Line->DisplayText = TextWithSubstitutions;
+    bool bSavedLine = false;
+    Yarn::Line SavedLine;
+    Reader << bSavedLine;
+    if (bSavedLine)
+    {
+        Reader << SavedLine;
+    }
+
+    TArray<TPair<FString, Yarn::FValue>> SavedLocalVariables;
+    if (Version >= 2)
+    {
+        int32 NumLocalVariables = 0;
+        Reader << NumLocalVariables;
+        for (int32 i = 0; i < NumLocalVariables && !Reader.IsError(); ++i)
+        {
+            TPair<FString, Yarn::FValue>& Variable = SavedLocalVariables.AddDefaulted_GetRef();
+            Reader << Variable.Key << Variable.Value;
+        }
+    }
+
+    // Loaded into a VM of its own first, so that data that can't be loaded leaves the running dialogue alone
+    TUniquePtr<Yarn::VirtualMachine> LoadedVirtualMachine = MakeUnique<Yarn::VirtualMachine>(VirtualMachine->GetContext(), *this);
+    LoadedVirtualMachine->SetRandomSeed(VirtualMachine->GetRandomSeed());
+    if (Reader.IsError() || !LoadedVirtualMachine->LoadSnapshot(Reader))
+    {
+        return false;
+    }
+
+    StopDialogue();
+    Prewarm.Reset();
+
+    VirtualMachine = MoveTemp(LoadedVirtualMachine);
+    VirtualMachine->SetDialogueSink(this);
+    VirtualMachine->SetContentBatching(bBatchContent);
+
+    for (FLocalVariable& Variable : LocalVariables)
+    {
+        Variable.Value.Reset();
+    }
+    ++LocalVariableChanges;
+    for (const TPair<FString, Yarn::FValue>& Variable : SavedLocalVariables)
+    {
+        if (FLocalVariable* LocalVariable = FindLocalVariable(Variable.Key))
+        {
+            LocalVariable->Value = Variable.Value;
+        }
+    }
+
+    const Yarn::VirtualMachine::ExecutionState State = VirtualMachine->GetCurrentExecutionState();
+    if (State == Yarn::VirtualMachine::ExecutionState::STOPPED)
+    {
+        return true;
+    }
+
+    bIsDialogueRunning = true;
+    OnDialogueStarted();
+
+    if (State == Yarn::VirtualMachine::ExecutionState::WAITING_ON_OPTION_SELECTION)
+    {
+        HandleOptions(Yarn::OptionSet{VirtualMachine->GetCurrentOptions()});
+    }
+    else if (State == Yarn::VirtualMachine::ExecutionState::WAITING_FOR_CONTINUE && bSavedLine)
+    {
+        HandleLine(SavedLine);
+    }
+    else
+    {
+        // Saved after a command, which has already run, or in the middle of a long calculation
+        ContinueDialogue();
+    }
+
+    return true;
+}
+
+
+/** Indicates to the dialogue runner that an option was selected. */
+void ADialogueRunner::SelectOptionByIndex(int32 OptionIndex)
+{
+    if (!VirtualMachine.IsValid() || VirtualMachine->GetCurrentExecutionState() != Yarn::VirtualMachine::ExecutionState::WAITING_ON_OPTION_SELECTION)
+    {
+        UE_LOG(LogYarnSpinner, Error, TEXT("Dialogue Runner received a call to SelectOption but it wasn't expecting a selection!"));
+        return;
+    }
+
+    if (!CurrentOptions.IsValidIndex(OptionIndex))
+    {
+        UE_LOG(LogYarnSpinner, Error, TEXT("Dialogue Runner can't select option %i: only %i options are available."), OptionIndex, CurrentOptions.Num());
+        return;
+    }
+
+    // Copied, because continuing may deliver the next set of options
+    const FYarnOption Option = CurrentOptions[OptionIndex];
+    CurrentOptions.Reset();
+
+    UE_LOG(LogYarnSpinner, Log, TEXT("Selected option %i (%s)"), Option.OptionID, *Option.Line.LineID.ToString());
+
+    // Looked up first, because selecting clears the VM's options; a save taken while the option's line is presented needs it
+    const Yarn::Option* SelectedOption = VirtualMachine->GetCurrentOptions().FindByPredicate([&Option](const Yarn::Option& Opt) { return Opt.ID == Option.OptionID; });
+    Yarn::Line SelectedLine = SelectedOption ? SelectedOption->Line : Yarn::Line();
+
+    VirtualMachine->SetSelectedOption(Option.OptionID);
+
+    if (bRunLinesForSelectedOptions)
+    {
+        PresentedLine = MoveTemp(SelectedLine);
+        bIsPresentingLine = SelectedOption != nullptr;
+
+        const TArray<TSoftObjectPtr<UObject>> LineAssets = YarnProject->GetLineAssets(Option.Line.LineID);
+        YS_LOG_FUNC("Got %d line assets for line '%s'", LineAssets.Num(), *Option.Line.LineID.ToString())
+
+        OnRunYarnLine(Option.Line, LineAssets);
+    }
+    else
+    {
+        ContinueDialogue();
+    }
+}
+
+
+void ADialogueRunner::SelectOption(UOption* Option)
+{
+    if (!IsValid(Option))
+    {
+        UE_LOG(LogYarnSpinner, Error, TEXT("Dialogue Runner received a call to SelectOption with an invalid option."));
+        return;
+    }
+
+    SelectOptionByIndex(CurrentOptions.IndexOfByPredicate([Option](const FYarnOption& Opt) { return Opt.OptionID == Option->OptionID; }));
+}
+
+void ADialogueRunner::SetValue(const FString& Name, bool bValue)
+{
+    if (FLocalVariable* Variable = FindLocalVariable(Name))
+    {
+        Variable->Value = Yarn::FValue(bValue);
+        ++LocalVariableChanges;
+        return;
+    }
+    YarnSubsystem()->SetValue(Name, bValue);
+}
+
+
+void ADialogueRunner::SetValue(const FString& Name, float Value)
+{
+    if (FLocalVariable* Variable = FindLocalVariable(Name))
+    {
+        Variable->Value = Yarn::FValue(Value);
+        ++LocalVariableChanges;
+        return;
+    }
+    YarnSubsystem()->SetValue(Name, Value);
+}
+
+
+void ADialogueRunner::SetValue(const FString& Name, const FString& Value)
+{
+    if (FLocalVariable* Variable = FindLocalVariable(Name))
+    {
+        Variable->Value = Yarn::FValue(Value);
+        ++LocalVariableChanges;
+        return;
+    }
+    YarnSubsystem()->SetValue(Name, Value);
+}
+
+
+bool ADialogueRunner::HasValue(const FString& Name)
+{
+    if (const FLocalVariable* Variable = FindLocalVariable(Name))
+    {
+        return Variable->Value.IsSet();
+    }
+    return YarnSubsystem()->HasValue(Name);
+}
+
+
+Yarn::FValue ADialogueRunner::GetValue(const FString& Name)
+{
+    if (const FLocalVariable* Variable = FindLocalVariable(Name))
+    {
+        return Variable->Value.Get(Yarn::FValue());
+    }
+    return YarnSubsystem()->GetValue(Name);
+}
+
+
+void ADialogueRunner::ClearValue(const FString& Name)
+{
+    if (FLocalVariable* Variable = FindLocalVariable(Name))
+    {
+        Variable->Value.Reset();
+        ++LocalVariableChanges;
+        return;
+    }
+    YarnSubsystem()->ClearValue(Name);
+}
+
+
+double ADialogueRunner::AddToNumber(const FString& Name, const double Delta)
+{
+    if (FLocalVariable* Variable = FindLocalVariable(Name))
+    {
+        const Yarn::FValue Value = Variable->Value.Get(Yarn::FValue());
+        const double Result = (Value.GetType() == Yarn::FValue::EValueType::Number ? Value.GetValue<double>() : 0) + Delta;
+        Variable->Value = Yarn::FValue(Result);
+        ++LocalVariableChanges;
+        return Result;
+    }
+    return YarnSubsystem()->AddToNumber(Name, Delta);
+}
+
+
+bool ADialogueRunner::GetSlotValue(const int32 Slot, TOptional<Yarn::FValue>& OutValue)
+{
+    const int32 Index = LocalVariableIndices.IsValidIndex(Slot) ? LocalVariableIndices[Slot] : INDEX_NONE;
+    if (Index == INDEX_NONE)
+    {
+        return false;
+    }
+
+    OutValue = LocalVariables[Index].Value;
+    return true;
+}
+
+
+bool ADialogueRunner::SetSlotValue(const int32 Slot, const Yarn::FValue& Value)
+{
+    const int32 Index = LocalVariableIndices.IsValidIndex(Slot) ? LocalVariableIndices[Slot] : INDEX_NONE;
+    if (Index == INDEX_NONE)
+    {
+        return false;
+    }
+
+    LocalVariables[Index].Value = Value;
+    ++LocalVariableChanges;
+    return true;
+}
+
+
+TOptional<uint64> ADialogueRunner::GetChangeCount()
+{
+    UYarnSubsystem* Subsystem = YarnSubsystem();
+    const TOptional<uint64> SubsystemChanges = Subsystem ? Subsystem->GetChangeCount() : TOptional<uint64>();
+    if (!SubsystemChanges.IsSet())
+    {
+        return {};
+    }
+
+    // Both only go up, so the sum changes whenever either does
+    return SubsystemChanges.GetValue() + LocalVariableChanges;
+}
+
+
+TSharedPtr<Yarn::VisitCounters> ADialogueRunner::GetVisitCounters(const TSharedRef<const Yarn::RuntimeContext>& Context)
+{
+    UYarnSubsystem* Subsystem = YarnSubsystem();
+    return Subsystem ? Subsystem->GetVisitCounters(Context) : nullptr;
+}
+
+
+void ADialogueRunner::LinkLocalVariables(const Yarn::RuntimeContext& Context)
+{
+    LocalVariables.Reset();
+    LocalVariablesByName.Reset();
+    LocalVariableIndices.Init(INDEX_NONE, Context.GetNumVariables());
+
+    for (int32 Slot = 0; Slot < Context.GetNumVariables(); ++Slot)
+    {
+        const FString& Name = Context.GetVariableName(Slot);
+        const bool bIsConversationVariable = !ConversationVariablePrefix.IsEmpty() && Name.StartsWith(ConversationVariablePrefix);
+        if (!bIsConversationVariable && (RunnerVariablePrefix.IsEmpty() || !Name.StartsWith(RunnerVariablePrefix)))
+        {
+            continue;
+        }
+
+        LocalVariableIndices[Slot] = LocalVariables.Num();
+        LocalVariablesByName.Add(Name, LocalVariables.Num());
+        LocalVariables.Add({Name, {}, bIsConversationVariable});
+    }
+
+    YS_LOG("Keeping %d of %d variables in the dialogue runner", LocalVariables.Num(), Context.GetNumVariables());
+}
+
+
+ADialogueRunner::FLocalVariable* ADialogueRunner::FindLocalVariable(const FString& Name)
+{
+    const int32* Index = LocalVariablesByName.Find(Name);
+    return Index ? &LocalVariables[*Index] : nullptr;
+}
+
+
+void ADialogueRunner::ResetConversationVariables()
+{
+    for (FLocalVariable& Variable : LocalVariables)
+    {
+        if (Variable.bIsConversationVariable)
+        {
+            Variable.Value.Reset();
+        }
+    }
+    ++LocalVariableChanges;
+}
+
+
+void ADialogueRunner::HandleLine(const Yarn::Line& Line)
+{
+    YS_LOG("Received line %s", *Line.LineID.ToString());
+
+    PresentedLine = Line;
+    bIsPresentingLine = true;
+
+    FYarnLine YarnLine;
+    YarnLine.LineID = Line.LineID;
+
+    UpdateDisplayTextForLine(YarnLine, Line);
+
+    const TArray<TSoftObjectPtr<UObject>> LineAssets = YarnProject->GetLineAssets(YarnLine.LineID);
+    YS_LOG_FUNC("Got %d line assets for line '%s'", LineAssets.Num(), *YarnLine.LineID.ToString())
+
+    OnRunYarnLine(YarnLine, LineAssets);
+}
+
+
+void ADialogueRunner::HandleOptions(const Yarn::OptionSet& OptionSet)
+{
+    YS_LOG("Received %llu options", OptionSet.Options.Num());
+
+    bIsPresentingLine = false;
+
+    // Build a TArray for every option in this OptionSet
+    CurrentOptions.Reset(OptionSet.Options.Num());
+
+    for (const Yarn::Option& Option : OptionSet.Options)
+    {
+        YS_LOG("- %i: %s", Option.ID, *Option.Line.LineID.ToString());
+
+        FYarnOption& Opt = CurrentOptions.AddDefaulted_GetRef();
+        Opt.OptionID = Option.ID;
+        Opt.Line.LineID = Option.Line.LineID;
+
+        UpdateDisplayTextForLine(Opt.Line, Option.Line);
+
+        Opt.bIsAvailable = Option.IsAvailable;
+    }
+
+    OnRunYarnOptions(CurrentOptions);
+}
+
+
+void ADialogueRunner::HandleCommand(const Yarn::Command& Command)
+{
+    YS_LOG("Received command \"%s\"", *Command.Text);
+
+    bIsPresentingLine = false;
+
+    const FString& CommandText = Command.Text;
+
+    TArray<FString> CommandElements;
+    CommandText.ParseIntoArray(CommandElements, TEXT(" "));
+
+    if (CommandElements.Num() == 0)
+    {
+        UE_LOG(LogYarnSpinner, Error, TEXT("Command received, but was unable to parse it."));
+        OnRunCommand(FString("(unknown)"), TArray<FString>());
+        return;
+    }
+
+    const FString CommandName = MoveTemp(CommandElements[0]);
+    CommandElements.RemoveAt(0);
+
+    RunCommand(CommandName, CommandElements);
+}
+
+
+void ADialogueRunner::RunCommand(const FString& CommandName, const TArray<FString>& Parameters)
+{
+    const UYarnLibraryRegistry* const Lib = YarnSubsystem()->GetYarnLibraryRegistry();
+    const FName Name(CommandName);
+
+    if (Lib->HasCommand(Name))
+    {
+        if (Lib->IsCommandBlocking(Name))
+        {
+            return Lib->CallCommand(Name, this, Parameters);
+        }
+
+        {
+            TGuardValue<bool> NonBlockingGuard(bIsRunningNonBlockingCommand, true);
+            Lib->CallCommand(Name, this, Parameters);
+        }
+
+        // The VM has already carried on past it, unless we're presenting a batch
+        if (ContentBatchIndex != INDEX_NONE)
+        {
+            ContinueDialogue();
+        }
+        return;
+    }
+
+    // Haven't handled the function yet, so call the DialogueRunner's handler
+    OnRunCommand(CommandName, Parameters);
+}
+
+
+void ADialogueRunner::HandleContentBatch(const TArray<Yarn::ContentItem>& Batch)
+{
+    YS_LOG("Received a batch of %d lines and commands", Batch.Num());
+
+    ContentBatch.Reset(Batch.Num());
+    ContentBatchIndex = INDEX_NONE;
+
+    for (const Yarn::ContentItem& Item : Batch)
+    {
+        FYarnContent& Content = ContentBatch.AddDefaulted_GetRef();
+
+        if (Item.Type == Yarn::ContentItem::EType::Line)
+        {
+            Content.Type = EYarnContentType::Line;
+            Content.Line.LineID = Item.Line.LineID;
+            UpdateDisplayTextForLine(Content.Line, Item.Line);
+        }
+        else
+        {
+            Content.Type = EYarnContentType::Command;
+            Item.Command.Text.ParseIntoArray(Content.Parameters, TEXT(" "));
+            if (Content.Parameters.Num() > 0)
+            {
+                Content.Command = MoveTemp(Content.Parameters[0]);
+                Content.Parameters.RemoveAt(0);
+            }
+        }
+    }
+
+    OnRunYarnContentBatch(ContentBatch);
+}
+
+
+bool ADialogueRunner::IsCommandBlocking(FName CommandName)
+{
+    const UYarnSubsystem* Subsystem = YarnSubsystem();
+    return !Subsystem || !Subsystem->GetYarnLibraryRegistry() || Subsystem->GetYarnLibraryRegistry()->IsCommandBlocking(CommandName);
+}
+
+
+void ADialogueRunner::PresentContentBatchItem()
+{
+    // Copied, because presenting it may move on to the next item or batch
+    const FYarnContent Content = ContentBatch[ContentBatchIndex];
+
+    if (Content.Type == EYarnContentType::Line)
+    {
+        const TArray<TSoftObjectPtr<UObject>> LineAssets = YarnProject->GetLineAssets(Content.Line.LineID);
+        OnRunYarnLine(Content.Line, LineAssets);
+    }
+    else if (Content.Command.IsEmpty())
+    {
+        UE_LOG(LogYarnSpinner, Error, TEXT("Command received, but was unable to parse it."));
+        OnRunCommand(FString("(unknown)"), TArray<FString>());
+    }
+    else
+    {
+        RunCommand(Content.Command, Content.Parameters);
+    }
+}
+
+
+void ADialogueRunner::HandleNodeStart(const FString& NodeName)
+{
+    UE_LOG(LogYarnSpinner, Log, TEXT("Received node start \"%s\""), *NodeName);
+}
+
+
+void ADialogueRunner::HandleNodeComplete(const FString& NodeName)
+{
+    UE_LOG(LogYarnSpinner, Log, TEXT("Received node complete \"%s\""), *NodeName);
+}
+
+
+void ADialogueRunner::HandleDialogueComplete()
+{
+    UE_LOG(LogYarnSpinner, Log, TEXT("Received dialogue complete"));
+    bIsDialogueRunning = false;
+    OnDialogueEnded();
+}
+
+
+bool ADialogueRunner::HasFunction(const FName FunctionName)
+{
+    return YarnSubsystem()->GetYarnLibraryRegistry()->HasFunction(FunctionName);
+}
+
+
+int ADialogueRunner::GetExpectedFunctionParamCount(const FName FunctionName)
+{
+    return YarnSubsystem()->GetYarnLibraryRegistry()->GetExpectedFunctionParamCount(FunctionName);
+}
+
+
+Yarn::FValue ADialogueRunner::HandleFunctionCall(const FName FunctionName, const TArray<Yarn::FValue>& Parameters)
+{
+    return YarnSubsystem()->GetYarnLibraryRegistry()->CallFunction(
+        FunctionName,
+        Parameters
+    );
+}
+
+
+bool ADialogueRunner::IsAsyncFunction(const FName FunctionName)
+{
+    const UYarnSubsystem* Subsystem = YarnSubsystem();
+    return Subsystem && Subsystem->GetYarnLibraryRegistry() && Subsystem->GetYarnLibraryRegistry()->IsAsyncFunction(FunctionName);
+}
+
+
+bool ADialogueRunner::IsPureFunction(const FName FunctionName)
+{
+    // The standard library's functions are, as are native ones flagged so; Blueprint functions could do anything
+    const UYarnSubsystem* Subsystem = YarnSubsystem();
+    return Subsystem && Subsystem->GetYarnLibraryRegistry() && Subsystem->GetYarnLibraryRegistry()->IsPureFunction(FunctionName);
+}
+
+
+void ADialogueRunner::HandleAsyncFunctionCall(const FName FunctionName, const TArray<Yarn::FValue>& Parameters)
+{
+    UYarnSubsystem* Subsystem = YarnSubsystem();
+    const FYarnAsyncLibFunction* Function = Subsystem->GetYarnLibraryRegistry()->FindAsyncFunction(FunctionName);
+
+    TFuture<Yarn::FValue> Future = Function->Function(Parameters);
+
+    if (Future.IsReady())
+    {
+        VirtualMachine->SetFunctionResult(Future.Get());
+        return;
+    }
+
+    const uint32 Serial = ++AsyncFunctionSerial;
+    const TWeakObjectPtr<ADialogueRunner> WeakThis(this);
+
+    // The future can complete on any thread, so the result is brought back to the game thread
+    Future.Next([WeakThis, Serial](Yarn::FValue Result)
+    {
+        AsyncTask(ENamedThreads::GameThread, [WeakThis, Serial, Result = MoveTemp(Result)]
+        {
+            if (ADialogueRunner* Runner = WeakThis.Get())
+            {
+                Runner->ReceiveFunctionResult(Serial, Result);
+            }
+        });
+    });
+
+    AsyncFunctionTimeout = Subsystem->GetLatentScheduler().Schedule(Function->TimeoutSeconds, this,
+        [WeakThis, Serial, FunctionName, TimeoutSeconds = Function->TimeoutSeconds, TimeoutValue = Function->TimeoutValue]
+        {
+            if (ADialogueRunner* Runner = WeakThis.Get())
+            {
+                YS_WARN("Async function '%s' didn't return within %.2f seconds.", *FunctionName.ToString(), TimeoutSeconds)
+                Runner->ReceiveFunctionResult(Serial, TimeoutValue);
+            }
+        });
+}
+
+
+void ADialogueRunner::ReceiveFunctionResult(const uint32 Serial, const Yarn::FValue& Result)
+{
+    if (Serial != AsyncFunctionSerial || !VirtualMachine.IsValid())
+    {
+        return;
+    }
+    ++AsyncFunctionSerial;
+
+    if (UYarnSubsystem* Subsystem = YarnSubsystem())
+    {
+        Subsystem->GetLatentScheduler().Cancel(AsyncFunctionTimeout);
+    }
+
+    VirtualMachine->SetFunctionResult(Result);
+    ContinueDialogue();
+}
+
+
+UYarnSubsystem* ADialogueRunner::YarnSubsystem() const
+{
+    if (UYarnSubsystem* Subsystem = CachedYarnSubsystem.Get())
+    {
+        return Subsystem;
+    }
+
+    if (!GetGameInstance())
+    {
+        YS_WARN("Could not retrieve YarnSubsystem because GetGameInstance() returned null")
+        return nullptr;
+    }
+    return GetGameInstance()->GetSubsystem<UYarnSubsystem>();
+}
+
+
+void ADialogueRunner::UpdateDisplayTextForLine(FYarnLine& Line, const Yarn::Line& YarnLine) const
+{
+    LineTextCache.Resolve(YarnProject, YarnLine, Line);
 }
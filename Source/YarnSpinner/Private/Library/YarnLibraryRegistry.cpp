@@ -30,7 +30,7 @@ void UYarnLibraryRegistry::BeginDestroy()
 
 bool UYarnLibraryRegistry::HasFunction(const FName& Name) const
 {
-    if (StdFunctions.Contains(Name))
+    if (StdFunctions.Contains(Name) || AsyncFunctions.Contains(Name))
         return true;
 
     if (!AllFunctions.Contains(Name))
@@ -71,6 +71,9 @@ int32 UYarnLibraryRegistry::GetExpectedFunctionParamCount(const FName& Name) con
     if (StdFunctions.Contains(Name))
         return StdFunctions[Name].ExpectedParamCount;
 
+    if (AsyncFunctions.Contains(Name))
+        return AsyncFunctions[Name].ExpectedParamCount;
+
     if (!AllFunctions.Contains(Name))
     {
         YS_WARN("Could not find function '%s' in registry.", *Name.ToString())
@@ -81,6 +84,79 @@ int32 UYarnLibraryRegistry::GetExpectedFunctionParamCount(const FName& Name) con
 }
 
 
+bool UYarnLibraryRegistry::IsThreadSafeFunction(const FName& Name) const
+{
+    if (const FYarnAsyncLibFunction* AsyncFunction = AsyncFunctions.Find(Name))
+    {
+        return AsyncFunction->bIsThreadSafe;
+    }
+    const FYarnStdLibFunction* Function = StdFunctions.Find(Name);
+    return Function && Function->bIsThreadSafe;
+}
+
+
+bool UYarnLibraryRegistry::IsPureFunction(const FName& Name) const
+{
+    const FYarnStdLibFunction* Function = StdFunctions.Find(Name);
+    return Function && Function->bIsPure;
+}
+
+
+bool UYarnLibraryRegistry::IsCommandBlocking(const FName& Name) const
+{
+    if (const FYarnStdLibCommand* Command = StdCommands.Find(Name))
+    {
+        return Command->bIsBlocking;
+    }
+    if (const FYarnBlueprintLibFunction* Command = AllCommands.Find(Name))
+    {
+        return Command->bIsBlocking;
+    }
+    return true;
+}
+
+
+bool UYarnLibraryRegistry::IsAsyncFunction(const FName& Name) const
+{
+    return AsyncFunctions.Contains(Name);
+}
+
+
+const FYarnAsyncLibFunction* UYarnLibraryRegistry::FindAsyncFunction(const FName& Name) const
+{
+    return AsyncFunctions.Find(Name);
+}
+
+
+void UYarnLibraryRegistry::AddAsyncFunction(const FYarnAsyncLibFunction& Func)
+{
+    check(IsInGameThread());
+    AsyncFunctions.Add(Func.Name, Func);
+}
+
+
+void UYarnLibraryRegistry::AddNativeFunction(const FYarnStdLibFunction& Func)
+{
+    check(IsInGameThread());
+    StdFunctions.Add(Func.Name, Func);
+}
+
+
+Yarn::FValue FYarnAsyncLibFunction::Wait(TFuture<Yarn::FValue>& Future) const
+{
+    // Dialogue on the game thread waits in WAITING_FOR_FUNCTION_RESULT instead of holding up the frame
+    check(!IsInGameThread());
+
+    if (Future.WaitFor(FTimespan::FromSeconds(TimeoutSeconds)))
+    {
+        return Future.Get();
+    }
+
+    YS_WARN("Async function '%s' didn't return within %.2f seconds.", *Name.ToString(), TimeoutSeconds)
+    return TimeoutValue;
+}
+
+
 Yarn::FValue UYarnLibraryRegistry::CallFunction(const FName& Name, TArray<Yarn::FValue> Parameters) const
 {
     if (StdFunctions.Contains(Name))
@@ -88,6 +164,19 @@ Yarn::FValue UYarnLibraryRegistry::CallFunction(const FName& Name, TArray<Yarn::
         return StdFunctions[Name].Function(Parameters);
     }
 
+    if (const FYarnAsyncLibFunction* AsyncFunction = AsyncFunctions.Find(Name))
+    {
+        TFuture<Yarn::FValue> Future = AsyncFunction->Function(MoveTemp(Parameters));
+        if (Future.IsReady())
+        {
+            return Future.Get();
+        }
+
+        // Hosts that can wait implement IDialogueSink::IsAsyncFunction, and never get here
+        YS_WARN("Async function '%s' didn't return straight away, and was called from dialogue that can't wait for it.", *Name.ToString())
+        return AsyncFunction->TimeoutValue;
+    }
+
     if (!AllFunctions.Contains(Name))
     {
         YS_WARN("Attempted to call non-existent function '%s'", *Name.ToString())
@@ -341,6 +430,7 @@ void UYarnLibraryRegistry::AddCommand(const FYSLSAction& Cmd)
     CommandLibraries.Add(BP);
 
     FYarnBlueprintLibFunction CmdDetail{BP, FName(Cmd.DefinitionName)};
+    CmdDetail.bIsBlocking = Cmd.IsBlocking;
 
     for (auto InParam : Cmd.Parameters)
     {
@@ -388,7 +478,10 @@ void UYarnLibraryRegistry::OnStartGameInstance(UGameInstance* GameInstance)
 
 void UYarnLibraryRegistry::AddStdFunction(const FYarnStdLibFunction& Func)
 {
-    StdFunctions.Add(Func.Name, Func);
+    // The standard library only computes values from its parameters
+    FYarnStdLibFunction& Added = StdFunctions.Add(Func.Name, Func);
+    Added.bIsThreadSafe = true;
+    Added.bIsPure = true;
 }
 
 
@@ -746,16 +839,15 @@ void UYarnLibraryRegistry::LoadStdFunctions()
         }
     });
 
-    // missing:
-    // format_invariant
-    // ...
+    // visited, visited_count, and the rest of the standard library from random to format_invariant, are answered by
+    // the VM itself; see Yarn::Intrinsic
 }
 
 
 void UYarnLibraryRegistry::LoadStdCommands()
 {
     AddStdCommand({
-        TEXT("wait"), 1, [this](TSoftObjectPtr<ADialogueRunner> DialogueRunner, TArray<FString> Params)
+        TEXT("wait"), 1, [](TSoftObjectPtr<ADialogueRunner> DialogueRunner, TArray<FString> Params)
         {
             YS_LOG_FUNCSIG
             float WaitTime = 0;
@@ -768,11 +860,8 @@ void UYarnLibraryRegistry::LoadStdCommands()
                 YS_WARN("wait called with incorrect parameter types (expected NUMBER).")
             }
 
-            DialogueRunner->GetWorld()->GetTimerManager().SetTimer(CommandTimerHandle, [DialogueRunner]()
-            {
-                YS_LOG_FUNCSIG
-                DialogueRunner->ContinueDialogue();
-            }, WaitTime, false);
+            // Each runner's waits are cancelled with its dialogue, and thousands can be pending without a timer each
+            DialogueRunner->ContinueDialogueAfter(WaitTime);
         }
     });
 }
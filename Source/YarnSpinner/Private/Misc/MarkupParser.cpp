@@ -1,13 +1,379 @@
 ﻿#include "MarkupParser.h"
 
+#include "Misc/YSLogging.h"
 
-FString FMarkupParser::Parse(const FString& LineText)
+
+namespace
+{
+    const FStringView NoMarkupAttribute = TEXTVIEW("nomarkup");
+    const FStringView NoMarkupCloseTag = TEXTVIEW("[/nomarkup]");
+    const FStringView CharacterAttribute = TEXTVIEW("character");
+    const FStringView CharacterNameProperty = TEXTVIEW("name");
+    const FStringView TrimWhitespaceProperty = TEXTVIEW("trimwhitespace");
+
+    FString ToString(const FStringView View)
+    {
+        return FString(View.Len(), View.GetData());
+    }
+
+    bool IsIdentifierChar(const TCHAR C)
+    {
+        return FChar::IsAlnum(C) || C == TEXT('_') || C == TEXT('-') || C == TEXT('.');
+    }
+}
+
+
+bool FMarkupParser::Parse(const FStringView LineText, FYarnMarkupParseResult& Result)
+{
+    Result.Text.Reset(LineText.Len());
+    Result.Attributes.Reset();
+
+    // Indices into Result.Attributes of attributes that haven't been closed yet
+    TArray<int32, TInlineAllocator<8>> OpenAttributes;
+    int32 NoMarkupAttributeIndex = INDEX_NONE;
+    bool bValid = true;
+
+    const auto CloseAttribute = [&Result](const int32 AttributeIndex)
+    {
+        FYarnMarkupAttribute& Attribute = Result.Attributes[AttributeIndex];
+        Attribute.Length = Result.Text.Len() - Attribute.Position;
+    };
+
+    int32 Index = ParseCharacterName(LineText, Result);
+
+    while (Index < LineText.Len())
+    {
+        const TCHAR C = LineText[Index];
+
+        if (NoMarkupAttributeIndex != INDEX_NONE)
+        {
+            // Inside [nomarkup] everything is literal except the tag that ends it
+            if (C == TEXT('[') && LineText.RightChop(Index).StartsWith(NoMarkupCloseTag))
+            {
+                CloseAttribute(NoMarkupAttributeIndex);
+                NoMarkupAttributeIndex = INDEX_NONE;
+                Index += NoMarkupCloseTag.Len();
+            }
+            else
+            {
+                Result.Text.AppendChar(C);
+                Index++;
+            }
+            continue;
+        }
+
+        if (C == TEXT('\\') && Index + 1 < LineText.Len())
+        {
+            const TCHAR Next = LineText[Index + 1];
+            if (Next == TEXT('[') || Next == TEXT(']') || Next == TEXT('\\'))
+            {
+                Result.Text.AppendChar(Next);
+                Index += 2;
+                continue;
+            }
+        }
+
+        if (C != TEXT('['))
+        {
+            Result.Text.AppendChar(C);
+            Index++;
+            continue;
+        }
+
+        const int32 TagEnd = FindTagEnd(LineText, Index + 1);
+        if (TagEnd == INDEX_NONE)
+        {
+            YS_WARN("Unterminated markup tag in line \"%s\"", *ToString(LineText))
+            // Keep the rest of the line as plain text rather than dropping it
+            Result.Text.Append(LineText.GetData() + Index, LineText.Len() - Index);
+            bValid = false;
+            break;
+        }
+
+        const FStringView Tag = LineText.Mid(Index + 1, TagEnd - Index - 1).TrimStartAndEnd();
+        Index = TagEnd + 1;
+
+        if (Tag.StartsWith(TEXT('/')))
+        {
+            const FStringView Name = Tag.RightChop(1).TrimStart();
+
+            if (Name.IsEmpty())
+            {
+                // [/] closes everything that's currently open
+                for (const int32 OpenAttribute : OpenAttributes)
+                {
+                    CloseAttribute(OpenAttribute);
+                }
+                OpenAttributes.Reset();
+                continue;
+            }
+
+            // Attributes don't have to be closed in the order they were opened, so close the most recent one with a
+            // matching name
+            const int32 Found = OpenAttributes.FindLastByPredicate([&Result, &Name](const int32 OpenAttribute)
+            {
+                return Name.Equals(Result.Attributes[OpenAttribute].Name);
+            });
+
+            if (Found == INDEX_NONE)
+            {
+                YS_WARN("Markup close tag [/%s] has no matching open tag", *ToString(Name))
+                bValid = false;
+                continue;
+            }
+
+            CloseAttribute(OpenAttributes[Found]);
+            OpenAttributes.RemoveAt(Found, 1, false);
+            continue;
+        }
+
+        const bool bSelfClosing = Tag.EndsWith(TEXT('/'));
+        const FStringView Body = bSelfClosing ? Tag.LeftChop(1).TrimEnd() : Tag;
+
+        const int32 NameEnd = ParseIdentifier(Body, 0);
+        if (NameEnd == 0)
+        {
+            YS_WARN("Invalid markup tag [%s]", *ToString(Tag))
+            bValid = false;
+            continue;
+        }
+
+        const int32 AttributeIndex = Result.Attributes.AddDefaulted();
+        FYarnMarkupAttribute& Attribute = Result.Attributes[AttributeIndex];
+        Attribute.Name = ToString(Body.Left(NameEnd));
+        Attribute.Position = Result.Text.Len();
+
+        if (!ParseProperties(Body, NameEnd, Attribute))
+        {
+            YS_WARN("Invalid properties in markup tag [%s]", *ToString(Tag))
+            bValid = false;
+        }
+
+        if (bSelfClosing)
+        {
+            // A self-closing tag between two words would otherwise leave a double space behind, so eat the space
+            // after it unless asked not to
+            const FString* const TrimWhitespace = Attribute.FindProperty(TrimWhitespaceProperty);
+            const bool bTrimWhitespace = !TrimWhitespace || !TrimWhitespace->Equals(TEXT("false"), ESearchCase::IgnoreCase);
+            const bool bAtWordBoundary = Result.Text.IsEmpty() || FChar::IsWhitespace(Result.Text[Result.Text.Len() - 1]);
+
+            if (bTrimWhitespace && bAtWordBoundary && Index < LineText.Len() && FChar::IsWhitespace(LineText[Index]))
+            {
+                Index++;
+            }
+            continue;
+        }
+
+        if (NoMarkupAttribute.Equals(Attribute.Name))
+        {
+            NoMarkupAttributeIndex = AttributeIndex;
+            continue;
+        }
+
+        OpenAttributes.Add(AttributeIndex);
+    }
+
+    // Anything left open runs to the end of the line
+    for (const int32 OpenAttribute : OpenAttributes)
+    {
+        CloseAttribute(OpenAttribute);
+    }
+    if (NoMarkupAttributeIndex != INDEX_NONE)
+    {
+        CloseAttribute(NoMarkupAttributeIndex);
+    }
+
+    return bValid;
+}
+
+
+bool FMarkupParser::Escape(const FStringView Text, FString& OutText)
 {
-    // TODO
-    FString S;
-    for (auto C : LineText)
+    int32 NumEscapes = 0;
+    for (const TCHAR C : Text)
     {
+        if (C == TEXT('[') || C == TEXT(']') || C == TEXT('\\'))
+        {
+            NumEscapes++;
+        }
+    }
+    if (NumEscapes == 0)
+    {
+        return false;
+    }
 
+    OutText.Reset(Text.Len() + NumEscapes);
+    for (const TCHAR C : Text)
+    {
+        if (C == TEXT('[') || C == TEXT(']') || C == TEXT('\\'))
+        {
+            OutText.AppendChar(TEXT('\\'));
+        }
+        OutText.AppendChar(C);
     }
-    return "";
+    return true;
+}
+
+
+int32 FMarkupParser::FindTagEnd(const FStringView LineText, const int32 Start)
+{
+    // Find the closing bracket, skipping over any inside quoted property values
+    bool bInQuotes = false;
+    for (int32 Index = Start; Index < LineText.Len(); Index++)
+    {
+        const TCHAR C = LineText[Index];
+        if (bInQuotes && C == TEXT('\\'))
+        {
+            Index++;
+        }
+        else if (C == TEXT('"'))
+        {
+            bInQuotes = !bInQuotes;
+        }
+        else if (C == TEXT(']') && !bInQuotes)
+        {
+            return Index;
+        }
+    }
+    return INDEX_NONE;
+}
+
+
+int32 FMarkupParser::ParseIdentifier(const FStringView Tag, const int32 Start)
+{
+    int32 End = Start;
+    while (End < Tag.Len() && IsIdentifierChar(Tag[End]))
+    {
+        End++;
+    }
+    return End;
+}
+
+
+int32 FMarkupParser::ParseValue(const FStringView Tag, const int32 Start, FString& OutValue)
+{
+    if (Start >= Tag.Len())
+    {
+        return INDEX_NONE;
+    }
+
+    if (Tag[Start] == TEXT('"'))
+    {
+        for (int32 Index = Start + 1; Index < Tag.Len(); Index++)
+        {
+            const TCHAR C = Tag[Index];
+            if (C == TEXT('\\') && Index + 1 < Tag.Len())
+            {
+                OutValue.AppendChar(Tag[++Index]);
+            }
+            else if (C == TEXT('"'))
+            {
+                return Index + 1;
+            }
+            else
+            {
+                OutValue.AppendChar(C);
+            }
+        }
+
+        // Unterminated string
+        return INDEX_NONE;
+    }
+
+    int32 End = Start;
+    while (End < Tag.Len() && !FChar::IsWhitespace(Tag[End]))
+    {
+        End++;
+    }
+    OutValue.Append(Tag.GetData() + Start, End - Start);
+    return End;
+}
+
+
+bool FMarkupParser::ParseProperties(const FStringView Tag, int32 Start, FYarnMarkupAttribute& Attribute)
+{
+    // [name=value] is shorthand for a property with the same name as the attribute
+    if (Start < Tag.Len() && Tag[Start] == TEXT('='))
+    {
+        FYarnMarkupProperty& Property = Attribute.Properties.AddDefaulted_GetRef();
+        Property.Name = Attribute.Name;
+        Start = ParseValue(Tag, Start + 1, Property.Value);
+        if (Start == INDEX_NONE)
+        {
+            return false;
+        }
+    }
+
+    while (true)
+    {
+        while (Start < Tag.Len() && FChar::IsWhitespace(Tag[Start]))
+        {
+            Start++;
+        }
+
+        if (Start >= Tag.Len())
+        {
+            return true;
+        }
+
+        const int32 NameEnd = ParseIdentifier(Tag, Start);
+        if (NameEnd == Start || NameEnd >= Tag.Len() || Tag[NameEnd] != TEXT('='))
+        {
+            return false;
+        }
+
+        FYarnMarkupProperty& Property = Attribute.Properties.AddDefaulted_GetRef();
+        Property.Name = ToString(Tag.Mid(Start, NameEnd - Start));
+        Start = ParseValue(Tag, NameEnd + 1, Property.Value);
+        if (Start == INDEX_NONE)
+        {
+            return false;
+        }
+    }
+}
+
+
+int32 FMarkupParser::ParseCharacterName(const FStringView LineText, FYarnMarkupParseResult& Result)
+{
+    // Lines of the form "Name: text" are marked as spoken by Name. Markup or escapes before the colon mean this isn't
+    // a character name.
+    int32 Colon = INDEX_NONE;
+    for (int32 Index = 0; Index < LineText.Len(); Index++)
+    {
+        const TCHAR C = LineText[Index];
+        if (C == TEXT(':'))
+        {
+            Colon = Index;
+            break;
+        }
+        if (C == TEXT('[') || C == TEXT(']') || C == TEXT('\\'))
+        {
+            return 0;
+        }
+    }
+
+    const FStringView Name = Colon == INDEX_NONE ? FStringView() : LineText.Left(Colon).TrimStartAndEnd();
+    if (Name.IsEmpty())
+    {
+        return 0;
+    }
+
+    int32 End = Colon + 1;
+    while (End < LineText.Len() && FChar::IsWhitespace(LineText[End]))
+    {
+        End++;
+    }
+
+    Result.Text.Append(LineText.GetData(), End);
+
+    FYarnMarkupAttribute& Attribute = Result.Attributes.AddDefaulted_GetRef();
+    Attribute.Name = ToString(CharacterAttribute);
+    Attribute.Position = 0;
+    Attribute.Length = End;
+
+    FYarnMarkupProperty& Property = Attribute.Properties.AddDefaulted_GetRef();
+    Property.Name = ToString(CharacterNameProperty);
+    Property.Value = ToString(Name);
+
+    return End;
 }
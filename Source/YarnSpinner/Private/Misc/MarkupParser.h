@@ -1,10 +1,32 @@
 ﻿#pragma once
 
+#include "CoreMinimal.h"
+#include "Misc/YarnMarkup.h"
+
+/**
+ * Single-pass parser for Yarn Spinner markup.
+ *
+ * Supports [attr], [attr=value], [attr key=value ...], self-closing [attr/],
+ * [/attr], the close-all tag [/], [nomarkup]...[/nomarkup], escaped \[ \] and
+ * \\, and the implicit `character` attribute for lines that start with
+ * "Name: ". The input is only ever read through views; the plain text and
+ * attributes are the only allocations made.
+ */
 class FMarkupParser
 {
 public:
+    // Parses LineText into Result, replacing its previous contents. Returns false if the markup was malformed; Result
+    // still holds a best-effort parse in that case.
+    static bool Parse(FStringView LineText, FYarnMarkupParseResult& Result);
 
-    FString Parse(const FString& LineText);
+    // Escapes [, ] and \ so that Text reads as plain text when it's spliced into a line before parsing. Returns false
+    // and leaves OutText alone if there was nothing to escape.
+    static bool Escape(FStringView Text, FString& OutText);
 
-    
+private:
+    static int32 FindTagEnd(FStringView LineText, int32 Start);
+    static int32 ParseIdentifier(FStringView Tag, int32 Start);
+    static int32 ParseValue(FStringView Tag, int32 Start, FString& OutValue);
+    static bool ParseProperties(FStringView Tag, int32 Start, FYarnMarkupAttribute& Attribute);
+    static int32 ParseCharacterName(FStringView LineText, FYarnMarkupParseResult& Result);
 };
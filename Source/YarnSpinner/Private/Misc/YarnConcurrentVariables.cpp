@@ -0,0 +1,130 @@
+#include "Misc/YarnConcurrentVariables.h"
+
+#include "HAL/PlatformProcess.h"
+#include "HAL/PlatformTLS.h"
+
+
+FYarnConcurrentVariables::FYarnConcurrentVariables()
+    : Current(new FVersion())
+{
+}
+
+
+FYarnConcurrentVariables::~FYarnConcurrentVariables()
+{
+    delete Current.load();
+}
+
+
+template <typename FunctionType>
+auto FYarnConcurrentVariables::Read(FunctionType&& Reader) const
+{
+    FReaderShard& Shard = ReaderShards[FPlatformTLS::GetCurrentThreadId() % NumReaderShards];
+
+    // Announced before the version is loaded, so a writer that replaces it afterwards waits for this read
+    const uint32 Phase = ReaderPhase.load() & 1;
+    Shard.Readers[Phase].fetch_add(1);
+    const FVersion* Version = Current.load();
+
+    auto Result = Reader(Version->Variables);
+
+    Shard.Readers[Phase].fetch_sub(1, std::memory_order_release);
+    return Result;
+}
+
+
+TOptional<Yarn::FValue> FYarnConcurrentVariables::Find(const FString& Name) const
+{
+    return Read([&Name](const FYarnVariableMap& Variables)
+    {
+        const Yarn::FValue* Value = Variables.Find(Name);
+        return Value ? TOptional<Yarn::FValue>(*Value) : TOptional<Yarn::FValue>();
+    });
+}
+
+
+bool FYarnConcurrentVariables::Contains(const FString& Name) const
+{
+    return Read([&Name](const FYarnVariableMap& Variables)
+    {
+        return Variables.Contains(Name);
+    });
+}
+
+
+int32 FYarnConcurrentVariables::Num() const
+{
+    return Read([](const FYarnVariableMap& Variables)
+    {
+        return Variables.Num();
+    });
+}
+
+
+FYarnVariableMap FYarnConcurrentVariables::Snapshot() const
+{
+    return Read([](const FYarnVariableMap& Variables)
+    {
+        return Variables;
+    });
+}
+
+
+void FYarnConcurrentVariables::Update(TFunctionRef<void(FYarnVariableMap& Variables)> Change)
+{
+    FScopeLock Lock(&WriterLock);
+
+    // Only this thread publishes, so the current version can be read without announcing it
+    FVersion* const Previous = Current.load(std::memory_order_relaxed);
+    FVersion* const Next = new FVersion(*Previous);
+    Change(Next->Variables);
+
+    if (Next->Variables.IsSameAs(Previous->Variables))
+    {
+        delete Next;
+        return;
+    }
+
+    Current.store(Next);
+
+    // Only after publishing, so a count is never paired with values older than it
+    ChangeCount.fetch_add(1);
+
+    WaitForReaders();
+    delete Previous;
+}
+
+
+double FYarnConcurrentVariables::AddToNumber(const FString& Name, const double Delta)
+{
+    double Result = Delta;
+    Update([&Name, &Result, Delta](FYarnVariableMap& Variables)
+    {
+        const Yarn::FValue* Value = Variables.Find(Name);
+        if (Value && Value->GetType() == Yarn::FValue::EValueType::Number)
+        {
+            Result = Value->GetValue<double>() + Delta;
+        }
+        Variables.Set(Name, Yarn::FValue(Result));
+    });
+    return Result;
+}
+
+
+void FYarnConcurrentVariables::WaitForReaders()
+{
+    // A reader can pick its phase just before the flip and announce itself just after, so both phases are drained
+    // in turn. Readers that announce themselves after the flip load the new version.
+    for (int32 Round = 0; Round < 2; ++Round)
+    {
+        const uint32 DrainingPhase = ReaderPhase.fetch_add(1) & 1;
+
+        for (const FReaderShard& Shard : ReaderShards)
+        {
+            while (Shard.Readers[DrainingPhase].load() != 0)
+            {
+                FPlatformProcess::Yield();
+            }
+        }
+    }
+}
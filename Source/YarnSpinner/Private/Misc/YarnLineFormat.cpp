@@ -0,0 +1,587 @@
+#include "Misc/YarnLineFormat.h"
+
+#include "Internationalization/FastDecimalFormat.h"
+#include "YarnSpinnerCore/Value.h"
+
+
+namespace
+{
+    FString ToString(const FStringView View)
+    {
+        return FString(View.Len(), View.GetData());
+    }
+
+    bool IsIdentifierChar(const TCHAR C)
+    {
+        return FChar::IsAlnum(C) || C == TEXT('_') || C == TEXT('-');
+    }
+
+    void SkipWhitespace(const FStringView Pattern, int32& Index)
+    {
+        while (Index < Pattern.Len() && FChar::IsWhitespace(Pattern[Index]))
+        {
+            ++Index;
+        }
+    }
+
+    FStringView ParseIdentifier(const FStringView Pattern, int32& Index)
+    {
+        const int32 Start = Index;
+        while (Index < Pattern.Len() && IsIdentifierChar(Pattern[Index]))
+        {
+            ++Index;
+        }
+        return Pattern.Mid(Start, Index - Start);
+    }
+
+    // Parses a positional {N} argument starting at Index
+    bool ParseArgumentIndex(const FStringView Pattern, int32& Index, int32& OutArgumentIndex)
+    {
+        if (Index >= Pattern.Len() || Pattern[Index] != TEXT('{'))
+        {
+            return false;
+        }
+
+        int32 Cursor = Index + 1;
+        int32 ArgumentIndex = 0;
+        while (Cursor < Pattern.Len() && FChar::IsDigit(Pattern[Cursor]) && Cursor - Index <= 6)
+        {
+            ArgumentIndex = ArgumentIndex * 10 + (Pattern[Cursor] - TEXT('0'));
+            ++Cursor;
+        }
+
+        if (Cursor == Index + 1 || Cursor >= Pattern.Len() || Pattern[Cursor] != TEXT('}'))
+        {
+            return false;
+        }
+
+        Index = Cursor + 1;
+        OutArgumentIndex = ArgumentIndex;
+        return true;
+    }
+
+    // Reads a quoted or bare value. Bare values run until one of Terminators (or whitespace, if asked), skipping over
+    // any {N} they contain.
+    bool ParseValue(const FStringView Pattern, int32& Index, const FStringView Terminators, const bool bStopAtWhitespace, FString& OutValue)
+    {
+        OutValue.Reset();
+
+        if (Index < Pattern.Len() && Pattern[Index] == TEXT('"'))
+        {
+            for (++Index; Index < Pattern.Len(); ++Index)
+            {
+                TCHAR C = Pattern[Index];
+                if (C == TEXT('"'))
+                {
+                    ++Index;
+                    return true;
+                }
+                if (C == TEXT('\\') && Index + 1 < Pattern.Len())
+                {
+                    C = Pattern[++Index];
+                }
+                OutValue.AppendChar(C);
+            }
+            return false;
+        }
+
+        int32 BraceDepth = 0;
+        for (; Index < Pattern.Len(); ++Index)
+        {
+            const TCHAR C = Pattern[Index];
+            if (C == TEXT('{'))
+            {
+                ++BraceDepth;
+            }
+            else if (C == TEXT('}'))
+            {
+                --BraceDepth;
+            }
+            else if (BraceDepth == 0)
+            {
+                int32 Unused;
+                if ((bStopAtWhitespace && FChar::IsWhitespace(C)) || Terminators.FindChar(C, Unused))
+                {
+                    break;
+                }
+            }
+            OutValue.AppendChar(C);
+        }
+
+        OutValue.TrimEndInline();
+        return !OutValue.IsEmpty();
+    }
+
+    bool ParsePluralForm(const FStringView Name, ETextPluralForm& OutForm)
+    {
+        if (Name.Equals(TEXTVIEW("zero"))) { OutForm = ETextPluralForm::Zero; return true; }
+        if (Name.Equals(TEXTVIEW("one"))) { OutForm = ETextPluralForm::One; return true; }
+        if (Name.Equals(TEXTVIEW("two"))) { OutForm = ETextPluralForm::Two; return true; }
+        if (Name.Equals(TEXTVIEW("few"))) { OutForm = ETextPluralForm::Few; return true; }
+        if (Name.Equals(TEXTVIEW("many"))) { OutForm = ETextPluralForm::Many; return true; }
+        if (Name.Equals(TEXTVIEW("other"))) { OutForm = ETextPluralForm::Other; return true; }
+        return false;
+    }
+
+    void AppendString(FStringBuilderBase& Builder, const FString& String)
+    {
+        Builder.Append(*String, String.Len());
+    }
+}
+
+
+FYarnLineFormat::FYarnLineFormat(const FStringView Pattern, const FCultureRef& InCulture)
+    : Culture(InCulture)
+    , NumberRules(&InCulture->GetDecimalNumberFormattingRules())
+{
+    if (!CompileSegments(Pattern, Segments, false, false))
+    {
+        // Leave anything we don't understand to FText, which at least only has to parse the pattern once as well
+        Segments.Reset();
+        Fallback.Emplace(FText::FromString(ToString(Pattern)));
+    }
+}
+
+
+FString FYarnLineFormat::Format(const TArray<FFormatArgumentValue>& Arguments) const
+{
+    if (Fallback.IsSet())
+    {
+        return FText::Format(Fallback.GetValue(), Arguments).ToString();
+    }
+
+    TStringBuilder<256> Builder;
+    AppendSegments(Builder, Segments, Arguments, nullptr);
+    return FString(Builder.Len(), Builder.GetData());
+}
+
+
+bool FYarnLineFormat::CompileSegments(const FStringView Pattern, TArray<FSegment>& OutSegments, const bool bIsChoice, const bool bPercentIsValue) const
+{
+    FString Literal;
+
+    const auto FlushLiteral = [&Literal, &OutSegments]()
+    {
+        if (!Literal.IsEmpty())
+        {
+            OutSegments.AddDefaulted_GetRef().Text = MoveTemp(Literal);
+            Literal.Reset();
+        }
+    };
+
+    int32 Index = 0;
+    while (Index < Pattern.Len())
+    {
+        const TCHAR C = Pattern[Index];
+
+        if (C == TEXT('`'))
+        {
+            // FText's escape character
+            return false;
+        }
+
+        if (C == TEXT('\\') && Index + 1 < Pattern.Len())
+        {
+            // Markup escapes are kept as written for the markup parser
+            Literal.AppendChars(&Pattern[Index], 2);
+            Index += 2;
+            continue;
+        }
+
+        if (C == TEXT('%') && bPercentIsValue)
+        {
+            FlushLiteral();
+            OutSegments.AddDefaulted_GetRef().Type = ESegmentType::Value;
+            ++Index;
+            continue;
+        }
+
+        if (C == TEXT('{'))
+        {
+            const int32 TokenStart = Index;
+            int32 ArgumentIndex;
+            if (!ParseArgumentIndex(Pattern, Index, ArgumentIndex))
+            {
+                return false;
+            }
+
+            FlushLiteral();
+            FSegment& Segment = OutSegments.AddDefaulted_GetRef();
+            Segment.ArgumentIndex = ArgumentIndex;
+
+            if (Index < Pattern.Len() && Pattern[Index] == TEXT('|'))
+            {
+                if (bIsChoice || !CompileModifier(Pattern, Index, Segment))
+                {
+                    return false;
+                }
+            }
+            else
+            {
+                Segment.Type = ESegmentType::Argument;
+                Segment.Text = ToString(Pattern.Mid(TokenStart, Index - TokenStart));
+            }
+            continue;
+        }
+
+        if (C == TEXT('[') && !bIsChoice)
+        {
+            int32 MarkerEnd = Index;
+            FSegment Marker;
+            if (CompileMarker(Pattern, MarkerEnd, Marker))
+            {
+                FlushLiteral();
+                OutSegments.Add(MoveTemp(Marker));
+                Index = MarkerEnd;
+                continue;
+            }
+        }
+
+        Literal.AppendChar(C);
+        ++Index;
+    }
+
+    FlushLiteral();
+    return true;
+}
+
+
+bool FYarnLineFormat::CompileModifier(const FStringView Pattern, int32& Index, FSegment& Segment) const
+{
+    // {N}|plural(one=...,other=...) or {N}|ordinal(...)
+    int32 Cursor = Index + 1;
+    const FStringView Name = ParseIdentifier(Pattern, Cursor);
+    if (Name.Equals(TEXTVIEW("plural")))
+    {
+        Segment.PluralType = ETextPluralType::Cardinal;
+    }
+    else if (Name.Equals(TEXTVIEW("ordinal")))
+    {
+        Segment.PluralType = ETextPluralType::Ordinal;
+    }
+    else
+    {
+        return false;
+    }
+
+    if (Cursor >= Pattern.Len() || Pattern[Cursor] != TEXT('('))
+    {
+        return false;
+    }
+    ++Cursor;
+
+    Segment.Type = ESegmentType::Plural;
+    Segment.Choices.SetNum(static_cast<int32>(ETextPluralForm::Count));
+
+    FString Value;
+    for (;;)
+    {
+        SkipWhitespace(Pattern, Cursor);
+        if (Cursor < Pattern.Len() && Pattern[Cursor] == TEXT(')'))
+        {
+            ++Cursor;
+            break;
+        }
+
+        ETextPluralForm Form;
+        if (!ParsePluralForm(ParseIdentifier(Pattern, Cursor), Form))
+        {
+            return false;
+        }
+
+        SkipWhitespace(Pattern, Cursor);
+        if (Cursor >= Pattern.Len() || Pattern[Cursor] != TEXT('='))
+        {
+            return false;
+        }
+        ++Cursor;
+        SkipWhitespace(Pattern, Cursor);
+
+        if (!ParseValue(Pattern, Cursor, TEXTVIEW(",)"), false, Value))
+        {
+            return false;
+        }
+
+        FChoice& Choice = Segment.Choices[static_cast<int32>(Form)];
+        Choice.bIsSet = true;
+        if (!CompileSegments(Value, Choice.Segments, true, false))
+        {
+            return false;
+        }
+
+        SkipWhitespace(Pattern, Cursor);
+        if (Cursor < Pattern.Len() && Pattern[Cursor] == TEXT(','))
+        {
+            ++Cursor;
+        }
+    }
+
+    Index = Cursor;
+    return true;
+}
+
+
+bool FYarnLineFormat::CompileMarker(const FStringView Pattern, int32& Index, FSegment& Segment) const
+{
+    // [plural value={N} one="..." other="..."/], [ordinal ...] or [select value={N} key="..." other="..."/]
+    int32 Cursor = Index + 1;
+    const FStringView Name = ParseIdentifier(Pattern, Cursor);
+    if (Name.Equals(TEXTVIEW("plural")))
+    {
+        Segment.Type = ESegmentType::Plural;
+        Segment.PluralType = ETextPluralType::Cardinal;
+    }
+    else if (Name.Equals(TEXTVIEW("ordinal")))
+    {
+        Segment.Type = ESegmentType::Plural;
+        Segment.PluralType = ETextPluralType::Ordinal;
+    }
+    else if (Name.Equals(TEXTVIEW("select")))
+    {
+        Segment.Type = ESegmentType::Select;
+    }
+    else
+    {
+        return false;
+    }
+
+    if (Cursor >= Pattern.Len() || !FChar::IsWhitespace(Pattern[Cursor]))
+    {
+        return false;
+    }
+
+    if (Segment.Type == ESegmentType::Plural)
+    {
+        Segment.Choices.SetNum(static_cast<int32>(ETextPluralForm::Count));
+    }
+
+    bool bHasValue = false;
+    FString Value;
+    for (;;)
+    {
+        SkipWhitespace(Pattern, Cursor);
+        if (Cursor + 1 < Pattern.Len() && Pattern[Cursor] == TEXT('/') && Pattern[Cursor + 1] == TEXT(']'))
+        {
+            Cursor += 2;
+            break;
+        }
+
+        const FStringView Key = ParseIdentifier(Pattern, Cursor);
+        if (Key.IsEmpty() || Cursor >= Pattern.Len() || Pattern[Cursor] != TEXT('='))
+        {
+            return false;
+        }
+        ++Cursor;
+
+        if (!ParseValue(Pattern, Cursor, TEXTVIEW("/]"), true, Value))
+        {
+            return false;
+        }
+
+        if (Key.Equals(TEXTVIEW("value")))
+        {
+            int32 ValueIndex = 0;
+            if (!ParseArgumentIndex(Value, ValueIndex, Segment.ArgumentIndex) || ValueIndex != Value.Len())
+            {
+                return false;
+            }
+            bHasValue = true;
+            continue;
+        }
+
+        FChoice* Choice;
+        if (Segment.Type == ESegmentType::Plural)
+        {
+            ETextPluralForm Form;
+            if (!ParsePluralForm(Key, Form))
+            {
+                return false;
+            }
+            Choice = &Segment.Choices[static_cast<int32>(Form)];
+        }
+        else
+        {
+            Choice = &Segment.Choices.AddDefaulted_GetRef();
+            Choice->Key = ToString(Key);
+        }
+
+        Choice->bIsSet = true;
+        if (!CompileSegments(Value, Choice->Segments, true, true))
+        {
+            return false;
+        }
+    }
+
+    if (!bHasValue)
+    {
+        return false;
+    }
+
+    Index = Cursor;
+    return true;
+}
+
+
+void FYarnLineFormat::AppendSegments(FStringBuilderBase& Builder, const TArray<FSegment>& InSegments, const TArray<FFormatArgumentValue>& Arguments, const FFormatArgumentValue* const Value) const
+{
+    for (const FSegment& Segment : InSegments)
+    {
+        switch (Segment.Type)
+        {
+        case ESegmentType::Literal:
+            AppendString(Builder, Segment.Text);
+            break;
+
+        case ESegmentType::Argument:
+            if (Arguments.IsValidIndex(Segment.ArgumentIndex))
+            {
+                AppendArgument(Builder, Arguments[Segment.ArgumentIndex]);
+            }
+            else
+            {
+                // Same as FText::Format: unmatched arguments are left in place
+                AppendString(Builder, Segment.Text);
+            }
+            break;
+
+        case ESegmentType::Value:
+            if (Value)
+            {
+                AppendArgument(Builder, *Value);
+            }
+            break;
+
+        case ESegmentType::Plural:
+            if (Arguments.IsValidIndex(Segment.ArgumentIndex))
+            {
+                const FFormatArgumentValue& Argument = Arguments[Segment.ArgumentIndex];
+                const FChoice* Choice = &Segment.Choices[static_cast<int32>(GetPluralForm(Argument, Segment.PluralType))];
+                if (!Choice->bIsSet)
+                {
+                    Choice = &Segment.Choices[static_cast<int32>(ETextPluralForm::Other)];
+                }
+                AppendSegments(Builder, Choice->Segments, Arguments, &Argument);
+            }
+            break;
+
+        case ESegmentType::Select:
+            if (Arguments.IsValidIndex(Segment.ArgumentIndex))
+            {
+                const FFormatArgumentValue& Argument = Arguments[Segment.ArgumentIndex];
+                const FString Key = ToInvariantString(Argument);
+                const FChoice* Choice = Segment.Choices.FindByPredicate([&Key](const FChoice& C) { return C.Key.Equals(Key, ESearchCase::CaseSensitive); });
+                if (!Choice)
+                {
+                    Choice = Segment.Choices.FindByPredicate([](const FChoice& C) { return C.Key == TEXT("other"); });
+                }
+                if (Choice)
+                {
+                    AppendSegments(Builder, Choice->Segments, Arguments, &Argument);
+                }
+            }
+            break;
+        }
+    }
+}
+
+
+void FYarnLineFormat::AppendArgument(FStringBuilderBase& Builder, const FFormatArgumentValue& Argument) const
+{
+    // Numbers are formatted the way FText::Format would, with the culture's default options
+    const FNumberFormattingOptions& Options = NumberRules->CultureDefaultFormattingOptions;
+
+    switch (Argument.GetType())
+    {
+    case EFormatArgumentType::Int:
+        AppendString(Builder, FastDecimalFormat::NumberToString(Argument.GetIntValue(), *NumberRules, Options));
+        break;
+    case EFormatArgumentType::UInt:
+        AppendString(Builder, FastDecimalFormat::NumberToString(Argument.GetUIntValue(), *NumberRules, Options));
+        break;
+    case EFormatArgumentType::Float:
+        AppendString(Builder, FastDecimalFormat::NumberToString(Argument.GetFloatValue(), *NumberRules, Options));
+        break;
+    case EFormatArgumentType::Double:
+        AppendString(Builder, FastDecimalFormat::NumberToString(Argument.GetDoubleValue(), *NumberRules, Options));
+        break;
+    case EFormatArgumentType::Text:
+        AppendString(Builder, Argument.GetTextValue().ToString());
+        break;
+    default:
+        break;
+    }
+}
+
+
+ETextPluralForm FYarnLineFormat::GetPluralForm(const FFormatArgumentValue& Argument, const ETextPluralType PluralType) const
+{
+    switch (Argument.GetType())
+    {
+    case EFormatArgumentType::Int:
+        return Culture->GetPluralForm(Argument.GetIntValue(), PluralType);
+    case EFormatArgumentType::UInt:
+        return Culture->GetPluralForm(static_cast<int64>(Argument.GetUIntValue()), PluralType);
+    case EFormatArgumentType::Float:
+        return Culture->GetPluralForm(Argument.GetFloatValue(), PluralType);
+    case EFormatArgumentType::Double:
+        return Culture->GetPluralForm(Argument.GetDoubleValue(), PluralType);
+    default:
+        return ETextPluralForm::Other;
+    }
+}
+
+
+FString FYarnLineFormat::ToInvariantString(const FFormatArgumentValue& Argument)
+{
+    TStringBuilder<32> Builder;
+    switch (Argument.GetType())
+    {
+    case EFormatArgumentType::Int:
+        Yarn::FValue::AppendNumber(Builder, Argument.GetIntValue());
+        break;
+    case EFormatArgumentType::UInt:
+        Yarn::FValue::AppendNumber(Builder, Argument.GetUIntValue());
+        break;
+    case EFormatArgumentType::Float:
+        Yarn::FValue::AppendNumber(Builder, Argument.GetFloatValue());
+        break;
+    case EFormatArgumentType::Double:
+        Yarn::FValue::AppendNumber(Builder, Argument.GetDoubleValue());
+        break;
+    case EFormatArgumentType::Text:
+        return Argument.GetTextValue().ToString();
+    default:
+        break;
+    }
+    return FString(Builder.Len(), Builder.GetData());
+}
+
+
+bool FYarnLineFormatCache::ResetIfCultureChanged()
+{
+    const FCultureRef CurrentCulture = FInternationalization::Get().GetCurrentLanguage();
+    if (Culture.Get() == &CurrentCulture.Get())
+    {
+        return false;
+    }
+
+    Formats.Reset();
+    Culture = CurrentCulture;
+    return true;
+}
+
+
+const FYarnLineFormat& FYarnLineFormatCache::FindOrCompile(const FName LineID, TFunctionRef<FString()> GetPattern)
+{
+    if (!Culture.IsValid())
+    {
+        ResetIfCultureChanged();
+    }
+
+    if (const FYarnLineFormat* const Format = Formats.Find(LineID))
+    {
+        return *Format;
+    }
+
+    return Formats.Emplace(LineID, FYarnLineFormat(GetPattern(), Culture.ToSharedRef()));
+}
@@ -0,0 +1,106 @@
+#include "Misc/YarnLineTextCache.h"
+
+#include "Line.h"
+#include "YarnProject.h"
+#include "Internationalization/TextLocalizationManager.h"
+#include "Misc/MarkupParser.h"
+#include "Misc/YSLogging.h"
+
+THIRD_PARTY_INCLUDES_START
+#include "YarnSpinnerCore/Common.h"
+THIRD_PARTY_INCLUDES_END
+
+
+namespace
+{
+    // Returns the substitutions unchanged unless one of them is text containing markup characters
+    const TArray<FFormatArgumentValue>& EscapeSubstitutions(const TArray<FFormatArgumentValue>& Substitutions, TArray<FFormatArgumentValue>& Escaped)
+    {
+        for (int32 Index = 0; Index < Substitutions.Num(); Index++)
+        {
+            if (Substitutions[Index].GetType() != EFormatArgumentType::Text)
+            {
+                continue;
+            }
+
+            FString EscapedText;
+            if (FMarkupParser::Escape(Substitutions[Index].GetTextValue().ToString(), EscapedText))
+            {
+                if (Escaped.Num() == 0)
+                {
+                    Escaped = Substitutions;
+                }
+                Escaped[Index] = FFormatArgumentValue(FText::FromString(MoveTemp(EscapedText)));
+            }
+        }
+        return Escaped.Num() > 0 ? Escaped : Substitutions;
+    }
+}
+
+
+void FYarnLineTextCache::Resolve(UYarnProject* const YarnProject, const Yarn::Line& YarnLine, FYarnLine& Line)
+{
+    const FName LineID = YarnLine.LineID;
+
+    // Both caches were built for one culture, so they go together when it changes
+    if (LineFormatCache.ResetIfCultureChanged())
+    {
+        MarkupCache.Reset();
+    }
+
+    // Lines without substitutions always produce the same text for a given culture, so their markup only needs
+    // parsing once
+    const bool bCanCache = YarnLine.Substitutions.Num() == 0;
+    if (bCanCache)
+    {
+        if (const FYarnMarkupParseResult* const Cached = MarkupCache.Find(LineID))
+        {
+            Line.DisplayText = FText::FromString(Cached->Text);
+            Line.Attributes = Cached->Attributes;
+            return;
+        }
+    }
+
+    // This assumes that we only ever care about lines that actually exist in .yarn files (rather than allowing extra lines in .csv files)
+    if (!IsValid(YarnProject) || !YarnProject->HasLine(LineID))
+    {
+        Line.DisplayText = FText::FromString(TEXT("(missing line!)"));
+        return;
+    }
+
+    // The line's text is only looked up and compiled the first time it's seen in this culture
+    const FYarnLineFormat& LineFormat = LineFormatCache.FindOrCompile(LineID, [YarnProject, LineID]() -> FString
+    {
+        // Try to find the localized string. If not, use the non-localized one from the project itself.
+        const FTextConstDisplayStringPtr FindDisplayStr = FTextLocalizationManager::Get()
+            .FindDisplayString(YarnProject->GetName(), LineID.ToString());
+
+        // Log if we weren't able to find a localized version
+        if (!FindDisplayStr.IsValid())
+        {
+            YS_LOG("Using non-localized version of line with ID '%s' because a localized version was not found.", *LineID.ToString());
+            return YarnProject->GetLine(LineID);
+        }
+
+        return *FindDisplayStr;
+    });
+
+    TArray<FFormatArgumentValue> EscapedSubstitutions;
+
+    // Apply Substitutions. Markup is parsed after substitution, so substituted values can be used as property values;
+    // their brackets are escaped first so that a value containing [b] or [/] reads as text rather than as tags.
+    const FString TextWithSubstitutions = LineFormat.Format(EscapeSubstitutions(YarnLine.Substitutions, EscapedSubstitutions));
+
+    FYarnMarkupParseResult Markup;
+    FMarkupParser::Parse(TextWithSubstitutions, Markup);
+
+    YS_LOG_FUNC("Setting line %s to display text '%s'", *LineID.ToString(), *Markup.Text)
+
+    Line.DisplayText = FText::FromString(Markup.Text);
+    Line.Attributes = Markup.Attributes;
+
+    if (bCanCache)
+    {
+        MarkupCache.Emplace(LineID, MoveTemp(Markup));
+    }
+}
@@ -0,0 +1,520 @@
+#include "Misc/YarnVariableJournal.h"
+
+#include "HAL/FileManager.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Misc/YSLogging.h"
+#include "Serialization/MemoryReader.h"
+#include "Serialization/MemoryWriter.h"
+
+
+namespace
+{
+    // "YSVC"
+    constexpr uint32 CheckpointMagic = 0x43565359;
+    constexpr uint8 CheckpointVersion = 1;
+
+    // Size and checksum in front of every flushed frame
+    constexpr int64 FrameHeaderSize = sizeof(uint32) * 2;
+
+    FString GetJournalPath(const FString& Directory, const uint32 Generation)
+    {
+        return FPaths::Combine(Directory, FString::Printf(TEXT("Variables.%u.journal"), Generation));
+    }
+
+    uint32 ReadUInt32(const uint8* Bytes)
+    {
+        uint32 Value;
+        FMemory::Memcpy(&Value, Bytes, sizeof(Value));
+        return Value;
+    }
+}
+
+
+FYarnVariableJournal::FYarnVariableJournal(const FString& InDirectory)
+    : Directory(InDirectory)
+{
+}
+
+
+FYarnVariableJournal::~FYarnVariableJournal()
+{
+    Close();
+}
+
+
+bool FYarnVariableJournal::Open(FYarnVariableMap& OutVariables)
+{
+    Close();
+
+    OutVariables.Reset();
+    uint32 FirstJournal = 0;
+    if (!LoadCheckpoint(OutVariables, FirstJournal))
+    {
+        // The journals it covers are gone, so replaying the rest would only give part of the variables, and a new
+        // checkpoint would make that permanent. Everything is left on disk as it is for someone to look at.
+        YS_ERR("Not journaling variables to %s, because its checkpoint can't be loaded", *Directory);
+        OutVariables.Reset();
+        return false;
+    }
+
+    uint32 LastJournal = FirstJournal;
+    int32 NumReplayed = 0;
+    for (const uint32 JournalGeneration : FindJournals())
+    {
+        if (JournalGeneration < FirstJournal)
+        {
+            // Left behind by a crash after its checkpoint was written, and already part of it
+            IFileManager::Get().Delete(*GetJournalPath(Directory, JournalGeneration));
+            continue;
+        }
+
+        ReplayJournal(GetJournalPath(Directory, JournalGeneration), OutVariables);
+        LastJournal = JournalGeneration;
+        ++NumReplayed;
+    }
+
+    YS_LOG("Recovered %d variables from %s, replaying %d journals", OutVariables.Num(), *Directory, NumReplayed);
+
+    {
+        FScopeLock Lock(&RecordLock);
+        LatestVariables = OutVariables;
+    }
+
+    if (!OpenJournal(LastJournal + 1))
+    {
+        return false;
+    }
+
+    // Folded into a checkpoint straight away, so recovering next time doesn't have to replay them again
+    if (NumReplayed > 0)
+    {
+        StartCheckpoint(OutVariables, Generation);
+    }
+    return true;
+}
+
+
+void FYarnVariableJournal::Close()
+{
+    if (Writer.IsValid())
+    {
+        Flush();
+    }
+
+    if (CheckpointTask.IsValid())
+    {
+        FTaskGraphInterface::Get().WaitUntilTaskCompletes(CheckpointTask);
+        CheckpointTask = nullptr;
+    }
+
+    Writer.Reset();
+
+    FScopeLock Lock(&RecordLock);
+    PendingRecords.Reset();
+    SlotIDs.Reset();
+    LatestVariables.Reset();
+}
+
+
+void FYarnVariableJournal::RecordSet(const FString& Name, const Yarn::FValue& Value, const FYarnVariableMap& Variables)
+{
+    FScopeLock Lock(&RecordLock);
+
+    const uint32 SlotID = GetSlotID(Name);
+
+    FMemoryWriter Archive(PendingRecords, false, true);
+    WriteValue(Archive, Value);
+    uint32 PackedSlotID = SlotID;
+    Archive.SerializeIntPacked(PackedSlotID);
+
+    LatestVariables = Variables;
+}
+
+
+void FYarnVariableJournal::RecordClear(const FString& Name, const FYarnVariableMap& Variables)
+{
+    FScopeLock Lock(&RecordLock);
+
+    const uint32 SlotID = GetSlotID(Name);
+
+    FMemoryWriter Archive(PendingRecords, false, true);
+    uint8 Record = static_cast<uint8>(ERecord::Clear);
+    uint32 PackedSlotID = SlotID;
+    Archive << Record;
+    Archive.SerializeIntPacked(PackedSlotID);
+
+    LatestVariables = Variables;
+}
+
+
+bool FYarnVariableJournal::Flush()
+{
+    if (!Writer.IsValid())
+    {
+        return false;
+    }
+
+    TArray<uint8> Records;
+    FYarnVariableMap Variables;
+    bool bStartNewJournal = false;
+    {
+        FScopeLock Lock(&RecordLock);
+        if (PendingRecords.Num() == 0)
+        {
+            return true;
+        }
+
+        Records = MoveTemp(PendingRecords);
+        PendingRecords.Reset();
+
+        // Anything recorded from here on goes into the next journal, which gives out its own slot IDs
+        bStartNewJournal = JournalSize + Records.Num() + FrameHeaderSize >= CompactThreshold && !IsWritingCheckpoint();
+        if (bStartNewJournal)
+        {
+            Variables = LatestVariables;
+            SlotIDs.Reset();
+        }
+    }
+
+    uint32 Size = Records.Num();
+    uint32 Checksum = FCrc::MemCrc32(Records.GetData(), Records.Num());
+    *Writer << Size << Checksum;
+    Writer->Serialize(Records.GetData(), Records.Num());
+    Writer->Flush();
+    JournalSize += Records.Num() + FrameHeaderSize;
+
+    if (Writer->IsError())
+    {
+        YS_ERR("Couldn't write to the variable journal %s", *GetJournalPath(Directory, Generation));
+        return false;
+    }
+
+    if (bStartNewJournal)
+    {
+        if (!OpenJournal(Generation + 1))
+        {
+            return false;
+        }
+        StartCheckpoint(Variables, Generation);
+    }
+    return true;
+}
+
+
+uint32 FYarnVariableJournal::GetSlotID(const FString& Name)
+{
+    if (const uint32* SlotID = SlotIDs.Find(Name))
+    {
+        return *SlotID;
+    }
+
+    // Slots are given out in order, so the record only needs the name
+    FMemoryWriter Archive(PendingRecords, false, true);
+    uint8 Record = static_cast<uint8>(ERecord::Declare);
+    FString DeclaredName = Name;
+    Archive << Record << DeclaredName;
+
+    return SlotIDs.Add(Name, SlotIDs.Num());
+}
+
+
+bool FYarnVariableJournal::OpenJournal(const uint32 NewGeneration)
+{
+    const FString Path = GetJournalPath(Directory, NewGeneration);
+
+    // Replaces a journal left over from a crash that never got a frame in, or the writer that's closing
+    Writer.Reset();
+    Writer.Reset(IFileManager::Get().CreateFileWriter(*Path));
+    if (!Writer.IsValid())
+    {
+        YS_ERR("Couldn't create the variable journal %s", *Path);
+        return false;
+    }
+
+    Generation = NewGeneration;
+    JournalSize = 0;
+    return true;
+}
+
+
+void FYarnVariableJournal::StartCheckpoint(const FYarnVariableMap& Variables, const uint32 FirstJournal)
+{
+    // The map can't change under the copy, so the whole thing is written off the game thread
+    CheckpointTask = FFunctionGraphTask::CreateAndDispatchWhenReady([Variables, FirstJournal, CheckpointPath = GetCheckpointPath(), OldJournals = FindJournals(), JournalDirectory = Directory]
+    {
+        if (!WriteCheckpoint(CheckpointPath, Variables, FirstJournal))
+        {
+            return;
+        }
+
+        for (const uint32 JournalGeneration : OldJournals)
+        {
+            if (JournalGeneration < FirstJournal)
+            {
+                IFileManager::Get().Delete(*GetJournalPath(JournalDirectory, JournalGeneration));
+            }
+        }
+    }, TStatId(), nullptr, ENamedThreads::AnyBackgroundThreadNormalTask);
+}
+
+
+FString FYarnVariableJournal::GetCheckpointPath() const
+{
+    return FPaths::Combine(Directory, TEXT("Variables.checkpoint"));
+}
+
+
+TArray<uint32> FYarnVariableJournal::FindJournals() const
+{
+    TArray<FString> FileNames;
+    IFileManager::Get().FindFiles(FileNames, *FPaths::Combine(Directory, TEXT("Variables.*.journal")), true, false);
+
+    TArray<uint32> Journals;
+    for (const FString& FileName : FileNames)
+    {
+        const FString GenerationString = FPaths::GetBaseFilename(FileName).RightChop(FCString::Strlen(TEXT("Variables.")));
+        if (GenerationString.IsNumeric())
+        {
+            Journals.Add(static_cast<uint32>(FCString::Strtoui64(*GenerationString, nullptr, 10)));
+        }
+    }
+
+    Journals.Sort();
+    return Journals;
+}
+
+
+void FYarnVariableJournal::WriteValue(FArchive& Archive, const Yarn::FValue& Value)
+{
+    uint8 Record = 0;
+    switch (Value.GetType())
+    {
+    case Yarn::FValue::EValueType::Number:
+        {
+            Record = static_cast<uint8>(ERecord::SetNumber);
+            double Number = Value.GetValue<double>();
+            Archive << Record << Number;
+            break;
+        }
+    case Yarn::FValue::EValueType::Bool:
+        Record = static_cast<uint8>(Value.GetValue<bool>() ? ERecord::SetTrue : ERecord::SetFalse);
+        Archive << Record;
+        break;
+    case Yarn::FValue::EValueType::String:
+        {
+            Record = static_cast<uint8>(ERecord::SetString);
+            FString String = Value.GetValue<FString>();
+            Archive << Record << String;
+            break;
+        }
+    }
+}
+
+
+bool FYarnVariableJournal::ReadValue(FArchive& Archive, const ERecord Record, Yarn::FValue& OutValue)
+{
+    switch (Record)
+    {
+    case ERecord::SetNumber:
+        {
+            double Number = 0;
+            Archive << Number;
+            OutValue = Yarn::FValue(Number);
+            return true;
+        }
+    case ERecord::SetFalse:
+    case ERecord::SetTrue:
+        OutValue = Yarn::FValue(Record == ERecord::SetTrue);
+        return true;
+    case ERecord::SetString:
+        {
+            FString String;
+            Archive << String;
+            OutValue = Yarn::FValue(String);
+            return true;
+        }
+    default:
+        return false;
+    }
+}
+
+
+bool FYarnVariableJournal::LoadCheckpoint(FYarnVariableMap& OutVariables, uint32& OutFirstJournal) const
+{
+    // Nothing has been checkpointed yet, so every journal is still there
+    if (!IFileManager::Get().FileExists(*GetCheckpointPath()))
+    {
+        return true;
+    }
+
+    TArray<uint8> Data;
+    if (!FFileHelper::LoadFileToArray(Data, *GetCheckpointPath(), FILEREAD_Silent))
+    {
+        YS_ERR("The variable checkpoint in %s can't be read", *Directory);
+        return false;
+    }
+
+    // The checksum covers everything before it
+    if (Data.Num() < static_cast<int32>(sizeof(uint32)) || FCrc::MemCrc32(Data.GetData(), Data.Num() - sizeof(uint32)) != ReadUInt32(Data.GetData() + Data.Num() - sizeof(uint32)))
+    {
+        YS_ERR("The variable checkpoint in %s is damaged and can't be loaded", *Directory);
+        return false;
+    }
+
+    FMemoryReader Archive(Data);
+    uint32 Magic = 0;
+    uint8 Version = 0;
+    uint32 FirstJournal = 0;
+    int32 NumVariables = 0;
+    Archive << Magic << Version << FirstJournal << NumVariables;
+    if (Magic != CheckpointMagic || Version != CheckpointVersion)
+    {
+        YS_ERR("The variable checkpoint in %s is from a version that isn't supported", *Directory);
+        return false;
+    }
+
+    FYarnVariableMap Variables;
+    for (int32 i = 0; i < NumVariables && !Archive.IsError(); ++i)
+    {
+        FString Name;
+        uint8 Record = 0;
+        Yarn::FValue Value;
+        Archive << Name << Record;
+        if (!ReadValue(Archive, static_cast<ERecord>(Record), Value))
+        {
+            Archive.SetError();
+            break;
+        }
+        Variables.Set(Name, Value);
+    }
+
+    if (Archive.IsError())
+    {
+        YS_ERR("The variable checkpoint in %s is damaged and can't be loaded", *Directory);
+        return false;
+    }
+
+    OutVariables = MoveTemp(Variables);
+    OutFirstJournal = FirstJournal;
+    return true;
+}
+
+
+bool FYarnVariableJournal::WriteCheckpoint(const FString& Path, const FYarnVariableMap& Variables, const uint32 FirstJournal)
+{
+    TArray<uint8> Data;
+    FMemoryWriter Archive(Data);
+
+    uint32 Magic = CheckpointMagic;
+    uint8 Version = CheckpointVersion;
+    uint32 FirstJournalToReplay = FirstJournal;
+    int32 NumVariables = Variables.Num();
+    Archive << Magic << Version << FirstJournalToReplay << NumVariables;
+
+    Variables.ForEach([&Archive](const FString& Name, const Yarn::FValue& Value)
+    {
+        FString VariableName = Name;
+        Archive << VariableName;
+        WriteValue(Archive, Value);
+    });
+
+    uint32 Checksum = FCrc::MemCrc32(Data.GetData(), Data.Num());
+    Archive << Checksum;
+
+    // Written next to the old checkpoint and moved over it, so there's always a whole one on disk
+    const FString TempPath = Path + TEXT(".tmp");
+    if (!FFileHelper::SaveArrayToFile(Data, *TempPath) || !IFileManager::Get().Move(*Path, *TempPath, true, true))
+    {
+        YS_ERR("Couldn't write the variable checkpoint %s", *Path);
+        return false;
+    }
+
+    YS_LOG("Wrote a checkpoint of %d variables, %d bytes", NumVariables, Data.Num());
+    return true;
+}
+
+
+int64 FYarnVariableJournal::ReplayJournal(const FString& Path, FYarnVariableMap& Variables)
+{
+    TArray<uint8> Data;
+    if (!FFileHelper::LoadFileToArray(Data, *Path, FILEREAD_Silent))
+    {
+        return 0;
+    }
+
+    TArray<FString> SlotNames;
+    int64 Offset = 0;
+    int32 NumRecords = 0;
+
+    while (Offset + FrameHeaderSize <= Data.Num())
+    {
+        const uint32 Size = ReadUInt32(Data.GetData() + Offset);
+        const uint32 Checksum = ReadUInt32(Data.GetData() + Offset + sizeof(uint32));
+        const uint8* const Frame = Data.GetData() + Offset + FrameHeaderSize;
+
+        // Only the last frame can be cut short, by a crash while it was being written
+        if (Offset + FrameHeaderSize + Size > Data.Num() || FCrc::MemCrc32(Frame, Size) != Checksum)
+        {
+            break;
+        }
+
+        FMemoryReader Archive(Data);
+        Archive.Seek(Offset + FrameHeaderSize);
+        const int64 FrameEnd = Offset + FrameHeaderSize + Size;
+
+        while (Archive.Tell() < FrameEnd && !Archive.IsError())
+        {
+            uint8 Record = 0;
+            Archive << Record;
+
+            if (static_cast<ERecord>(Record) == ERecord::Declare)
+            {
+                Archive << SlotNames.AddDefaulted_GetRef();
+                continue;
+            }
+
+            Yarn::FValue Value;
+            const bool bIsSet = ReadValue(Archive, static_cast<ERecord>(Record), Value);
+            if (!bIsSet && static_cast<ERecord>(Record) != ERecord::Clear)
+            {
+                Archive.SetError();
+                break;
+            }
+
+            uint32 SlotID = 0;
+            Archive.SerializeIntPacked(SlotID);
+            if (!SlotNames.IsValidIndex(SlotID))
+            {
+                Archive.SetError();
+                break;
+            }
+
+            if (bIsSet)
+            {
+                Variables.Set(SlotNames[SlotID], Value);
+            }
+            else
+            {
+                Variables.Remove(SlotNames[SlotID]);
+            }
+            ++NumRecords;
+        }
+
+        if (Archive.IsError())
+        {
+            YS_ERR("The variable journal %s has a damaged frame and can't be replayed past it", *Path);
+            break;
+        }
+
+        Offset = FrameEnd;
+    }
+
+    if (Offset < Data.Num())
+    {
+        YS_WARN("Dropped %lld bytes from the end of the variable journal %s that weren't written whole", Data.Num() - Offset, *Path);
+    }
+
+    YS_LOG("Replayed %d changes from %s", NumRecords, *Path);
+    return Offset;
+}
@@ -0,0 +1,427 @@
+#include "Misc/YarnVariableMap.h"
+
+
+const Yarn::FValue* FYarnVariableMap::Find(const FString& Name) const
+{
+    const FLeaf* Leaf = FindLeaf(Root.Get(), GetTypeHash(Name), 0, Name);
+    return Leaf ? &Leaf->Value : nullptr;
+}
+
+
+void FYarnVariableMap::Set(const FString& Name, const Yarn::FValue& Value)
+{
+    const FLeafPtr Leaf = MakeShared<FLeaf>(FLeaf{GetTypeHash(Name), Name, Value});
+
+    bool bAdded = false;
+    Root = Insert(Root, 0, Leaf, bAdded);
+    if (bAdded)
+    {
+        ++Count;
+    }
+}
+
+
+bool FYarnVariableMap::Remove(const FString& Name)
+{
+    if (!Root)
+    {
+        return false;
+    }
+
+    bool bRemoved = false;
+    Root = Erase(Root, GetTypeHash(Name), 0, Name, bRemoved);
+    if (bRemoved)
+    {
+        --Count;
+    }
+    return bRemoved;
+}
+
+
+void FYarnVariableMap::Reset()
+{
+    Root.Reset();
+    Count = 0;
+}
+
+
+void FYarnVariableMap::ForEach(TFunctionRef<void(const FString& Name, const Yarn::FValue& Value)> Visitor) const
+{
+    ForEachLeaf(Root.Get(), [&Visitor](const FLeaf& Leaf)
+    {
+        Visitor(Leaf.Name, Leaf.Value);
+    });
+}
+
+
+void FYarnVariableMap::Diff(const FYarnVariableMap& From, const FYarnVariableMap& To, TFunctionRef<void(const FString& Name, const Yarn::FValue* Before, const Yarn::FValue* After)> Visitor)
+{
+    DiffNodes(From.Root.Get(), To.Root.Get(), 0, Visitor);
+}
+
+
+SIZE_T FYarnVariableMap::GetUniqueAllocatedSize() const
+{
+    return GetUniqueAllocatedSize(Root);
+}
+
+
+const FYarnVariableMap::FLeaf* FYarnVariableMap::FindLeaf(const FNode* Node, const uint32 Hash, uint32 Shift, const FString& Name)
+{
+    while (Node)
+    {
+        if (Node->IsCollision())
+        {
+            for (const FLeafPtr& Leaf : Node->Leaves)
+            {
+                if (Leaf->Name == Name)
+                {
+                    return &Leaf.Get();
+                }
+            }
+            return nullptr;
+        }
+
+        const uint32 Bit = Slot(Hash, Shift);
+        if (Node->LeafMap & Bit)
+        {
+            const FLeaf& Leaf = *Node->Leaves[Index(Node->LeafMap, Bit)];
+            return Leaf.Hash == Hash && Leaf.Name == Name ? &Leaf : nullptr;
+        }
+        if (!(Node->ChildMap & Bit))
+        {
+            return nullptr;
+        }
+
+        Node = Node->Children[Index(Node->ChildMap, Bit)].Get();
+        Shift += BitsPerLevel;
+    }
+    return nullptr;
+}
+
+
+FYarnVariableMap::FNodePtr FYarnVariableMap::Insert(const FNodePtr& Node, const uint32 Shift, const FLeafPtr& Leaf, bool& bOutAdded)
+{
+    if (!Node)
+    {
+        const TSharedRef<FNode> NewNode = MakeShared<FNode>();
+        if (Shift < 32)
+        {
+            NewNode->LeafMap = Slot(Leaf->Hash, Shift);
+        }
+        NewNode->Leaves.Add(Leaf);
+        bOutAdded = true;
+        return NewNode;
+    }
+
+    // Everything below is a copy of the node on the way down; the original stays as it was for other versions
+    const TSharedRef<FNode> Copy = MakeShared<FNode>(*Node);
+
+    if (Node->IsCollision())
+    {
+        for (FLeafPtr& Existing : Copy->Leaves)
+        {
+            if (Existing->Name == Leaf->Name)
+            {
+                Existing = Leaf;
+                return Copy;
+            }
+        }
+        Copy->Leaves.Add(Leaf);
+        bOutAdded = true;
+        return Copy;
+    }
+
+    const uint32 Bit = Slot(Leaf->Hash, Shift);
+
+    if (Node->LeafMap & Bit)
+    {
+        const int32 LeafIndex = Index(Node->LeafMap, Bit);
+        const FLeafPtr& Existing = Node->Leaves[LeafIndex];
+        if (Existing->Hash == Leaf->Hash && Existing->Name == Leaf->Name)
+        {
+            Copy->Leaves[LeafIndex] = Leaf;
+            return Copy;
+        }
+
+        // Two variables in the same slot: push both down a level
+        Copy->Leaves.RemoveAt(LeafIndex);
+        Copy->LeafMap &= ~Bit;
+        Copy->ChildMap |= Bit;
+        Copy->Children.Insert(Merge(Existing, Leaf, Shift + BitsPerLevel), Index(Copy->ChildMap, Bit));
+        bOutAdded = true;
+        return Copy;
+    }
+
+    if (Node->ChildMap & Bit)
+    {
+        const int32 ChildIndex = Index(Node->ChildMap, Bit);
+        Copy->Children[ChildIndex] = Insert(Node->Children[ChildIndex], Shift + BitsPerLevel, Leaf, bOutAdded);
+        return Copy;
+    }
+
+    Copy->LeafMap |= Bit;
+    Copy->Leaves.Insert(Leaf, Index(Copy->LeafMap, Bit));
+    bOutAdded = true;
+    return Copy;
+}
+
+
+FYarnVariableMap::FNodePtr FYarnVariableMap::Erase(const FNodePtr& Node, const uint32 Hash, const uint32 Shift, const FString& Name, bool& bOutRemoved)
+{
+    if (Node->IsCollision())
+    {
+        const int32 LeafIndex = Node->Leaves.IndexOfByPredicate([&Name](const FLeafPtr& Leaf) { return Leaf->Name == Name; });
+        if (LeafIndex == INDEX_NONE)
+        {
+            return Node;
+        }
+
+        bOutRemoved = true;
+        if (Node->Leaves.Num() == 1)
+        {
+            return nullptr;
+        }
+
+        const TSharedRef<FNode> Copy = MakeShared<FNode>(*Node);
+        Copy->Leaves.RemoveAt(LeafIndex);
+        return Copy;
+    }
+
+    const uint32 Bit = Slot(Hash, Shift);
+
+    if (Node->LeafMap & Bit)
+    {
+        const int32 LeafIndex = Index(Node->LeafMap, Bit);
+        const FLeaf& Leaf = *Node->Leaves[LeafIndex];
+        if (Leaf.Hash != Hash || Leaf.Name != Name)
+        {
+            return Node;
+        }
+
+        bOutRemoved = true;
+        if (Node->LeafMap == Bit && Node->ChildMap == 0)
+        {
+            return nullptr;
+        }
+
+        const TSharedRef<FNode> Copy = MakeShared<FNode>(*Node);
+        Copy->Leaves.RemoveAt(LeafIndex);
+        Copy->LeafMap &= ~Bit;
+        return Copy;
+    }
+
+    if (!(Node->ChildMap & Bit))
+    {
+        return Node;
+    }
+
+    const int32 ChildIndex = Index(Node->ChildMap, Bit);
+    const FNodePtr Child = Erase(Node->Children[ChildIndex], Hash, Shift + BitsPerLevel, Name, bOutRemoved);
+    if (!bOutRemoved)
+    {
+        return Node;
+    }
+
+    const TSharedRef<FNode> Copy = MakeShared<FNode>(*Node);
+
+    if (Child && (Child->Children.Num() > 0 || Child->Leaves.Num() > 1))
+    {
+        Copy->Children[ChildIndex] = Child;
+        return Copy;
+    }
+
+    Copy->Children.RemoveAt(ChildIndex);
+    Copy->ChildMap &= ~Bit;
+
+    // A child left with a single variable is folded back into this node, so the trie stays as shallow as it can
+    if (Child)
+    {
+        Copy->LeafMap |= Bit;
+        Copy->Leaves.Insert(Child->Leaves[0], Index(Copy->LeafMap, Bit));
+    }
+    else if (Copy->LeafMap == 0 && Copy->ChildMap == 0)
+    {
+        return nullptr;
+    }
+
+    return Copy;
+}
+
+
+FYarnVariableMap::FNodePtr FYarnVariableMap::Merge(const FLeafPtr& A, const FLeafPtr& B, const uint32 Shift)
+{
+    const TSharedRef<FNode> Node = MakeShared<FNode>();
+
+    // Out of hash bits, so the two hashes are the same
+    if (Shift >= 32)
+    {
+        Node->Leaves.Add(A);
+        Node->Leaves.Add(B);
+        return Node;
+    }
+
+    const uint32 BitA = Slot(A->Hash, Shift);
+    const uint32 BitB = Slot(B->Hash, Shift);
+    if (BitA == BitB)
+    {
+        Node->ChildMap = BitA;
+        Node->Children.Add(Merge(A, B, Shift + BitsPerLevel));
+        return Node;
+    }
+
+    Node->LeafMap = BitA | BitB;
+    Node->Leaves.Add(BitA < BitB ? A : B);
+    Node->Leaves.Add(BitA < BitB ? B : A);
+    return Node;
+}
+
+
+void FYarnVariableMap::ForEachLeaf(const FNode* Node, TFunctionRef<void(const FLeaf& Leaf)> Visitor)
+{
+    if (!Node)
+    {
+        return;
+    }
+
+    for (const FLeafPtr& Leaf : Node->Leaves)
+    {
+        Visitor(*Leaf);
+    }
+    for (const FNodePtr& Child : Node->Children)
+    {
+        ForEachLeaf(Child.Get(), Visitor);
+    }
+}
+
+
+void FYarnVariableMap::DiffNodes(const FNode* From, const FNode* To, const uint32 Shift, TFunctionRef<void(const FString&, const Yarn::FValue*, const Yarn::FValue*)> Visitor)
+{
+    // Shared between both versions, so nothing below has changed
+    if (From == To)
+    {
+        return;
+    }
+
+    if (!From || !To || From->IsCollision() || To->IsCollision())
+    {
+        ForEachLeaf(From, [&](const FLeaf& Before)
+        {
+            const FLeaf* After = FindLeaf(To, Before.Hash, Shift, Before.Name);
+            if (!After)
+            {
+                Visitor(Before.Name, &Before.Value, nullptr);
+            }
+            else if (After->Value != Before.Value)
+            {
+                Visitor(Before.Name, &Before.Value, &After->Value);
+            }
+        });
+        ForEachLeaf(To, [&](const FLeaf& After)
+        {
+            if (!FindLeaf(From, After.Hash, Shift, After.Name))
+            {
+                Visitor(After.Name, nullptr, &After.Value);
+            }
+        });
+        return;
+    }
+
+    uint32 Remaining = From->LeafMap | From->ChildMap | To->LeafMap | To->ChildMap;
+    while (Remaining)
+    {
+        const uint32 Bit = Remaining & (~Remaining + 1);
+        Remaining &= ~Bit;
+
+        const FLeaf* FromLeaf = (From->LeafMap & Bit) ? &From->Leaves[Index(From->LeafMap, Bit)].Get() : nullptr;
+        const FLeaf* ToLeaf = (To->LeafMap & Bit) ? &To->Leaves[Index(To->LeafMap, Bit)].Get() : nullptr;
+        const FNode* FromChild = (From->ChildMap & Bit) ? From->Children[Index(From->ChildMap, Bit)].Get() : nullptr;
+        const FNode* ToChild = (To->ChildMap & Bit) ? To->Children[Index(To->ChildMap, Bit)].Get() : nullptr;
+
+        if (FromLeaf && ToLeaf)
+        {
+            if (FromLeaf == ToLeaf)
+            {
+                continue;
+            }
+            if (FromLeaf->Hash == ToLeaf->Hash && FromLeaf->Name == ToLeaf->Name)
+            {
+                if (FromLeaf->Value != ToLeaf->Value)
+                {
+                    Visitor(FromLeaf->Name, &FromLeaf->Value, &ToLeaf->Value);
+                }
+                continue;
+            }
+            Visitor(FromLeaf->Name, &FromLeaf->Value, nullptr);
+            Visitor(ToLeaf->Name, nullptr, &ToLeaf->Value);
+        }
+        else if (FromLeaf && ToChild)
+        {
+            DiffLeafAgainstNode(*FromLeaf, ToChild, true, Visitor);
+        }
+        else if (FromChild && ToLeaf)
+        {
+            DiffLeafAgainstNode(*ToLeaf, FromChild, false, Visitor);
+        }
+        else if (FromLeaf)
+        {
+            Visitor(FromLeaf->Name, &FromLeaf->Value, nullptr);
+        }
+        else if (ToLeaf)
+        {
+            Visitor(ToLeaf->Name, nullptr, &ToLeaf->Value);
+        }
+        else
+        {
+            DiffNodes(FromChild, ToChild, Shift + BitsPerLevel, Visitor);
+        }
+    }
+}
+
+
+void FYarnVariableMap::DiffLeafAgainstNode(const FLeaf& Leaf, const FNode* Node, const bool bLeafIsFrom, TFunctionRef<void(const FString&, const Yarn::FValue*, const Yarn::FValue*)> Visitor)
+{
+    bool bFound = false;
+    ForEachLeaf(Node, [&](const FLeaf& Other)
+    {
+        if (Other.Hash == Leaf.Hash && Other.Name == Leaf.Name)
+        {
+            bFound = true;
+            if (Other.Value != Leaf.Value)
+            {
+                Visitor(Leaf.Name, bLeafIsFrom ? &Leaf.Value : &Other.Value, bLeafIsFrom ? &Other.Value : &Leaf.Value);
+            }
+            return;
+        }
+        Visitor(Other.Name, bLeafIsFrom ? nullptr : &Other.Value, bLeafIsFrom ? &Other.Value : nullptr);
+    });
+
+    if (!bFound)
+    {
+        Visitor(Leaf.Name, bLeafIsFrom ? &Leaf.Value : nullptr, bLeafIsFrom ? nullptr : &Leaf.Value);
+    }
+}
+
+
+SIZE_T FYarnVariableMap::GetUniqueAllocatedSize(const FNodePtr& Node)
+{
+    // Anything referenced from more than one place is shared with another version
+    if (!Node || Node.GetSharedReferenceCount() > 1)
+    {
+        return 0;
+    }
+
+    SIZE_T Size = sizeof(FNode) + Node->Leaves.GetAllocatedSize() + Node->Children.GetAllocatedSize();
+    for (const FLeafPtr& Leaf : Node->Leaves)
+    {
+        if (Leaf.GetSharedReferenceCount() == 1)
+        {
+            Size += sizeof(FLeaf) + Leaf->Name.GetAllocatedSize();
+        }
+    }
+    for (const FNodePtr& Child : Node->Children)
+    {
+        Size += GetUniqueAllocatedSize(Child);
+    }
+    return Size;
+}
@@ -0,0 +1,129 @@
+#include "CoreMinimal.h"
+#include "HAL/IConsoleManager.h"
+#include "Misc/AutomationTest.h"
+#include "Misc/ScopeExit.h"
+#include "YarnBarkRuntime.h"
+#include "YarnProject.h"
+
+// Building a project in code needs UYarnProject::SetProgram, which only editor builds have
+#if WITH_DEV_AUTOMATION_TESTS && WITH_EDITORONLY_DATA
+
+namespace
+{
+    constexpr int32 BarkLinesPerNode = 3;
+
+    // Just enough storage for barks to record their visits in
+    class FBenchmarkVariableStorage final : public Yarn::IVariableStorage
+    {
+    public:
+        virtual void SetValue(const FString& Name, bool Value) override { Values.Add(Name, Yarn::FValue(Value)); }
+        virtual void SetValue(const FString& Name, float Value) override { Values.Add(Name, Yarn::FValue(Value)); }
+        virtual void SetValue(const FString& Name, const FString& Value) override { Values.Add(Name, Yarn::FValue(Value)); }
+
+        virtual bool HasValue(const FString& Name) override { return Values.Contains(Name); }
+        virtual Yarn::FValue GetValue(const FString& Name) override { return Values.FindRef(Name); }
+
+        virtual void ClearValue(const FString& Name) override { Values.Remove(Name); }
+
+    private:
+        Yarn::CaseSensitiveMap<Yarn::FValue> Values;
+    };
+
+    // A project with one node, Bark, that runs a few lines and stops
+    UYarnProject* CreateBarkProject()
+    {
+        Yarn::Program Program;
+        Program.set_name("BarkBenchmark");
+
+        Yarn::Node& Node = (*Program.mutable_nodes())["Bark"];
+        Node.set_name("Bark");
+
+        TMap<FName, FString> Lines;
+        for (int32 LineIndex = 0; LineIndex < BarkLinesPerNode; ++LineIndex)
+        {
+            const FString LineID = FString::Printf(TEXT("line:bark%d"), LineIndex);
+            Lines.Add(FName(LineID), FString::Printf(TEXT("Guard: Bark number %d, [b]move along[/b]."), LineIndex));
+
+            Yarn::Instruction& Instruction = *Node.add_instructions();
+            Instruction.set_opcode(Yarn::Instruction_OpCode_RUN_LINE);
+            Instruction.add_operands()->set_string_value(TCHAR_TO_UTF8(*LineID));
+        }
+        Node.add_instructions()->set_opcode(Yarn::Instruction_OpCode_STOP);
+
+        UYarnProject* YarnProject = NewObject<UYarnProject>(GetTransientPackage());
+        YarnProject->SetProgram(Program);
+        YarnProject->SetLines(MoveTemp(Lines));
+        return YarnProject;
+    }
+}
+
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FYarnBarkRuntimeScalingTest, "YarnSpinner.Barks.Scaling",
+    EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::PerfFilter)
+
+bool FYarnBarkRuntimeScalingTest::RunTest(const FString& Parameters)
+{
+    UYarnProject* const YarnProject = CreateBarkProject();
+    if (!TestTrue(TEXT("Project loads"), YarnProject->GetRuntimeContext().IsValid()))
+    {
+        return false;
+    }
+
+    // Timed on the game thread, where the storage below is safe to use
+    IConsoleVariable* const BarksOnWorkerThreads = IConsoleManager::Get().FindConsoleVariable(TEXT("yarn.BarksOnWorkerThreads"));
+    const bool bBarksOnWorkerThreads = BarksOnWorkerThreads && BarksOnWorkerThreads->GetBool();
+    if (bBarksOnWorkerThreads)
+    {
+        BarksOnWorkerThreads->Set(false, ECVF_SetByCode);
+    }
+    ON_SCOPE_EXIT
+    {
+        if (bBarksOnWorkerThreads)
+        {
+            BarksOnWorkerThreads->Set(true, ECVF_SetByCode);
+        }
+    };
+
+    AddInfo(FString::Printf(TEXT("Each bark takes %llu bytes, not counting its value stack"), static_cast<uint64>(FYarnBarkRuntime::GetInstanceFootprint())));
+
+    for (const int32 NumBarks : {100, 1000, 10000})
+    {
+        FBenchmarkVariableStorage VariableStorage;
+        FYarnBarkRuntime Runtime(VariableStorage, nullptr);
+
+        int32 LinesDelivered = 0;
+        int32 BarksFinished = 0;
+        Runtime.OnLines.AddLambda([&LinesDelivered](TConstArrayView<FYarnBarkLine> Lines) { LinesDelivered += Lines.Num(); });
+        Runtime.OnFinished.AddLambda([&BarksFinished](TConstArrayView<FYarnBarkHandle> Barks) { BarksFinished += Barks.Num(); });
+
+        // Each bark runs its first line as it starts, then one line a frame
+        const double StartTime = FPlatformTime::Seconds();
+        for (int32 BarkIndex = 0; BarkIndex < NumBarks; ++BarkIndex)
+        {
+            Runtime.StartBark(YarnProject, TEXT("Bark"), 1.0f);
+        }
+        Runtime.DeliverPending();
+        const double StartSeconds = FPlatformTime::Seconds() - StartTime;
+
+        const SIZE_T AllocatedSize = Runtime.GetAllocatedSize();
+
+        int32 Frames = 0;
+        const double FramesStartTime = FPlatformTime::Seconds();
+        while (Runtime.Num() > 0 && Frames < BarkLinesPerNode * 2)
+        {
+            Runtime.Tick(1.0f);
+            Runtime.DeliverPending();
+            ++Frames;
+        }
+        const double FrameSeconds = (FPlatformTime::Seconds() - FramesStartTime) / FMath::Max(Frames, 1);
+
+        TestEqual(FString::Printf(TEXT("Lines delivered by %d barks"), NumBarks), LinesDelivered, NumBarks * BarkLinesPerNode);
+        TestEqual(FString::Printf(TEXT("%d barks finished"), NumBarks), BarksFinished, NumBarks);
+
+        AddInfo(FString::Printf(TEXT("%d barks: started in %.3f ms (%.2f us each), %.3f ms a frame, %.1f KB while running"),
+            NumBarks, StartSeconds * 1000.0, StartSeconds * 1000000.0 / NumBarks, FrameSeconds * 1000.0, AllocatedSize / 1024.0));
+    }
+    return true;
+}
+
+#endif
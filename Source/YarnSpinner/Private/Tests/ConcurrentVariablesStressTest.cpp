@@ -0,0 +1,153 @@
+#include "CoreMinimal.h"
+#include "Async/Async.h"
+#include "Misc/AutomationTest.h"
+#include "Misc/YarnConcurrentVariables.h"
+
+THIRD_PARTY_INCLUDES_START
+#include "YarnSpinnerCore/Library.h"
+#include "YarnSpinnerCore/VirtualMachine.h"
+THIRD_PARTY_INCLUDES_END
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+namespace
+{
+    constexpr int32 VisitsPerVirtualMachine = 2000;
+
+    // Storage over FYarnConcurrentVariables, the way UYarnSubsystem uses it, without the subsystem's game instance
+    class FConcurrentVariableStorage final : public Yarn::IVariableStorage
+    {
+    public:
+        virtual void SetValue(const FString& Name, bool Value) override { Set(Name, Yarn::FValue(Value)); }
+        virtual void SetValue(const FString& Name, float Value) override { Set(Name, Yarn::FValue(Value)); }
+        virtual void SetValue(const FString& Name, const FString& Value) override { Set(Name, Yarn::FValue(Value)); }
+
+        virtual bool HasValue(const FString& Name) override { return Variables.Contains(Name); }
+        virtual Yarn::FValue GetValue(const FString& Name) override { return Variables.Find(Name).Get(Yarn::FValue()); }
+
+        virtual void ClearValue(const FString& Name) override
+        {
+            Variables.Update([&Name](FYarnVariableMap& Map) { Map.Remove(Name); });
+        }
+
+        virtual double AddToNumber(const FString& Name, const double Delta) override { return Variables.AddToNumber(Name, Delta); }
+        virtual TOptional<uint64> GetChangeCount() override { return Variables.GetChangeCount(); }
+
+    private:
+        FYarnConcurrentVariables Variables;
+
+        void Set(const FString& Name, const Yarn::FValue& Value)
+        {
+            Variables.Update([&Name, &Value](FYarnVariableMap& Map) { Map.Set(Name, Value); });
+        }
+    };
+
+    // Dialogue that only reads and counts visits, so it never has to wait for anyone
+    class FNullDialogueSink final : public Yarn::IDialogueSink
+    {
+    public:
+        virtual void HandleLine(const Yarn::Line& Line) override {}
+        virtual void HandleOptions(const Yarn::OptionSet& Options) override {}
+        virtual void HandleCommand(const Yarn::Command& Command) override {}
+        virtual void HandleDialogueComplete() override {}
+
+        virtual bool HasFunction(FName Name) override { return false; }
+        virtual int GetExpectedFunctionParamCount(FName Name) override { return -1; }
+        virtual Yarn::FValue HandleFunctionCall(FName Name, const TArray<Yarn::FValue>& Parameters) override { return Yarn::FValue(); }
+    };
+
+    // One node, Visit, that reads $shared and stops. Completing it adds to its visit variable.
+    TSharedRef<const Yarn::RuntimeContext> CreateVisitContext()
+    {
+        const TSharedRef<Yarn::Program> Program = MakeShared<Yarn::Program>();
+        Program->set_name("ConcurrentVariablesStress");
+
+        Yarn::Node& Node = (*Program->mutable_nodes())["Visit"];
+        Node.set_name("Visit");
+
+        Yarn::Instruction& Push = *Node.add_instructions();
+        Push.set_opcode(Yarn::Instruction_OpCode_PUSH_VARIABLE);
+        Push.add_operands()->set_string_value("$shared");
+        Node.add_instructions()->set_opcode(Yarn::Instruction_OpCode_POP);
+        Node.add_instructions()->set_opcode(Yarn::Instruction_OpCode_STOP);
+
+        return MakeShared<const Yarn::RuntimeContext>(Program);
+    }
+}
+
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FYarnConcurrentVariablesStressTest, "YarnSpinner.Variables.ConcurrentVirtualMachines",
+    EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::StressFilter)
+
+bool FYarnConcurrentVariablesStressTest::RunTest(const FString& Parameters)
+{
+    const TSharedRef<const Yarn::RuntimeContext> Context = CreateVisitContext();
+    const FString VisitVariable = Yarn::Library::GenerateUniqueVisitedVariableForNode(TEXT("Visit"));
+
+    // 1, 2, 4... VMs up to one per core, to show whether throughput scales or serialises on the storage
+    TArray<int32> VirtualMachineCounts;
+    const int32 NumCores = FMath::Max(FPlatformMisc::NumberOfCoresIncludingHyperthreads(), 2);
+    for (int32 NumVirtualMachines = 1; NumVirtualMachines < NumCores; NumVirtualMachines *= 2)
+    {
+        VirtualMachineCounts.Add(NumVirtualMachines);
+    }
+    VirtualMachineCounts.Add(NumCores);
+
+    for (const int32 NumVirtualMachines : VirtualMachineCounts)
+    {
+        FConcurrentVariableStorage VariableStorage;
+        VariableStorage.SetValue(TEXT("$shared"), 0.0f);
+
+        TArray<TUniquePtr<Yarn::VirtualMachine>> VirtualMachines;
+        TArray<FNullDialogueSink> Sinks;
+        Sinks.SetNum(NumVirtualMachines);
+        for (int32 Index = 0; Index < NumVirtualMachines; ++Index)
+        {
+            Yarn::VirtualMachine& VirtualMachine = *VirtualMachines.Add_GetRef(MakeUnique<Yarn::VirtualMachine>(Context, VariableStorage));
+            VirtualMachine.SetDialogueSink(&Sinks[Index]);
+        }
+
+        // Each VM runs on a pool thread while this thread keeps writing the variable they all read
+        const double StartTime = FPlatformTime::Seconds();
+        TArray<TFuture<int32>> Results;
+        for (const TUniquePtr<Yarn::VirtualMachine>& VirtualMachine : VirtualMachines)
+        {
+            Results.Add(Async(EAsyncExecution::ThreadPool, [&VirtualMachine]
+            {
+                int32 Failures = 0;
+                for (int32 Visit = 0; Visit < VisitsPerVirtualMachine; ++Visit)
+                {
+                    if (!VirtualMachine->SetNode(TEXT("Visit")) || !VirtualMachine->Continue())
+                    {
+                        ++Failures;
+                    }
+                }
+                return Failures;
+            }));
+        }
+
+        int32 Writes = 0;
+        while (Results.ContainsByPredicate([](const TFuture<int32>& Result) { return !Result.IsReady(); }))
+        {
+            VariableStorage.SetValue(TEXT("$shared"), static_cast<float>(++Writes));
+        }
+
+        int32 Failures = 0;
+        for (TFuture<int32>& Result : Results)
+        {
+            Failures += Result.Get();
+        }
+        const double Seconds = FMath::Max(FPlatformTime::Seconds() - StartTime, SMALL_NUMBER);
+
+        // Every visit is an atomic add on one variable, so none of them may be lost however many VMs raced for it
+        TestEqual(FString::Printf(TEXT("Failures with %d VMs"), NumVirtualMachines), Failures, 0);
+        TestEqual(FString::Printf(TEXT("Visits counted with %d VMs"), NumVirtualMachines),
+            VariableStorage.GetValue(VisitVariable).GetValue<double>(), static_cast<double>(NumVirtualMachines * VisitsPerVirtualMachine));
+
+        AddInfo(FString::Printf(TEXT("%d VMs: %.0f visits/s while the variable they read was written %d times"),
+            NumVirtualMachines, NumVirtualMachines * VisitsPerVirtualMachine / Seconds, Writes));
+    }
+    return true;
+}
+
+#endif
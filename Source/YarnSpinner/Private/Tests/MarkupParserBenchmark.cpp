@@ -0,0 +1,59 @@
+#include "CoreMinimal.h"
+#include "Misc/AutomationTest.h"
+#include "Misc/MarkupParser.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+namespace
+{
+    // Lines like the ones in the samples: a character name, nested and self-closing attributes, properties, the close
+    // all tag, nomarkup and escapes
+    const TCHAR* const BenchmarkLines[] = {
+        TEXT("Sally: Hello there!"),
+        TEXT("Ship: [wave]Welcome aboard![/wave] Please make your way to the [b]bridge[/b]."),
+        TEXT("Sally: I [shake size=2 speed=\"fast\"]really[/shake] don't think that's a [i]good[/i] idea."),
+        TEXT("[bounce][b]Nested[/b] spans, then [i]close them all[/][pause length=500/] and carry on."),
+        TEXT("Ship: [nomarkup]Tags like [wave] stay as they are[/nomarkup], as do \\[escaped\\] brackets and \\\\."),
+        TEXT("A plain line with no markup at all, of about the length most dialogue lines turn out to be."),
+    };
+
+    constexpr int32 BenchmarkIterations = 20000;
+}
+
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FYarnMarkupParserThroughputTest, "YarnSpinner.Markup.ParserThroughput",
+    EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::PerfFilter)
+
+bool FYarnMarkupParserThroughputTest::RunTest(const FString& Parameters)
+{
+    FYarnMarkupParseResult Result;
+
+    // Checked before timing anything, so a broken parser doesn't post a good number
+    TestTrue(TEXT("Parses markup"), FMarkupParser::Parse(BenchmarkLines[1], Result));
+    TestEqual(TEXT("Plain text"), Result.Text, FString(TEXT("Ship: Welcome aboard! Please make your way to the bridge.")));
+    TestEqual(TEXT("Attributes"), Result.Attributes.Num(), 3);
+
+    int64 Characters = 0;
+    for (const TCHAR* Line : BenchmarkLines)
+    {
+        Characters += FCString::Strlen(Line);
+    }
+
+    // The result is reused, as the line text cache does, so the timing is of parsing rather than allocating results
+    const double StartTime = FPlatformTime::Seconds();
+    for (int32 Iteration = 0; Iteration < BenchmarkIterations; ++Iteration)
+    {
+        for (const TCHAR* Line : BenchmarkLines)
+        {
+            FMarkupParser::Parse(Line, Result);
+        }
+    }
+    const double Seconds = FMath::Max(FPlatformTime::Seconds() - StartTime, SMALL_NUMBER);
+
+    const int64 LinesParsed = static_cast<int64>(BenchmarkIterations) * UE_ARRAY_COUNT(BenchmarkLines);
+    AddInfo(FString::Printf(TEXT("Parsed %lld lines in %.3f ms: %.0f lines/s, %.1f MB/s of text"),
+        LinesParsed, Seconds * 1000.0, LinesParsed / Seconds, Characters * BenchmarkIterations * sizeof(TCHAR) / Seconds / (1024.0 * 1024.0)));
+    return true;
+}
+
+#endif
@@ -0,0 +1,239 @@
+#include "CoreMinimal.h"
+#include "Misc/AutomationTest.h"
+#include "Serialization/MemoryReader.h"
+#include "Serialization/MemoryWriter.h"
+
+THIRD_PARTY_INCLUDES_START
+#include "YarnSpinnerCore/VirtualMachine.h"
+THIRD_PARTY_INCLUDES_END
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+namespace
+{
+    // A call to a standard library function, and what a command substituting its result should read
+    struct FLibraryCase
+    {
+        const char* Function;
+        TArray<float> Arguments;
+        const TCHAR* Expected;
+    };
+
+    const TArray<FLibraryCase>& GetLibraryCases()
+    {
+        static const TArray<FLibraryCase> Cases = {
+            // Halves go to the even neighbour
+            {"round", {2.5f}, TEXT("2")},
+            {"round", {3.5f}, TEXT("4")},
+            {"round", {-2.5f}, TEXT("-2")},
+            {"round", {2.6f}, TEXT("3")},
+            {"round_places", {0.125f, 2}, TEXT("0.12")},
+            {"round_places", {0.375f, 2}, TEXT("0.38")},
+            {"round_places", {1234.5f, 0}, TEXT("1234")},
+
+            // To the next or previous whole number
+            {"inc", {1}, TEXT("2")},
+            {"inc", {1.5f}, TEXT("2")},
+            {"inc", {-1.5f}, TEXT("-1")},
+            {"dec", {1}, TEXT("0")},
+            {"dec", {1.5f}, TEXT("1")},
+            {"dec", {-1.5f}, TEXT("-2")},
+
+            // Shortest text that reads back as the same float, whatever the culture
+            {"format_invariant", {0.1f}, TEXT("0.1")},
+            {"format_invariant", {1234.5f}, TEXT("1234.5")},
+            {"format_invariant", {-3}, TEXT("-3")},
+            {"format_invariant", {1.0e-5f}, TEXT("1e-05")},
+        };
+        return Cases;
+    }
+
+    constexpr int32 RandomDraws = 8;
+
+    class FMapVariableStorage final : public Yarn::IVariableStorage
+    {
+    public:
+        virtual void SetValue(const FString& Name, bool Value) override { Values.Add(Name, Yarn::FValue(Value)); }
+        virtual void SetValue(const FString& Name, float Value) override { Values.Add(Name, Yarn::FValue(Value)); }
+        virtual void SetValue(const FString& Name, const FString& Value) override { Values.Add(Name, Yarn::FValue(Value)); }
+
+        virtual bool HasValue(const FString& Name) override { return Values.Contains(Name); }
+        virtual Yarn::FValue GetValue(const FString& Name) override { return Values.FindRef(Name); }
+
+        virtual void ClearValue(const FString& Name) override { Values.Remove(Name); }
+
+    private:
+        Yarn::CaseSensitiveMap<Yarn::FValue> Values;
+    };
+
+    // Collects the text of every command, which is how the program below reports results
+    class FCommandSink final : public Yarn::IDialogueSink
+    {
+    public:
+        TArray<FString> Commands;
+
+        virtual void HandleLine(const Yarn::Line& Line) override {}
+        virtual void HandleOptions(const Yarn::OptionSet& Options) override {}
+        virtual void HandleCommand(const Yarn::Command& Command) override { Commands.Add(Command.Text); }
+        virtual void HandleDialogueComplete() override {}
+
+        virtual bool HasFunction(FName Name) override { return false; }
+        virtual int GetExpectedFunctionParamCount(FName Name) override { return -1; }
+        virtual Yarn::FValue HandleFunctionCall(FName Name, const TArray<Yarn::FValue>& Parameters) override { return Yarn::FValue(); }
+    };
+
+    void AddPushFloat(Yarn::Node& Node, const float Value)
+    {
+        Yarn::Instruction& Instruction = *Node.add_instructions();
+        Instruction.set_opcode(Yarn::Instruction_OpCode_PUSH_FLOAT);
+        Instruction.add_operands()->set_float_value(Value);
+    }
+
+    // Calls Function and runs a command with its result substituted in, which the VM waits at
+    void AddCallAndReport(Yarn::Node& Node, const char* Function, const TArray<float>& Arguments)
+    {
+        for (const float Argument : Arguments)
+        {
+            AddPushFloat(Node, Argument);
+        }
+        AddPushFloat(Node, Arguments.Num());
+
+        Yarn::Instruction& Call = *Node.add_instructions();
+        Call.set_opcode(Yarn::Instruction_OpCode_CALL_FUNC);
+        Call.add_operands()->set_string_value(Function);
+
+        Yarn::Instruction& Command = *Node.add_instructions();
+        Command.set_opcode(Yarn::Instruction_OpCode_RUN_COMMAND);
+        Command.add_operands()->set_string_value("{0}");
+        Command.add_operands()->set_float_value(1);
+    }
+
+    // Library, which runs every case above, and Random, which draws from each random function in turn
+    TSharedRef<const Yarn::RuntimeContext> CreateLibraryContext()
+    {
+        const TSharedRef<Yarn::Program> Program = MakeShared<Yarn::Program>();
+        Program->set_name("StandardLibrary");
+
+        Yarn::Node& Library = (*Program->mutable_nodes())["Library"];
+        Library.set_name("Library");
+        for (const FLibraryCase& Case : GetLibraryCases())
+        {
+            AddCallAndReport(Library, Case.Function, Case.Arguments);
+        }
+        Library.add_instructions()->set_opcode(Yarn::Instruction_OpCode_STOP);
+
+        Yarn::Node& Random = (*Program->mutable_nodes())["Random"];
+        Random.set_name("Random");
+        for (int32 Draw = 0; Draw < RandomDraws; ++Draw)
+        {
+            AddCallAndReport(Random, "random", {});
+            AddCallAndReport(Random, "random_range", {1, 100});
+            AddCallAndReport(Random, "dice", {6});
+        }
+        Random.add_instructions()->set_opcode(Yarn::Instruction_OpCode_STOP);
+
+        return MakeShared<const Yarn::RuntimeContext>(Program);
+    }
+
+    // Continues until the dialogue stops, or until MaxCommands more commands have run
+    void RunCommands(Yarn::VirtualMachine& VirtualMachine, const FCommandSink& Sink, const int32 MaxCommands = MAX_int32)
+    {
+        const int32 StopAt = MaxCommands == MAX_int32 ? MAX_int32 : Sink.Commands.Num() + MaxCommands;
+        while (Sink.Commands.Num() < StopAt && VirtualMachine.Continue()
+            && VirtualMachine.GetCurrentExecutionState() == Yarn::VirtualMachine::WAITING_FOR_CONTINUE)
+        {
+        }
+    }
+}
+
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FYarnStandardLibraryTest, "YarnSpinner.VirtualMachine.StandardLibrary",
+    EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::ProductFilter)
+
+bool FYarnStandardLibraryTest::RunTest(const FString& Parameters)
+{
+    const TSharedRef<const Yarn::RuntimeContext> Context = CreateLibraryContext();
+    FMapVariableStorage VariableStorage;
+
+    {
+        FCommandSink Sink;
+        Yarn::VirtualMachine VirtualMachine(Context, VariableStorage);
+        VirtualMachine.SetDialogueSink(&Sink);
+        TestTrue(TEXT("Library node starts"), VirtualMachine.SetNode(TEXT("Library")));
+        RunCommands(VirtualMachine, Sink);
+
+        const TArray<FLibraryCase>& Cases = GetLibraryCases();
+        if (TestEqual(TEXT("Results"), Sink.Commands.Num(), Cases.Num()))
+        {
+            for (int32 Index = 0; Index < Cases.Num(); ++Index)
+            {
+                const FLibraryCase& Case = Cases[Index];
+                const FString Arguments = FString::JoinBy(Case.Arguments, TEXT(", "), [](const float Argument) { return Yarn::FValue(Argument).ConvertToString(); });
+                TestEqual(FString::Printf(TEXT("%s(%s)"), *FString(Case.Function), *Arguments), Sink.Commands[Index], FString(Case.Expected));
+            }
+        }
+    }
+
+    // The same seed draws the same numbers
+    constexpr int32 Seed = 1234;
+    TArray<FString> Draws;
+    {
+        FCommandSink Sink;
+        Yarn::VirtualMachine VirtualMachine(Context, VariableStorage);
+        VirtualMachine.SetDialogueSink(&Sink);
+        VirtualMachine.SetRandomSeed(Seed);
+        VirtualMachine.SetNode(TEXT("Random"));
+        RunCommands(VirtualMachine, Sink);
+        Draws = MoveTemp(Sink.Commands);
+    }
+
+    TestEqual(TEXT("Random draws"), Draws.Num(), RandomDraws * 3);
+    for (int32 Index = 0; Index + 2 < Draws.Num(); Index += 3)
+    {
+        const double Fraction = FCString::Atod(*Draws[Index]);
+        const double Range = FCString::Atod(*Draws[Index + 1]);
+        const double Dice = FCString::Atod(*Draws[Index + 2]);
+        TestTrue(TEXT("random() is in [0, 1)"), Fraction >= 0 && Fraction < 1);
+        TestTrue(TEXT("random_range(1, 100) is a whole number in range"), Range >= 1 && Range <= 100 && FMath::TruncToDouble(Range) == Range);
+        TestTrue(TEXT("dice(6) is a whole number in range"), Dice >= 1 && Dice <= 6 && FMath::TruncToDouble(Dice) == Dice);
+    }
+
+    {
+        FCommandSink Sink;
+        Yarn::VirtualMachine VirtualMachine(Context, VariableStorage);
+        VirtualMachine.SetDialogueSink(&Sink);
+        VirtualMachine.SetRandomSeed(Seed);
+        VirtualMachine.SetNode(TEXT("Random"));
+        RunCommands(VirtualMachine, Sink);
+        TestTrue(TEXT("Draws with the same seed"), Sink.Commands == Draws);
+    }
+
+    // A VM loaded from a snapshot taken part way through draws what the original would have drawn next
+    {
+        FCommandSink Sink;
+        Yarn::VirtualMachine VirtualMachine(Context, VariableStorage);
+        VirtualMachine.SetDialogueSink(&Sink);
+        VirtualMachine.SetRandomSeed(Seed);
+        VirtualMachine.SetNode(TEXT("Random"));
+        RunCommands(VirtualMachine, Sink, Draws.Num() / 2);
+
+        TArray<uint8> Snapshot;
+        FMemoryWriter Writer(Snapshot);
+        TestTrue(TEXT("Snapshot saves"), VirtualMachine.SaveSnapshot(Writer));
+
+        FCommandSink LoadedSink;
+        LoadedSink.Commands = Sink.Commands;
+        Yarn::VirtualMachine LoadedVirtualMachine(Context, VariableStorage);
+        LoadedVirtualMachine.SetDialogueSink(&LoadedSink);
+        FMemoryReader Reader(Snapshot);
+        TestTrue(TEXT("Snapshot loads"), LoadedVirtualMachine.LoadSnapshot(Reader));
+
+        RunCommands(VirtualMachine, Sink);
+        RunCommands(LoadedVirtualMachine, LoadedSink);
+        TestTrue(TEXT("Draws after saving"), Sink.Commands == Draws);
+        TestTrue(TEXT("Draws after loading"), LoadedSink.Commands == Draws);
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,515 @@
+#include "YarnBarkRuntime.h"
+
+#include "YarnDialogueScheduler.h"
+#include "YarnProject.h"
+#include "YarnWorkerDialogue.h"
+#include "HAL/IConsoleManager.h"
+#include "Library/YarnLibraryRegistry.h"
+#include "Misc/YarnLineTextCache.h"
+#include "Misc/YSLogging.h"
+
+
+static TAutoConsoleVariable<bool> CVarBarksOnWorkerThreads(
+    TEXT("yarn.BarksOnWorkerThreads"),
+    false,
+    TEXT("Runs the VMs of new barks on task graph workers. Lines, options and commands are still handled on the game thread, as are Blueprint functions."));
+
+
+class FYarnBarkRuntime::FBark final : public Yarn::IDialogueSink
+{
+public:
+    FBark(FYarnBarkRuntime& InRuntime, const FYarnBarkHandle InHandle, UYarnProject* InYarnProject, FYarnLineTextCache& InLineTextCache, const float InLineDuration)
+        : Runtime(InRuntime)
+        , Handle(InHandle)
+        , YarnProject(InYarnProject)
+        , LineTextCache(InLineTextCache)
+        , LineDuration(InLineDuration)
+    {
+    }
+
+    FYarnBarkRuntime& Runtime;
+    FYarnBarkHandle Handle;
+    TWeakObjectPtr<UYarnProject> YarnProject;
+    FYarnLineTextCache& LineTextCache;
+
+    // Exactly one of these is set, depending on where the bark runs
+    TUniquePtr<Yarn::VirtualMachine> VirtualMachine;
+    TSharedPtr<FYarnWorkerDialogue, ESPMode::ThreadSafe> Worker;
+
+    float LineDuration;
+
+    // Set while the VM is running, so the bark isn't destroyed from inside one of its own callbacks
+    bool bIsRunning = false;
+    bool bIsFinished = false;
+    bool bIsContinueQueued = false;
+
+    // The async function the VM is waiting on, if any. Tick hands its result over once it's ready or times out.
+    TFuture<Yarn::FValue> PendingFunction;
+    FName PendingFunctionName;
+    double PendingFunctionDeadline = 0;
+    Yarn::FValue PendingFunctionTimeoutValue;
+
+    // From a handler: the VM resumes as soon as the handler returns, or the worker is asked to continue
+    void ContinueFromHandler()
+    {
+        if (Worker)
+        {
+            bIsContinueQueued = true;
+            Worker->Continue();
+        }
+        else
+        {
+            VirtualMachine->Continue();
+        }
+    }
+
+    void SelectOption(const int32 OptionID)
+    {
+        if (Worker)
+        {
+            bIsContinueQueued = true;
+            Worker->SetSelectedOption(OptionID);
+        }
+        else
+        {
+            VirtualMachine->SetSelectedOption(OptionID);
+        }
+    }
+
+    // IDialogueSink
+    virtual void HandleLine(const Yarn::Line& Line) override
+    {
+        bIsContinueQueued = false;
+
+        FYarnBarkLine& BarkLine = Runtime.PendingLines.AddDefaulted_GetRef();
+        BarkLine.Bark = Handle;
+        BarkLine.Line.LineID = Line.LineID;
+        LineTextCache.Resolve(YarnProject.Get(), Line, BarkLine.Line);
+
+        if (LineDuration > 0)
+        {
+            Runtime.ScheduleContinue(Handle, LineDuration);
+        }
+    }
+
+    virtual void HandleOptions(const Yarn::OptionSet& OptionSet) override
+    {
+        bIsContinueQueued = false;
+
+        // Nobody is there to choose, so take the first option that's available
+        const Yarn::Option* Option = OptionSet.Options.FindByPredicate([](const Yarn::Option& O) { return O.IsAvailable; });
+        if (!Option)
+        {
+            Option = &OptionSet.Options[0];
+        }
+
+        YS_VERBOSE("Bark chose option %i (%s)", Option->ID, *Option->Line.LineID.ToString());
+        SelectOption(Option->ID);
+    }
+
+    virtual void HandleCommand(const Yarn::Command& Command) override
+    {
+        TArray<FString> Parameters;
+        Command.Text.ParseIntoArray(Parameters, TEXT(" "));
+
+        if (Parameters.Num() == 0)
+        {
+            YS_WARN("Bark received a command, but was unable to parse it.");
+            bIsContinueQueued = false;
+            ContinueFromHandler();
+            return;
+        }
+
+        FString CommandName = MoveTemp(Parameters[0]);
+        Parameters.RemoveAt(0);
+
+        // A worker keeps running past a non-blocking command, so its continue is still in progress
+        const bool bIsBlocking = IsCommandBlocking(FName(CommandName));
+        if (bIsBlocking)
+        {
+            bIsContinueQueued = false;
+        }
+
+        if (CommandName == TEXT("wait"))
+        {
+            const double WaitTime = Parameters.Num() == 1 ? FCString::Atod(*Parameters[0]) : 0;
+            if (WaitTime <= 0)
+            {
+                YS_WARN("wait called with incorrect parameters (expected one positive NUMBER).");
+                ContinueFromHandler();
+                return;
+            }
+
+            Runtime.ScheduleContinue(Handle, WaitTime);
+            return;
+        }
+
+        FYarnBarkCommand& BarkCommand = Runtime.PendingCommands.AddDefaulted_GetRef();
+        BarkCommand.Bark = Handle;
+        BarkCommand.Command = MoveTemp(CommandName);
+        BarkCommand.Parameters = MoveTemp(Parameters);
+
+        // Barks never wait for commands, but the VM only moves past non-blocking ones by itself
+        if (bIsBlocking)
+        {
+            ContinueFromHandler();
+        }
+    }
+
+    virtual bool IsCommandBlocking(const FName Name) override
+    {
+        return !Runtime.LibraryRegistry || Runtime.LibraryRegistry->IsCommandBlocking(Name);
+    }
+
+    virtual void HandleDialogueComplete() override
+    {
+        bIsContinueQueued = false;
+        bIsFinished = true;
+        Runtime.PendingFinished.Add(Handle);
+    }
+
+    virtual bool HasFunction(const FName Name) override
+    {
+        return Runtime.LibraryRegistry && Runtime.LibraryRegistry->HasFunction(Name);
+    }
+
+    virtual int GetExpectedFunctionParamCount(const FName Name) override
+    {
+        return Runtime.LibraryRegistry->GetExpectedFunctionParamCount(Name);
+    }
+
+    virtual Yarn::FValue HandleFunctionCall(const FName Name, const TArray<Yarn::FValue>& Parameters) override
+    {
+        return Runtime.LibraryRegistry->CallFunction(Name, Parameters);
+    }
+
+    virtual bool IsAsyncFunction(const FName Name) override
+    {
+        return Runtime.LibraryRegistry && Runtime.LibraryRegistry->IsAsyncFunction(Name);
+    }
+
+    virtual void HandleAsyncFunctionCall(const FName Name, const TArray<Yarn::FValue>& Parameters) override
+    {
+        const FYarnAsyncLibFunction* Function = Runtime.LibraryRegistry->FindAsyncFunction(Name);
+
+        TFuture<Yarn::FValue> Future = Function->Function(Parameters);
+
+        if (Future.IsReady())
+        {
+            VirtualMachine->SetFunctionResult(Future.Get());
+            return;
+        }
+
+        PendingFunction = MoveTemp(Future);
+        PendingFunctionName = Name;
+        PendingFunctionDeadline = Runtime.Time + Function->TimeoutSeconds;
+        PendingFunctionTimeoutValue = Function->TimeoutValue;
+    }
+};
+
+
+FYarnBarkRuntime::FYarnBarkRuntime(Yarn::IVariableStorage& InVariableStorage, const UYarnLibraryRegistry* InLibraryRegistry, FYarnDialogueScheduler* InScheduler)
+    : VariableStorage(InVariableStorage)
+    , LibraryRegistry(InLibraryRegistry)
+    , Scheduler(InScheduler)
+{
+}
+
+
+FYarnBarkRuntime::~FYarnBarkRuntime()
+{
+    // Workers use the variable storage and library registry, which may go away with us
+    for (const TUniquePtr<FBark>& Bark : Barks)
+    {
+        if (Bark->Worker)
+        {
+            Bark->Worker->Wait();
+        }
+    }
+}
+
+
+FYarnBarkHandle FYarnBarkRuntime::StartBark(UYarnProject* YarnProject, const FName NodeName, const float LineDuration)
+{
+    if (!IsValid(YarnProject))
+    {
+        YS_WARN("Can't start bark %s without a Yarn project.", *NodeName.ToString());
+        return FYarnBarkHandle();
+    }
+
+    const TSharedPtr<const Yarn::RuntimeContext> RuntimeContext = YarnProject->GetRuntimeContext();
+    if (!RuntimeContext.IsValid())
+    {
+        YS_WARN("Can't start bark %s, because its Yarn project failed to load.", *NodeName.ToString());
+        return FYarnBarkHandle();
+    }
+
+    TUniquePtr<FYarnLineTextCache>& LineTextCache = LineTextCaches.FindOrAdd(YarnProject);
+    if (!LineTextCache)
+    {
+        LineTextCache = MakeUnique<FYarnLineTextCache>();
+    }
+
+    FYarnBarkHandle Handle;
+    Handle.Index = Barks.AddUninitialized().Index;
+    Handle.Serial = NextSerial++;
+
+    new (&Barks[Handle.Index]) TUniquePtr<FBark>(MakeUnique<FBark>(*this, Handle, YarnProject, *LineTextCache, LineDuration));
+    FBark& Bark = *Barks[Handle.Index];
+
+    bool bNodeSet;
+    if (CVarBarksOnWorkerThreads.GetValueOnGameThread())
+    {
+        Bark.Worker = MakeShared<FYarnWorkerDialogue, ESPMode::ThreadSafe>(RuntimeContext.ToSharedRef(), VariableStorage, LibraryRegistry);
+        bNodeSet = Bark.Worker->SetNode(NodeName.ToString());
+    }
+    else
+    {
+        Bark.VirtualMachine = MakeUnique<Yarn::VirtualMachine>(RuntimeContext.ToSharedRef(), VariableStorage);
+        Bark.VirtualMachine->SetDialogueSink(&Bark);
+        bNodeSet = Bark.VirtualMachine->SetNode(NodeName.ToString());
+    }
+
+    if (!bNodeSet)
+    {
+        Remove(Handle);
+        return FYarnBarkHandle();
+    }
+
+    RequestContinue(Bark);
+    return Handle;
+}
+
+
+void FYarnBarkRuntime::ContinueBark(const FYarnBarkHandle Bark)
+{
+    if (FBark* const Found = Find(Bark))
+    {
+        RequestContinue(*Found);
+    }
+}
+
+
+void FYarnBarkRuntime::StopBark(const FYarnBarkHandle Bark)
+{
+    if (FBark* const Found = Find(Bark))
+    {
+        if (Found->bIsRunning)
+        {
+            // Stopping from inside the bark's own callback; it's removed on the next tick, once the VM has returned
+            if (!Found->bIsFinished)
+            {
+                Found->bIsFinished = true;
+                PendingFinished.Add(Bark);
+            }
+            return;
+        }
+        Remove(Bark);
+    }
+}
+
+
+bool FYarnBarkRuntime::IsBarkRunning(const FYarnBarkHandle Bark) const
+{
+    const FBark* const Found = Find(Bark);
+    return Found && !Found->bIsFinished;
+}
+
+
+void FYarnBarkRuntime::Tick(const float DeltaTime)
+{
+    Time += DeltaTime;
+
+    // Collect whatever workers and async functions have produced since last time
+    for (const TUniquePtr<FBark>& Bark : Barks)
+    {
+        if (Bark->Worker && !Bark->bIsFinished)
+        {
+            Bark->Worker->Drain(*Bark);
+        }
+        else if (Bark->PendingFunction.IsValid())
+        {
+            PollFunctionResult(*Bark);
+        }
+    }
+
+    while (ScheduledContinues.Num() > 0 && ScheduledContinues.HeapTop().Time <= Time)
+    {
+        FScheduledContinue Next;
+        ScheduledContinues.HeapPop(Next, false);
+
+        if (FBark* const Bark = Find(Next.Bark))
+        {
+            RequestContinue(*Bark);
+        }
+    }
+}
+
+
+void FYarnBarkRuntime::DeliverPending()
+{
+    // Swapped out first, because handlers may start more barks
+    if (PendingLines.Num() > 0)
+    {
+        TArray<FYarnBarkLine> Lines = MoveTemp(PendingLines);
+        OnLines.Broadcast(Lines);
+    }
+
+    if (PendingCommands.Num() > 0)
+    {
+        TArray<FYarnBarkCommand> Commands = MoveTemp(PendingCommands);
+        OnCommands.Broadcast(Commands);
+    }
+
+    if (PendingFinished.Num() > 0)
+    {
+        TArray<FYarnBarkHandle> Finished = MoveTemp(PendingFinished);
+        for (const FYarnBarkHandle& Bark : Finished)
+        {
+            Remove(Bark);
+        }
+        OnFinished.Broadcast(Finished);
+    }
+}
+
+
+SIZE_T FYarnBarkRuntime::GetInstanceFootprint()
+{
+    return sizeof(TUniquePtr<FBark>) + sizeof(FBark) + sizeof(Yarn::VirtualMachine) + sizeof(Yarn::State);
+}
+
+
+SIZE_T FYarnBarkRuntime::GetAllocatedSize() const
+{
+    SIZE_T Size = Barks.GetAllocatedSize() + ScheduledContinues.GetAllocatedSize();
+
+    for (const TUniquePtr<FBark>& Bark : Barks)
+    {
+        // A worker's VM may be running, so only its fixed size is counted
+        Size += sizeof(FBark) + (Bark->Worker ? sizeof(FYarnWorkerDialogue) + sizeof(Yarn::VirtualMachine) + sizeof(Yarn::State) : sizeof(Yarn::VirtualMachine) + Bark->VirtualMachine->GetAllocatedSize());
+    }
+
+    return Size;
+}
+
+
+FYarnBarkRuntime::FBark* FYarnBarkRuntime::Find(const FYarnBarkHandle Bark) const
+{
+    if (!Barks.IsValidIndex(Bark.Index))
+    {
+        return nullptr;
+    }
+
+    FBark* const Found = Barks[Bark.Index].Get();
+    return Found->Handle.Serial == Bark.Serial ? Found : nullptr;
+}
+
+
+void FYarnBarkRuntime::RequestContinue(FBark& Bark)
+{
+    if (Bark.Worker)
+    {
+        // Workers don't take game thread time, so they skip the scheduler
+        if (!Bark.bIsFinished && !Bark.bIsContinueQueued)
+        {
+            Bark.bIsContinueQueued = true;
+            Bark.Worker->Continue();
+        }
+        return;
+    }
+
+    if (!Scheduler)
+    {
+        Continue(Bark);
+        return;
+    }
+
+    if (Bark.bIsContinueQueued)
+    {
+        return;
+    }
+
+    Bark.bIsContinueQueued = true;
+    Scheduler->Enqueue(EYarnDialoguePriority::Ambient, [this, Handle = Bark.Handle]
+    {
+        if (FBark* const Found = Find(Handle))
+        {
+            Found->bIsContinueQueued = false;
+            Continue(*Found);
+        }
+    });
+}
+
+
+void FYarnBarkRuntime::Continue(FBark& Bark)
+{
+    if (Bark.bIsFinished || Bark.bIsRunning)
+    {
+        return;
+    }
+
+    const Yarn::VirtualMachine::ExecutionState State = Bark.VirtualMachine->GetCurrentExecutionState();
+    if (State != Yarn::VirtualMachine::STOPPED && State != Yarn::VirtualMachine::WAITING_FOR_CONTINUE && State != Yarn::VirtualMachine::SUSPENDED)
+    {
+        return;
+    }
+
+    Bark.bIsRunning = true;
+    const bool bContinued = Bark.VirtualMachine->Continue(Scheduler ? FYarnDialogueScheduler::GetInstructionSlice() : 0);
+    Bark.bIsRunning = false;
+
+    if (Bark.VirtualMachine->GetCurrentExecutionState() == Yarn::VirtualMachine::SUSPENDED && !Bark.bIsFinished)
+    {
+        RequestContinue(Bark);
+        return;
+    }
+
+    if (!bContinued && !Bark.bIsFinished)
+    {
+        YS_WARN("Bark stopped because its dialogue hit an error.");
+        Bark.HandleDialogueComplete();
+    }
+}
+
+
+void FYarnBarkRuntime::PollFunctionResult(FBark& Bark)
+{
+    Yarn::FValue Result;
+    if (Bark.PendingFunction.IsReady())
+    {
+        Result = Bark.PendingFunction.Get();
+    }
+    else if (Time >= Bark.PendingFunctionDeadline)
+    {
+        YS_WARN("Async function '%s' didn't return within the time it was given.", *Bark.PendingFunctionName.ToString())
+        Result = Bark.PendingFunctionTimeoutValue;
+    }
+    else
+    {
+        return;
+    }
+
+    Bark.PendingFunction = TFuture<Yarn::FValue>();
+    if (Bark.bIsFinished)
+    {
+        return;
+    }
+
+    Bark.VirtualMachine->SetFunctionResult(Result);
+    RequestContinue(Bark);
+}
+
+
+void FYarnBarkRuntime::ScheduleContinue(const FYarnBarkHandle Bark, const double Delay)
+{
+    ScheduledContinues.HeapPush({Time + Delay, Bark});
+}
+
+
+void FYarnBarkRuntime::Remove(const FYarnBarkHandle Bark)
+{
+    if (Find(Bark))
+    {
+        Barks.RemoveAt(Bark.Index);
+    }
+}
@@ -0,0 +1,557 @@
+#include "YarnDialogueDriver.h"
+
+#if YARNSPINNER_WITH_COROUTINES
+
+#include "YarnDialogueScheduler.h"
+#include "YarnProject.h"
+#include "YarnSubsystem.h"
+#include "Async/Async.h"
+#include "Library/YarnLibraryRegistry.h"
+#include "Misc/YSLogging.h"
+
+
+FYarnCoroutineArena::~FYarnCoroutineArena()
+{
+    for (void* Page : Pages)
+    {
+        FMemory::Free(Page);
+    }
+}
+
+
+void* FYarnCoroutineArena::Allocate(const SIZE_T Size)
+{
+    const SIZE_T Total = Size + HeaderSize;
+    if (Total > PageSize)
+    {
+        return AllocateUnpooled(Size);
+    }
+
+    int32 SizeClass = 0;
+    while ((MinBlockSize << SizeClass) < Total)
+    {
+        ++SizeClass;
+    }
+    const SIZE_T BlockSize = MinBlockSize << SizeClass;
+
+    uint8* Block;
+    if (FFreeBlock* Free = FreeLists[SizeClass])
+    {
+        FreeLists[SizeClass] = Free->Next;
+        Block = reinterpret_cast<uint8*>(Free);
+    }
+    else
+    {
+        // Whatever is left of the old page is too small, and stays unused until the arena goes
+        if (PageRemaining < BlockSize)
+        {
+            PageCursor = static_cast<uint8*>(FMemory::Malloc(PageSize, 16));
+            PageRemaining = PageSize;
+            Pages.Add(PageCursor);
+        }
+
+        Block = PageCursor;
+        PageCursor += BlockSize;
+        PageRemaining -= BlockSize;
+    }
+
+    FBlockHeader* Header = reinterpret_cast<FBlockHeader*>(Block);
+    Header->Arena = this;
+    Header->SizeClass = SizeClass;
+    return Block + HeaderSize;
+}
+
+
+void* FYarnCoroutineArena::AllocateUnpooled(const SIZE_T Size)
+{
+    uint8* Block = static_cast<uint8*>(FMemory::Malloc(Size + HeaderSize, 16));
+
+    FBlockHeader* Header = reinterpret_cast<FBlockHeader*>(Block);
+    Header->Arena = nullptr;
+    Header->SizeClass = INDEX_NONE;
+    return Block + HeaderSize;
+}
+
+
+void FYarnCoroutineArena::Free(void* Ptr)
+{
+    if (!Ptr)
+    {
+        return;
+    }
+
+    uint8* Block = static_cast<uint8*>(Ptr) - HeaderSize;
+    const FBlockHeader* Header = reinterpret_cast<const FBlockHeader*>(Block);
+
+    FYarnCoroutineArena* Arena = Header->Arena;
+    if (!Arena)
+    {
+        FMemory::Free(Block);
+        return;
+    }
+
+    const int32 SizeClass = Header->SizeClass;
+    FFreeBlock* Free = reinterpret_cast<FFreeBlock*>(Block);
+    Free->Next = Arena->FreeLists[SizeClass];
+    Arena->FreeLists[SizeClass] = Free;
+}
+
+
+FYarnDialogueTask& FYarnDialogueTask::operator=(FYarnDialogueTask&& Other)
+{
+    if (this != &Other)
+    {
+        if (Handle)
+        {
+            Handle.destroy();
+        }
+        Handle = Other.Handle;
+        Other.Handle = nullptr;
+    }
+    return *this;
+}
+
+
+FYarnDialogueTask::~FYarnDialogueTask()
+{
+    if (Handle)
+    {
+        Handle.destroy();
+    }
+}
+
+
+bool FYarnDialogueDriver::FContentAwaiter::await_suspend(std::coroutine_handle<>)
+{
+    Driver.bSkipCommands = bSkipCommands;
+    Driver.Event = EYarnDialogueEvent::None;
+    Driver.SelectedOption = INDEX_NONE;
+
+    // Without a scheduler there's nothing to come back from, so run now and carry straight on, unless the dialogue
+    // has to wait for an async function
+    if (!Driver.Scheduler)
+    {
+        if (Driver.RunVirtualMachine(0))
+        {
+            return false;
+        }
+        Driver.WaitingFor = EWaitingFor::Content;
+        return true;
+    }
+
+    Driver.WaitingFor = EWaitingFor::Content;
+    Driver.RequestContinue();
+    return true;
+}
+
+
+bool FYarnDialogueDriver::FSelectionAwaiter::await_suspend(std::coroutine_handle<>)
+{
+    if (Driver.Event != EYarnDialogueEvent::Options)
+    {
+        YS_WARN("PresentOptions was awaited, but the dialogue isn't showing options.");
+        return false;
+    }
+
+    Driver.WaitingFor = EWaitingFor::Selection;
+    return true;
+}
+
+
+bool FYarnDialogueDriver::FWaitAwaiter::await_suspend(std::coroutine_handle<>)
+{
+    if (!Driver.LatentScheduler)
+    {
+        YS_WARN("Can't wait without a latent scheduler; carrying on straight away.");
+        return false;
+    }
+
+    Driver.WaitingFor = EWaitingFor::Time;
+    Driver.WaitHandle = Driver.LatentScheduler->Schedule(Seconds, nullptr, [WeakThis = TWeakPtr<FYarnDialogueDriver>(Driver.AsShared())]
+    {
+        if (const TSharedPtr<FYarnDialogueDriver> This = WeakThis.Pin())
+        {
+            This->WaitHandle = FYarnLatentHandle();
+            if (This->WaitingFor == EWaitingFor::Time)
+            {
+                This->WaitingFor = EWaitingFor::Nothing;
+                This->Resume();
+            }
+        }
+    });
+    return true;
+}
+
+
+FYarnDialogueDriver::FYarnDialogueDriver(UYarnProject* InYarnProject, const TSharedRef<const Yarn::RuntimeContext>& Context, Yarn::IVariableStorage& VariableStorage, const UYarnLibraryRegistry* InLibraryRegistry, FYarnDialogueScheduler* InScheduler, FYarnLatentScheduler* InLatentScheduler)
+    : YarnProject(InYarnProject)
+    , LibraryRegistry(InLibraryRegistry)
+    , Scheduler(InScheduler)
+    , LatentScheduler(InLatentScheduler)
+    , VirtualMachine(MakeUnique<Yarn::VirtualMachine>(Context, VariableStorage))
+{
+    VirtualMachine->SetDialogueSink(this);
+}
+
+
+FYarnDialogueDriver::~FYarnDialogueDriver()
+{
+    if (LatentScheduler)
+    {
+        LatentScheduler->Cancel(WaitHandle);
+        LatentScheduler->Cancel(AsyncFunctionTimeout);
+    }
+}
+
+
+TSharedPtr<FYarnDialogueDriver> FYarnDialogueDriver::Create(UYarnSubsystem& Subsystem, UYarnProject* YarnProject)
+{
+    if (!IsValid(YarnProject))
+    {
+        YS_WARN("Can't create a dialogue driver without a Yarn project.");
+        return nullptr;
+    }
+
+    const TSharedPtr<const Yarn::RuntimeContext> RuntimeContext = YarnProject->GetRuntimeContext();
+    if (!RuntimeContext.IsValid())
+    {
+        YS_WARN("Can't create a dialogue driver, because its Yarn project failed to load.");
+        return nullptr;
+    }
+
+    return MakeShared<FYarnDialogueDriver>(YarnProject, RuntimeContext.ToSharedRef(), Subsystem, Subsystem.GetYarnLibraryRegistry(), &Subsystem.GetDialogueScheduler(), &Subsystem.GetLatentScheduler());
+}
+
+
+bool FYarnDialogueDriver::Start(FYarnDialogueTask&& InTask, const FString& NodeName)
+{
+    check(IsInGameThread());
+
+    if (!InTask.IsValid() || InTask.IsDone())
+    {
+        YS_WARN("Can't start dialogue from %s without a coroutine to run it.", *NodeName);
+        return false;
+    }
+
+    if (bIsResuming)
+    {
+        YS_WARN("Can't start dialogue from %s inside a running coroutine.", *NodeName);
+        return false;
+    }
+
+    Stop();
+
+    if (!VirtualMachine->SetNode(NodeName))
+    {
+        return false;
+    }
+
+    Event = EYarnDialogueEvent::None;
+    bIsDialogueComplete = false;
+    SelectedOption = INDEX_NONE;
+
+    Task = MoveTemp(InTask);
+    Resume();
+    return true;
+}
+
+
+void FYarnDialogueDriver::Stop()
+{
+    if (bIsResuming)
+    {
+        YS_WARN("A dialogue coroutine can't stop itself; it should co_return instead.");
+        return;
+    }
+
+    if (LatentScheduler)
+    {
+        LatentScheduler->Cancel(WaitHandle);
+        LatentScheduler->Cancel(AsyncFunctionTimeout);
+    }
+    WaitHandle = FYarnLatentHandle();
+    AsyncFunctionTimeout = FYarnLatentHandle();
+    WaitingFor = EWaitingFor::Nothing;
+    ++AsyncFunctionSerial;
+
+    Task = FYarnDialogueTask();
+    VirtualMachine->Stop();
+}
+
+
+void FYarnDialogueDriver::SelectOption(const int32 OptionIndex)
+{
+    if (Event != EYarnDialogueEvent::Options || SelectedOption != INDEX_NONE)
+    {
+        YS_WARN("SelectOption was called, but the dialogue isn't waiting for an option.");
+        return;
+    }
+
+    if (!Options.IsValidIndex(OptionIndex))
+    {
+        YS_WARN("SelectOption was called with option %i, but there are only %i options.", OptionIndex, Options.Num());
+        return;
+    }
+
+    SelectedOption = OptionIndex;
+    VirtualMachine->SetSelectedOption(Options[OptionIndex].OptionID);
+
+    // Picked before the coroutine asked, it gets the answer when it does
+    if (WaitingFor == EWaitingFor::Selection)
+    {
+        WaitingFor = EWaitingFor::Nothing;
+        Resume();
+    }
+}
+
+
+void FYarnDialogueDriver::RequestContinue()
+{
+    if (bIsContinueQueued)
+    {
+        return;
+    }
+
+    bIsContinueQueued = true;
+    Scheduler->Enqueue(EYarnDialoguePriority::Player, [WeakThis = TWeakPtr<FYarnDialogueDriver>(AsShared())]
+    {
+        const TSharedPtr<FYarnDialogueDriver> This = WeakThis.Pin();
+        if (!This)
+        {
+            return;
+        }
+
+        This->bIsContinueQueued = false;
+        if (This->WaitingFor != EWaitingFor::Content)
+        {
+            // Stopped since this was queued
+            return;
+        }
+
+        if (!This->RunVirtualMachine(FYarnDialogueScheduler::GetInstructionSlice()))
+        {
+            // An async function's result continues the dialogue when it arrives
+            if (This->VirtualMachine->GetCurrentExecutionState() == Yarn::VirtualMachine::SUSPENDED)
+            {
+                This->RequestContinue();
+            }
+            return;
+        }
+
+        This->WaitingFor = EWaitingFor::Nothing;
+        This->Resume();
+    });
+}
+
+
+bool FYarnDialogueDriver::RunVirtualMachine(const int32 MaxInstructions)
+{
+    if (!VirtualMachine->Continue(MaxInstructions))
+    {
+        YS_WARN("Dialogue driven by a coroutine stopped because of an error.");
+        HandleDialogueComplete();
+        return true;
+    }
+
+    const Yarn::VirtualMachine::ExecutionState State = VirtualMachine->GetCurrentExecutionState();
+    return State != Yarn::VirtualMachine::SUSPENDED && State != Yarn::VirtualMachine::WAITING_FOR_FUNCTION_RESULT;
+}
+
+
+void FYarnDialogueDriver::Resume()
+{
+    check(Task.IsValid() && !Task.IsDone());
+
+    bIsResuming = true;
+    Task.Handle.resume();
+    bIsResuming = false;
+
+    if (Task.IsDone())
+    {
+        Task = FYarnDialogueTask();
+    }
+}
+
+
+void FYarnDialogueDriver::HandleLine(const Yarn::Line& YarnLine)
+{
+    Line.LineID = YarnLine.LineID;
+    LineTextCache.Resolve(YarnProject.Get(), YarnLine, Line);
+    Event = EYarnDialogueEvent::Line;
+}
+
+
+void FYarnDialogueDriver::HandleOptions(const Yarn::OptionSet& OptionSet)
+{
+    // Sized rather than rebuilt, so the options' strings and attributes keep their memory from last time
+    Options.SetNum(OptionSet.Options.Num(), false);
+
+    for (int32 i = 0; i < OptionSet.Options.Num(); ++i)
+    {
+        const Yarn::Option& Option = OptionSet.Options[i];
+
+        FYarnOption& Opt = Options[i];
+        Opt.OptionID = Option.ID;
+        Opt.Line.LineID = Option.Line.LineID;
+        LineTextCache.Resolve(YarnProject.Get(), Option.Line, Opt.Line);
+        Opt.bIsAvailable = Option.IsAvailable;
+    }
+
+    SelectedOption = INDEX_NONE;
+    Event = EYarnDialogueEvent::Options;
+}
+
+
+void FYarnDialogueDriver::HandleCommand(const Yarn::Command& YarnCommand)
+{
+    YarnCommand.Text.ParseIntoArray(CommandParameters, TEXT(" "));
+    if (CommandParameters.Num() == 0)
+    {
+        YS_WARN("Command received, but was unable to parse it.");
+        Command.Reset();
+    }
+    else
+    {
+        Command = MoveTemp(CommandParameters[0]);
+        CommandParameters.RemoveAt(0, 1, false);
+    }
+
+    // Non-blocking commands never stop the VM, so they're always passed on rather than returned from Next
+    const bool bIsBlocking = Command.IsEmpty() || IsCommandBlocking(FName(Command));
+    if (bIsBlocking && !bSkipCommands)
+    {
+        Event = EYarnDialogueEvent::Command;
+        return;
+    }
+
+    if (CommandHandler && !Command.IsEmpty())
+    {
+        CommandHandler(Command, CommandParameters);
+    }
+
+    if (bIsBlocking)
+    {
+        VirtualMachine->Continue();
+    }
+}
+
+
+void FYarnDialogueDriver::HandleDialogueComplete()
+{
+    bIsDialogueComplete = true;
+    Event = EYarnDialogueEvent::Complete;
+}
+
+
+bool FYarnDialogueDriver::IsCommandBlocking(const FName Name)
+{
+    return !LibraryRegistry || LibraryRegistry->IsCommandBlocking(Name);
+}
+
+
+bool FYarnDialogueDriver::HasFunction(const FName Name)
+{
+    return LibraryRegistry && LibraryRegistry->HasFunction(Name);
+}
+
+
+int FYarnDialogueDriver::GetExpectedFunctionParamCount(const FName Name)
+{
+    return LibraryRegistry->GetExpectedFunctionParamCount(Name);
+}
+
+
+Yarn::FValue FYarnDialogueDriver::HandleFunctionCall(const FName Name, const TArray<Yarn::FValue>& Parameters)
+{
+    return LibraryRegistry->CallFunction(Name, Parameters);
+}
+
+
+bool FYarnDialogueDriver::IsAsyncFunction(const FName Name)
+{
+    return LibraryRegistry && LibraryRegistry->IsAsyncFunction(Name);
+}
+
+
+void FYarnDialogueDriver::HandleAsyncFunctionCall(const FName Name, const TArray<Yarn::FValue>& Parameters)
+{
+    const FYarnAsyncLibFunction* Function = LibraryRegistry->FindAsyncFunction(Name);
+
+    TFuture<Yarn::FValue> Future = Function->Function(Parameters);
+
+    if (Future.IsReady())
+    {
+        VirtualMachine->SetFunctionResult(Future.Get());
+        return;
+    }
+
+    const uint32 Serial = ++AsyncFunctionSerial;
+    const TWeakPtr<FYarnDialogueDriver> WeakThis = AsShared();
+
+    // The future can complete on any thread, so the result is brought back to the game thread
+    Future.Next([WeakThis, Serial](Yarn::FValue Result)
+    {
+        AsyncTask(ENamedThreads::GameThread, [WeakThis, Serial, Result = MoveTemp(Result)]
+        {
+            if (const TSharedPtr<FYarnDialogueDriver> This = WeakThis.Pin())
+            {
+                This->ReceiveFunctionResult(Serial, Result);
+            }
+        });
+    });
+
+    if (LatentScheduler)
+    {
+        AsyncFunctionTimeout = LatentScheduler->Schedule(Function->TimeoutSeconds, nullptr,
+            [WeakThis, Serial, Name, TimeoutSeconds = Function->TimeoutSeconds, TimeoutValue = Function->TimeoutValue]
+            {
+                if (const TSharedPtr<FYarnDialogueDriver> This = WeakThis.Pin())
+                {
+                    YS_WARN("Async function '%s' didn't return within %.2f seconds.", *Name.ToString(), TimeoutSeconds)
+                    This->AsyncFunctionTimeout = FYarnLatentHandle();
+                    This->ReceiveFunctionResult(Serial, TimeoutValue);
+                }
+            });
+    }
+}
+
+
+void FYarnDialogueDriver::ReceiveFunctionResult(const uint32 Serial, const Yarn::FValue& Result)
+{
+    if (Serial != AsyncFunctionSerial)
+    {
+        return;
+    }
+    ++AsyncFunctionSerial;
+
+    if (LatentScheduler)
+    {
+        LatentScheduler->Cancel(AsyncFunctionTimeout);
+    }
+    AsyncFunctionTimeout = FYarnLatentHandle();
+
+    VirtualMachine->SetFunctionResult(Result);
+
+    if (WaitingFor != EWaitingFor::Content)
+    {
+        return;
+    }
+
+    if (Scheduler)
+    {
+        RequestContinue();
+    }
+    else if (RunVirtualMachine(0))
+    {
+        WaitingFor = EWaitingFor::Nothing;
+        Resume();
+    }
+}
+
+
+bool FYarnDialogueDriver::IsPureFunction(const FName Name)
+{
+    return LibraryRegistry && LibraryRegistry->IsPureFunction(Name);
+}
+
+#endif
@@ -0,0 +1,325 @@
+#include "YarnDialoguePrewarm.h"
+
+#include "YarnProject.h"
+#include "Library/YarnLibraryRegistry.h"
+#include "Misc/YarnLineTextCache.h"
+#include "Misc/YSLogging.h"
+
+
+void FYarnSpeculativeVariableStorage::SetValue(const FString& Name, const bool bValue)
+{
+    Writes.FindOrAdd(Name) = Yarn::FValue(bValue);
+}
+
+
+void FYarnSpeculativeVariableStorage::SetValue(const FString& Name, const float Value)
+{
+    Writes.FindOrAdd(Name) = Yarn::FValue(Value);
+}
+
+
+void FYarnSpeculativeVariableStorage::SetValue(const FString& Name, const FString& Value)
+{
+    Writes.FindOrAdd(Name) = Yarn::FValue(Value);
+}
+
+
+bool FYarnSpeculativeVariableStorage::HasValue(const FString& Name)
+{
+    if (const TOptional<Yarn::FValue>* Written = Writes.Find(Name))
+    {
+        return Written->IsSet();
+    }
+    return Read(Name).IsSet();
+}
+
+
+Yarn::FValue FYarnSpeculativeVariableStorage::GetValue(const FString& Name)
+{
+    if (const TOptional<Yarn::FValue>* Written = Writes.Find(Name))
+    {
+        return Written->Get(Yarn::FValue());
+    }
+    return Read(Name).Get(Yarn::FValue());
+}
+
+
+void FYarnSpeculativeVariableStorage::ClearValue(const FString& Name)
+{
+    Writes.FindOrAdd(Name).Reset();
+}
+
+
+bool FYarnSpeculativeVariableStorage::IsUpToDate() const
+{
+    for (const TPair<FString, TOptional<Yarn::FValue>>& Entry : Reads)
+    {
+        // Checked before GetValue, since some storage adds variables it's asked for
+        const bool bHasValue = Base.HasValue(Entry.Key);
+        if (bHasValue != Entry.Value.IsSet())
+        {
+            return false;
+        }
+        if (bHasValue && Base.GetValue(Entry.Key) != Entry.Value.GetValue())
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+void FYarnSpeculativeVariableStorage::Commit()
+{
+    for (const TPair<FString, TOptional<Yarn::FValue>>& Entry : Writes)
+    {
+        if (!Entry.Value.IsSet())
+        {
+            Base.ClearValue(Entry.Key);
+            continue;
+        }
+
+        const Yarn::FValue& Value = Entry.Value.GetValue();
+        switch (Value.GetType())
+        {
+        case Yarn::FValue::EValueType::String:
+            Base.SetValue(Entry.Key, Value.GetValue<FString>());
+            break;
+        case Yarn::FValue::EValueType::Bool:
+            Base.SetValue(Entry.Key, Value.GetValue<bool>());
+            break;
+        case Yarn::FValue::EValueType::Number:
+            Base.SetValue(Entry.Key, static_cast<float>(Value.GetValue<double>()));
+            break;
+        }
+    }
+
+    Reset();
+}
+
+
+void FYarnSpeculativeVariableStorage::Reset()
+{
+    Writes.Reset();
+    Reads.Reset();
+}
+
+
+const TOptional<Yarn::FValue>& FYarnSpeculativeVariableStorage::Read(const FString& Name)
+{
+    if (const TOptional<Yarn::FValue>* Found = Reads.Find(Name))
+    {
+        return *Found;
+    }
+
+    TOptional<Yarn::FValue> Value;
+    if (Base.HasValue(Name))
+    {
+        Value = Base.GetValue(Name);
+    }
+    return Reads.Add(Name, MoveTemp(Value));
+}
+
+
+FYarnDialoguePrewarm::FYarnDialoguePrewarm(UYarnProject* InYarnProject, const TSharedRef<const Yarn::RuntimeContext>& Context, Yarn::IVariableStorage& InVariables, const UYarnLibraryRegistry* InLibraryRegistry, FYarnLineTextCache& InLineTextCache)
+    : YarnProject(InYarnProject)
+    , LibraryRegistry(InLibraryRegistry)
+    , LineTextCache(InLineTextCache)
+    , Variables(InVariables)
+    , VirtualMachine(MakeUnique<Yarn::VirtualMachine>(Context, Variables))
+{
+    VirtualMachine->SetDialogueSink(this);
+}
+
+
+FYarnDialoguePrewarm::~FYarnDialoguePrewarm() = default;
+
+
+bool FYarnDialoguePrewarm::Start(const FString& InNodeName, const int32 RandomSeed)
+{
+    NodeName = InNodeName;
+    StartingRandomSeed = RandomSeed;
+    Content = EContent::None;
+    NodeEvents.Reset();
+    Variables.Reset();
+
+    if (!VirtualMachine.IsValid() || !VirtualMachine->SetNode(NodeName))
+    {
+        State = EState::Failed;
+        return false;
+    }
+
+    VirtualMachine->SetRandomSeed(RandomSeed);
+
+    State = EState::Running;
+    return true;
+}
+
+
+bool FYarnDialoguePrewarm::Run(const int32 MaxInstructions)
+{
+    if (State != EState::Running)
+    {
+        return false;
+    }
+
+    if (!VirtualMachine->Continue(MaxInstructions))
+    {
+        Fail(TEXT("its dialogue hit an error"));
+        return false;
+    }
+
+    if (State == EState::Running && VirtualMachine->GetCurrentExecutionState() != Yarn::VirtualMachine::SUSPENDED)
+    {
+        // Stopped without content, e.g. waiting on an async function
+        Fail(TEXT("it stopped before reaching any content"));
+    }
+
+    return State == EState::Running;
+}
+
+
+TUniquePtr<Yarn::VirtualMachine> FYarnDialoguePrewarm::Commit(Yarn::IVariableStorage& Storage)
+{
+    if (!CanCommit())
+    {
+        return nullptr;
+    }
+
+    Variables.Commit();
+    VirtualMachine->SetVariableStorage(Storage);
+    VirtualMachine->SetDialogueSink(nullptr);
+
+    State = EState::Failed;
+    return MoveTemp(VirtualMachine);
+}
+
+
+SIZE_T FYarnDialoguePrewarm::GetAllocatedSize() const
+{
+    SIZE_T Size = VirtualMachine.IsValid() ? sizeof(Yarn::VirtualMachine) + VirtualMachine->GetAllocatedSize() : 0;
+    Size += Options.GetAllocatedSize() + YarnLine.Substitutions.GetAllocatedSize() + LineAssets.GetAllocatedSize() + NodeEvents.GetAllocatedSize();
+    return Size;
+}
+
+
+void FYarnDialoguePrewarm::Fail(const TCHAR* Reason)
+{
+    YS_LOG("Prewarming node %s stopped, because %s.", *NodeName, Reason);
+
+    State = EState::Failed;
+    Content = EContent::None;
+    if (VirtualMachine.IsValid())
+    {
+        VirtualMachine->Stop();
+    }
+}
+
+
+void FYarnDialoguePrewarm::HandleLine(const Yarn::Line& InYarnLine)
+{
+    YarnLine = InYarnLine;
+    Line.LineID = YarnLine.LineID;
+    LineTextCache.Resolve(YarnProject.Get(), YarnLine, Line);
+
+    if (const UYarnProject* Project = YarnProject.Get())
+    {
+        LineAssets = Project->GetLineAssets(Line.LineID);
+    }
+    else
+    {
+        LineAssets.Reset();
+    }
+
+    Content = EContent::Line;
+    State = EState::Ready;
+}
+
+
+void FYarnDialoguePrewarm::HandleOptions(const Yarn::OptionSet& OptionSet)
+{
+    Options.SetNum(OptionSet.Options.Num(), false);
+
+    for (int32 i = 0; i < OptionSet.Options.Num(); ++i)
+    {
+        const Yarn::Option& Option = OptionSet.Options[i];
+
+        FYarnOption& Opt = Options[i];
+        Opt.OptionID = Option.ID;
+        Opt.Line.LineID = Option.Line.LineID;
+        LineTextCache.Resolve(YarnProject.Get(), Option.Line, Opt.Line);
+        Opt.bIsAvailable = Option.IsAvailable;
+    }
+
+    Content = EContent::Options;
+    State = EState::Ready;
+}
+
+
+void FYarnDialoguePrewarm::HandleCommand(const Yarn::Command& Command)
+{
+    Fail(TEXT("commands can't run ahead of time"));
+}
+
+
+void FYarnDialoguePrewarm::HandleNodeStart(const FString& StartedNode)
+{
+    NodeEvents.Add({StartedNode, true});
+}
+
+
+void FYarnDialoguePrewarm::HandleNodeComplete(const FString& CompletedNode)
+{
+    NodeEvents.Add({CompletedNode, false});
+}
+
+
+void FYarnDialoguePrewarm::HandleDialogueComplete()
+{
+    Content = EContent::DialogueComplete;
+    State = EState::Ready;
+}
+
+
+bool FYarnDialoguePrewarm::HasFunction(const FName Name)
+{
+    return LibraryRegistry && LibraryRegistry->HasFunction(Name);
+}
+
+
+int FYarnDialoguePrewarm::GetExpectedFunctionParamCount(const FName Name)
+{
+    return LibraryRegistry->GetExpectedFunctionParamCount(Name);
+}
+
+
+Yarn::FValue FYarnDialoguePrewarm::HandleFunctionCall(const FName Name, const TArray<Yarn::FValue>& Parameters)
+{
+    // Anything with side effects couldn't be undone if the prewarm is thrown away
+    if (LibraryRegistry->IsPureFunction(Name))
+    {
+        return LibraryRegistry->CallFunction(Name, Parameters);
+    }
+
+    Fail(TEXT("only functions without side effects can run ahead of time"));
+    return Yarn::FValue();
+}
+
+
+bool FYarnDialoguePrewarm::IsAsyncFunction(const FName Name)
+{
+    return LibraryRegistry && LibraryRegistry->IsAsyncFunction(Name);
+}
+
+
+void FYarnDialoguePrewarm::HandleAsyncFunctionCall(const FName Name, const TArray<Yarn::FValue>& Parameters)
+{
+    // Not started at all: the prewarm couldn't wait for it, and whatever it does couldn't be undone
+    Fail(TEXT("async functions can't run ahead of time"));
+}
+
+
+bool FYarnDialoguePrewarm::IsPureFunction(const FName Name)
+{
+    return LibraryRegistry && LibraryRegistry->IsPureFunction(Name);
+}
@@ -0,0 +1,157 @@
+#include "YarnDialogueScheduler.h"
+
+#include "HAL/IConsoleManager.h"
+#include "Stats/Stats.h"
+
+
+DECLARE_STATS_GROUP(TEXT("Yarn Spinner"), STATGROUP_YarnSpinner, STATCAT_Advanced);
+DECLARE_CYCLE_STAT(TEXT("Dialogue Scheduler"), STAT_YarnDialogueScheduler, STATGROUP_YarnSpinner);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Queued Dialogue Requests"), STAT_YarnDialogueQueueDepth, STATGROUP_YarnSpinner);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Dialogue Requests Run"), STAT_YarnDialogueExecuted, STATGROUP_YarnSpinner);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("Max Dialogue Latency (ms)"), STAT_YarnDialogueMaxLatency, STATGROUP_YarnSpinner);
+
+static TAutoConsoleVariable<float> CVarDialogueFrameBudget(
+    TEXT("yarn.DialogueFrameBudget"),
+    1000.0f,
+    TEXT("Microseconds of dialogue the Yarn Spinner scheduler may run each frame. Work that doesn't fit carries over to the next frame."));
+
+static TAutoConsoleVariable<int32> CVarInstructionSlice(
+    TEXT("yarn.InstructionSlice"),
+    2000,
+    TEXT("Instructions a scheduled Yarn Spinner VM runs before yielding to other dialogue. 0 runs until the next line, options or command."));
+
+
+void FYarnDialogueScheduler::Enqueue(const EYarnDialoguePriority Priority, TUniqueFunction<void()>&& Work)
+{
+    check(Priority < EYarnDialoguePriority::MAX);
+    Queues[static_cast<int32>(Priority)].Add({MoveTemp(Work), FPlatformTime::Seconds()});
+}
+
+
+bool FYarnDialogueScheduler::TryRunNow(const EYarnDialoguePriority Priority, const TFunctionRef<void()> Work)
+{
+    check(Priority < EYarnDialoguePriority::MAX);
+
+    if (bIsRunningWork || ImmediateCycles >= GetBudgetCycles())
+    {
+        return false;
+    }
+
+    // Anything already waiting at this priority or above goes first
+    for (int32 Waiting = 0; Waiting <= static_cast<int32>(Priority); ++Waiting)
+    {
+        if (QueueHeads[Waiting] < Queues[Waiting].Num())
+        {
+            return false;
+        }
+    }
+
+    SCOPE_CYCLE_COUNTER(STAT_YarnDialogueScheduler);
+
+    const uint64 StartCycles = FPlatformTime::Cycles64();
+    {
+        TGuardValue<bool> RunningGuard(bIsRunningWork, true);
+        Work();
+    }
+    ImmediateCycles += FPlatformTime::Cycles64() - StartCycles;
+    ++ImmediateExecuted;
+
+    // Latency is zero, which the average should see as well
+    Stats.AverageLatencyMs = FMath::Lerp(Stats.AverageLatencyMs, 0.0f, 0.05f);
+    return true;
+}
+
+
+void FYarnDialogueScheduler::RunFrame()
+{
+    SCOPE_CYCLE_COUNTER(STAT_YarnDialogueScheduler);
+
+    const uint64 StartCycles = FPlatformTime::Cycles64();
+    const uint64 BudgetCycles = GetBudgetCycles();
+    const double Now = FPlatformTime::Seconds();
+
+    int32 Executed = 0;
+    double MaxLatency = 0;
+
+    FRequest Request;
+    while ((Executed == 0 || ImmediateCycles + (FPlatformTime::Cycles64() - StartCycles) < BudgetCycles) && PopNext(Request))
+    {
+        const double Latency = FMath::Max(0.0, Now - Request.EnqueueTime);
+        MaxLatency = FMath::Max(MaxLatency, Latency);
+        Stats.AverageLatencyMs = FMath::Lerp(Stats.AverageLatencyMs, static_cast<float>(Latency * 1000.0), 0.05f);
+
+        TGuardValue<bool> RunningGuard(bIsRunningWork, true);
+        Request.Work();
+        ++Executed;
+    }
+
+    for (int32 Priority = 0; Priority < NumPriorities; ++Priority)
+    {
+        Queues[Priority].RemoveAt(0, QueueHeads[Priority], false);
+        QueueHeads[Priority] = 0;
+    }
+
+    Stats.QueueDepth = Num();
+    Stats.Executed = ImmediateExecuted + Executed;
+    Stats.FrameMicroseconds = static_cast<float>(FPlatformTime::ToMilliseconds64(ImmediateCycles + (FPlatformTime::Cycles64() - StartCycles)) * 1000.0);
+    Stats.MaxLatencyMs = static_cast<float>(MaxLatency * 1000.0);
+
+    // The budget starts again for work run between now and the next frame
+    ImmediateCycles = 0;
+    ImmediateExecuted = 0;
+
+    SET_DWORD_STAT(STAT_YarnDialogueQueueDepth, Stats.QueueDepth);
+    SET_DWORD_STAT(STAT_YarnDialogueExecuted, Stats.Executed);
+    SET_FLOAT_STAT(STAT_YarnDialogueMaxLatency, Stats.MaxLatencyMs);
+}
+
+
+void FYarnDialogueScheduler::Reset()
+{
+    for (int32 Priority = 0; Priority < NumPriorities; ++Priority)
+    {
+        Queues[Priority].Reset();
+        QueueHeads[Priority] = 0;
+    }
+    Stats.QueueDepth = 0;
+    ImmediateCycles = 0;
+    ImmediateExecuted = 0;
+}
+
+
+uint64 FYarnDialogueScheduler::GetBudgetCycles()
+{
+    return static_cast<uint64>(FMath::Max(0.0f, CVarDialogueFrameBudget.GetValueOnGameThread()) * 1e-6 / FPlatformTime::GetSecondsPerCycle64());
+}
+
+
+int32 FYarnDialogueScheduler::GetInstructionSlice()
+{
+    return FMath::Max(0, CVarInstructionSlice.GetValueOnGameThread());
+}
+
+
+int32 FYarnDialogueScheduler::Num() const
+{
+    int32 Count = 0;
+    for (int32 Priority = 0; Priority < NumPriorities; ++Priority)
+    {
+        Count += Queues[Priority].Num() - QueueHeads[Priority];
+    }
+    return Count;
+}
+
+
+bool FYarnDialogueScheduler::PopNext(FRequest& OutRequest)
+{
+    // Checked from the top every time, so that a player request queued by ambient work still goes next
+    for (int32 Priority = 0; Priority < NumPriorities; ++Priority)
+    {
+        if (QueueHeads[Priority] < Queues[Priority].Num())
+        {
+            OutRequest = MoveTemp(Queues[Priority][QueueHeads[Priority]++]);
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,291 @@
+#include "YarnLatentScheduler.h"
+
+
+namespace
+{
+    // Longest delay the wheel can hold in one go, in ticks; anything later is held at the top and moved down later
+    constexpr uint64 MaxScheduleTicks = uint64(1) << 40;
+}
+
+
+FYarnLatentScheduler::FYarnLatentScheduler()
+{
+    Reset();
+}
+
+
+FYarnLatentHandle FYarnLatentScheduler::Schedule(const double DelaySeconds, const UObject* Owner, TUniqueFunction<void()>&& Callback)
+{
+    const int32 Index = FreeEntries.Num() > 0 ? FreeEntries.Pop(false) : Entries.AddDefaulted();
+
+    // Measured from now, which is part way through the current tick
+    const double Ticks = FMath::CeilToDouble((FMath::Max(0.0, DelaySeconds) + PendingSeconds) / TickSeconds);
+
+    FEntry& Entry = Entries[Index];
+    Entry.Callback = MoveTemp(Callback);
+    Entry.DueTick = CurrentTick + FMath::Clamp<uint64>(static_cast<uint64>(FMath::Min(Ticks, static_cast<double>(MaxScheduleTicks))), 1, MaxScheduleTicks);
+    Entry.Owner = FObjectKey(Owner);
+    Entry.Serial = NextSerial++;
+    if (NextSerial == 0)
+    {
+        NextSerial = 1;
+    }
+
+    Link(Index);
+    LinkOwner(Index);
+    ++NumPending;
+
+    FYarnLatentHandle Handle;
+    Handle.Index = Index;
+    Handle.Serial = Entry.Serial;
+    return Handle;
+}
+
+
+bool FYarnLatentScheduler::Cancel(const FYarnLatentHandle Handle)
+{
+    if (!IsPending(Handle))
+    {
+        return false;
+    }
+
+    Release(Handle.Index);
+    return true;
+}
+
+
+int32 FYarnLatentScheduler::CancelAll(const UObject* Owner)
+{
+    const FObjectKey OwnerKey(Owner);
+    if (OwnerKey == FObjectKey())
+    {
+        return 0;
+    }
+
+    int32 Cancelled = 0;
+    while (const int32* Head = OwnerHeads.Find(OwnerKey))
+    {
+        Release(*Head);
+        ++Cancelled;
+    }
+    return Cancelled;
+}
+
+
+bool FYarnLatentScheduler::IsPending(const FYarnLatentHandle Handle) const
+{
+    return Entries.IsValidIndex(Handle.Index) && Entries[Handle.Index].Bucket != INDEX_NONE && Entries[Handle.Index].Serial == Handle.Serial;
+}
+
+
+void FYarnLatentScheduler::Advance(const double DeltaSeconds)
+{
+    if (DeltaSeconds <= 0)
+    {
+        return;
+    }
+
+    PendingSeconds += DeltaSeconds;
+    uint64 Ticks = static_cast<uint64>(PendingSeconds / TickSeconds);
+    PendingSeconds -= Ticks * TickSeconds;
+
+    while (Ticks > 0)
+    {
+        if (NumPending == 0)
+        {
+            // Nothing in the wheel to move down or run
+            CurrentTick += Ticks;
+            break;
+        }
+
+        --Ticks;
+        ++CurrentTick;
+
+        // When a level comes round to the start again, the next slot up is due to be spread across it
+        for (int32 Level = 1; Level < NumLevels; ++Level)
+        {
+            if ((CurrentTick & ((uint64(1) << (SlotBits * Level)) - 1)) != 0)
+            {
+                break;
+            }
+            Cascade(Level);
+        }
+
+        // Everything in this slot is due now. Anything the callbacks schedule is due later, so lands in another slot.
+        const int32 Bucket = static_cast<int32>(CurrentTick & (SlotsPerLevel - 1));
+        while (BucketHeads[Bucket] != INDEX_NONE)
+        {
+            const int32 Index = BucketHeads[Bucket];
+            check(Entries[Index].DueTick == CurrentTick);
+
+            TUniqueFunction<void()> Callback = MoveTemp(Entries[Index].Callback);
+            Release(Index);
+            Callback();
+        }
+    }
+}
+
+
+void FYarnLatentScheduler::Reset()
+{
+    Entries.Reset();
+    FreeEntries.Reset();
+    OwnerHeads.Reset();
+
+    for (int32 Bucket = 0; Bucket < NumBuckets; ++Bucket)
+    {
+        BucketHeads[Bucket] = INDEX_NONE;
+        BucketTails[Bucket] = INDEX_NONE;
+    }
+
+    NumPending = 0;
+}
+
+
+void FYarnLatentScheduler::Link(const int32 Index)
+{
+    FEntry& Entry = Entries[Index];
+
+    const uint64 Delta = Entry.DueTick - CurrentTick;
+
+    int32 Level = 0;
+    while (Level < NumLevels - 1 && Delta >= (uint64(1) << (SlotBits * (Level + 1))))
+    {
+        ++Level;
+    }
+
+    // Past the top level's range, the wait goes in the last slot that comes round before it and is moved again then
+    const uint64 WheelRange = uint64(1) << (SlotBits * NumLevels);
+    const uint64 SlotTick = Delta >= WheelRange ? CurrentTick + WheelRange - 1 : Entry.DueTick;
+
+    const int32 Slot = static_cast<int32>((SlotTick >> (SlotBits * Level)) & (SlotsPerLevel - 1));
+    const int32 Bucket = Level * SlotsPerLevel + Slot;
+
+    Entry.Bucket = Bucket;
+    Entry.Prev = BucketTails[Bucket];
+    Entry.Next = INDEX_NONE;
+
+    if (BucketTails[Bucket] != INDEX_NONE)
+    {
+        Entries[BucketTails[Bucket]].Next = Index;
+    }
+    else
+    {
+        BucketHeads[Bucket] = Index;
+    }
+    BucketTails[Bucket] = Index;
+}
+
+
+void FYarnLatentScheduler::Unlink(const int32 Index)
+{
+    FEntry& Entry = Entries[Index];
+
+    if (Entry.Prev != INDEX_NONE)
+    {
+        Entries[Entry.Prev].Next = Entry.Next;
+    }
+    else
+    {
+        BucketHeads[Entry.Bucket] = Entry.Next;
+    }
+
+    if (Entry.Next != INDEX_NONE)
+    {
+        Entries[Entry.Next].Prev = Entry.Prev;
+    }
+    else
+    {
+        BucketTails[Entry.Bucket] = Entry.Prev;
+    }
+
+    Entry.Prev = INDEX_NONE;
+    Entry.Next = INDEX_NONE;
+}
+
+
+void FYarnLatentScheduler::LinkOwner(const int32 Index)
+{
+    FEntry& Entry = Entries[Index];
+    Entry.OwnerPrev = INDEX_NONE;
+    Entry.OwnerNext = INDEX_NONE;
+
+    if (Entry.Owner == FObjectKey())
+    {
+        return;
+    }
+
+    int32& Head = OwnerHeads.FindOrAdd(Entry.Owner, INDEX_NONE);
+    if (Head != INDEX_NONE)
+    {
+        Entry.OwnerNext = Head;
+        Entries[Head].OwnerPrev = Index;
+    }
+    Head = Index;
+}
+
+
+void FYarnLatentScheduler::UnlinkOwner(const int32 Index)
+{
+    FEntry& Entry = Entries[Index];
+
+    if (Entry.Owner == FObjectKey())
+    {
+        return;
+    }
+
+    if (Entry.OwnerPrev != INDEX_NONE)
+    {
+        Entries[Entry.OwnerPrev].OwnerNext = Entry.OwnerNext;
+    }
+    else if (Entry.OwnerNext != INDEX_NONE)
+    {
+        OwnerHeads[Entry.Owner] = Entry.OwnerNext;
+    }
+    else
+    {
+        OwnerHeads.Remove(Entry.Owner);
+    }
+
+    if (Entry.OwnerNext != INDEX_NONE)
+    {
+        Entries[Entry.OwnerNext].OwnerPrev = Entry.OwnerPrev;
+    }
+
+    Entry.OwnerPrev = INDEX_NONE;
+    Entry.OwnerNext = INDEX_NONE;
+}
+
+
+void FYarnLatentScheduler::Release(const int32 Index)
+{
+    Unlink(Index);
+    UnlinkOwner(Index);
+
+    FEntry& Entry = Entries[Index];
+    Entry.Callback.Reset();
+    Entry.Owner = FObjectKey();
+    Entry.Bucket = INDEX_NONE;
+
+    FreeEntries.Add(Index);
+    --NumPending;
+}
+
+
+void FYarnLatentScheduler::Cascade(const int32 Level)
+{
+    const int32 Slot = static_cast<int32>((CurrentTick >> (SlotBits * Level)) & (SlotsPerLevel - 1));
+    const int32 Bucket = Level * SlotsPerLevel + Slot;
+
+    int32 Index = BucketHeads[Bucket];
+    BucketHeads[Bucket] = INDEX_NONE;
+    BucketTails[Bucket] = INDEX_NONE;
+
+    // Everything here is due within this level's slot, so it now fits in a lower level
+    while (Index != INDEX_NONE)
+    {
+        const int32 Next = Entries[Index].Next;
+        Link(Index);
+        Index = Next;
+    }
+}
@@ -48,6 +48,20 @@ TSharedPtr<Yarn::Program> UYarnProject::GetProgram()
 	return Program;
 }
 
+
+TSharedPtr<const Yarn::RuntimeContext> UYarnProject::GetRuntimeContext()
+{
+	if (!RuntimeContext.IsValid())
+	{
+		if (const TSharedPtr<Yarn::Program> LoadedProgram = GetProgram())
+		{
+			RuntimeContext = MakeShared<const Yarn::RuntimeContext>(LoadedProgram.ToSharedRef());
+		}
+	}
+
+	return RuntimeContext;
+}
+
 FString UYarnProject::GetBaseLocAssetPackage() const
 {
     return FPaths::Combine(FPaths::GetPath(GetPathName()), GetName() + TEXT("_Loc"));
@@ -206,6 +220,10 @@ void UYarnProject::SetProgram(const Yarn::Program& NewProgram)
 	const std::string Data = NewProgram.SerializeAsString();
 	// And convert THAT into a TArray of bytes for storage
 	ProgramData = TArray(reinterpret_cast<const uint8*>(Data.c_str()), Data.size());
+
+	// Anything built from the old program is stale now
+	Program = nullptr;
+	RuntimeContext = nullptr;
 }
 
 #endif
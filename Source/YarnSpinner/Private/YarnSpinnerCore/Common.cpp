@@ -2,3 +2,66 @@
 
 #include <string>
 #include <stdexcept>
+
+
+namespace Yarn
+{
+    FArchive& operator<<(FArchive& archive, Line& line)
+    {
+        // As a string, since plain memory archives don't serialise names
+        FString lineID = archive.IsSaving() ? line.LineID.ToString() : FString();
+        archive << lineID;
+        if (archive.IsLoading())
+        {
+            line.LineID = FName(lineID);
+        }
+
+        int32 numSubstitutions = line.Substitutions.Num();
+        archive << numSubstitutions;
+        if (archive.IsLoading())
+        {
+            line.Substitutions.SetNum(numSubstitutions);
+        }
+
+        // Substitutions come from FValue::ConvertToFormatArgument, so only need its three types
+        for (FFormatArgumentValue& substitution : line.Substitutions)
+        {
+            uint8 type = static_cast<uint8>(substitution.GetType());
+            archive << type;
+
+            switch (static_cast<EFormatArgumentType::Type>(type))
+            {
+            case EFormatArgumentType::Int:
+                {
+                    int64 value = substitution.GetIntValue();
+                    archive << value;
+                    substitution = FFormatArgumentValue(value);
+                    break;
+                }
+            case EFormatArgumentType::Double:
+                {
+                    double value = substitution.GetDoubleValue();
+                    archive << value;
+                    substitution = FFormatArgumentValue(value);
+                    break;
+                }
+            default:
+                {
+                    FString value;
+                    if (archive.IsSaving())
+                    {
+                        substitution.ToFormattedString(false, false, value);
+                    }
+                    archive << value;
+                    if (archive.IsLoading())
+                    {
+                        substitution = FFormatArgumentValue(FText::AsCultureInvariant(value));
+                    }
+                    break;
+                }
+            }
+        }
+
+        return archive;
+    }
+}
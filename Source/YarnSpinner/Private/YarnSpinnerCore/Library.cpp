@@ -410,6 +410,6 @@ namespace Yarn
 
     FString Library::GenerateUniqueVisitedVariableForNode(const FString& NodeName)
     {
-        return FString::Printf(TEXT("$Yarn.Internal.Visiting.%s"), *NodeName);
+        return VisitedVariablePrefix + NodeName;
     }
 }
@@ -0,0 +1,407 @@
+#include "YarnSpinnerCore/RuntimeContext.h"
+
+#include "Misc/ScopeLock.h"
+#include "Misc/YSLogging.h"
+#include "YarnSpinnerCore/Library.h"
+
+
+namespace Yarn
+{
+    namespace
+    {
+        // Enough for every runner in a busy level to start a conversation without allocating
+        constexpr int32 MaxPooledStates = 64;
+
+        // The compiler tags the nodes it compiles smart variables into with this
+        constexpr const char* SmartVariableNodeTag = "Yarn.SmartVariable";
+
+        struct IntrinsicFunction
+        {
+            const TCHAR* name;
+            Intrinsic intrinsic;
+            int32 parameterCount;
+        };
+
+        const IntrinsicFunction IntrinsicFunctions[] =
+        {
+            {TEXT("visited"), Intrinsic::Visited, 1},
+            {TEXT("visited_count"), Intrinsic::VisitedCount, 1},
+            {TEXT("random"), Intrinsic::Random, 0},
+            {TEXT("random_range"), Intrinsic::RandomRange, 2},
+            {TEXT("dice"), Intrinsic::Dice, 1},
+            {TEXT("round"), Intrinsic::Round, 1},
+            {TEXT("round_places"), Intrinsic::RoundPlaces, 2},
+            {TEXT("floor"), Intrinsic::Floor, 1},
+            {TEXT("ceil"), Intrinsic::Ceil, 1},
+            {TEXT("inc"), Intrinsic::Inc, 1},
+            {TEXT("dec"), Intrinsic::Dec, 1},
+            {TEXT("decimal"), Intrinsic::Decimal, 1},
+            {TEXT("int"), Intrinsic::Int, 1},
+            {TEXT("format_invariant"), Intrinsic::FormatInvariant, 1},
+        };
+
+        FString ToFString(const std::string& string)
+        {
+            return FString(UTF8_TO_TCHAR(string.c_str()));
+        }
+
+        TOptional<FValue> ToValue(const Operand& operand)
+        {
+            switch (operand.value_case())
+            {
+            case Operand::ValueCase::kBoolValue:
+                return FValue(operand.bool_value());
+            case Operand::ValueCase::kStringValue:
+                return FValue(ToFString(operand.string_value()));
+            case Operand::ValueCase::kFloatValue:
+                return FValue(operand.float_value());
+            default:
+                return {};
+            }
+        }
+    }
+
+
+    RuntimeContext::RuntimeContext(const TSharedRef<const Program>& program)
+        : program(program)
+    {
+        // Initial values first, so the slots of declared variables don't depend on the order they're used in
+        for (const auto& initialValue : program->initial_values())
+        {
+            const int32 slot = InternVariable(ToFString(initialValue.first));
+            initialValues[slot] = ToValue(initialValue.second);
+
+            if (!initialValues[slot].IsSet())
+            {
+                YS_ERR("Unknown initial value type %i for variable %s", initialValue.second.value_case(), *variableNames[slot]);
+            }
+        }
+
+        nodes.Reserve(program->nodes_size());
+        nodeIndices.Reserve(program->nodes_size());
+
+        for (const auto& node : program->nodes())
+        {
+            PreparedNode& preparedNode = nodes.AddDefaulted_GetRef();
+            preparedNode.name = ToFString(node.first);
+            preparedNode.visitVariable = Library::GenerateUniqueVisitedVariableForNode(preparedNode.name);
+            preparedNode.source = &node.second;
+
+            for (const std::string& tag : node.second.tags())
+            {
+                preparedNode.isSmartVariable |= tag == SmartVariableNodeTag;
+            }
+        }
+
+        // The program's map of nodes has no fixed order, so nodes, and the strings they intern, are put in one. That
+        // way their indices only change when the program does.
+        nodes.Sort([](const PreparedNode& a, const PreparedNode& b) { return a.name.Compare(b.name, ESearchCase::CaseSensitive) < 0; });
+
+        for (int32 nodeIndex = 0; nodeIndex < nodes.Num(); ++nodeIndex)
+        {
+            nodes[nodeIndex].index = nodeIndex;
+            nodeIndices.Add(nodes[nodeIndex].name, nodeIndex);
+        }
+
+        for (PreparedNode& node : nodes)
+        {
+            PrepareNode(node, *node.source);
+        }
+
+        for (int32 nodeIndex = 0; nodeIndex < nodes.Num(); ++nodeIndex)
+        {
+            if (nodes[nodeIndex].isSmartVariable)
+            {
+                InternVariable(nodes[nodeIndex].name);
+                smartVariableNodes.Add(nodeIndex);
+            }
+        }
+
+        smartVariablesBySlot.Init(INDEX_NONE, variableNames.Num());
+        for (int32 smartVariable = 0; smartVariable < smartVariableNodes.Num(); ++smartVariable)
+        {
+            smartVariablesBySlot[FindVariableSlot(nodes[smartVariableNodes[smartVariable]].name)] = smartVariable;
+        }
+
+        programHash = HashProgram();
+
+        YS_LOG("Prepared %d nodes, %d strings, %d variables, %d smart variables and %d call sites", nodes.Num(), strings.Num(), variableNames.Num(), smartVariableNodes.Num(), numCallSites);
+    }
+
+
+    RuntimeContext::~RuntimeContext() = default;
+
+
+    void RuntimeContext::PrepareNode(PreparedNode& node, const Node& sourceNode)
+    {
+        for (const auto& label : sourceNode.labels())
+        {
+            node.labels.Add(ToFString(label.first), label.second);
+        }
+
+        const auto resolveLabel = [&node](PreparedInstruction& prepared, const FString& label)
+        {
+            if (const int32* const target = node.labels.Find(label))
+            {
+                prepared.target = *target;
+            }
+            else
+            {
+                // Left unresolved, so the VM reports it as an error if the jump is ever taken
+                YS_WARN("Unknown label %s in node %s", *label, *node.name);
+            }
+        };
+
+        node.instructions.SetNum(sourceNode.instructions_size());
+
+        for (int32 index = 0; index < sourceNode.instructions_size(); ++index)
+        {
+            const Instruction& instruction = sourceNode.instructions(index);
+            PreparedInstruction& prepared = node.instructions[index];
+            prepared.opcode = instruction.opcode();
+            prepared.source = &instruction;
+
+            switch (instruction.opcode())
+            {
+            case Instruction_OpCode_RUN_LINE:
+                prepared.name = FName(ToFString(instruction.operands(0).string_value()));
+                if (instruction.operands_size() > 1)
+                {
+                    prepared.count = static_cast<int32>(instruction.operands(1).float_value());
+                }
+                break;
+
+            case Instruction_OpCode_RUN_COMMAND:
+                {
+                    prepared.stringIndex = InternString(instruction.operands(0).string_value());
+                    if (instruction.operands_size() > 1)
+                    {
+                        prepared.count = static_cast<int32>(instruction.operands(1).float_value());
+                    }
+
+                    // Lets the VM ask whether to wait for the command without parsing its text every time
+                    FString commandName;
+                    const FString& commandText = strings[prepared.stringIndex];
+                    if (!commandText.Split(TEXT(" "), &commandName, nullptr))
+                    {
+                        commandName = commandText;
+                    }
+                    if (!commandName.IsEmpty() && !commandName.Contains(TEXT("{")))
+                    {
+                        prepared.name = FName(commandName);
+                    }
+                    break;
+                }
+
+            case Instruction_OpCode_ADD_OPTION:
+                prepared.name = FName(ToFString(instruction.operands(0).string_value()));
+                prepared.stringIndex = InternString(instruction.operands(1).string_value());
+                if (instruction.operands_size() > 2)
+                {
+                    prepared.count = static_cast<int32>(instruction.operands(2).float_value());
+                }
+                if (instruction.operands_size() > 3)
+                {
+                    prepared.hasCondition = instruction.operands(3).bool_value();
+                }
+                break;
+
+            case Instruction_OpCode_PUSH_STRING:
+                prepared.literal = FValue(ToFString(instruction.operands(0).string_value()));
+                break;
+
+            case Instruction_OpCode_PUSH_FLOAT:
+                prepared.literal = FValue(instruction.operands(0).float_value());
+                break;
+
+            case Instruction_OpCode_PUSH_BOOL:
+                prepared.literal = FValue(instruction.operands(0).bool_value());
+                break;
+
+            case Instruction_OpCode_JUMP_TO:
+            case Instruction_OpCode_JUMP_IF_FALSE:
+                prepared.stringIndex = InternString(instruction.operands(0).string_value());
+                resolveLabel(prepared, strings[prepared.stringIndex]);
+                break;
+
+            case Instruction_OpCode_CALL_FUNC:
+                {
+                    prepared.stringIndex = InternString(instruction.operands(0).string_value());
+                    const FString& functionName = strings[prepared.stringIndex];
+                    prepared.name = FName(functionName);
+                    prepared.slot = numCallSites++;
+
+                    for (const IntrinsicFunction& intrinsicFunction : IntrinsicFunctions)
+                    {
+                        if (functionName.Equals(intrinsicFunction.name, ESearchCase::CaseSensitive))
+                        {
+                            prepared.intrinsic = intrinsicFunction.intrinsic;
+                            prepared.count = intrinsicFunction.parameterCount;
+                            break;
+                        }
+                    }
+
+                    // The argument is pushed just before the parameter count, so a literal node name can be linked
+                    // now and its count read by index
+                    const bool isVisitCount = prepared.intrinsic == Intrinsic::Visited || prepared.intrinsic == Intrinsic::VisitedCount;
+                    if (isVisitCount && index >= 2)
+                    {
+                        const PreparedInstruction& argument = node.instructions[index - 2];
+                        if (argument.opcode == Instruction_OpCode_PUSH_STRING && node.instructions[index - 1].opcode == Instruction_OpCode_PUSH_FLOAT)
+                        {
+                            prepared.node = FindNode(argument.literal.GetValue<FString>());
+                        }
+                    }
+                    break;
+                }
+
+            case Instruction_OpCode_PUSH_VARIABLE:
+                prepared.slot = InternVariable(ToFString(instruction.operands(0).string_value()));
+                break;
+
+            case Instruction_OpCode_STORE_VARIABLE:
+                prepared.slot = InternVariable(ToFString(instruction.operands(0).string_value()));
+                node.countsOwnVisits |= variableNames[prepared.slot] == node.visitVariable;
+                break;
+
+            default:
+                break;
+            }
+        }
+    }
+
+
+    uint32 RuntimeContext::HashProgram() const
+    {
+        uint32 hash = 0;
+        const auto hashString = [&hash](const FString& string)
+        {
+            hash = FCrc::MemCrc32(*string, string.Len() * sizeof(TCHAR), hash);
+        };
+        const auto hashInt = [&hash](const int32 value)
+        {
+            hash = FCrc::MemCrc32(&value, sizeof(value), hash);
+        };
+
+        for (const FString& string : strings)
+        {
+            hashString(string);
+        }
+
+        for (const PreparedNode& node : nodes)
+        {
+            hashString(node.name);
+            hashInt(node.instructions.Num());
+
+            for (const PreparedInstruction& instruction : node.instructions)
+            {
+                hashInt(instruction.opcode);
+                hashInt(instruction.stringIndex);
+                hashInt(instruction.target);
+                hashInt(instruction.count);
+                if (!instruction.name.IsNone())
+                {
+                    hashString(instruction.name.ToString());
+                }
+                if (instruction.opcode == Instruction_OpCode_PUSH_STRING || instruction.opcode == Instruction_OpCode_PUSH_FLOAT || instruction.opcode == Instruction_OpCode_PUSH_BOOL)
+                {
+                    hashString(instruction.literal.ConvertToString());
+                }
+            }
+        }
+
+        return hash;
+    }
+
+
+    int32 RuntimeContext::InternString(const std::string& string)
+    {
+        FString value = ToFString(string);
+        if (const int32* const existing = stringIndices.Find(value))
+        {
+            return *existing;
+        }
+
+        const int32 index = strings.Add(value);
+        stringIndices.Add(MoveTemp(value), index);
+        return index;
+    }
+
+
+    int32 RuntimeContext::InternVariable(const FString& variableName)
+    {
+        if (const int32* const existing = variableSlots.Find(variableName))
+        {
+            return *existing;
+        }
+
+        const int32 slot = variableNames.Add(variableName);
+        initialValues.AddDefaulted();
+        variableSlots.Add(variableName, slot);
+        return slot;
+    }
+
+
+    int32 RuntimeContext::FindNode(const FString& nodeName) const
+    {
+        const int32* const nodeIndex = nodeIndices.Find(nodeName);
+        return nodeIndex ? *nodeIndex : INDEX_NONE;
+    }
+
+
+    int32 RuntimeContext::FindDialogueNode(const FString& nodeName) const
+    {
+        const int32 nodeIndex = FindNode(nodeName);
+        return nodeIndex != INDEX_NONE && !nodes[nodeIndex].isSmartVariable ? nodeIndex : INDEX_NONE;
+    }
+
+
+    int32 RuntimeContext::FindString(const FString& string) const
+    {
+        const int32* const stringIndex = stringIndices.Find(string);
+        return stringIndex ? *stringIndex : INDEX_NONE;
+    }
+
+
+    int32 RuntimeContext::FindVariableSlot(const FString& variableName) const
+    {
+        const int32* const slot = variableSlots.Find(variableName);
+        return slot ? *slot : INDEX_NONE;
+    }
+
+
+    const FValue* RuntimeContext::GetInitialValue(const int32 slot) const
+    {
+        return initialValues.IsValidIndex(slot) && initialValues[slot].IsSet() ? &initialValues[slot].GetValue() : nullptr;
+    }
+
+
+    TUniquePtr<State> RuntimeContext::AcquireState() const
+    {
+        {
+            FScopeLock lock(&statePoolLock);
+            if (statePool.Num() > 0)
+            {
+                return statePool.Pop(false);
+            }
+        }
+        return MakeUnique<State>();
+    }
+
+
+    void RuntimeContext::ReleaseState(TUniquePtr<State>&& state) const
+    {
+        if (!state.IsValid())
+        {
+            return;
+        }
+
+        state->Reset();
+
+        FScopeLock lock(&statePoolLock);
+        if (statePool.Num() < MaxPooledStates)
+        {
+            statePool.Add(MoveTemp(state));
+        }
+    }
+}
@@ -75,4 +75,12 @@ namespace Yarn
         stack.Empty();
     }
 
+    void State::Reset()
+    {
+        stack.Reset();
+        currentOptions.Reset();
+        currentNodeName.Reset();
+        programCounter = 0;
+    }
+
 }
\ No newline at end of file
@@ -0,0 +1,119 @@
+#include "YarnSpinnerCore/Value.h"
+
+#include <charconv>
+
+#include "CoreMinimal.h"
+
+
+namespace Yarn
+{
+    // Doubles can represent every integer up to 2^53 exactly, so anything
+    // below this can be printed as an integer without losing information.
+    static constexpr double MaxExactIntegralDouble = 9007199254740992.0;
+
+    static bool IsExactInteger(const double Number)
+    {
+        return FMath::Abs(Number) < MaxExactIntegralDouble && FMath::TruncToDouble(Number) == Number;
+    }
+
+
+    FFormatArgumentValue FValue::ConvertToFormatArgument() const
+    {
+        switch (GetType())
+        {
+        case String:
+            return FFormatArgumentValue(FText::FromString(Data.Get<FString>()));
+        case Number:
+            {
+                // Whole numbers are passed as integers so that FText picks the
+                // same plural form the writer expects ("1 time", not "1.0 times")
+                const double NumberValue = Data.Get<double>();
+                return IsExactInteger(NumberValue) ?
+                    FFormatArgumentValue(static_cast<int64>(NumberValue)) :
+                    FFormatArgumentValue(NumberValue);
+            }
+        case Bool:
+            {
+                static const FText TrueText = FText::AsCultureInvariant(TEXT("True"));
+                static const FText FalseText = FText::AsCultureInvariant(TEXT("False"));
+                return FFormatArgumentValue(Data.Get<bool>() ? TrueText : FalseText);
+            }
+        default:
+            return FFormatArgumentValue(FText::GetEmpty());
+        }
+    }
+
+
+    void FValue::AppendNumber(FStringBuilderBase& Builder, const double Number)
+    {
+        if (IsExactInteger(Number))
+        {
+            // Fast path: write the digits directly, back to front
+            TCHAR Buffer[24];
+            TCHAR* const End = Buffer + UE_ARRAY_COUNT(Buffer);
+            TCHAR* Cursor = End;
+
+            const bool bNegative = Number < 0;
+            uint64 Magnitude = static_cast<uint64>(bNegative ? -Number : Number);
+            do
+            {
+                *--Cursor = static_cast<TCHAR>(TEXT('0') + Magnitude % 10);
+                Magnitude /= 10;
+            }
+            while (Magnitude != 0);
+
+            if (bNegative)
+            {
+                *--Cursor = TEXT('-');
+            }
+
+            Builder.Append(Cursor, static_cast<int32>(End - Cursor));
+            return;
+        }
+
+        ANSICHAR Buffer[32];
+        int32 Length;
+
+        // Yarn numbers come from floats: PUSH_FLOAT operands and SetValue(float). A double that is exactly a float is
+        // printed as the float, so 0.1 reads "0.1" rather than the 0.10000000149011612 the float widens to.
+        const float FloatNumber = static_cast<float>(Number);
+        const bool bIsFloat = static_cast<double>(FloatNumber) == Number;
+
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+        // std::to_chars without a precision produces the shortest round-trip
+        // representation
+        const std::to_chars_result Result = bIsFloat ?
+            std::to_chars(Buffer, Buffer + UE_ARRAY_COUNT(Buffer), FloatNumber) :
+            std::to_chars(Buffer, Buffer + UE_ARRAY_COUNT(Buffer), Number);
+        Length = static_cast<int32>(Result.ptr - Buffer);
+#else
+        if (bIsFloat)
+        {
+            // The fewest significant digits that read back as the same float; 9 always do
+            for (int32 Precision = 6; Precision <= 9; Precision++)
+            {
+                Length = FCStringAnsi::Snprintf(Buffer, UE_ARRAY_COUNT(Buffer), "%.*g", Precision, Number);
+                if (static_cast<float>(FCStringAnsi::Atod(Buffer)) == FloatNumber)
+                {
+                    break;
+                }
+            }
+        }
+        else
+        {
+            // 15 significant digits round-trips almost every value a script will
+            // produce; fall back to the full 17 for the few that don't
+            Length = FCStringAnsi::Snprintf(Buffer, UE_ARRAY_COUNT(Buffer), "%.15g", Number);
+            if (FCStringAnsi::Atod(Buffer) != Number)
+            {
+                Length = FCStringAnsi::Snprintf(Buffer, UE_ARRAY_COUNT(Buffer), "%.17g", Number);
+            }
+        }
+#endif
+
+        for (int32 Index = 0; Index < Length; Index++)
+        {
+            Builder.AppendChar(static_cast<TCHAR>(Buffer[Index]));
+        }
+    }
+}
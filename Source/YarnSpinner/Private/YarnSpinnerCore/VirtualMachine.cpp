@@ -2,77 +2,353 @@
 
 #include <regex>
 #include <string>
-#include <string>
 
 #include "CoreMinimal.h"
+#include "HAL/IConsoleManager.h"
 #include "Misc/YSLogging.h"
+#include "YarnSpinnerCore/Library.h"
+
+
+static TAutoConsoleVariable<int32> CVarRunawayInstructionLimit(
+    TEXT("yarn.RunawayInstructionLimit"),
+    Yarn::VirtualMachine::DefaultRunawayInstructionLimit,
+    TEXT("Instructions a Yarn Spinner VM may run without delivering a line, options or a command before it stops with an error. 0 disables the check. Applies to VMs created afterwards."));
 
 
 namespace Yarn
 {
-    VirtualMachine::VirtualMachine(const TSharedRef<Yarn::Program>& Program, Library& Library, IVariableStorage& VariableStorage)
-        : Program(Program),
-          state(State()),
+    VirtualMachine::VirtualMachine(const TSharedRef<const RuntimeContext>& Context, IVariableStorage& VariableStorage)
+        : context(Context),
+          state(Context->AcquireState()),
           executionState(STOPPED),
-          library(Library),
-          variableStorage(VariableStorage)
-    {
-        // Add the 'visited' and 'visited_count' functions, which query the variable
-        // storage for information about how many times a node has been visited.
-        Library.AddFunction(
-            "visited",
-            TYarnFunction<bool>::CreateLambda(
-            [&VariableStorage](const TArray<FValue>& Values)
-            {
-                const FString NodeName = Values[0].GetValue<FString>();
-                const FString VisitTrackingVariable = Library::GenerateUniqueVisitedVariableForNode(NodeName);
-                return VariableStorage.HasValue(VisitTrackingVariable) ?
-                    VariableStorage.GetValue(VisitTrackingVariable).GetValue<double>() > 0 :
-                    false;
-            }),
-            1);
-
-        Library.AddFunction(
-            "visited_count",
-            TYarnFunction<float>::CreateLambda(
-            [&VariableStorage](const TArray<FValue>& Values)
-            {
-                const FString NodeName = Values[0].GetValue<FString>();
-                const FString VisitTrackingVariable = Library::GenerateUniqueVisitedVariableForNode(NodeName);
-                return VariableStorage.HasValue(VisitTrackingVariable) ?
-                    static_cast<int>(VariableStorage.GetValue(VisitTrackingVariable).GetValue<double>()) :
-                    0;
-            }),
-            1);
+          variableStorage(&VariableStorage),
+          runawayInstructionLimit(CVarRunawayInstructionLimit.GetValueOnAnyThread()),
+          checkedCallSites(false, Context->GetNumCallSites()),
+          delegateSink(*this),
+          sink(&delegateSink)
+    {
+        smartVariables.SetNum(Context->GetNumSmartVariables());
+        visitCounters = variableStorage->GetVisitCounters(context);
+        randomStream.GenerateNewSeed();
+    }
+
+
+    VirtualMachine::~VirtualMachine()
+    {
+        context->ReleaseState(MoveTemp(state));
     }
+
     
     bool VirtualMachine::SetNode(const FString& NodeName)
     {
-        if (Program->nodes().contains(TCHAR_TO_UTF8(*NodeName)) == false)
+        const int32 nodeIndex = context->FindDialogueNode(NodeName);
+        if (nodeIndex == INDEX_NONE)
         {
-            YS_ERR("No node named %s has been loaded.", *NodeName);
+            if (context->FindNode(NodeName) != INDEX_NONE)
+            {
+                YS_ERR("Node %s computes a smart variable, and can't be run as dialogue.", *NodeName);
+            }
+            else
+            {
+                YS_ERR("No node named %s has been loaded.", *NodeName);
+            }
             return false;
         }
 
         YS_LOG("Running node %s", *NodeName);
 
-        currentNode = Program->nodes().at(TCHAR_TO_UTF8(*NodeName));
+        currentNode = &context->GetNode(nodeIndex);
+
+        // Content collected before a jump to this node still goes out; anything else is left over from a conversation
+        // that was abandoned
+        if (executionState != RUNNING)
+        {
+            contentBatch.Reset();
+        }
 
         // Clear our State and return to the Stopped execution state
-        state = State();
+        state->Reset();
         SetCurrentExecutionState(ExecutionState::STOPPED);
 
-        state.currentNodeName = NodeName;
+        state->currentNodeName = NodeName;
 
-        OnNodeStart.Broadcast(NodeName);
+        sink->HandleNodeStart(NodeName);
 
         return true;
     }
 
 
+    void VirtualMachine::Stop()
+    {
+        contentBatch.Reset();
+        SetCurrentExecutionState(STOPPED);
+    }
+
+
+    void VirtualMachine::SetDialogueSink(IDialogueSink* newSink)
+    {
+        sink = newSink ? newSink : &delegateSink;
+    }
+
+
     const char* VirtualMachine::GetCurrentNodeName()
     {
-        return currentNode.name().c_str();
+        return currentNode ? currentNode->source->name().c_str() : "";
+    }
+
+
+    SIZE_T VirtualMachine::GetAllocatedSize() const
+    {
+        SIZE_T size = sizeof(State) + checkedCallSites.GetAllocatedSize() + smartVariables.GetAllocatedSize();
+        for (const SmartVariableMemo& memo : smartVariables)
+        {
+            size += memo.reads.GetAllocatedSize();
+        }
+        if (state.IsValid())
+        {
+            size += state->stack.GetAllocatedSize() + state->currentOptions.GetAllocatedSize() + state->currentNodeName.GetAllocatedSize();
+        }
+        return size;
+    }
+
+
+    namespace
+    {
+        // "YSVM"
+        constexpr uint32 SnapshotMagic = 0x4D565359;
+
+        // 1: no random seed
+        // 2: the random seed after the execution state
+        constexpr uint8 SnapshotVersion = 2;
+
+        enum class ESnapshotValue : uint8
+        {
+            Number,
+            False,
+            True,
+            PooledString,
+            String
+        };
+
+        // Strings from the program's pool go in as their index, anything built at runtime in full
+        void SerializeString(FArchive& archive, const RuntimeContext& context, FString& string)
+        {
+            int32 stringIndex = archive.IsSaving() ? context.FindString(string) : INDEX_NONE;
+            uint32 packedIndex = static_cast<uint32>(stringIndex + 1);
+            archive.SerializeIntPacked(packedIndex);
+            stringIndex = static_cast<int32>(packedIndex) - 1;
+
+            if (stringIndex == INDEX_NONE)
+            {
+                archive << string;
+            }
+            else if (archive.IsLoading())
+            {
+                if (stringIndex >= context.GetNumStrings())
+                {
+                    archive.SetError();
+                    return;
+                }
+                string = context.GetString(stringIndex);
+            }
+        }
+
+        void SerializeValue(FArchive& archive, const RuntimeContext& context, FValue& value)
+        {
+            uint8 type = 0;
+            if (archive.IsSaving())
+            {
+                switch (value.GetType())
+                {
+                case FValue::EValueType::Number:
+                    type = static_cast<uint8>(ESnapshotValue::Number);
+                    break;
+                case FValue::EValueType::Bool:
+                    type = static_cast<uint8>(value.GetValue<bool>() ? ESnapshotValue::True : ESnapshotValue::False);
+                    break;
+                case FValue::EValueType::String:
+                    type = static_cast<uint8>(context.FindString(value.GetValue<FString>()) == INDEX_NONE ? ESnapshotValue::String : ESnapshotValue::PooledString);
+                    break;
+                }
+            }
+            archive << type;
+
+            switch (static_cast<ESnapshotValue>(type))
+            {
+            case ESnapshotValue::Number:
+                {
+                    double number = archive.IsSaving() ? value.GetValue<double>() : 0;
+                    archive << number;
+                    value = FValue(number);
+                    break;
+                }
+            case ESnapshotValue::False:
+            case ESnapshotValue::True:
+                value = FValue(static_cast<ESnapshotValue>(type) == ESnapshotValue::True);
+                break;
+            case ESnapshotValue::PooledString:
+            case ESnapshotValue::String:
+                {
+                    FString string = archive.IsSaving() ? value.GetValue<FString>() : FString();
+                    SerializeString(archive, context, string);
+                    value = FValue(string);
+                    break;
+                }
+            default:
+                archive.SetError();
+                break;
+            }
+        }
+    }
+
+
+    bool VirtualMachine::SaveSnapshot(FArchive& archive) const
+    {
+        switch (executionState)
+        {
+        case STOPPED:
+        case WAITING_FOR_CONTINUE:
+        case WAITING_ON_OPTION_SELECTION:
+        case SUSPENDED:
+            break;
+        default:
+            YS_WARN("Can't save a snapshot of the VirtualMachine while it's running or waiting on a function.");
+            return false;
+        }
+
+        if (contentBatch.Num() > 0)
+        {
+            YS_WARN("Can't save a snapshot of the VirtualMachine before its batched content has been delivered.");
+            return false;
+        }
+
+        uint32 magic = SnapshotMagic;
+        uint8 version = SnapshotVersion;
+        uint32 programHash = context->GetProgramHash();
+        uint8 savedState = static_cast<uint8>(executionState);
+        int32 randomSeed = randomStream.GetCurrentSeed();
+        archive << magic << version << programHash << savedState << randomSeed;
+
+        if (executionState == STOPPED)
+        {
+            return !archive.IsError();
+        }
+
+        uint32 nodeIndex = static_cast<uint32>(currentNode->index);
+        uint32 programCounter = static_cast<uint32>(state->programCounter);
+        archive.SerializeIntPacked(nodeIndex);
+        archive.SerializeIntPacked(programCounter);
+
+        uint32 numValues = static_cast<uint32>(state->stack.Num());
+        archive.SerializeIntPacked(numValues);
+        for (const FValue& stackValue : state->stack)
+        {
+            FValue value = stackValue;
+            SerializeValue(archive, *context, value);
+        }
+
+        uint32 numOptions = static_cast<uint32>(state->currentOptions.Num());
+        archive.SerializeIntPacked(numOptions);
+        for (const Option& currentOption : state->currentOptions)
+        {
+            Option option = currentOption;
+            int32 id = option.ID;
+            bool isAvailable = option.IsAvailable;
+            archive << id << option.Line;
+            SerializeString(archive, *context, option.DestinationNode);
+            archive << isAvailable;
+        }
+
+        return !archive.IsError();
+    }
+
+
+    bool VirtualMachine::LoadSnapshot(FArchive& archive)
+    {
+        uint32 magic = 0;
+        uint8 version = 0;
+        uint32 programHash = 0;
+        uint8 savedState = 0;
+        archive << magic << version << programHash << savedState;
+
+        // Snapshots from before the seed was saved carry on with this VM's own
+        int32 randomSeed = randomStream.GetCurrentSeed();
+        if (version >= 2)
+        {
+            archive << randomSeed;
+        }
+
+        if (archive.IsError() || magic != SnapshotMagic || version < 1 || version > SnapshotVersion)
+        {
+            YS_WARN("Not a VirtualMachine snapshot, or one from a version that isn't supported.");
+            return false;
+        }
+
+        if (programHash != context->GetProgramHash())
+        {
+            // Indices in the snapshot could point anywhere in a different program
+            YS_WARN("This VirtualMachine snapshot was saved with a different version of the program and can't be loaded.");
+            return false;
+        }
+
+        const ExecutionState loadedState = static_cast<ExecutionState>(savedState);
+        if (loadedState == STOPPED)
+        {
+            Stop();
+            randomStream.Initialize(randomSeed);
+            return true;
+        }
+
+        if (loadedState != WAITING_FOR_CONTINUE && loadedState != WAITING_ON_OPTION_SELECTION && loadedState != SUSPENDED)
+        {
+            YS_WARN("This VirtualMachine snapshot is damaged.");
+            return false;
+        }
+
+        uint32 nodeIndex = 0;
+        uint32 programCounter = 0;
+        archive.SerializeIntPacked(nodeIndex);
+        archive.SerializeIntPacked(programCounter);
+
+        TArray<FValue> stack;
+        uint32 numValues = 0;
+        archive.SerializeIntPacked(numValues);
+        for (uint32 i = 0; i < numValues && !archive.IsError(); ++i)
+        {
+            SerializeValue(archive, *context, stack.AddDefaulted_GetRef());
+        }
+
+        TArray<Option> options;
+        uint32 numOptions = 0;
+        archive.SerializeIntPacked(numOptions);
+        for (uint32 i = 0; i < numOptions && !archive.IsError(); ++i)
+        {
+            Option& option = options.AddDefaulted_GetRef();
+            archive << option.ID << option.Line;
+            SerializeString(archive, *context, option.DestinationNode);
+            archive << option.IsAvailable;
+        }
+
+        if (archive.IsError() || static_cast<int32>(nodeIndex) >= context->GetNumNodes() || context->GetNode(nodeIndex).isSmartVariable
+            || static_cast<int32>(programCounter) > context->GetNode(nodeIndex).instructions.Num())
+        {
+            YS_WARN("This VirtualMachine snapshot is damaged.");
+            return false;
+        }
+
+        contentBatch.Reset();
+        currentNode = &context->GetNode(nodeIndex);
+        state->Reset();
+        state->currentNodeName = currentNode->name;
+        state->programCounter = static_cast<int>(programCounter);
+        state->stack = MoveTemp(stack);
+        state->currentOptions = MoveTemp(options);
+        instructionsSinceContent = 0;
+        randomStream.Initialize(randomSeed);
+        SetCurrentExecutionState(loadedState);
+
+        YS_LOG("Loaded a snapshot in node %s", *currentNode->name);
+        return true;
     }
 
 
@@ -88,12 +364,24 @@ namespace Yarn
         if (executionState == STOPPED)
         {
             // We've stopped; clear our state.
-            state = State();
+            state->Reset();
+        }
+
+        if (executionState != RUNNING && executionState != SUSPENDED)
+        {
+            // The script has reached content or finished, so it isn't looping
+            instructionsSinceContent = 0;
         }
     }
 
 
     bool VirtualMachine::Continue()
+    {
+        return Continue(0);
+    }
+
+
+    bool VirtualMachine::Continue(const int32 maxInstructions)
     {
         // Perform a safety check to ensure that we're in a ready state to continue
         if (CheckCanContinue() == false)
@@ -114,9 +402,36 @@ namespace Yarn
 
         SetCurrentExecutionState(RUNNING);
 
+        int32 instructionsRun = 0;
+
         while (GetCurrentExecutionState() == RUNNING)
         {
-            Yarn::Instruction currentInstruction = currentNode.instructions().at(state.programCounter);
+            if (state->programCounter >= currentNode->instructions.Num())
+            {
+                // Resuming after the batch that was collected before the end of the node
+                CompleteNode();
+                continue;
+            }
+
+            if (maxInstructions > 0 && instructionsRun >= maxInstructions)
+            {
+                // Out of time for this slice; pick up from the same instruction next time
+                SetCurrentExecutionState(SUSPENDED);
+                break;
+            }
+
+            if (runawayInstructionLimit > 0 && instructionsSinceContent >= runawayInstructionLimit)
+            {
+                YS_ERR("Node %s ran %d instructions without delivering any content, and was stopped at instruction %d. Check it for a loop that never exits.",
+                    *currentNode->name, instructionsSinceContent, state->programCounter);
+                SetCurrentExecutionState(VirtualMachine::ExecutionState::ERROR);
+                return false;
+            }
+
+            ++instructionsRun;
+            ++instructionsSinceContent;
+
+            const PreparedInstruction& currentInstruction = currentNode->instructions[state->programCounter];
 
             bool successfullyRanInstruction = RunInstruction(currentInstruction);
 
@@ -128,14 +443,11 @@ namespace Yarn
                 return false;
             }
 
-            state.programCounter += 1;
+            state->programCounter += 1;
 
-            if (state.programCounter >= currentNode.instructions_size() && GetCurrentExecutionState() != STOPPED)
+            if (state->programCounter >= currentNode->instructions.Num() && GetCurrentExecutionState() != STOPPED)
             {
-                OnNodeComplete.Broadcast(currentNode.name().c_str());
-                SetCurrentExecutionState(STOPPED);
-                OnDialogueComplete.Broadcast();
-                YS_LOG("Run complete.");
+                CompleteNode();
             }
         }
 
@@ -143,69 +455,133 @@ namespace Yarn
     }
 
 
-    bool VirtualMachine::RunInstruction(Yarn::Instruction& instruction)
+    void VirtualMachine::CompleteNode()
+    {
+        if (DeliverContentBatch())
+        {
+            return;
+        }
+
+        RecordVisit();
+        sink->HandleNodeComplete(currentNode->name);
+        SetCurrentExecutionState(STOPPED);
+        sink->HandleDialogueComplete();
+        YS_LOG("Run complete.");
+    }
+
+
+    void VirtualMachine::RecordVisit()
+    {
+        if (currentNode->countsOwnVisits)
+        {
+            return;
+        }
+
+        // Counters are where storage that has them keeps visit counts, so a visit doesn't have to write a variable
+        if (visitCounters)
+        {
+            visitCounters->AddVisit(currentNode->index);
+        }
+        else
+        {
+            variableStorage->AddToNumber(currentNode->visitVariable, 1);
+        }
+    }
+
+
+    bool VirtualMachine::DeliverContentBatch()
     {
-        TStringBuilder<NAME_SIZE> StrBuilder;
+        if (contentBatch.Num() == 0)
+        {
+            return false;
+        }
+
+        // Swapped out, because a host that continues straight away can have the next batch started before it returns
+        TArray<ContentItem> batch = MoveTemp(contentBatch);
+        contentBatch = MoveTemp(spareContentBatch);
+
+        SetCurrentExecutionState(DELIVERING_CONTENT);
+
+        sink->HandleContentBatch(batch);
+
+        if (GetCurrentExecutionState() == DELIVERING_CONTENT)
+        {
+            SetCurrentExecutionState(WAITING_FOR_CONTINUE);
+        }
+
+        batch.Reset();
+        spareContentBatch = MoveTemp(batch);
+        return true;
+    }
 
-        StrBuilder << Instruction_OpCode_Name(instruction.opcode()).c_str();
 
-        for (auto operand : instruction.operands())
+    bool VirtualMachine::RunInstruction(const PreparedInstruction& instruction)
+    {
+        if (UE_LOG_ACTIVE(LogYarnSpinner, Log))
         {
-            StrBuilder << " ";
-            switch (operand.value_case())
+            TStringBuilder<NAME_SIZE> StrBuilder;
+
+            StrBuilder << Instruction_OpCode_Name(instruction.opcode).c_str();
+
+            for (const auto& operand : instruction.source->operands())
             {
-            case Yarn::Operand::kBoolValue:
-                StrBuilder << (operand.bool_value() ? "true" : "false");
-                break;
-            case Yarn::Operand::kFloatValueFieldNumber:
-                StrBuilder << FString::SanitizeFloat(operand.float_value());
-                break;
-            case Yarn::Operand::kStringValue:
-                StrBuilder << operand.string_value().c_str();
-                break;
-            default:
-                StrBuilder << "(unknown operand type!)";
+                StrBuilder << " ";
+                switch (operand.value_case())
+                {
+                case Yarn::Operand::kBoolValue:
+                    StrBuilder << (operand.bool_value() ? "true" : "false");
+                    break;
+                case Yarn::Operand::kFloatValueFieldNumber:
+                    StrBuilder << FString::SanitizeFloat(operand.float_value());
+                    break;
+                case Yarn::Operand::kStringValue:
+                    StrBuilder << operand.string_value().c_str();
+                    break;
+                default:
+                    StrBuilder << "(unknown operand type!)";
+                }
             }
+
+            YS_LOG("%s", StrBuilder.ToString());
         }
 
-        YS_LOG("%s", StrBuilder.ToString());
-        
-        switch (instruction.opcode())
+        switch (instruction.opcode)
         {
         case Yarn::Instruction_OpCode_RUN_LINE:
             {
-                // Fetch line ID
-                auto lineID = instruction.operands(0).string_value();
-
                 // Build line structs
                 Line line = Line();
-                line.LineID = lineID.c_str();
+                line.LineID = instruction.name;
 
-                // If we have 2+ operands, get the second operand as a number
-                if (instruction.operands_size() > 1)
+                // Get that many expressions off the stack and build the
+                // collection of substitutions (in reverse order), keeping
+                // each value's type
+                line.Substitutions.SetNum(instruction.count);
+
+                for (int expressionIndex = instruction.count - 1; expressionIndex >= 0; expressionIndex--)
                 {
-                    auto expressionCount = (int)instruction.operands(1).float_value();
+                    line.Substitutions[expressionIndex] = state->PopValue().ConvertToFormatArgument();
+                }
 
-                    // And get that many expressions off the stack and build the
-                    // collection of substitutions (in reverse order)
-                    TArray<FFormatArgumentValue> substitutions;
+                if (batchContent)
+                {
+                    ContentItem& item = contentBatch.AddDefaulted_GetRef();
+                    item.Type = ContentItem::EType::Line;
+                    item.Line = MoveTemp(line);
+                    instructionsSinceContent = 0;
 
-                    for (int expressionIndex = expressionCount - 1; expressionIndex >= 0; expressionIndex--)
+                    if (contentBatch.Num() >= MaxContentBatchSize)
                     {
-                        const FValue top = state.PopValue();
-                        substitutions.Add(FText::FromString(*top.ConvertToString()));
+                        DeliverContentBatch();
                     }
-
-                    Algo::Reverse(substitutions);
-
-                    line.Substitutions = substitutions;
+                    break;
                 }
 
                 // Mark that we're currently delivering content
                 SetCurrentExecutionState(DELIVERING_CONTENT);
 
                 // Call the line handler
-                OnLine.Broadcast(line);
+                sink->HandleLine(line);
 
                 // If we're still marked as delivering content, then the line
                 // handler didn't call Continue, so we'll wait here
@@ -218,159 +594,159 @@ namespace Yarn
             }
         case Yarn::Instruction_OpCode_RUN_COMMAND:
             {
-                std::string commandText = instruction.operands(0).string_value();
+                auto command = Command();
+                command.Text = context->GetString(instruction.stringIndex);
 
-                // If we have 2+ operands, get the second operand as a number
-                if (instruction.operands_size() > 1)
+                // Get that many expressions off the stack and substitute
+                // them into the command text (in reverse order)
+                for (int expressionIndex = instruction.count - 1; expressionIndex >= 0; expressionIndex--)
                 {
-                    auto expressionCount = (int)instruction.operands(1).float_value();
+                    const FValue top = state->PopValue();
+                    command.Text.ReplaceInline(*FString::Printf(TEXT("{%d}"), expressionIndex), *top.ConvertToString());
+                }
 
-                    // And get that many expressions off the stack and build the
-                    // collection of substitutions (in reverse order)
-                    TArray<FString> substitutions;
+                const bool blocking = instruction.name.IsNone() || sink->IsCommandBlocking(instruction.name);
 
-                    for (int expressionIndex = expressionCount - 1; expressionIndex >= 0; expressionIndex--)
+                if (batchContent)
+                {
+                    // Blocking commands end the batch, since the host needs to wait for them
+                    ContentItem& item = contentBatch.AddDefaulted_GetRef();
+                    item.Type = ContentItem::EType::Command;
+                    item.Command = MoveTemp(command);
+                    if (blocking || contentBatch.Num() >= MaxContentBatchSize)
                     {
-                        auto top = state.PopValue();
-                        const std::string topAsString = TCHAR_TO_UTF8(*top.ConvertToString());
-
-                        // FString placeholder("\\{" << expressionIndex << "\\}");
-                        commandText = std::regex_replace(commandText, std::regex("\\{" + std::to_string(expressionIndex) + "\\}"), topAsString);
+                        DeliverContentBatch();
                     }
+                    break;
                 }
 
-                SetCurrentExecutionState(DELIVERING_CONTENT);
+                // A non-blocking command doesn't count as content for the runaway check, since nothing waits for it
+                const int32 instructionsBeforeCommand = instructionsSinceContent;
 
-                auto command = Command();
-                command.Text = commandText.c_str();
+                SetCurrentExecutionState(DELIVERING_CONTENT);
 
-                OnCommand.Broadcast(command);
+                sink->HandleCommand(command);
 
                 if (GetCurrentExecutionState() == DELIVERING_CONTENT)
                 {
-                    // The client didn't call Continue, so we'll wait here.
-                    SetCurrentExecutionState(WAITING_FOR_CONTINUE);
+                    if (blocking)
+                    {
+                        // The client didn't call Continue, so we'll wait here.
+                        SetCurrentExecutionState(WAITING_FOR_CONTINUE);
+                    }
+                    else
+                    {
+                        SetCurrentExecutionState(RUNNING);
+                        instructionsSinceContent = instructionsBeforeCommand;
+                    }
                 }
 
                 break;
             }
         case Yarn::Instruction_OpCode_STOP:
             {
-                OnNodeComplete.Broadcast(currentNode.name().c_str());
-                OnDialogueComplete.Broadcast();
+                if (DeliverContentBatch())
+                {
+                    // Stop once the batch has been acknowledged
+                    state->programCounter -= 1;
+                    break;
+                }
+
+                RecordVisit();
+                sink->HandleNodeComplete(currentNode->name);
+                sink->HandleDialogueComplete();
                 SetCurrentExecutionState(STOPPED);
                 break;
             }
         case Yarn::Instruction_OpCode_PUSH_BOOL:
-            {
-                bool value = instruction.operands(0).bool_value();
-                state.PushValue(value);
-                break;
-            }
         case Yarn::Instruction_OpCode_PUSH_FLOAT:
-            {
-                float value = instruction.operands(0).float_value();
-                state.PushValue(value);
-                break;
-            }
         case Yarn::Instruction_OpCode_PUSH_STRING:
             {
-                FString value = instruction.operands(0).string_value().c_str();
-                state.PushValue(value);
+                state->PushValue(instruction.literal);
                 break;
             }
         case Yarn::Instruction_OpCode_JUMP_IF_FALSE:
             {
-                bool topOfStack = state.PeekValue().GetValue<bool>();
+                bool topOfStack = state->PeekValue().GetValue<bool>();
                 if (topOfStack == false)
                 {
-                    auto label = instruction.operands(0).string_value().c_str();
-                    state.programCounter = FindInstructionPointForLabel(label) - 1;
+                    if (instruction.target == INDEX_NONE)
+                    {
+                        return FindInstructionPointForLabel(context->GetString(instruction.stringIndex)) >= 0;
+                    }
+                    state->programCounter = instruction.target - 1;
                 }
                 break;
             }
         case Yarn::Instruction_OpCode_JUMP_TO:
             {
-                auto label = instruction.operands(0).string_value().c_str();
-                state.programCounter = FindInstructionPointForLabel(label) - 1;
+                if (instruction.target == INDEX_NONE)
+                {
+                    return FindInstructionPointForLabel(context->GetString(instruction.stringIndex)) >= 0;
+                }
+                state->programCounter = instruction.target - 1;
                 break;
             }
         case Yarn::Instruction_OpCode_JUMP:
             {
                 // Jumps to a label whose name is on the stack.
-                FString jumpDestination = state.PeekValue().GetValue<FString>();
-                state.programCounter = FindInstructionPointForLabel(jumpDestination) - 1;
+                FString jumpDestination = state->PeekValue().GetValue<FString>();
+                state->programCounter = FindInstructionPointForLabel(jumpDestination) - 1;
                 break;
             }
         case Yarn::Instruction_OpCode_ADD_OPTION:
             {
                 Line line = Line();
+                line.LineID = instruction.name;
 
-                line.LineID = instruction.operands(0).string_value().c_str();
-                FString destination = instruction.operands(1).string_value().c_str();
+                // Get that many expressions off the stack and build the collection
+                // of substitutions (in reverse order), keeping each value's type
+                line.Substitutions.SetNum(instruction.count);
 
-                if (instruction.operands_size() > 2)
+                for (int expressionIndex = instruction.count - 1; expressionIndex >= 0; expressionIndex--)
                 {
-                    // The third operand is the number of substitutions present in the
-                    // line.
-
-                    auto expressionCount = (int)instruction.operands(2).float_value();
-
-                    // Get that many expressions off the stack and build the collection
-                    // of substitutions (in reverse order)
-                    TArray<FFormatArgumentValue> substitutions;
-
-                    for (int expressionIndex = expressionCount - 1; expressionIndex >= 0; expressionIndex--)
-                    {
-                        const FValue top = state.PopValue();
-                        substitutions.Add(FText::FromString(top.ConvertToString()));
-                    }
-
-                    Algo::Reverse(substitutions);
-
-                    line.Substitutions = substitutions;
+                    line.Substitutions[expressionIndex] = state->PopValue().ConvertToFormatArgument();
                 }
 
                 // Indicates whether the VM believes that the option should be shown to
                 // the user, based on any conditions that were attached to the option.
                 bool lineConditionPassed = true;
 
-                if (instruction.operands_size() > 3)
+                if (instruction.hasCondition)
                 {
-                    // The fourth operand is a bool that indicates whether this option
-                    // had a condition or not. If it does, then a bool value will exist
-                    // on the stack indiciating whether the condition passed or not. We
+                    // This option has a condition, and a bool value will exist on
+                    // the stack indicating whether the condition passed or not. We
                     // pass that information to the game.
-
-                    bool hasLineCondition = instruction.operands(3).bool_value();
-
-                    if (hasLineCondition)
-                    {
-                        // This option has a condition. Get it from the stack.
-                        lineConditionPassed = state.PopValue().GetValue<bool>();
-                    }
+                    lineConditionPassed = state->PopValue().GetValue<bool>();
                 }
 
-                state.AddOption(line, destination, lineConditionPassed);
+                state->AddOption(line, context->GetString(instruction.stringIndex), lineConditionPassed);
                 break;
             }
         case Yarn::Instruction_OpCode_SHOW_OPTIONS:
             {
                 // Show all accumulated options to the game.
 
+                if (DeliverContentBatch())
+                {
+                    // Show the options once the lines before them have been acknowledged
+                    state->programCounter -= 1;
+                    break;
+                }
+
                 // If we have no options to show, immediately stop.
 
-                if (state.currentOptions.IsEmpty())
+                if (state->currentOptions.IsEmpty())
                 {
                     SetCurrentExecutionState(STOPPED);
-                    OnDialogueComplete.Broadcast();
+                    sink->HandleDialogueComplete();
                     break;
                 }
 
                 // Present the list of options to the user and let them pick
                 auto optionSet = OptionSet();
 
-                optionSet.Options = state.currentOptions;
+                optionSet.Options = state->currentOptions;
 
                 // We can't continue until our client tell us which
                 // option to pick
@@ -379,7 +755,7 @@ namespace Yarn
                 // Pass the options set to the client, as well as a
                 // delegate for them to call when the user has made
                 // a selection
-                OnOptions.Broadcast(optionSet);
+                sink->HandleOptions(optionSet);
 
                 if (GetCurrentExecutionState() == WAITING_FOR_CONTINUE)
                 {
@@ -403,110 +779,41 @@ namespace Yarn
         case Yarn::Instruction_OpCode_POP:
             {
                 // Remove a value from the top of the stack and discard it.
-                state.PopValue();
+                state->PopValue();
                 break;
             }
         case Yarn::Instruction_OpCode_CALL_FUNC:
             {
-                // Call a named function, with parameters found on the stack, and push
-                // the resulting value onto the stack.
-                const FString functionName = instruction.operands(0).string_value().c_str();
+                const bool async = instruction.intrinsic == Intrinsic::None && sink->IsAsyncFunction(instruction.name);
 
-                const int actualParamCount = static_cast<int>(state.PopValue().GetValue<double>());
-                if (!OnCheckFunctionExist.Execute(functionName))
+                if (async && DeliverContentBatch())
                 {
-                    YS_ERR("Unknown function '%s'", *functionName);
-                    return false;
+                    // Don't hold the lines before it back while the function runs
+                    state->programCounter -= 1;
+                    break;
                 }
 
-                // auto expectedParamCount = library.GetExpectedParameterCount(functionName);
-                auto expectedParamCount = OnGetFunctionParamNum.Execute(functionName);
-
-                if (expectedParamCount >= 0 && expectedParamCount != actualParamCount)
+                // Call a named function, with parameters found on the stack, and push
+                // the resulting value onto the stack.
+                if (!CallFunction(instruction, async))
                 {
-                    YS_ERR("Function '%s' expects %i parameters, but %i were provided", *functionName, expectedParamCount, actualParamCount);
                     return false;
                 }
 
-                TArray<FValue> parameters;
-
-                for (int param = actualParamCount - 1; param >= 0; param--)
+                if (GetCurrentExecutionState() == WAITING_FOR_FUNCTION_RESULT)
                 {
-                    auto value = state.PopValue();
-                    parameters.Add(value);
+                    break;
                 }
-                Algo::Reverse(parameters);
-
-                auto result = OnCallFunction.Execute(functionName, parameters);
-                state.PushValue(result);
-
-                // if (library.HasFunction<FString>(functionName))
-                // {
-                //     auto function = library.GetFunction<FString>(functionName);
-                //     auto result = function.Function(parameters);
-                //     state.PushValue(result);
-                // }
-                // else if (library.HasFunction<float>(functionName))
-                // {
-                //     auto function = library.GetFunction<float>(functionName);
-                //     auto result = function.Function(parameters);
-                //     state.PushValue(result);
-                // }
-                // else if (library.HasFunction<bool>(functionName))
-                // {
-                //     auto function = library.GetFunction<bool>(functionName);
-                //     auto result = function.Function(parameters);
-                //     state.PushValue(result);
-                // }
-                // else
-                // {
-                //     YS_ERR("Unknown function %s", *functionName);
-                //     return false;
-                // }
-
-                YS_LOG("Function call returned \"%s\" (type: %d)", *state.PeekValue().ConvertToString(), state.PeekValue().GetType());
+
+                YS_LOG("Function call returned \"%s\" (type: %d)", *state->PeekValue().ConvertToString(), state->PeekValue().GetType());
 
                 break;
             }
         case Yarn::Instruction_OpCode_PUSH_VARIABLE:
             {
                 // Get the contents of a variable, and push that onto the stack.
-                const FString variableName = instruction.operands(0).string_value().c_str();
-
-                if (variableStorage.HasValue(variableName))
-                {
-                    // We found a value for this variable in the storage.
-                    FValue v = variableStorage.GetValue(variableName);
-                    state.PushValue(v);
-                }
-                else if (Program->initial_values().count(TCHAR_TO_UTF8(*variableName)) > 0)
-                {
-                    // We don't have a value for this. The initial value may be found in
-                    // the program. (If it's not, then the variable's value is
-                    // undefined, which isn't allowed.)
-                    auto operand = Program->initial_values().at(TCHAR_TO_UTF8(*variableName));
-                    switch (operand.value_case())
-                    {
-                    case Yarn::Operand::ValueCase::kBoolValue:
-                        state.PushValue(operand.bool_value());
-                        break;
-                    case Yarn::Operand::ValueCase::kStringValue:
-                        state.PushValue(operand.string_value().c_str());
-                        break;
-                    case Yarn::Operand::ValueCase::kFloatValue:
-                        state.PushValue(operand.float_value());
-                        break;
-                    default:
-                        YS_ERR("Unknown initial value type %i for variable %s", operand.value_case(), *variableName);
-                        return false;
-                    }
-                }
-                else
+                if (!PushVariable(instruction.slot))
                 {
-                    // We didn't find a value for this variable in storage or in the
-                    // program's initial values. This is an error - the variable must not
-                    // have been defined.
-                    YS_ERR("Undefined variable %s", *variableName);
                     return false;
                 }
                 break;
@@ -514,21 +821,26 @@ namespace Yarn
         case Yarn::Instruction_OpCode_STORE_VARIABLE:
             {
                 // Store the top value on the stack in a variable.
-                const FValue topValue = state.PeekValue();
-                const FString destinationVariableName = instruction.operands(0).string_value().c_str();
+                const FValue& topValue = state->PeekValue();
+                const FString& destinationVariableName = context->GetVariableName(instruction.slot);
 
                 YS_LOG("Set %ss to %s", *destinationVariableName, *topValue.ConvertToString());
 
+                if (variableStorage->SetSlotValue(instruction.slot, topValue))
+                {
+                    break;
+                }
+
                 switch (topValue.GetType())
                 {
                 case FValue::EValueType::String:
-                    variableStorage.SetValue(destinationVariableName, topValue.GetValue<FString>());
+                    variableStorage->SetValue(destinationVariableName, topValue.GetValue<FString>());
                     break;
                 case FValue::EValueType::Number:
-                    variableStorage.SetValue(destinationVariableName, static_cast<float>(topValue.GetValue<double>()));
+                    variableStorage->SetValue(destinationVariableName, static_cast<float>(topValue.GetValue<double>()));
                     break;
                 case FValue::EValueType::Bool:
-                    variableStorage.SetValue(destinationVariableName, topValue.GetValue<bool>());
+                    variableStorage->SetValue(destinationVariableName, topValue.GetValue<bool>());
                     break;
                 default:
                     YS_ERR("Invalid Yarn value type %i for variable %s", topValue.GetType(), *destinationVariableName);
@@ -539,20 +851,24 @@ namespace Yarn
         case Yarn::Instruction_OpCode_RUN_NODE:
             {
                 // Pop a string from the stack, and jump to a node with that name.
-                const FString nodeName = state.PopValue().GetValue<FString>();
+                const FString nodeName = state->PopValue().GetValue<FString>();
 
-                OnNodeComplete.Broadcast(currentNode.name().c_str());
+                RecordVisit();
+                sink->HandleNodeComplete(currentNode->name);
 
-                SetNode(nodeName);
+                if (!SetNode(nodeName))
+                {
+                    return false;
+                }
 
                 // Decrement program counter here, because it will be incremented when
                 // this function returns, and would mean skipping the first instruction
-                state.programCounter -= 1;
+                state->programCounter -= 1;
 
                 break;
             }
         default:
-            YS_LOG("Unhandled instruction type %i", instruction.opcode());
+            YS_LOG("Unhandled instruction type %i", instruction.opcode);
             return false;
             break;
         }
@@ -568,15 +884,436 @@ namespace Yarn
     }
 
 
+    bool VirtualMachine::CallFunction(const PreparedInstruction& instruction, const bool async)
+    {
+        const int actualParamCount = static_cast<int>(state->PopValue().GetValue<double>());
+
+        if (instruction.intrinsic != Intrinsic::None)
+        {
+            return CallIntrinsic(instruction, actualParamCount);
+        }
+
+        if (smartVariableReads && !sink->IsPureFunction(instruction.name))
+        {
+            isSmartVariablePure = false;
+        }
+
+        // Whether the function exists and takes this many parameters can't change for a given call site, so it's only
+        // checked the first time the call site runs
+        if (!checkedCallSites[instruction.slot])
+        {
+            if (!sink->HasFunction(instruction.name))
+            {
+                YS_ERR("Unknown function '%s'", *context->GetString(instruction.stringIndex));
+                return false;
+            }
+
+            const int expectedParamCount = sink->GetExpectedFunctionParamCount(instruction.name);
+
+            if (expectedParamCount >= 0 && expectedParamCount != actualParamCount)
+            {
+                YS_ERR("Function '%s' expects %i parameters, but %i were provided", *context->GetString(instruction.stringIndex), expectedParamCount, actualParamCount);
+                return false;
+            }
+
+            checkedCallSites[instruction.slot] = true;
+        }
+
+        TArray<FValue> parameters;
+        parameters.SetNum(actualParamCount);
+
+        for (int param = actualParamCount - 1; param >= 0; param--)
+        {
+            parameters[param] = state->PopValue();
+        }
+
+        if (async)
+        {
+            SetCurrentExecutionState(WAITING_FOR_FUNCTION_RESULT);
+
+            sink->HandleAsyncFunctionCall(instruction.name, parameters);
+
+            if (GetCurrentExecutionState() == WAITING_FOR_CONTINUE)
+            {
+                // The result was already there
+                SetCurrentExecutionState(RUNNING);
+            }
+            return true;
+        }
+
+        state->PushValue(sink->HandleFunctionCall(instruction.name, parameters));
+        return true;
+    }
+
+
+    bool VirtualMachine::CallIntrinsic(const PreparedInstruction& instruction, const int actualParamCount)
+    {
+        if (actualParamCount != instruction.count)
+        {
+            YS_ERR("Function '%s' expects %i parameters, but %i were provided", *context->GetString(instruction.stringIndex), instruction.count, actualParamCount);
+            return false;
+        }
+
+        if (instruction.intrinsic == Intrinsic::Visited || instruction.intrinsic == Intrinsic::VisitedCount)
+        {
+            // Both of these ask how many times a node has been visited. The node is usually linked already; otherwise
+            // it's looked up by the name on the stack.
+            const FValue nodeName = state->PopValue();
+            const int32 nodeIndex = instruction.node != INDEX_NONE ? instruction.node : context->FindNode(nodeName.GetValue<FString>());
+            const double visitCount = GetVisitCount(nodeIndex, nodeName.GetValue<FString>());
+
+            if (smartVariableReads)
+            {
+                if (nodeIndex != INDEX_NONE)
+                {
+                    smartVariableReads->Add({INDEX_NONE, nodeIndex, FValue(visitCount)});
+                }
+                else
+                {
+                    isSmartVariablePure = false;
+                }
+            }
+
+            if (instruction.intrinsic == Intrinsic::Visited)
+            {
+                state->PushValue(visitCount > 0);
+            }
+            else
+            {
+                state->PushValue(static_cast<double>(static_cast<int>(visitCount)));
+            }
+            return true;
+        }
+
+        // The rest of the standard library works on numbers. Parameters come off the stack last first.
+        const double second = instruction.count > 1 ? state->PopValue().ConvertToNumber() : 0;
+        const double first = instruction.count > 0 ? state->PopValue().ConvertToNumber() : 0;
+
+        // A smart variable that draws random numbers can't be kept
+        if (instruction.intrinsic == Intrinsic::Random || instruction.intrinsic == Intrinsic::RandomRange || instruction.intrinsic == Intrinsic::Dice)
+        {
+            isSmartVariablePure = false;
+        }
+
+        switch (instruction.intrinsic)
+        {
+        case Intrinsic::Random:
+            state->PushValue(static_cast<double>(randomStream.GetFraction()));
+            return true;
+        case Intrinsic::RandomRange:
+            // A whole number, with both ends included
+            state->PushValue(static_cast<double>(randomStream.RandRange(static_cast<int32>(first), static_cast<int32>(second))));
+            return true;
+        case Intrinsic::Dice:
+            state->PushValue(static_cast<double>(randomStream.RandRange(1, static_cast<int32>(first))));
+            return true;
+        case Intrinsic::Round:
+            // Halves go to the even neighbour, as they do in Yarn Spinner's other runtimes
+            state->PushValue(FMath::RoundHalfToEven(first));
+            return true;
+        case Intrinsic::RoundPlaces:
+            {
+                const double scale = FMath::Pow(10.0, FMath::TruncToDouble(second));
+                state->PushValue(FMath::RoundHalfToEven(first * scale) / scale);
+                return true;
+            }
+        case Intrinsic::Floor:
+            state->PushValue(FMath::FloorToDouble(first));
+            return true;
+        case Intrinsic::Ceil:
+            state->PushValue(FMath::CeilToDouble(first));
+            return true;
+        case Intrinsic::Inc:
+            // To the next whole number
+            state->PushValue(first != FMath::TruncToDouble(first) ? FMath::CeilToDouble(first) : first + 1);
+            return true;
+        case Intrinsic::Dec:
+            state->PushValue(first != FMath::TruncToDouble(first) ? FMath::FloorToDouble(first) : first - 1);
+            return true;
+        case Intrinsic::Decimal:
+            state->PushValue(first - FMath::TruncToDouble(first));
+            return true;
+        case Intrinsic::Int:
+            state->PushValue(FMath::TruncToDouble(first));
+            return true;
+        case Intrinsic::FormatInvariant:
+            state->PushValue(FValue(first).ConvertToString());
+            return true;
+        default:
+            return false;
+        }
+    }
+
+
+    double VirtualMachine::GetVisitCount(const int32 nodeIndex, const FString& nodeName)
+    {
+        if (visitCounters && nodeIndex != INDEX_NONE)
+        {
+            return visitCounters->Get(nodeIndex);
+        }
+
+        const FString visitVariable = nodeIndex != INDEX_NONE ?
+            context->GetNode(nodeIndex).visitVariable :
+            Library::GenerateUniqueVisitedVariableForNode(nodeName);
+
+        if (variableStorage->HasValue(visitVariable))
+        {
+            return variableStorage->GetValue(visitVariable).GetValue<double>();
+        }
+
+        const FValue* const initialValue = context->GetInitialValue(context->FindVariableSlot(visitVariable));
+        return initialValue && initialValue->GetType() == FValue::EValueType::Number ? initialValue->GetValue<double>() : 0;
+    }
+
+
+    TOptional<FValue> VirtualMachine::ReadVariable(const int32 slot)
+    {
+        const FString& variableName = context->GetVariableName(slot);
+
+        TOptional<FValue> slotValue;
+        const bool isKeptBySlot = variableStorage->GetSlotValue(slot, slotValue);
+
+        if (slotValue.IsSet())
+        {
+            return slotValue;
+        }
+        if (!isKeptBySlot && variableStorage->HasValue(variableName))
+        {
+            // We found a value for this variable in the storage.
+            return variableStorage->GetValue(variableName);
+        }
+        if (const FValue* const initialValue = context->GetInitialValue(slot))
+        {
+            // We don't have a value for this. The initial value may be found in
+            // the program.
+            return *initialValue;
+        }
+        return {};
+    }
+
+
+    bool VirtualMachine::PushVariable(const int32 slot)
+    {
+        const int32 smartVariable = context->FindSmartVariable(slot);
+        if (smartVariable != INDEX_NONE)
+        {
+            return PushSmartVariable(smartVariable);
+        }
+
+        const TOptional<FValue> value = ReadVariable(slot);
+
+        if (smartVariableReads)
+        {
+            smartVariableReads->Add({slot, INDEX_NONE, value});
+        }
+
+        if (!value.IsSet())
+        {
+            // We didn't find a value for this variable in storage or in the
+            // program's initial values. This is an error - the variable must not
+            // have been defined.
+            YS_ERR("Undefined variable %s", *context->GetVariableName(slot));
+            return false;
+        }
+
+        state->PushValue(value.GetValue());
+        return true;
+    }
+
+
+    bool VirtualMachine::PushSmartVariable(const int32 smartVariable)
+    {
+        SmartVariableMemo& memo = smartVariables[smartVariable];
+
+        if (memo.value.IsSet() && IsSmartVariableCurrent(memo))
+        {
+            if (smartVariableReads)
+            {
+                smartVariableReads->Append(memo.reads);
+            }
+            state->PushValue(memo.value.GetValue());
+            return true;
+        }
+
+        const PreparedNode& node = context->GetSmartVariableNode(smartVariable);
+        if (memo.isEvaluating)
+        {
+            YS_ERR("Smart variable %s depends on itself", *node.name);
+            return false;
+        }
+
+        // Read before anything is evaluated, so a change made meanwhile makes the result look out of date, never current
+        const TOptional<uint64> changeCount = GetChangeCount();
+
+        TArray<SmartVariableRead> reads;
+        TArray<SmartVariableRead>* const outerReads = smartVariableReads;
+        const bool isOuterPure = isSmartVariablePure;
+        smartVariableReads = &reads;
+        isSmartVariablePure = true;
+        memo.isEvaluating = true;
+
+        FValue value;
+        const bool evaluated = EvaluateSmartVariable(node, value);
+
+        memo.isEvaluating = false;
+        const bool isPure = isSmartVariablePure;
+        smartVariableReads = outerReads;
+        isSmartVariablePure = isOuterPure && isPure;
+
+        if (!evaluated)
+        {
+            return false;
+        }
+
+        // A smart variable that reads another depends on everything that one read
+        if (smartVariableReads)
+        {
+            smartVariableReads->Append(reads);
+        }
+
+        if (isPure)
+        {
+            memo.value = value;
+            memo.reads = MoveTemp(reads);
+            memo.changeCount = changeCount;
+        }
+        else
+        {
+            memo.value.Reset();
+            memo.reads.Reset();
+        }
+
+        state->PushValue(value);
+        return true;
+    }
+
+
+    bool VirtualMachine::IsSmartVariableCurrent(SmartVariableMemo& memo)
+    {
+        const TOptional<uint64> changeCount = GetChangeCount();
+        if (changeCount.IsSet() && changeCount == memo.changeCount)
+        {
+            return true;
+        }
+
+        // Something has changed, but not necessarily anything this one reads
+        for (const SmartVariableRead& read : memo.reads)
+        {
+            const TOptional<FValue> current = read.slot != INDEX_NONE ? ReadVariable(read.slot) : TOptional<FValue>(FValue(GetVisitCount(read.node, FString())));
+            if (current != read.value)
+            {
+                return false;
+            }
+        }
+
+        memo.changeCount = changeCount;
+        return true;
+    }
+
+
+    TOptional<uint64> VirtualMachine::GetChangeCount() const
+    {
+        const TOptional<uint64> changeCount = variableStorage->GetChangeCount();
+        if (!changeCount.IsSet() || !visitCounters)
+        {
+            return changeCount;
+        }
+
+        // Both only ever go up, so their sum changes whenever either does
+        return changeCount.GetValue() + visitCounters->GetChangeCount();
+    }
+
+
+    bool VirtualMachine::EvaluateSmartVariable(const PreparedNode& node, FValue& outValue)
+    {
+        const PreparedNode* const callerNode = currentNode;
+        const int callerProgramCounter = state->programCounter;
+        const int32 stackDepth = state->stack.Num();
+
+        currentNode = &node;
+        state->programCounter = 0;
+
+        bool succeeded = true;
+        while (succeeded && state->programCounter < node.instructions.Num())
+        {
+            const PreparedInstruction& instruction = node.instructions[state->programCounter];
+            if (instruction.opcode == Instruction_OpCode_STOP)
+            {
+                break;
+            }
+
+            // Only what an expression compiles to; anything else would deliver content or change state part way
+            // through whatever read the variable
+            bool isExpression = false;
+            switch (instruction.opcode)
+            {
+            case Instruction_OpCode_PUSH_STRING:
+            case Instruction_OpCode_PUSH_FLOAT:
+            case Instruction_OpCode_PUSH_BOOL:
+            case Instruction_OpCode_PUSH_VARIABLE:
+            case Instruction_OpCode_POP:
+            case Instruction_OpCode_JUMP_TO:
+            case Instruction_OpCode_JUMP_IF_FALSE:
+                isExpression = true;
+                break;
+            case Instruction_OpCode_CALL_FUNC:
+                isExpression = instruction.intrinsic != Intrinsic::None || !sink->IsAsyncFunction(instruction.name);
+                break;
+            default:
+                break;
+            }
+
+            if (!isExpression)
+            {
+                YS_ERR("Smart variable %s can only compute a value, but instruction %d does something else", *node.name, state->programCounter);
+                succeeded = false;
+                break;
+            }
+
+            // Counted with the instructions of whatever read the variable, so a smart variable that loops is stopped
+            // like dialogue that does
+            if (runawayInstructionLimit > 0 && instructionsSinceContent >= runawayInstructionLimit)
+            {
+                YS_ERR("Smart variable %s ran %d instructions without delivering any content, and was stopped at instruction %d. Check it for a loop that never exits.",
+                    *node.name, instructionsSinceContent, state->programCounter);
+                succeeded = false;
+                break;
+            }
+            ++instructionsSinceContent;
+
+            succeeded = RunInstruction(instruction);
+            state->programCounter += 1;
+        }
+
+        currentNode = callerNode;
+        state->programCounter = callerProgramCounter;
+
+        if (succeeded && state->stack.Num() != stackDepth + 1)
+        {
+            YS_ERR("Smart variable %s didn't compute exactly one value", *node.name);
+            succeeded = false;
+        }
+
+        if (!succeeded)
+        {
+            return false;
+        }
+
+        outValue = state->PopValue();
+        return true;
+    }
+
+
     int VirtualMachine::FindInstructionPointForLabel(const FString& Label)
     {
-        if (currentNode.labels().count(TCHAR_TO_UTF8(*Label)) == 0)
+        const int32* const instructionPoint = currentNode->labels.Find(Label);
+        if (!instructionPoint)
         {
-            YS_ERR("Unknown label %s in node %s", *Label, currentNode.name().c_str());
+            YS_ERR("Unknown label %s in node %s", *Label, *currentNode->name);
             SetCurrentExecutionState(ERROR);
             return -1;
         }
-        return currentNode.labels().at(TCHAR_TO_UTF8(*Label));
+        return *instructionPoint;
     }
 
 
@@ -588,27 +1325,46 @@ namespace Yarn
             return false;
         }
 
-        if (!OnLine.IsBound())
+        if (executionState == WAITING_FOR_FUNCTION_RESULT)
+        {
+            YS_ERR("Cannot continue running dialogue. Still waiting on a function result.");
+            return false;
+        }
+
+        if (currentNode == nullptr)
+        {
+            YS_ERR("Cannot continue running dialogue. No node has been selected.");
+            return false;
+        }
+
+        // A host-provided sink handles everything itself
+        return sink != &delegateSink || delegateSink.IsReady();
+    }
+
+
+    bool VirtualMachine::DelegateSink::IsReady() const
+    {
+        if (!vm.OnLine.IsBound())
         {
             YS_ERR("Cannot continue dialogue: OnLine handler has not been set.");
             return false;
         }
-        if (!OnOptions.IsBound())
+        if (!vm.OnOptions.IsBound())
         {
             YS_ERR("Cannot continue dialogue: OnOptions handler has not been set.");
             return false;
         }
-        if (!OnCommand.IsBound())
+        if (!vm.OnCommand.IsBound())
         {
             YS_ERR("Cannot continue dialogue: OnCommand handler has not been set.");
             return false;
         }
-        if (!OnNodeComplete.IsBound())
+        if (!vm.OnNodeComplete.IsBound())
         {
             YS_ERR("Cannot continue dialogue: OnNodeComplete handler has not been set.");
             return false;
         }
-        if (!OnDialogueComplete.IsBound())
+        if (!vm.OnDialogueComplete.IsBound())
         {
             YS_ERR("Cannot continue dialogue: OnDialogueComplete handler has not been set.");
             return false;
@@ -617,6 +1373,103 @@ namespace Yarn
     }
 
 
+    void VirtualMachine::SetVariableStorage(IVariableStorage& newVariableStorage)
+    {
+        variableStorage = &newVariableStorage;
+        visitCounters = variableStorage->GetVisitCounters(context);
+
+        // Change counts from the old storage mean nothing to the new one, so smart variables check what they read
+        for (SmartVariableMemo& memo : smartVariables)
+        {
+            memo.changeCount.Reset();
+        }
+    }
+
+
+    double IVariableStorage::AddToNumber(const FString& name, const double delta)
+    {
+        const FValue value = HasValue(name) ? GetValue(name) : FValue();
+        const double result = (value.GetType() == FValue::EValueType::Number ? value.GetValue<double>() : 0) + delta;
+        SetValue(name, static_cast<float>(result));
+        return result;
+    }
+
+
+    void IDialogueSink::HandleContentBatch(const TArray<ContentItem>& batch)
+    {
+        for (const ContentItem& item : batch)
+        {
+            if (item.Type == ContentItem::EType::Line)
+            {
+                HandleLine(item.Line);
+            }
+            else
+            {
+                HandleCommand(item.Command);
+            }
+        }
+    }
+
+
+    void VirtualMachine::DelegateSink::HandleLine(const Line& line)
+    {
+        vm.OnLine.Broadcast(line);
+    }
+
+
+    void VirtualMachine::DelegateSink::HandleOptions(const OptionSet& options)
+    {
+        vm.OnOptions.Broadcast(options);
+    }
+
+
+    void VirtualMachine::DelegateSink::HandleCommand(const Command& command)
+    {
+        vm.OnCommand.Broadcast(command);
+    }
+
+
+    void VirtualMachine::DelegateSink::HandleNodeStart(const FString& nodeName)
+    {
+        vm.OnNodeStart.Broadcast(nodeName);
+    }
+
+
+    void VirtualMachine::DelegateSink::HandleNodeComplete(const FString& nodeName)
+    {
+        vm.OnNodeComplete.Broadcast(nodeName);
+    }
+
+
+    void VirtualMachine::DelegateSink::HandleDialogueComplete()
+    {
+        vm.OnDialogueComplete.Broadcast();
+    }
+
+
+    bool VirtualMachine::DelegateSink::HasFunction(const FName name)
+    {
+        return vm.OnCheckFunctionExist.IsBound() && vm.OnCheckFunctionExist.Execute(name.ToString());
+    }
+
+
+    int VirtualMachine::DelegateSink::GetExpectedFunctionParamCount(const FName name)
+    {
+        return vm.OnGetFunctionParamNum.IsBound() ? vm.OnGetFunctionParamNum.Execute(name.ToString()) : -1;
+    }
+
+
+    FValue VirtualMachine::DelegateSink::HandleFunctionCall(const FName name, const TArray<FValue>& parameters)
+    {
+        if (!vm.OnCallFunction.IsBound())
+        {
+            YS_ERR("Cannot call function '%s': OnCallFunction handler has not been set.", *name.ToString());
+            return FValue();
+        }
+        return vm.OnCallFunction.Execute(name.ToString(), parameters);
+    }
+
+
     void VirtualMachine::SetSelectedOption(int selectedOptionIndex)
     {
         if (GetCurrentExecutionState() != WAITING_ON_OPTION_SELECTION)
@@ -626,15 +1479,30 @@ namespace Yarn
             return;
         }
 
-        if (selectedOptionIndex < 0 || selectedOptionIndex >= state.currentOptions.Num())
+        if (selectedOptionIndex < 0 || selectedOptionIndex >= state->currentOptions.Num())
         {
             YS_LOG("SetSelectedOption was called with an invalid option index");
         }
 
-        auto destinationNode = state.currentOptions[selectedOptionIndex].DestinationNode;
-        state.PushValue(destinationNode);
+        auto destinationNode = state->currentOptions[selectedOptionIndex].DestinationNode;
+        state->PushValue(destinationNode);
+
+        state->currentOptions.Reset();
+
+        SetCurrentExecutionState(WAITING_FOR_CONTINUE);
+    }
+
+
+    void VirtualMachine::SetFunctionResult(const FValue& result)
+    {
+        if (GetCurrentExecutionState() != WAITING_FOR_FUNCTION_RESULT)
+        {
+            // Not an error in the dialogue itself: a result can turn up after the dialogue it was for has stopped
+            YS_WARN("SetFunctionResult was called, but Dialogue wasn't waiting for a function result.");
+            return;
+        }
 
-        state.currentOptions.Empty();
+        state->PushValue(result);
 
         SetCurrentExecutionState(WAITING_FOR_CONTINUE);
     }
@@ -0,0 +1,74 @@
+#include "YarnSpinnerCore/VisitCounters.h"
+
+#include "YarnSpinnerCore/Library.h"
+
+namespace Yarn
+{
+    VisitCounters::VisitCounters(const TSharedRef<const RuntimeContext>& context)
+        : context(context),
+          counts(MakeUnique<std::atomic<double>[]>(context->GetNumNodes())),
+          uncollected(MakeUnique<std::atomic<bool>[]>(context->GetNumNodes()))
+    {
+        for (int32 nodeIndex = 0; nodeIndex < context->GetNumNodes(); ++nodeIndex)
+        {
+            Set(nodeIndex, nullptr);
+        }
+    }
+
+
+    void VisitCounters::AddVisit(const int32 nodeIndex)
+    {
+        double count = counts[nodeIndex].load(std::memory_order_relaxed);
+        while (!counts[nodeIndex].compare_exchange_weak(count, count + 1, std::memory_order_relaxed))
+        {
+        }
+
+        // Flagged after the count, so whoever sees the flag also sees this visit
+        uncollected[nodeIndex].store(true, std::memory_order_release);
+        anyUncollected.store(true, std::memory_order_release);
+        changeCount.fetch_add(1, std::memory_order_acq_rel);
+    }
+
+
+    void VisitCounters::Set(const int32 nodeIndex, const FValue* value)
+    {
+        if (!value)
+        {
+            value = context->GetInitialValue(context->FindVariableSlot(context->GetNode(nodeIndex).visitVariable));
+        }
+
+        const double count = value && value->GetType() == FValue::EValueType::Number ? value->GetValue<double>() : 0;
+        counts[nodeIndex].store(count, std::memory_order_relaxed);
+        uncollected[nodeIndex].store(false, std::memory_order_release);
+        changeCount.fetch_add(1, std::memory_order_acq_rel);
+    }
+
+
+    int32 VisitCounters::FindNodeForVariable(const FString& variableName) const
+    {
+        if (!variableName.StartsWith(Library::VisitedVariablePrefix, ESearchCase::CaseSensitive))
+        {
+            return INDEX_NONE;
+        }
+        return context->FindNode(variableName.RightChop(FCString::Strlen(Library::VisitedVariablePrefix)));
+    }
+
+
+    void VisitCounters::CollectVisits(const TFunctionRef<void(int32 nodeIndex, double count)> collect)
+    {
+        if (!anyUncollected.exchange(false, std::memory_order_acq_rel))
+        {
+            return;
+        }
+
+        // Each flag is cleared before its count is read, so a visit that lands in between is collected twice rather
+        // than not at all
+        for (int32 nodeIndex = 0; nodeIndex < context->GetNumNodes(); ++nodeIndex)
+        {
+            if (uncollected[nodeIndex].exchange(false, std::memory_order_acq_rel))
+            {
+                collect(nodeIndex, counts[nodeIndex].load(std::memory_order_relaxed));
+            }
+        }
+    }
+}
@@ -3,12 +3,17 @@
 
 #include "YarnSubsystem.h"
 
+#include "Engine/GameInstance.h"
 #include "Engine/ObjectLibrary.h"
+#include "Engine/World.h"
 #include "Library/YarnCommandLibrary.h"
 #include "Library/YarnFunctionLibrary.h"
 #include "Library/YarnLibraryRegistry.h"
+#include "Misc/Paths.h"
 #include "Misc/YarnAssetHelpers.h"
 #include "Misc/YSLogging.h"
+#include "YarnProject.h"
+#include "YarnSpinnerCore/Library.h"
 
 
 UYarnSubsystem::UYarnSubsystem()
@@ -29,41 +34,583 @@ UYarnSubsystem::UYarnSubsystem()
 }
 
 
+void UYarnSubsystem::Deinitialize()
+{
+    DialogueScheduler.Reset();
+    LatentScheduler.Reset();
+    BarkRuntime.Reset();
+    DisableVariableJournal();
+    Super::Deinitialize();
+}
+
+
+void UYarnSubsystem::Tick(float DeltaTime)
+{
+    // Waits follow the game world's clock, so they stop while it's paused and stretch with time dilation
+    const UWorld* World = GetGameInstance() ? GetGameInstance()->GetWorld() : nullptr;
+    LatentScheduler.Advance(!World ? DeltaTime : World->IsPaused() ? 0.0f : World->GetDeltaSeconds());
+
+    if (BarkRuntime)
+    {
+        BarkRuntime->Tick(DeltaTime);
+    }
+
+    DialogueScheduler.RunFrame();
+
+    if (BarkRuntime)
+    {
+        BarkRuntime->DeliverPending();
+    }
+
+    CollectVisits();
+    DispatchVariableChanges();
+
+    if (VariableJournal)
+    {
+        VariableJournal->Flush();
+    }
+}
+
+
+bool UYarnSubsystem::IsTickable() const
+{
+    return !IsTemplate();
+}
+
+
+TStatId UYarnSubsystem::GetStatId() const
+{
+    RETURN_QUICK_DECLARE_CYCLE_STAT(UYarnSubsystem, STATGROUP_Tickables);
+}
+
+
+FYarnLatentHandle UYarnSubsystem::ScheduleLatent(UObject* Owner, const float DelaySeconds, FYarnLatentDelegate Callback)
+{
+    return LatentScheduler.Schedule(DelaySeconds, Owner, [Callback = MoveTemp(Callback)]
+    {
+        Callback.ExecuteIfBound();
+    });
+}
+
+
+bool UYarnSubsystem::CancelLatent(const FYarnLatentHandle Handle)
+{
+    return LatentScheduler.Cancel(Handle);
+}
+
+
+int32 UYarnSubsystem::CancelAllLatent(UObject* Owner)
+{
+    return LatentScheduler.CancelAll(Owner);
+}
+
+
+FYarnBarkRuntime& UYarnSubsystem::GetBarkRuntime()
+{
+    if (!BarkRuntime)
+    {
+        BarkRuntime = MakeUnique<FYarnBarkRuntime>(*this, YarnFunctionRegistry, &DialogueScheduler);
+
+        // Blueprint delegates need their own copy of each batch, so only make one when something is listening
+        BarkRuntime->OnLines.AddWeakLambda(this, [this](TConstArrayView<FYarnBarkLine> Lines)
+        {
+            if (OnBarkLines.IsBound())
+            {
+                OnBarkLines.Broadcast(TArray<FYarnBarkLine>(Lines));
+            }
+        });
+        BarkRuntime->OnCommands.AddWeakLambda(this, [this](TConstArrayView<FYarnBarkCommand> Commands)
+        {
+            if (OnBarkCommands.IsBound())
+            {
+                OnBarkCommands.Broadcast(TArray<FYarnBarkCommand>(Commands));
+            }
+        });
+    }
+    return *BarkRuntime;
+}
+
+
+FYarnBarkHandle UYarnSubsystem::StartBark(UYarnProject* YarnProject, FName NodeName, float LineDuration)
+{
+    return GetBarkRuntime().StartBark(YarnProject, NodeName, LineDuration);
+}
+
+
+void UYarnSubsystem::ContinueBark(FYarnBarkHandle Bark)
+{
+    if (BarkRuntime)
+    {
+        BarkRuntime->ContinueBark(Bark);
+    }
+}
+
+
+void UYarnSubsystem::StopBark(FYarnBarkHandle Bark)
+{
+    if (BarkRuntime)
+    {
+        BarkRuntime->StopBark(Bark);
+    }
+}
+
+
+bool UYarnSubsystem::IsBarkRunning(FYarnBarkHandle Bark) const
+{
+    return BarkRuntime && BarkRuntime->IsBarkRunning(Bark);
+}
+
+
 void UYarnSubsystem::SetValue(const FString& name, bool value)
 {
-    Variables.FindOrAdd(name) = value;
+    SetVariable(name, Yarn::FValue(value));
 }
 
 
 void UYarnSubsystem::SetValue(const FString& name, float value)
 {
-    Variables.FindOrAdd(name) = value;
+    SetVariable(name, Yarn::FValue(value));
 }
 
 
 void UYarnSubsystem::SetValue(const FString& name, const FString& value)
 {
-    Variables.FindOrAdd(name) = value;
+    SetVariable(name, Yarn::FValue(value));
 }
 
 
 bool UYarnSubsystem::HasValue(const FString& name)
 {
-    return Variables.Contains(name);
+    return Variables.Contains(name) || FindUncollectedVisits(name).IsSet();
 }
 
 
 Yarn::FValue UYarnSubsystem::GetValue(const FString& name)
 {
-    return Variables.FindOrAdd(name);
+    if (TOptional<Yarn::FValue> Visits = FindUncollectedVisits(name))
+    {
+        return MoveTemp(Visits.GetValue());
+    }
+    return Variables.Find(name).Get(Yarn::FValue());
 }
 
 
 void UYarnSubsystem::ClearValue(const FString& name)
 {
-    Variables.Remove(name);
+    Variables.Update([this, &name](FYarnVariableMap& Map)
+    {
+        if (!Map.Remove(name))
+        {
+            return;
+        }
+
+        UpdateVisitCounter(name, Map);
+        if (VariableJournal)
+        {
+            VariableJournal->RecordClear(name, Map);
+        }
+    });
+}
+
+
+double UYarnSubsystem::AddToNumber(const FString& name, const double delta)
+{
+    double Result = delta;
+    Variables.Update([this, &name, &Result, delta](FYarnVariableMap& Map)
+    {
+        // Adds to the visit count the counters have, if it's a visit variable
+        CollectVisits(Map);
+
+        const Yarn::FValue* Value = Map.Find(name);
+        if (Value && Value->GetType() == Yarn::FValue::EValueType::Number)
+        {
+            Result = Value->GetValue<double>() + delta;
+        }
+
+        Map.Set(name, Yarn::FValue(Result));
+        UpdateVisitCounter(name, Map);
+        if (VariableJournal)
+        {
+            VariableJournal->RecordSet(name, Yarn::FValue(Result), Map);
+        }
+    });
+    return Result;
+}
+
+
+TOptional<uint64> UYarnSubsystem::GetChangeCount()
+{
+    return Variables.GetChangeCount();
+}
+
+
+void UYarnSubsystem::SetVariable(const FString& Name, const Yarn::FValue& Value)
+{
+    Variables.Update([this, &Name, &Value](FYarnVariableMap& Map)
+    {
+        Map.Set(Name, Value);
+        UpdateVisitCounter(Name, Map);
+        if (VariableJournal)
+        {
+            VariableJournal->RecordSet(Name, Value, Map);
+        }
+    });
+}
+
+
+TSharedPtr<Yarn::VisitCounters> UYarnSubsystem::GetVisitCounters(const TSharedRef<const Yarn::RuntimeContext>& Context)
+{
+    TSharedPtr<Yarn::VisitCounters> Counters;
+
+    // Seeded inside an update, so no change to the visit variables can slip in before they're being kept in step
+    Variables.Update([this, &Context, &Counters](FYarnVariableMap& Map)
+    {
+        if (const TSharedRef<Yarn::VisitCounters>* Existing = VisitCountersByProgram.Find(Context->GetProgramHash()))
+        {
+            Counters = *Existing;
+            return;
+        }
+
+        // Seeded from the latest counts, which for nodes other programs share may only be in their counters so far
+        CollectVisits(Map);
+        const TSharedRef<Yarn::VisitCounters> NewCounters = MakeShared<Yarn::VisitCounters>(Context);
+        SeedVisitCounters(*NewCounters, Map);
+
+        FRWScopeLock Lock(VisitCountersLock, SLT_Write);
+        VisitCountersByProgram.Add(Context->GetProgramHash(), NewCounters);
+        Counters = NewCounters;
+    });
+    return Counters;
+}
+
+
+void UYarnSubsystem::UpdateVisitCounter(const FString& Name, const FYarnVariableMap& Map)
+{
+    if (VisitCountersByProgram.Num() == 0 || !Name.StartsWith(Yarn::Library::VisitedVariablePrefix, ESearchCase::CaseSensitive))
+    {
+        return;
+    }
+
+    for (const TPair<uint32, TSharedRef<Yarn::VisitCounters>>& Pair : VisitCountersByProgram)
+    {
+        const int32 NodeIndex = Pair.Value->FindNodeForVariable(Name);
+        if (NodeIndex != INDEX_NONE)
+        {
+            Pair.Value->Set(NodeIndex, Map.Find(Name));
+        }
+    }
+}
+
+
+void UYarnSubsystem::SeedVisitCounters(Yarn::VisitCounters& Counters, const FYarnVariableMap& Map)
+{
+    const Yarn::RuntimeContext& Context = Counters.GetContext();
+    for (int32 NodeIndex = 0; NodeIndex < Context.GetNumNodes(); ++NodeIndex)
+    {
+        Counters.Set(NodeIndex, Map.Find(Context.GetNode(NodeIndex).visitVariable));
+    }
 }
 
 
+void UYarnSubsystem::CollectVisits()
+{
+    bool bHasUncollectedVisits = false;
+    {
+        FRWScopeLock Lock(VisitCountersLock, SLT_ReadOnly);
+        for (const TPair<uint32, TSharedRef<Yarn::VisitCounters>>& Pair : VisitCountersByProgram)
+        {
+            bHasUncollectedVisits |= Pair.Value->HasUncollectedVisits();
+        }
+    }
+
+    // Nothing to write most frames, so the variables are only updated when there is
+    if (bHasUncollectedVisits)
+    {
+        Variables.Update([this](FYarnVariableMap& Map)
+        {
+            CollectVisits(Map);
+        });
+    }
+}
+
+
+void UYarnSubsystem::CollectVisits(FYarnVariableMap& Map)
+{
+    for (const TPair<uint32, TSharedRef<Yarn::VisitCounters>>& Pair : VisitCountersByProgram)
+    {
+        const Yarn::RuntimeContext& Context = Pair.Value->GetContext();
+        Pair.Value->CollectVisits([this, &Map, &Pair, &Context](const int32 NodeIndex, const double Count)
+        {
+            const FString& Name = Context.GetNode(NodeIndex).visitVariable;
+            Map.Set(Name, Yarn::FValue(Count));
+            if (VariableJournal)
+            {
+                VariableJournal->RecordSet(Name, Yarn::FValue(Count), Map);
+            }
+
+            // Other programs with the same node see the new count too. The collected counter itself is left alone, as
+            // setting it could undo a visit added since.
+            for (const TPair<uint32, TSharedRef<Yarn::VisitCounters>>& Other : VisitCountersByProgram)
+            {
+                const int32 OtherNodeIndex = Other.Key != Pair.Key ? Other.Value->FindNodeForVariable(Name) : INDEX_NONE;
+                if (OtherNodeIndex != INDEX_NONE)
+                {
+                    Other.Value->Set(OtherNodeIndex, Map.Find(Name));
+                }
+            }
+        });
+    }
+}
+
+
+TOptional<Yarn::FValue> UYarnSubsystem::FindUncollectedVisits(const FString& Name) const
+{
+    if (!Name.StartsWith(Yarn::Library::VisitedVariablePrefix, ESearchCase::CaseSensitive))
+    {
+        return {};
+    }
+
+    FRWScopeLock Lock(VisitCountersLock, SLT_ReadOnly);
+    for (const TPair<uint32, TSharedRef<Yarn::VisitCounters>>& Pair : VisitCountersByProgram)
+    {
+        const int32 NodeIndex = Pair.Value->FindNodeForVariable(Name);
+        if (NodeIndex != INDEX_NONE && Pair.Value->IsUncollected(NodeIndex))
+        {
+            return Yarn::FValue(Pair.Value->Get(NodeIndex));
+        }
+    }
+    return {};
+}
+
+
+FYarnVariableWatchHandle UYarnSubsystem::WatchVariable(const FString& Name, FVariableChangedCallback&& Callback)
+{
+    return AddVariableWatcher(Name, false, MoveTemp(Callback));
+}
 
 
+FYarnVariableWatchHandle UYarnSubsystem::WatchVariablePrefix(const FString& Prefix, FVariableChangedCallback&& Callback)
+{
+    return AddVariableWatcher(Prefix, true, MoveTemp(Callback));
+}
+
+
+FYarnVariableWatchHandle UYarnSubsystem::WatchVariables(const FString& NameOrPrefix, const bool bIsPrefix, FYarnVariableChangedDelegate Callback)
+{
+    return AddVariableWatcher(NameOrPrefix, bIsPrefix, [Callback = MoveTemp(Callback)](const FString& Name, const Yarn::FValue*)
+    {
+        Callback.ExecuteIfBound(Name);
+    });
+}
+
+
+bool UYarnSubsystem::UnwatchVariables(const FYarnVariableWatchHandle Handle)
+{
+    FVariableWatcher Watcher;
+    if (!VariableWatchers.RemoveAndCopyValue(Handle.ID, Watcher))
+    {
+        return false;
+    }
+
+    if (Watcher.bIsPrefix)
+    {
+        PrefixVariableWatchers.Remove(Handle.ID);
+    }
+    else
+    {
+        VariableWatchersByName.RemoveSingle(Watcher.NameOrPrefix, Handle.ID);
+    }
+    return true;
+}
+
+
+FYarnVariableWatchHandle UYarnSubsystem::AddVariableWatcher(const FString& NameOrPrefix, const bool bIsPrefix, FVariableChangedCallback&& Callback)
+{
+    FYarnVariableWatchHandle Handle;
+    Handle.ID = ++LastVariableWatcherID;
+
+    if (bIsPrefix)
+    {
+        PrefixVariableWatchers.Add(Handle.ID);
+    }
+    else
+    {
+        VariableWatchersByName.Add(NameOrPrefix, Handle.ID);
+    }
+
+    VariableWatchers.Add(Handle.ID, {NameOrPrefix, bIsPrefix, MoveTemp(Callback)});
+    return Handle;
+}
+
+
+void UYarnSubsystem::DispatchVariableChanges()
+{
+    // Anything a watcher changes goes out next time
+    if (bIsDispatchingVariableChanges)
+    {
+        return;
+    }
+
+    const FYarnVariableMap Current = Variables.Snapshot();
+    if (Current.IsSameAs(DispatchedVariables))
+    {
+        return;
+    }
+
+    const FYarnVariableMap Previous = MoveTemp(DispatchedVariables);
+    DispatchedVariables = Current;
+
+    if (VariableWatchers.Num() == 0)
+    {
+        return;
+    }
+
+    TGuardValue<bool> DispatchingGuard(bIsDispatchingVariableChanges, true);
+
+    // Watchers can watch and unwatch from their callbacks, so the ones to call are picked out before any of them are
+    TArray<uint32> WatcherIDs;
+    FYarnVariableMap::Diff(Previous, Current, [this, &WatcherIDs](const FString& Name, const Yarn::FValue*, const Yarn::FValue* After)
+    {
+        WatcherIDs.Reset();
+        VariableWatchersByName.MultiFind(Name, WatcherIDs);
+        for (const uint32 WatcherID : PrefixVariableWatchers)
+        {
+            if (Name.StartsWith(VariableWatchers[WatcherID].NameOrPrefix))
+            {
+                WatcherIDs.Add(WatcherID);
+            }
+        }
+
+        for (const uint32 WatcherID : WatcherIDs)
+        {
+            if (const FVariableWatcher* Watcher = VariableWatchers.Find(WatcherID))
+            {
+                // Copied, in case the callback unwatches itself
+                const FVariableChangedCallback Callback = Watcher->Callback;
+                Callback(Name, After);
+            }
+        }
+    });
+}
+
+
+bool UYarnSubsystem::EnableVariableJournal(const FString& Directory)
+{
+    DisableVariableJournal();
+
+    TUniquePtr<FYarnVariableJournal> Journal = MakeUnique<FYarnVariableJournal>(Directory.IsEmpty() ? FPaths::Combine(FPaths::ProjectSavedDir(), TEXT("YarnSpinner"), TEXT("Variables")) : Directory);
+
+    // The variables in memory are only replaced once the journal is known to be working
+    FYarnVariableMap Recovered;
+    if (!Journal->Open(Recovered))
+    {
+        return false;
+    }
+
+    // Workers only use the journal from inside an update
+    Variables.Update([this, &Recovered, &Journal](FYarnVariableMap& Map)
+    {
+        Map = MoveTemp(Recovered);
+        for (const TPair<uint32, TSharedRef<Yarn::VisitCounters>>& Pair : VisitCountersByProgram)
+        {
+            SeedVisitCounters(*Pair.Value, Map);
+        }
+
+        VariableJournal = MoveTemp(Journal);
+    });
+    return true;
+}
+
+
+void UYarnSubsystem::DisableVariableJournal()
+{
+    TUniquePtr<FYarnVariableJournal> Journal;
+    Variables.Update([this, &Journal](FYarnVariableMap& Map)
+    {
+        // So the journal doesn't close without the last visits in it
+        CollectVisits(Map);
+        Journal = MoveTemp(VariableJournal);
+    });
+
+    // Closing flushes, and waits for any checkpoint being written
+    Journal.Reset();
+}
+
+
+bool UYarnSubsystem::FlushVariableJournal()
+{
+    if (!VariableJournal)
+    {
+        return false;
+    }
+
+    CollectVisits();
+    return VariableJournal->Flush();
+}
+
+
+FYarnVariableSnapshot UYarnSubsystem::SnapshotVariables() const
+{
+    FYarnVariableSnapshot Snapshot;
+    Snapshot.Variables = Variables.Snapshot();
+
+    // Visits the variables don't have yet go in the snapshot's copy, leaving the variables themselves alone
+    FRWScopeLock Lock(VisitCountersLock, SLT_ReadOnly);
+    for (const TPair<uint32, TSharedRef<Yarn::VisitCounters>>& Pair : VisitCountersByProgram)
+    {
+        const Yarn::RuntimeContext& Context = Pair.Value->GetContext();
+        for (int32 NodeIndex = 0; NodeIndex < Context.GetNumNodes(); ++NodeIndex)
+        {
+            if (Pair.Value->IsUncollected(NodeIndex))
+            {
+                Snapshot.Variables.Set(Context.GetNode(NodeIndex).visitVariable, Yarn::FValue(Pair.Value->Get(NodeIndex)));
+            }
+        }
+    }
+    return Snapshot;
+}
+
+
+void UYarnSubsystem::RestoreVariables(const FYarnVariableSnapshot& Snapshot)
+{
+    Variables.Update([this, &Snapshot](FYarnVariableMap& Map)
+    {
+        // Collected first, so a visit variable the snapshot changes is journalled as changing from its latest count
+        CollectVisits(Map);
+        const FYarnVariableMap Previous = MoveTemp(Map);
+        Map = Snapshot.Variables;
+
+        if (VariableJournal || VisitCountersByProgram.Num() > 0)
+        {
+            // Only what differs is journalled, and Diff skips everything the two maps still share
+            FYarnVariableMap::Diff(Previous, Map, [this, &Map](const FString& Name, const Yarn::FValue*, const Yarn::FValue* After)
+            {
+                UpdateVisitCounter(Name, Map);
+                if (!VariableJournal)
+                {
+                    return;
+                }
+
+                if (After)
+                {
+                    VariableJournal->RecordSet(Name, *After, Map);
+                }
+                else
+                {
+                    VariableJournal->RecordClear(Name, Map);
+                }
+            });
+        }
+    });
+}
+
+
+TArray<FString> UYarnSubsystem::DiffVariableSnapshots(const FYarnVariableSnapshot& From, const FYarnVariableSnapshot& To)
+{
+    TArray<FString> Changed;
+    FYarnVariableMap::Diff(From.Variables, To.Variables, [&Changed](const FString& Name, const Yarn::FValue*, const Yarn::FValue*)
+    {
+        Changed.Add(Name);
+    });
+    return Changed;
+}
@@ -0,0 +1,299 @@
+#include "YarnWorkerDialogue.h"
+
+#include "Async/Async.h"
+#include "Library/YarnLibraryRegistry.h"
+#include "Misc/YSLogging.h"
+
+
+namespace
+{
+    // Runs Work on the game thread and blocks until it has. Only for workers: the game thread never waits on them
+    // without pumping its own tasks.
+    template <typename ResultType>
+    ResultType RunOnGameThread(TFunctionRef<ResultType()> Work)
+    {
+        if (IsInGameThread())
+        {
+            return Work();
+        }
+
+        TPromise<ResultType> Promise;
+        TFuture<ResultType> Future = Promise.GetFuture();
+
+        AsyncTask(ENamedThreads::GameThread, [Promise = MoveTemp(Promise), Work]() mutable
+        {
+            Promise.SetValue(Work());
+        });
+
+        return Future.Get();
+    }
+}
+
+
+// Runs on the worker, queueing content for Drain and looking after function calls
+class FYarnWorkerDialogue::FWorkerSink final : public Yarn::IDialogueSink
+{
+public:
+    explicit FWorkerSink(FYarnWorkerDialogue& InOwner) : Owner(InOwner) {}
+
+    virtual void HandleLine(const Yarn::Line& Line) override
+    {
+        FContent Item;
+        Item.Type = FContent::EType::Line;
+        Item.Line = Line;
+        Owner.Content.Enqueue(MoveTemp(Item));
+    }
+
+    virtual void HandleOptions(const Yarn::OptionSet& Options) override
+    {
+        FContent Item;
+        Item.Type = FContent::EType::Options;
+        Item.Options = Options;
+        Owner.Content.Enqueue(MoveTemp(Item));
+    }
+
+    virtual void HandleCommand(const Yarn::Command& Command) override
+    {
+        FContent Item;
+        Item.Type = FContent::EType::Command;
+        Item.Command = Command;
+        Owner.Content.Enqueue(MoveTemp(Item));
+    }
+
+    virtual void HandleNodeStart(const FString& NodeName) override
+    {
+        FContent Item;
+        Item.Type = FContent::EType::NodeStart;
+        Item.NodeName = NodeName;
+        Owner.Content.Enqueue(MoveTemp(Item));
+    }
+
+    virtual void HandleNodeComplete(const FString& NodeName) override
+    {
+        FContent Item;
+        Item.Type = FContent::EType::NodeComplete;
+        Item.NodeName = NodeName;
+        Owner.Content.Enqueue(MoveTemp(Item));
+    }
+
+    virtual void HandleDialogueComplete() override
+    {
+        FContent Item;
+        Item.Type = FContent::EType::DialogueComplete;
+        Owner.Content.Enqueue(MoveTemp(Item));
+    }
+
+    virtual bool IsCommandBlocking(const FName Name) override
+    {
+        const UYarnLibraryRegistry* Registry = Owner.LibraryRegistry;
+        if (!Registry)
+        {
+            return true;
+        }
+
+        // Asking the game thread for every command would stall the worker, and commands don't change mid-dialogue
+        if (const bool* bIsBlocking = CommandBlocking.Find(Name))
+        {
+            return *bIsBlocking;
+        }
+        const bool bIsBlocking = RunOnGameThread<bool>([Registry, Name] { return Registry->IsCommandBlocking(Name); });
+        CommandBlocking.Add(Name, bIsBlocking);
+        return bIsBlocking;
+    }
+
+    virtual bool HasFunction(const FName Name) override
+    {
+        const UYarnLibraryRegistry* Registry = Owner.LibraryRegistry;
+        if (!Registry)
+        {
+            return false;
+        }
+        if (Registry->IsThreadSafeFunction(Name))
+        {
+            return true;
+        }
+        return RunOnGameThread<bool>([Registry, Name] { return Registry->HasFunction(Name); });
+    }
+
+    virtual int GetExpectedFunctionParamCount(const FName Name) override
+    {
+        const UYarnLibraryRegistry* Registry = Owner.LibraryRegistry;
+        if (Registry->IsThreadSafeFunction(Name))
+        {
+            return Registry->GetExpectedFunctionParamCount(Name);
+        }
+        return RunOnGameThread<int>([Registry, Name] { return Registry->GetExpectedFunctionParamCount(Name); });
+    }
+
+    virtual Yarn::FValue HandleFunctionCall(const FName Name, const TArray<Yarn::FValue>& Parameters) override
+    {
+        const UYarnLibraryRegistry* Registry = Owner.LibraryRegistry;
+        if (Registry->IsThreadSafeFunction(Name))
+        {
+            if (const FYarnAsyncLibFunction* AsyncFunction = Registry->FindAsyncFunction(Name))
+            {
+                TFuture<Yarn::FValue> AsyncResult = AsyncFunction->Function(Parameters);
+                return AsyncFunction->Wait(AsyncResult);
+            }
+            return Registry->CallFunction(Name, Parameters);
+        }
+
+        // Async functions are started on the game thread like the rest, but waited for here so it isn't held up
+        FYarnAsyncLibFunction AsyncFunction;
+        TSharedPtr<TFuture<Yarn::FValue>> AsyncResult;
+
+        const Yarn::FValue Result = RunOnGameThread<Yarn::FValue>([Registry, Name, &Parameters, &AsyncFunction, &AsyncResult]
+        {
+            if (const FYarnAsyncLibFunction* Found = Registry->FindAsyncFunction(Name))
+            {
+                AsyncFunction = *Found;
+                AsyncResult = MakeShared<TFuture<Yarn::FValue>>(Found->Function(Parameters));
+                return Yarn::FValue();
+            }
+            return Registry->CallFunction(Name, Parameters);
+        });
+
+        return AsyncResult ? AsyncFunction.Wait(*AsyncResult) : Result;
+    }
+
+private:
+    FYarnWorkerDialogue& Owner;
+
+    // Only touched by the worker
+    TMap<FName, bool> CommandBlocking;
+};
+
+
+FYarnWorkerDialogue::FYarnWorkerDialogue(const TSharedRef<const Yarn::RuntimeContext>& Context, Yarn::IVariableStorage& VariableStorage, const UYarnLibraryRegistry* InLibraryRegistry)
+    : LibraryRegistry(InLibraryRegistry)
+    , WorkerSink(MakeUnique<FWorkerSink>(*this))
+    , VirtualMachine(MakeUnique<Yarn::VirtualMachine>(Context, VariableStorage))
+{
+    VirtualMachine->SetDialogueSink(WorkerSink.Get());
+}
+
+
+FYarnWorkerDialogue::~FYarnWorkerDialogue() = default;
+
+
+bool FYarnWorkerDialogue::SetNode(const FString& NodeName)
+{
+    check(IsInGameThread());
+
+    if (!IsIdle())
+    {
+        YS_WARN("Can't set node %s while the dialogue is running on a worker.", *NodeName);
+        return false;
+    }
+
+    return VirtualMachine->SetNode(NodeName);
+}
+
+
+void FYarnWorkerDialogue::Continue()
+{
+    Post(FRequest());
+}
+
+
+void FYarnWorkerDialogue::SetSelectedOption(const int32 OptionID)
+{
+    FRequest Request;
+    Request.OptionID = OptionID;
+    Post(Request);
+}
+
+
+int32 FYarnWorkerDialogue::Drain(Yarn::IDialogueSink& Sink)
+{
+    check(IsInGameThread());
+
+    int32 Delivered = 0;
+
+    FContent Item;
+    while (Content.Dequeue(Item))
+    {
+        switch (Item.Type)
+        {
+        case FContent::EType::Line:
+            Sink.HandleLine(Item.Line);
+            break;
+        case FContent::EType::Options:
+            Sink.HandleOptions(Item.Options);
+            break;
+        case FContent::EType::Command:
+            Sink.HandleCommand(Item.Command);
+            break;
+        case FContent::EType::NodeStart:
+            Sink.HandleNodeStart(Item.NodeName);
+            break;
+        case FContent::EType::NodeComplete:
+            Sink.HandleNodeComplete(Item.NodeName);
+            break;
+        case FContent::EType::DialogueComplete:
+            Sink.HandleDialogueComplete();
+            break;
+        }
+        ++Delivered;
+    }
+
+    return Delivered;
+}
+
+
+void FYarnWorkerDialogue::Wait()
+{
+    check(IsInGameThread());
+
+    // Waiting as the game thread keeps its queue running, so a worker blocked on a Blueprint function still finishes
+    while (!IsIdle() && WorkerTask.IsValid())
+    {
+        FTaskGraphInterface::Get().WaitUntilTaskCompletes(WorkerTask, ENamedThreads::GameThread);
+    }
+}
+
+
+void FYarnWorkerDialogue::Post(const FRequest& Request)
+{
+    check(IsInGameThread());
+
+    Requests.Enqueue(Request);
+
+    // Only start a worker if there isn't one already; a running worker picks the request up before it finishes
+    if (PendingRequests.fetch_add(1) == 0)
+    {
+        WorkerTask = FFunctionGraphTask::CreateAndDispatchWhenReady([This = AsShared()]
+        {
+            This->ProcessRequests();
+        }, TStatId(), nullptr, ENamedThreads::AnyBackgroundThreadNormalTask);
+    }
+}
+
+
+void FYarnWorkerDialogue::ProcessRequests()
+{
+    do
+    {
+        FRequest Request;
+        verify(Requests.Dequeue(Request));
+
+        if (Request.OptionID != INDEX_NONE)
+        {
+            VirtualMachine->SetSelectedOption(Request.OptionID);
+        }
+
+        if (VirtualMachine->GetCurrentExecutionState() == Yarn::VirtualMachine::ERROR)
+        {
+            YS_ERR("VirtualMachine is in an error state and cannot continue running.");
+            continue;
+        }
+
+        if (!VirtualMachine->Continue())
+        {
+            // Nobody on the game thread can see the VM's state, so end the dialogue rather than leave it waiting
+            YS_WARN("Dialogue running on a worker stopped because of an error.");
+            WorkerSink->HandleDialogueComplete();
+        }
+    }
+    while (PendingRequests.fetch_sub(1) > 1);
+}
@@ -5,10 +5,15 @@
 #include "CoreMinimal.h"
 #include "GameFramework/Actor.h"
 #include "YarnProject.h"
+#include "Line.h"
+#include "Option.h"
+#include "YarnDialoguePrewarm.h"
+#include "YarnDialogueScheduler.h"
+#include "YarnLatentScheduler.h"
+#include "Misc/YarnLineTextCache.h"
 
 THIRD_PARTY_INCLUDES_START
 #include "YarnSpinnerCore/VirtualMachine.h"
-#include "YarnSpinnerCore/Library.h"
 #include "YarnSpinnerCore/Common.h"
 THIRD_PARTY_INCLUDES_END
 
@@ -17,7 +22,7 @@ THIRD_PARTY_INCLUDES_END
 DECLARE_DELEGATE(FYarnDialogueRunnerContinueDelegate);
 
 UCLASS(BlueprintType)
-class YARNSPINNER_API ADialogueRunner : public AActor, public Yarn::IVariableStorage
+class YARNSPINNER_API ADialogueRunner : public AActor, public Yarn::IVariableStorage, public Yarn::IDialogueSink
 {
     GENERATED_BODY()
     
@@ -27,6 +32,7 @@ public:
 
 protected:
     virtual void BeginPlay() override;
+    virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
     
 public:
     UFUNCTION(BlueprintNativeEvent, Category="Dialogue Runner")
@@ -35,23 +41,77 @@ public:
     UFUNCTION(BlueprintNativeEvent, Category="Dialogue Runner")
     void OnDialogueEnded();
     
+    // Called for every line. The default implementation passes the line on to OnRunLine as a ULine.
+    UFUNCTION(BlueprintNativeEvent, Category="Dialogue Runner")
+    void OnRunYarnLine(const FYarnLine& Line, const TArray<TSoftObjectPtr<UObject>>& LineAssets);
+
+    // Called for every set of options. The default implementation passes them on to OnRunOptions as UOptions.
+    UFUNCTION(BlueprintNativeEvent, Category="Dialogue Runner")
+    void OnRunYarnOptions(const TArray<FYarnOption>& Options);
+
+    // Compatibility path for runners that haven't moved to OnRunYarnLine. With bReuseLineObjects set, the ULine is
+    // recycled for the next line, so copy out anything that needs to outlive it.
     UFUNCTION(BlueprintNativeEvent, Category="Dialogue Runner")
     void OnRunLine(class ULine* Line, const TArray<TSoftObjectPtr<UObject>>& LineAssets);
 
+    // Compatibility path for runners that haven't moved to OnRunYarnOptions. With bReuseLineObjects set, the UOptions
+    // are recycled for the next set of options.
     UFUNCTION(BlueprintNativeEvent, Category="Dialogue Runner")
     void OnRunOptions(const TArray<class UOption*>& Options);
 
     UFUNCTION(BlueprintNativeEvent, Category="Dialogue Runner")
     void OnRunCommand(const FString& Command, const TArray<FString>& Parameters);
+
+    // Called with every batch of content when bBatchContent is set: the lines and non-blocking commands up to the next
+    // blocking command, set of options or the end of the dialogue, and that command if there is one. Call
+    // ContinueDialogue once the whole batch has been presented. The default implementation passes the items to
+    // OnRunYarnLine and OnRunCommand one at a time, treating each ContinueDialogue as the acknowledgement of one item,
+    // and moves past non-blocking commands by itself.
+    UFUNCTION(BlueprintNativeEvent, Category="Dialogue Runner")
+    void OnRunYarnContentBatch(const TArray<FYarnContent>& Content);
     
     UFUNCTION(BlueprintCallable, Category="Dialogue Runner")
     void StartDialogue(FName NodeName);
+
+    // Runs NodeName up to its first line or options ahead of time, e.g. when the player walks up to someone, so that
+    // StartDialogue with the same node can present it straight away. The result is thrown away if a variable it read
+    // changes before then, or if the node runs a command or a function that isn't pure on the way.
+    UFUNCTION(BlueprintCallable, Category="Dialogue Runner")
+    void PrewarmDialogue(FName NodeName);
     
+    // Continues this runner's dialogue through the Yarn subsystem's scheduler: straight away while the frame's dialogue
+    // budget has room, otherwise in a later frame. Calling it from inside OnRunYarnLine or OnRunCommand always continues
+    // straight away.
     UFUNCTION(BlueprintCallable, Category="Dialogue Runner")
     void ContinueDialogue();
 
-    // TODO: add StopDialogue() blueprint callback
+    // For commands that take a while: continues the dialogue after Seconds of game time, unless it's stopped first.
+    // Call it instead of ContinueDialogue from the command.
+    UFUNCTION(BlueprintCallable, Category="Dialogue Runner")
+    void ContinueDialogueAfter(float Seconds);
+
+    // Ends the running dialogue straight away, cancelling anything it was waiting on, and calls OnDialogueEnded
+    UFUNCTION(BlueprintCallable, Category="Dialogue Runner")
+    void StopDialogue();
+
+    UFUNCTION(BlueprintPure, Category="Dialogue Runner")
+    bool IsDialogueRunning() const { return bIsDialogueRunning; }
+
+    // Writes where the running dialogue is up to, for a save game. Fails while content is on its way to the runner,
+    // i.e. from inside OnRunYarnLine or OnRunCommand, while a batch is being presented or while a continue is queued.
+    UFUNCTION(BlueprintCallable, Category="Dialogue Runner")
+    bool SaveDialogueState(TArray<uint8>& OutData);
+
+    // Stops any running dialogue and carries on from data written by SaveDialogueState, presenting the line or options
+    // it was waiting on again. Fails without touching the running dialogue if the data is damaged or the Yarn project
+    // has changed since it was saved.
+    UFUNCTION(BlueprintCallable, Category="Dialogue Runner")
+    bool LoadDialogueState(const TArray<uint8>& Data);
     
+    // Selects an option by its index in the array passed to OnRunYarnOptions
+    UFUNCTION(BlueprintCallable, Category="Dialogue Runner")
+    void SelectOptionByIndex(int32 OptionIndex);
+
     UFUNCTION(BlueprintCallable, Category="Dialogue Runner")
     void SelectOption(UOption* Option);
     
@@ -61,13 +121,88 @@ public:
     UPROPERTY(EditInstanceOnly, BlueprintReadWrite, Category="Dialogue Runner")
     bool bRunLinesForSelectedOptions = true;
 
+    // Reuses the ULine and UOptions passed to OnRunLine and OnRunOptions instead of creating new ones for every
+    // delivery. Only turn this on if nothing holds on to them, e.g. for a history log.
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dialogue Runner")
+    bool bReuseLineObjects = false;
+
+    // Runs ahead to the next command, options or end of dialogue and delivers everything before it to
+    // OnRunYarnContentBatch at once. Read in BeginPlay.
+    UPROPERTY(EditAnywhere, BlueprintReadOnly, Category="Dialogue Runner")
+    bool bBatchContent = false;
+
+    // Variables whose names start with this last for one conversation: they're kept by this runner rather than the
+    // Yarn subsystem, and cleared whenever dialogue starts. Empty by default, which keeps every variable in the
+    // subsystem; set it to something like "$conversation_" to turn this on. Read in BeginPlay.
+    UPROPERTY(EditAnywhere, BlueprintReadOnly, Category="Dialogue Runner")
+    FString ConversationVariablePrefix;
+
+    // Variables whose names start with this belong to this runner, e.g. one NPC's own state, and last as long as it
+    // does. Only variables the Yarn project uses are kept here; anything else goes to the subsystem. Empty by
+    // default; set it to something like "$runner_" to turn this on. Read in BeginPlay.
+    UPROPERTY(EditAnywhere, BlueprintReadOnly, Category="Dialogue Runner")
+    FString RunnerVariablePrefix;
+
+    // When the subsystem has more dialogue to run than fits in a frame, higher priority runners go first
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dialogue Runner")
+    EYarnDialoguePriority Priority = EYarnDialoguePriority::Player;
+
+    // Seeds random(), random_range() and dice() in this runner's dialogue, so that a simulation or replay draws the
+    // same numbers every time. 0 picks a different seed every play. Read in BeginPlay; SaveDialogueState saves where
+    // the numbers are up to.
+    UPROPERTY(EditAnywhere, BlueprintReadOnly, Category="Dialogue Runner")
+    int32 RandomSeed = 0;
+
+    // Starts this runner's random numbers again from Seed
+    UFUNCTION(BlueprintCallable, Category="Dialogue Runner")
+    void SetRandomSeed(int32 Seed);
+
 private:
     TUniquePtr<Yarn::VirtualMachine> VirtualMachine;
 
-    TUniquePtr<Yarn::Library> Library;
-
     FYarnDialogueRunnerContinueDelegate ContinueDelegate;
 
+    // From StartDialogue until the dialogue completes or is stopped
+    bool bIsDialogueRunning = false;
+
+    // Set while a continue is waiting in the scheduler, so asking twice doesn't skip a line
+    bool bIsContinueQueued = false;
+
+    // Set while the VM is running, i.e. while one of our handlers is being called
+    bool bIsRunningVirtualMachine = false;
+
+    // Set while a non-blocking command runs; dialogue doesn't wait for those, so a continue from one is ignored
+    bool bIsRunningNonBlockingCommand = false;
+
+    void RunVirtualMachine(bool bIsScheduled);
+
+    // The line being presented, kept so that LoadDialogueState can present it again
+    Yarn::Line PresentedLine;
+    bool bIsPresentingLine = false;
+
+    // From PrewarmDialogue until the next StartDialogue
+    TUniquePtr<FYarnDialoguePrewarm> Prewarm;
+    bool bIsPrewarmQueued = false;
+
+    void RunPrewarm();
+    bool StartPrewarmedDialogue(FYarnDialoguePrewarm& Prewarmed);
+
+    // Identifies the async function call being waited on. Bumped when its result or timeout arrives, or the dialogue
+    // stops, so whichever comes later is ignored.
+    uint32 AsyncFunctionSerial = 0;
+    FYarnLatentHandle AsyncFunctionTimeout;
+
+    void ReceiveFunctionResult(uint32 Serial, const Yarn::FValue& Result);
+
+    // The batch being presented, if any
+    TArray<FYarnContent> ContentBatch;
+
+    // The item being presented by the default OnRunYarnContentBatch, or INDEX_NONE if the batch is presented as a whole
+    int32 ContentBatchIndex = INDEX_NONE;
+
+    void PresentContentBatchItem();
+    void RunCommand(const FString& CommandName, const TArray<FString>& Parameters);
+
     // IVariableStorage
     virtual void SetValue(const FString& Name, bool bValue) override;
     virtual void SetValue(const FString& Name, float Value) override;
@@ -77,11 +212,68 @@ private:
     virtual Yarn::FValue GetValue(const FString& Name) override;
 
     virtual void ClearValue(const FString& Name) override;
+    virtual double AddToNumber(const FString& Name, double Delta) override;
+    virtual bool GetSlotValue(int32 Slot, TOptional<Yarn::FValue>& OutValue) override;
+    virtual bool SetSlotValue(int32 Slot, const Yarn::FValue& Value) override;
+    virtual TOptional<uint64> GetChangeCount() override;
+    virtual TSharedPtr<Yarn::VisitCounters> GetVisitCounters(const TSharedRef<const Yarn::RuntimeContext>& Context) override;
+
+    struct FLocalVariable
+    {
+        FString Name;
+        TOptional<Yarn::FValue> Value;
+        bool bIsConversationVariable = false;
+    };
+
+    // Conversation and runner variables, which never touch the subsystem. The VM finds them by slot through
+    // LocalVariableIndices, worked out once in BeginPlay; anything else finds them by name.
+    TArray<FLocalVariable> LocalVariables;
+    TArray<int32> LocalVariableIndices;
+    TMap<FString, int32> LocalVariablesByName;
+
+    // Goes up whenever a local variable changes; see GetChangeCount
+    uint64 LocalVariableChanges = 0;
+
+    void LinkLocalVariables(const Yarn::RuntimeContext& Context);
+    FLocalVariable* FindLocalVariable(const FString& Name);
+    void ResetConversationVariables();
+
+    // IDialogueSink
+    virtual void HandleLine(const Yarn::Line& Line) override;
+    virtual void HandleOptions(const Yarn::OptionSet& OptionSet) override;
+    virtual void HandleCommand(const Yarn::Command& Command) override;
+    virtual void HandleNodeStart(const FString& NodeName) override;
+    virtual void HandleNodeComplete(const FString& NodeName) override;
+    virtual void HandleDialogueComplete() override;
+    virtual void HandleContentBatch(const TArray<Yarn::ContentItem>& Batch) override;
+    virtual bool IsCommandBlocking(FName CommandName) override;
+
+    virtual bool HasFunction(FName FunctionName) override;
+    virtual int GetExpectedFunctionParamCount(FName FunctionName) override;
+    virtual Yarn::FValue HandleFunctionCall(FName FunctionName, const TArray<Yarn::FValue>& Parameters) override;
+    virtual bool IsAsyncFunction(FName FunctionName) override;
+    virtual bool IsPureFunction(FName FunctionName) override;
+    virtual void HandleAsyncFunctionCall(FName FunctionName, const TArray<Yarn::FValue>& Parameters) override;
 
     UPROPERTY()
     FString Blah;
 
     class UYarnSubsystem* YarnSubsystem() const;
+
+    // Set in BeginPlay, so looking the subsystem up doesn't go through the game instance every time
+    TWeakObjectPtr<class UYarnSubsystem> CachedYarnSubsystem;
     
-    void UpdateDisplayTextForLine(ULine* const Line, const Yarn::Line& YarnLine) const;
+    void UpdateDisplayTextForLine(FYarnLine& Line, const Yarn::Line& YarnLine) const;
+
+    // The options waiting on a selection
+    TArray<FYarnOption> CurrentOptions;
+
+    // Objects handed to OnRunLine and OnRunOptions, reused from one delivery to the next when bReuseLineObjects is set
+    UPROPERTY(Transient)
+    TObjectPtr<ULine> PooledLine;
+
+    UPROPERTY(Transient)
+    TArray<TObjectPtr<UOption>> PooledOptions;
+
+    mutable FYarnLineTextCache LineTextCache;
 };
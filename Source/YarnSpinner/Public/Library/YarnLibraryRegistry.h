@@ -3,6 +3,7 @@
 #pragma once
 
 #include "CoreMinimal.h"
+#include "Async/Future.h"
 #include "UObject/Object.h"
 #include "YarnSpinnerCore/Value.h"
 #include "YarnLibraryRegistry.generated.h"
@@ -35,6 +36,9 @@ struct YARNSPINNER_API FYarnBlueprintLibFunction
 
     TArray<FYarnBlueprintParam> InParams;
     TOptional<FYarnBlueprintParam> OutParam;
+
+    // Commands only; see FYSLSAction::IsBlocking
+    bool bIsBlocking = true;
 };
 
 
@@ -61,6 +65,36 @@ struct YARNSPINNER_API FYarnStdLibFunction
     FName Name;
     int32 ExpectedParamCount = 0;
     TFunction<Yarn::FValue(TArray<Yarn::FValue> Params)> Function;
+
+    // Opt-ins for functions registered with UYarnLibraryRegistry::AddNativeFunction; the standard library has both.
+    // Safe to call from any thread, so dialogue running on a worker calls it there rather than on the game thread.
+    bool bIsThreadSafe = false;
+    // The result depends only on the parameters and the call changes nothing, so the function can run ahead of time
+    // and smart variables that call it can keep their value.
+    bool bIsPure = false;
+};
+
+
+// A function that can't return straight away, e.g. because it has to load something. Registered from C++ with
+// UYarnLibraryRegistry::AddAsyncFunction; dialogue waits for the future without holding up the game thread.
+USTRUCT()
+struct YARNSPINNER_API FYarnAsyncLibFunction
+{
+    GENERATED_BODY()
+
+    FName Name;
+    int32 ExpectedParamCount = 0;
+    // Called on the game thread unless bIsThreadSafe is set. The future may be completed on any thread.
+    TFunction<TFuture<Yarn::FValue>(TArray<Yarn::FValue> Params)> Function;
+    // Seconds to wait for the result before carrying on with TimeoutValue instead
+    float TimeoutSeconds = 5.0f;
+    Yarn::FValue TimeoutValue;
+    // Function is safe to call from any thread, so dialogue running on a worker starts it there
+    bool bIsThreadSafe = false;
+
+    // Blocks until Future completes or times out, for dialogue running on a worker thread. Never call it on the game
+    // thread; dialogue there implements IDialogueSink::HandleAsyncFunctionCall instead.
+    Yarn::FValue Wait(TFuture<Yarn::FValue>& Future) const;
 };
 
 
@@ -72,6 +106,8 @@ struct YARNSPINNER_API FYarnStdLibCommand
     FName Name;
     int32 ExpectedParamCount = 0;
     TFunction<void(TSoftObjectPtr<class ADialogueRunner>, TArray<FString> Params)> Command;
+    // Blocking commands continue the dialogue runner themselves when they're done
+    bool bIsBlocking = true;
 };
 
 
@@ -90,6 +126,24 @@ public:
     bool HasFunction(const FName& Name) const;
     bool HasCommand(const FName& Name) const;
     int32 GetExpectedFunctionParamCount(const FName& Name) const;
+    // Whether a function can be called from any thread: the standard library and native and async functions flagged
+    // bIsThreadSafe. Blueprint functions have to be called on the game thread.
+    bool IsThreadSafeFunction(const FName& Name) const;
+    // Whether a function has no side effects and its result depends only on its parameters: the standard library and
+    // native functions flagged bIsPure
+    bool IsPureFunction(const FName& Name) const;
+    // Whether dialogue waits for a command to continue it. Commands the registry doesn't know are blocking, since
+    // they're left to the dialogue runner's OnRunCommand.
+    bool IsCommandBlocking(const FName& Name) const;
+    bool IsAsyncFunction(const FName& Name) const;
+    // Null unless Name is an async function. Dialogue hosts call async functions from here and wait for the future
+    // themselves; CallFunction never blocks on one, and falls back to its TimeoutValue if the result isn't ready.
+    const FYarnAsyncLibFunction* FindAsyncFunction(const FName& Name) const;
+    // Game thread only, before any dialogue that calls the function starts
+    void AddAsyncFunction(const FYarnAsyncLibFunction& Func);
+    // Registers a function implemented in C++. Game thread only, before any dialogue starts, since dialogue on worker
+    // threads looks thread-safe functions up without synchronising.
+    void AddNativeFunction(const FYarnStdLibFunction& Func);
     Yarn::FValue CallFunction(const FName& Name, TArray<Yarn::FValue> Parameters) const;
     void CallCommand(const FName& Name, TSoftObjectPtr<class ADialogueRunner> DialogueRunner, TArray<FString> UnprocessedParamStrings) const;
 
@@ -106,11 +160,10 @@ private:
     // A map of function names to lists of details of implementations
     TMap<FName, FYarnBlueprintLibFunction> AllFunctions;
     TMap<FName, FYarnStdLibFunction> StdFunctions;
+    TMap<FName, FYarnAsyncLibFunction> AsyncFunctions;
     TMap<FName, FYarnBlueprintLibFunction> AllCommands;
     TMap<FName, FYarnStdLibCommand> StdCommands;
 
-    FTimerHandle CommandTimerHandle;
-
     static UBlueprint* GetYarnFunctionLibraryBlueprint(const FAssetData& AssetData);
     static UBlueprint* GetYarnCommandLibraryBlueprint(const FAssetData& AssetData);
     void FindFunctionsAndCommands();
@@ -70,6 +70,11 @@ struct YARNSPINNER_API FYSLSAction
     // A Yarn type; either 'string', 'number', 'boolean', 'any'.
     UPROPERTY()
     FString ReturnType = "any";
+
+    // Commands only. If false, dialogue carries on as soon as the command has been called instead of waiting for it
+    // to continue the dialogue runner.
+    UPROPERTY()
+    bool IsBlocking = true;
 };
 
 
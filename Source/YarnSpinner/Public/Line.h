@@ -4,8 +4,62 @@
 
 #include "CoreMinimal.h"
 #include "UObject/NoExportTypes.h"
+#include "Misc/YarnMarkup.h"
 #include "Line.generated.h"
 
+
+/**
+ * A line of dialogue, delivered by value so that running dialogue doesn't create garbage for the GC.
+ */
+USTRUCT(BlueprintType)
+struct YARNSPINNER_API FYarnLine
+{
+    GENERATED_BODY()
+
+    UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+    FName LineID;
+
+    UPROPERTY(BlueprintReadWrite, Category="Yarn Spinner")
+    FText DisplayText;
+
+    // Markup attributes, with positions relative to DisplayText
+    UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+    TArray<FYarnMarkupAttribute> Attributes;
+};
+
+
+UENUM(BlueprintType)
+enum class EYarnContentType : uint8
+{
+    Line,
+    Command
+};
+
+
+/**
+ * A line or command from a batch of content.
+ */
+USTRUCT(BlueprintType)
+struct YARNSPINNER_API FYarnContent
+{
+    GENERATED_BODY()
+
+    UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+    EYarnContentType Type = EYarnContentType::Line;
+
+    // Set for lines
+    UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+    FYarnLine Line;
+
+    // Set for commands
+    UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+    FString Command;
+
+    UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+    TArray<FString> Parameters;
+};
+
+
 /**
  *
  */
@@ -20,4 +74,15 @@ public:
 
     UPROPERTY(BlueprintReadWrite, Category="Yarn Spinner")
     FText DisplayText;
+
+    // Markup attributes, with positions relative to DisplayText
+    UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+    TArray<FYarnMarkupAttribute> Attributes;
+
+    void SetFromYarnLine(const FYarnLine& Line)
+    {
+        LineID = Line.LineID;
+        DisplayText = Line.DisplayText;
+        Attributes = Line.Attributes;
+    }
 };
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/CriticalSection.h"
+#include "Misc/YarnVariableMap.h"
+
+#include <atomic>
+
+
+/**
+ * Variables that any number of threads can read while another writes, without reads ever taking a lock. The variables
+ * are an FYarnVariableMap, which is never changed once published: a write makes a changed copy, which only copies the
+ * nodes on the way to the variable, and publishes it in place of the old one (read-copy-update).
+ *
+ * Readers announce themselves on one of several counters, picked by thread so that readers on different cores rarely
+ * touch the same cache line, then read whichever version is published. A writer frees the version it replaced once
+ * every reader that could still be looking at it has left. Writes take turns, so Update also makes read-modify-write
+ * changes, like AddToNumber, atomic.
+ */
+class YARNSPINNER_API FYarnConcurrentVariables
+{
+public:
+    FYarnConcurrentVariables();
+    ~FYarnConcurrentVariables();
+
+    FYarnConcurrentVariables(const FYarnConcurrentVariables&) = delete;
+    FYarnConcurrentVariables& operator=(const FYarnConcurrentVariables&) = delete;
+
+    TOptional<Yarn::FValue> Find(const FString& Name) const;
+    bool Contains(const FString& Name) const;
+    int32 Num() const;
+
+    // Every variable as it is now, in O(1)
+    FYarnVariableMap Snapshot() const;
+
+    // Calls Change with a copy of the variables and publishes whatever it leaves there. Updates never overlap, and
+    // each one sees the last one's result, so Change can read a value and write one based on it.
+    void Update(TFunctionRef<void(FYarnVariableMap& Variables)> Change);
+
+    // Adds Delta to a number variable, treating one that isn't set or isn't a number as zero. Returns the new value.
+    double AddToNumber(const FString& Name, double Delta);
+
+    // Goes up after every update that changes something. A reader that sees the same count before and after reading
+    // some variables knows they haven't changed since.
+    uint64 GetChangeCount() const { return ChangeCount.load(); }
+
+private:
+    struct FVersion
+    {
+        FYarnVariableMap Variables;
+    };
+
+    static constexpr int32 NumReaderShards = 16;
+
+    struct alignas(PLATFORM_CACHE_LINE_SIZE) FReaderShard
+    {
+        // Readers in each of the two phases
+        std::atomic<int32> Readers[2] = {{0}, {0}};
+    };
+
+    std::atomic<FVersion*> Current;
+    mutable FReaderShard ReaderShards[NumReaderShards];
+    std::atomic<uint32> ReaderPhase{0};
+    std::atomic<uint64> ChangeCount{0};
+
+    FCriticalSection WriterLock;
+
+    template <typename FunctionType>
+    auto Read(FunctionType&& Reader) const;
+
+    // Returns once no reader can still be using a version that was replaced before the call
+    void WaitForReaders();
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Internationalization/Culture.h"
+#include "Internationalization/Text.h"
+
+
+/**
+ * A line's text compiled once for a culture, so that formatting it is a walk over literal runs and argument slots.
+ *
+ * Understands {N} arguments, FText-style {N}|plural(...) and {N}|ordinal(...) modifiers, and Yarn's
+ * [plural value={N} .../], [ordinal value={N} .../] and [select value={N} .../] markers. Plural choices are stored
+ * by ICU plural category and resolved with the culture's plural rules, which are looked up when the line is compiled.
+ * Patterns using anything else (named arguments, gender, escapes) fall back to a precompiled FTextFormat.
+ */
+class YARNSPINNER_API FYarnLineFormat
+{
+public:
+    FYarnLineFormat(FStringView Pattern, const FCultureRef& InCulture);
+
+    FString Format(const TArray<FFormatArgumentValue>& Arguments) const;
+
+private:
+    enum class ESegmentType : uint8
+    {
+        Literal,
+        // {N}
+        Argument,
+        // The % placeholder inside a Yarn plural/ordinal/select case, standing for the value being tested
+        Value,
+        Plural,
+        Select
+    };
+
+    struct FChoice;
+
+    struct FSegment
+    {
+        ESegmentType Type = ESegmentType::Literal;
+
+        // Literal text, or the original {N} token for arguments so a missing argument can be left in place
+        FString Text;
+
+        int32 ArgumentIndex = INDEX_NONE;
+
+        ETextPluralType PluralType = ETextPluralType::Cardinal;
+
+        // Plural: indexed by ETextPluralForm. Select: one per case.
+        TArray<FChoice> Choices;
+    };
+
+    struct FChoice
+    {
+        FString Key;
+        bool bIsSet = false;
+        TArray<FSegment> Segments;
+    };
+
+    TArray<FSegment> Segments;
+
+    FCultureRef Culture;
+    const FDecimalNumberFormattingRules* NumberRules;
+
+    TOptional<FTextFormat> Fallback;
+
+    bool CompileSegments(FStringView Pattern, TArray<FSegment>& OutSegments, bool bIsChoice, bool bPercentIsValue) const;
+    bool CompileModifier(FStringView Pattern, int32& Index, FSegment& Segment) const;
+    bool CompileMarker(FStringView Pattern, int32& Index, FSegment& Segment) const;
+
+    void AppendSegments(FStringBuilderBase& Builder, const TArray<FSegment>& InSegments, const TArray<FFormatArgumentValue>& Arguments, const FFormatArgumentValue* Value) const;
+    void AppendArgument(FStringBuilderBase& Builder, const FFormatArgumentValue& Argument) const;
+    ETextPluralForm GetPluralForm(const FFormatArgumentValue& Argument, ETextPluralType PluralType) const;
+    static FString ToInvariantString(const FFormatArgumentValue& Argument);
+};
+
+
+/**
+ * Compiled line formats for the current culture, keyed by line ID. Everything is thrown away when the culture changes.
+ */
+class YARNSPINNER_API FYarnLineFormatCache
+{
+public:
+    // Drops all cached formats if the current culture isn't the one they were compiled for. Returns true if it did.
+    bool ResetIfCultureChanged();
+
+    // Returns the compiled format for a line. GetPattern is only called the first time the line is seen.
+    const FYarnLineFormat& FindOrCompile(FName LineID, TFunctionRef<FString()> GetPattern);
+
+private:
+    TMap<FName, FYarnLineFormat> Formats;
+    FCulturePtr Culture;
+};
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Misc/YarnLineFormat.h"
+#include "Misc/YarnMarkup.h"
+
+class UYarnProject;
+struct FYarnLine;
+
+namespace Yarn
+{
+    struct Line;
+}
+
+
+/**
+ * Turns lines from a Yarn project into display text and markup attributes. Lines are looked up and compiled once per
+ * culture, and lines without substitutions keep their parsed markup as well.
+ */
+class YARNSPINNER_API FYarnLineTextCache
+{
+public:
+    void Resolve(UYarnProject* YarnProject, const Yarn::Line& YarnLine, FYarnLine& OutLine);
+
+private:
+    // Display text and markup for lines without substitutions, which can't change until the culture does
+    TMap<FName, FYarnMarkupParseResult> MarkupCache;
+
+    // Line text compiled for the current culture, so plural and select choices aren't re-parsed on every delivery
+    FYarnLineFormatCache LineFormatCache;
+};
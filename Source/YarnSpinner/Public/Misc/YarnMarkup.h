@@ -0,0 +1,62 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "YarnMarkup.generated.h"
+
+
+// A single name=value pair attached to a markup attribute, e.g. height=4 in [float height=4]
+USTRUCT(BlueprintType)
+struct YARNSPINNER_API FYarnMarkupProperty
+{
+    GENERATED_BODY()
+
+    UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+    FString Name;
+
+    // The property value as written, with quotes and escapes removed.
+    UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+    FString Value;
+};
+
+
+// A markup attribute and the span of plain text it applies to.
+USTRUCT(BlueprintType)
+struct YARNSPINNER_API FYarnMarkupAttribute
+{
+    GENERATED_BODY()
+
+    UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+    FString Name;
+
+    // Index of the first character of the span in the plain text
+    UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+    int32 Position = 0;
+
+    // Number of characters covered; zero for self-closing attributes
+    UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+    int32 Length = 0;
+
+    UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+    TArray<FYarnMarkupProperty> Properties;
+
+    const FString* FindProperty(const FStringView PropertyName) const
+    {
+        const FYarnMarkupProperty* Property = Properties.FindByPredicate([&PropertyName](const FYarnMarkupProperty& P) { return PropertyName.Equals(P.Name); });
+        return Property ? &Property->Value : nullptr;
+    }
+};
+
+
+// The output of parsing a line: the text with all markup removed, plus the attributes that applied to it.
+USTRUCT(BlueprintType)
+struct YARNSPINNER_API FYarnMarkupParseResult
+{
+    GENERATED_BODY()
+
+    UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+    FString Text;
+
+    // Attributes in the order they were opened
+    UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+    TArray<FYarnMarkupAttribute> Attributes;
+};
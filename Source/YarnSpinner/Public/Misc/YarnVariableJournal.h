@@ -0,0 +1,95 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Async/TaskGraphInterfaces.h"
+#include "Misc/YarnVariableMap.h"
+
+
+/**
+ * Keeps variables on disk by appending every change to a journal, so that saving never has to write all of them out.
+ * Each journal file gives a variable a small slot ID the first time it's written, and refers to it by that from then
+ * on. Changes are kept in memory until Flush, which appends them as one frame with a checksum; after a crash, replaying
+ * stops at the first frame that didn't make it to disk whole, so only changes since the last flush are lost.
+ *
+ * Once a journal has grown past the compaction threshold, Flush starts a new one and writes every variable into a
+ * checkpoint on a background thread, then deletes the journals the checkpoint covers. Open loads the checkpoint and
+ * replays the journals written since.
+ *
+ * RecordSet and RecordClear can be called from any thread, but the caller has to make sure they're called in the same
+ * order as the changes were made, e.g. under the lock that guards the variables. Everything else is for one thread.
+ */
+class YARNSPINNER_API FYarnVariableJournal
+{
+public:
+    static constexpr int64 DefaultCompactThreshold = 1024 * 1024;
+
+    explicit FYarnVariableJournal(const FString& InDirectory);
+
+    // Flushes and waits for a checkpoint being written
+    ~FYarnVariableJournal();
+
+    // Recovers the variables kept in Directory into OutVariables and starts a new journal after them. Returns false if
+    // the new journal can't be created, or if there's a checkpoint that can't be loaded, in which case OutVariables is
+    // empty and nothing on disk is touched.
+    bool Open(FYarnVariableMap& OutVariables);
+    void Close();
+    bool IsOpen() const { return Writer.IsValid(); }
+
+    // Variables is the map with the change already made, for the next checkpoint
+    void RecordSet(const FString& Name, const Yarn::FValue& Value, const FYarnVariableMap& Variables);
+    void RecordClear(const FString& Name, const FYarnVariableMap& Variables);
+
+    // Appends everything recorded since the last flush to the journal. Returns false if it couldn't be written.
+    bool Flush();
+
+    void SetCompactThreshold(int64 Bytes) { CompactThreshold = Bytes; }
+
+    const FString& GetDirectory() const { return Directory; }
+
+private:
+    enum class ERecord : uint8
+    {
+        // Gives the next slot ID to a name
+        Declare,
+        SetNumber,
+        SetFalse,
+        SetTrue,
+        SetString,
+        Clear
+    };
+
+    FString Directory;
+    int64 CompactThreshold = DefaultCompactThreshold;
+
+    // Guards everything up to Writer, which RecordSet and RecordClear use
+    FCriticalSection RecordLock;
+    TArray<uint8> PendingRecords;
+    TMap<FString, uint32> SlotIDs;
+
+    // What the variables are with every pending record applied
+    FYarnVariableMap LatestVariables;
+
+    TUniquePtr<FArchive> Writer;
+    uint32 Generation = 0;
+    int64 JournalSize = 0;
+
+    FGraphEventRef CheckpointTask;
+
+    uint32 GetSlotID(const FString& Name);
+    bool OpenJournal(uint32 NewGeneration);
+    void StartCheckpoint(const FYarnVariableMap& Variables, uint32 FirstJournal);
+    bool IsWritingCheckpoint() const { return CheckpointTask.IsValid() && !CheckpointTask->IsComplete(); }
+
+    FString GetCheckpointPath() const;
+
+    // Journals in Directory, oldest first
+    TArray<uint32> FindJournals() const;
+
+    static void WriteValue(FArchive& Archive, const Yarn::FValue& Value);
+    static bool ReadValue(FArchive& Archive, ERecord Record, Yarn::FValue& OutValue);
+
+    // True with nothing loaded if there's no checkpoint yet; false if there is one but it can't be loaded
+    bool LoadCheckpoint(FYarnVariableMap& OutVariables, uint32& OutFirstJournal) const;
+    static bool WriteCheckpoint(const FString& Path, const FYarnVariableMap& Variables, uint32 FirstJournal);
+    static int64 ReplayJournal(const FString& Path, FYarnVariableMap& Variables);
+};
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "YarnSpinnerCore/Value.h"
+
+
+/**
+ * A persistent map from variable names to values: a hash array mapped trie whose nodes are never changed once built.
+ * Setting or removing a variable copies only the nodes on the way to it, at most seven of them, and shares the rest
+ * with the map it came from. So copying a map is O(1), and keeping many copies around, e.g. one per line for rewind,
+ * only costs memory for what changed between them. Diff skips everything two maps still share.
+ *
+ * Names are compared the same way as TMap<FString, ...> does, i.e. ignoring case. Copies can be read from any thread,
+ * but a single map isn't safe to change while something else is using it.
+ */
+class YARNSPINNER_API FYarnVariableMap
+{
+public:
+    const Yarn::FValue* Find(const FString& Name) const;
+    bool Contains(const FString& Name) const { return Find(Name) != nullptr; }
+
+    void Set(const FString& Name, const Yarn::FValue& Value);
+
+    // Returns false if there was nothing to remove
+    bool Remove(const FString& Name);
+
+    void Reset();
+
+    int32 Num() const { return Count; }
+
+    // Whether both maps are the same version, i.e. one is an unchanged copy of the other
+    bool IsSameAs(const FYarnVariableMap& Other) const { return Root == Other.Root; }
+
+    void ForEach(TFunctionRef<void(const FString& Name, const Yarn::FValue& Value)> Visitor) const;
+
+    // Calls Visitor for every variable that differs between From and To. Before or After is null where the variable
+    // isn't in that map. Takes time proportional to the nodes the two maps don't share.
+    static void Diff(const FYarnVariableMap& From, const FYarnVariableMap& To, TFunctionRef<void(const FString& Name, const Yarn::FValue* Before, const Yarn::FValue* After)> Visitor);
+
+    // Memory used by nodes this map doesn't share with anything else
+    SIZE_T GetUniqueAllocatedSize() const;
+
+private:
+    struct FLeaf
+    {
+        uint32 Hash;
+        FString Name;
+        Yarn::FValue Value;
+    };
+
+    struct FNode;
+    using FLeafPtr = TSharedRef<const FLeaf>;
+    using FNodePtr = TSharedPtr<const FNode>;
+
+    struct FNode
+    {
+        // Which of the 32 slots at this level hold a leaf, and which hold a node below. A collision node, at the
+        // bottom, has neither and keeps every leaf whose hash is the same in Leaves.
+        uint32 LeafMap = 0;
+        uint32 ChildMap = 0;
+
+        // In slot order
+        TArray<FLeafPtr> Leaves;
+        TArray<FNodePtr> Children;
+
+        bool IsCollision() const { return LeafMap == 0 && ChildMap == 0; }
+    };
+
+    static constexpr uint32 BitsPerLevel = 5;
+
+    FNodePtr Root;
+    int32 Count = 0;
+
+    static uint32 Slot(uint32 Hash, uint32 Shift) { return 1u << ((Hash >> Shift) & 31); }
+    static int32 Index(uint32 Map, uint32 Bit) { return FMath::CountBits(Map & (Bit - 1)); }
+
+    static const FLeaf* FindLeaf(const FNode* Node, uint32 Hash, uint32 Shift, const FString& Name);
+    static FNodePtr Insert(const FNodePtr& Node, uint32 Shift, const FLeafPtr& Leaf, bool& bOutAdded);
+    static FNodePtr Erase(const FNodePtr& Node, uint32 Hash, uint32 Shift, const FString& Name, bool& bOutRemoved);
+    static FNodePtr Merge(const FLeafPtr& A, const FLeafPtr& B, uint32 Shift);
+    static void ForEachLeaf(const FNode* Node, TFunctionRef<void(const FLeaf& Leaf)> Visitor);
+    static void DiffNodes(const FNode* From, const FNode* To, uint32 Shift, TFunctionRef<void(const FString&, const Yarn::FValue*, const Yarn::FValue*)> Visitor);
+    static void DiffLeafAgainstNode(const FLeaf& Leaf, const FNode* Node, bool bLeafIsFrom, TFunctionRef<void(const FString&, const Yarn::FValue*, const Yarn::FValue*)> Visitor);
+    static SIZE_T GetUniqueAllocatedSize(const FNodePtr& Node);
+};
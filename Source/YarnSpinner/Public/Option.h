@@ -6,6 +6,29 @@
 #include "CoreMinimal.h"
 #include "Option.generated.h"
 
+
+/**
+ * One of a set of options, delivered by value. Select it by passing its index in the delivered array to
+ * ADialogueRunner::SelectOptionByIndex.
+ */
+USTRUCT(BlueprintType)
+struct YARNSPINNER_API FYarnOption
+{
+	GENERATED_BODY()
+
+	UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+	FYarnLine Line;
+
+	// Indicates whether the line condition on this option evaluated to true (or
+	// if no line condition was present.)
+	UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+	bool bIsAvailable = true;
+
+	UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+	int32 OptionID = INDEX_NONE;
+};
+
+
 /**
  * 
  */
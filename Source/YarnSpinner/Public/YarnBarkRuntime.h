@@ -0,0 +1,154 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Line.h"
+
+THIRD_PARTY_INCLUDES_START
+#include "YarnSpinnerCore/VirtualMachine.h"
+THIRD_PARTY_INCLUDES_END
+
+#include "YarnBarkRuntime.generated.h"
+
+class UYarnLibraryRegistry;
+class UYarnProject;
+class FYarnDialogueScheduler;
+class FYarnLineTextCache;
+
+
+// Identifies a running bark. A handle stops being valid when its bark finishes, even if the slot is reused.
+USTRUCT(BlueprintType)
+struct YARNSPINNER_API FYarnBarkHandle
+{
+    GENERATED_BODY()
+
+    int32 Index = INDEX_NONE;
+    int32 Serial = 0;
+
+    bool IsSet() const { return Index != INDEX_NONE; }
+
+    bool operator==(const FYarnBarkHandle& Other) const { return Index == Other.Index && Serial == Other.Serial; }
+    bool operator!=(const FYarnBarkHandle& Other) const { return !(*this == Other); }
+};
+
+
+// A line delivered by a bark
+USTRUCT(BlueprintType)
+struct YARNSPINNER_API FYarnBarkLine
+{
+    GENERATED_BODY()
+
+    UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+    FYarnBarkHandle Bark;
+
+    UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+    FYarnLine Line;
+};
+
+
+// A command a bark ran that the bark runtime doesn't handle itself
+USTRUCT(BlueprintType)
+struct YARNSPINNER_API FYarnBarkCommand
+{
+    GENERATED_BODY()
+
+    UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+    FYarnBarkHandle Bark;
+
+    UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+    FString Command;
+
+    UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+    TArray<FString> Parameters;
+};
+
+
+DECLARE_MULTICAST_DELEGATE_OneParam(FYarnBarkLinesDelegate, TConstArrayView<FYarnBarkLine>);
+DECLARE_MULTICAST_DELEGATE_OneParam(FYarnBarkCommandsDelegate, TConstArrayView<FYarnBarkCommand>);
+DECLARE_MULTICAST_DELEGATE_OneParam(FYarnBarksFinishedDelegate, TConstArrayView<FYarnBarkHandle>);
+
+
+/**
+ * Runs short, headless conversations ("barks") for crowds of NPCs without an actor per conversation.
+ *
+ * Each bark is a small sink object, a Yarn::VirtualMachine and a Yarn::State borrowed from its project's shared
+ * runtime context. GetInstanceFootprint() reports that fixed size; the only other per-bark memory is the VM's value
+ * stack while it runs. Programs, line text and compiled line formats are shared between all barks using a project.
+ *
+ * Barks don't wait for a UI. Options pick the first available choice, <<wait>> is handled here, other commands are
+ * reported and skipped over, and each line either waits for ContinueBark or continues by itself after a set duration.
+ * Async functions park the bark until Tick sees their result or timeout.
+ * Everything produced is collected and delivered in batches by DeliverPending.
+ *
+ * Given a scheduler, barks are continued through it at ambient priority, so a crowd starting to talk at once is spread
+ * over as many frames as it needs rather than landing in one.
+ *
+ * With yarn.BarksOnWorkerThreads set, new barks run their VMs on task graph workers instead (see FYarnWorkerDialogue)
+ * and Tick collects what they've produced. The variable storage then has to be thread-safe.
+ */
+class YARNSPINNER_API FYarnBarkRuntime
+{
+public:
+    FYarnBarkRuntime(Yarn::IVariableStorage& InVariableStorage, const UYarnLibraryRegistry* InLibraryRegistry, FYarnDialogueScheduler* InScheduler = nullptr);
+    ~FYarnBarkRuntime();
+
+    // Starts running a node. With a positive LineDuration, each line continues by itself after that many seconds.
+    FYarnBarkHandle StartBark(UYarnProject* YarnProject, FName NodeName, float LineDuration);
+
+    void ContinueBark(FYarnBarkHandle Bark);
+    void StopBark(FYarnBarkHandle Bark);
+    bool IsBarkRunning(FYarnBarkHandle Bark) const;
+
+    // Continues barks whose wait is over
+    void Tick(float DeltaTime);
+
+    // Broadcasts everything barks have produced since the last call
+    void DeliverPending();
+
+    int32 Num() const { return Barks.Num(); }
+
+    // Fixed bytes used by each bark, not counting its value stack or anything shared
+    static SIZE_T GetInstanceFootprint();
+
+    // Bytes used by all barks, including their value stacks
+    SIZE_T GetAllocatedSize() const;
+
+    FYarnBarkLinesDelegate OnLines;
+    FYarnBarkCommandsDelegate OnCommands;
+    FYarnBarksFinishedDelegate OnFinished;
+
+private:
+    class FBark;
+
+    struct FScheduledContinue
+    {
+        double Time;
+        FYarnBarkHandle Bark;
+
+        bool operator<(const FScheduledContinue& Other) const { return Time < Other.Time; }
+    };
+
+    Yarn::IVariableStorage& VariableStorage;
+    const UYarnLibraryRegistry* LibraryRegistry;
+    FYarnDialogueScheduler* Scheduler;
+
+    TSparseArray<TUniquePtr<FBark>> Barks;
+    int32 NextSerial = 1;
+
+    // One per project, shared by all of its barks
+    TMap<TWeakObjectPtr<UYarnProject>, TUniquePtr<FYarnLineTextCache>> LineTextCaches;
+
+    // Min-heap on time
+    TArray<FScheduledContinue> ScheduledContinues;
+    double Time = 0;
+
+    TArray<FYarnBarkLine> PendingLines;
+    TArray<FYarnBarkCommand> PendingCommands;
+    TArray<FYarnBarkHandle> PendingFinished;
+
+    FBark* Find(FYarnBarkHandle Bark) const;
+    void RequestContinue(FBark& Bark);
+    void Continue(FBark& Bark);
+    void PollFunctionResult(FBark& Bark);
+    void ScheduleContinue(FYarnBarkHandle Bark, double Delay);
+    void Remove(FYarnBarkHandle Bark);
+};
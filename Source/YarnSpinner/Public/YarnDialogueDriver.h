@@ -0,0 +1,311 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Line.h"
+#include "Option.h"
+#include "YarnLatentScheduler.h"
+#include "Misc/YarnLineTextCache.h"
+
+THIRD_PARTY_INCLUDES_START
+#include "YarnSpinnerCore/VirtualMachine.h"
+THIRD_PARTY_INCLUDES_END
+
+// The driver needs C++20 coroutines; with older language versions this header declares nothing
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define YARNSPINNER_WITH_COROUTINES 1
+#else
+#define YARNSPINNER_WITH_COROUTINES 0
+#endif
+
+#if YARNSPINNER_WITH_COROUTINES
+
+#include <coroutine>
+
+class FYarnDialogueDriver;
+class FYarnDialogueScheduler;
+class UYarnLibraryRegistry;
+class UYarnProject;
+class UYarnSubsystem;
+
+
+/**
+ * Memory for coroutine frames, owned by a dialogue driver. Frames are carved out of 4 KB pages and go back on a free
+ * list for their size class when the coroutine ends, so running the same sequence again doesn't allocate. Frames
+ * too big for a page come from the heap. Game thread only.
+ */
+class YARNSPINNER_API FYarnCoroutineArena
+{
+public:
+    FYarnCoroutineArena() = default;
+    FYarnCoroutineArena(const FYarnCoroutineArena&) = delete;
+    FYarnCoroutineArena& operator=(const FYarnCoroutineArena&) = delete;
+    ~FYarnCoroutineArena();
+
+    void* Allocate(SIZE_T Size);
+
+    // For frames that aren't tied to an arena. Free works out which kind it was given.
+    static void* AllocateUnpooled(SIZE_T Size);
+    static void Free(void* Ptr);
+
+    SIZE_T GetAllocatedSize() const { return Pages.Num() * PageSize; }
+
+private:
+    static constexpr SIZE_T PageSize = 4096;
+    static constexpr SIZE_T MinBlockSize = 64;
+    static constexpr int32 NumSizeClasses = 7;
+
+    struct FBlockHeader
+    {
+        FYarnCoroutineArena* Arena;
+        int32 SizeClass;
+    };
+
+    struct FFreeBlock
+    {
+        FFreeBlock* Next;
+    };
+
+    static constexpr SIZE_T HeaderSize = Align(sizeof(FBlockHeader), 16);
+
+    TArray<void*> Pages;
+    uint8* PageCursor = nullptr;
+    SIZE_T PageRemaining = 0;
+    FFreeBlock* FreeLists[NumSizeClasses] = {};
+};
+
+
+/**
+ * The return type of a dialogue coroutine. The coroutine must take the FYarnDialogueDriver it runs on as its first
+ * parameter (after the object, for member functions and lambdas), so that its frame can come from the driver's arena:
+ *
+ *     FYarnDialogueTask Talk(FYarnDialogueDriver& Driver)
+ *     {
+ *         while (co_await Driver.NextLine())
+ *         {
+ *             Show(Driver.GetLine());
+ *             co_await Driver.Wait(2.0);
+ *         }
+ *         if (Driver.GetEvent() == EYarnDialogueEvent::Options)
+ *         {
+ *             const int32 Chosen = co_await Driver.PresentOptions();
+ *             ...
+ *         }
+ *     }
+ *
+ *     Driver->Start(Talk(*Driver), TEXT("Start"));
+ *
+ * Coroutines are started with FYarnDialogueDriver::Start and can't await each other.
+ */
+class YARNSPINNER_API FYarnDialogueTask
+{
+public:
+    struct promise_type
+    {
+        FYarnDialogueTask get_return_object() { return FYarnDialogueTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+
+        // Started by the driver, and left for it to destroy when it finishes
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+
+        void return_void() {}
+        void unhandled_exception() { checkNoEntry(); }
+
+        template <typename... ArgTypes>
+        static void* operator new(SIZE_T Size, FYarnDialogueDriver& Driver, ArgTypes&&...);
+
+        template <typename ObjectType, typename... ArgTypes>
+        static void* operator new(SIZE_T Size, ObjectType&, FYarnDialogueDriver& Driver, ArgTypes&&...);
+
+        // Only for coroutines that don't take a driver; their frames come from the heap
+        static void* operator new(SIZE_T Size) { return FYarnCoroutineArena::AllocateUnpooled(Size); }
+
+        static void operator delete(void* Ptr) { FYarnCoroutineArena::Free(Ptr); }
+    };
+
+    FYarnDialogueTask() = default;
+    FYarnDialogueTask(FYarnDialogueTask&& Other) : Handle(Other.Handle) { Other.Handle = nullptr; }
+    FYarnDialogueTask& operator=(FYarnDialogueTask&& Other);
+    ~FYarnDialogueTask();
+
+    bool IsValid() const { return static_cast<bool>(Handle); }
+    bool IsDone() const { return !Handle || Handle.done(); }
+
+private:
+    friend class FYarnDialogueDriver;
+
+    explicit FYarnDialogueTask(const std::coroutine_handle<promise_type> InHandle) : Handle(InHandle) {}
+
+    std::coroutine_handle<promise_type> Handle;
+};
+
+
+// What the dialogue produced last
+enum class EYarnDialogueEvent : uint8
+{
+    None,
+    Line,
+    Options,
+    Command,
+    Complete
+};
+
+
+/**
+ * Runs a Yarn::VirtualMachine for a coroutine written in C++, instead of through a dialogue runner's events.
+ *
+ * co_await Next() runs the dialogue on to its next line, set of options, command or end, then GetEvent and the
+ * getters describe it. NextLine does the same, but passes commands to CommandHandler and keeps going. When there are
+ * options, co_await PresentOptions() waits until something calls SelectOption and returns its index. Wait suspends
+ * for a while of game time.
+ *
+ * With a dialogue scheduler, dialogue runs within its per-frame budget and the coroutine is resumed from there;
+ * without one, it runs straight away and awaiting content doesn't suspend. Awaiting never allocates: the awaiters
+ * live in the coroutine frame, and content is written into buffers the driver reuses. One coroutine runs at a time.
+ * Drivers must be owned by a TSharedPtr, and shouldn't outlive the schedulers they're given. Game thread only.
+ */
+class YARNSPINNER_API FYarnDialogueDriver final : public TSharedFromThis<FYarnDialogueDriver>, private Yarn::IDialogueSink
+{
+public:
+    struct FContentAwaiter
+    {
+        FYarnDialogueDriver& Driver;
+        bool bSkipCommands;
+
+        bool await_ready() const { return Driver.bIsDialogueComplete; }
+        bool await_suspend(std::coroutine_handle<> Handle);
+        EYarnDialogueEvent await_resume() const { return Driver.Event; }
+    };
+
+    struct FLineAwaiter : FContentAwaiter
+    {
+        bool await_resume() const { return Driver.Event == EYarnDialogueEvent::Line; }
+    };
+
+    struct FSelectionAwaiter
+    {
+        FYarnDialogueDriver& Driver;
+
+        bool await_ready() const { return Driver.SelectedOption != INDEX_NONE; }
+        bool await_suspend(std::coroutine_handle<> Handle);
+        int32 await_resume() const { return Driver.SelectedOption; }
+    };
+
+    struct FWaitAwaiter
+    {
+        FYarnDialogueDriver& Driver;
+        double Seconds;
+
+        bool await_ready() const { return Seconds <= 0; }
+        bool await_suspend(std::coroutine_handle<> Handle);
+        void await_resume() const {}
+    };
+
+    FYarnDialogueDriver(UYarnProject* InYarnProject, const TSharedRef<const Yarn::RuntimeContext>& Context, Yarn::IVariableStorage& VariableStorage, const UYarnLibraryRegistry* InLibraryRegistry, FYarnDialogueScheduler* InScheduler = nullptr, FYarnLatentScheduler* InLatentScheduler = nullptr);
+    ~FYarnDialogueDriver();
+
+    // A driver using the subsystem's variables, library and schedulers. Null if the project failed to load.
+    static TSharedPtr<FYarnDialogueDriver> Create(UYarnSubsystem& Subsystem, UYarnProject* YarnProject);
+
+    // Starts Task from NodeName, running it up to its first suspension. Stops any coroutine that's already running.
+    bool Start(FYarnDialogueTask&& Task, const FString& NodeName);
+
+    // Destroys the running coroutine without resuming it. Coroutines can't stop themselves; they should co_return.
+    void Stop();
+
+    bool IsRunning() const { return Task.IsValid(); }
+
+    FContentAwaiter Next() { return {*this, false}; }
+    FLineAwaiter NextLine() { return {{*this, true}}; }
+    FSelectionAwaiter PresentOptions() { return {*this}; }
+    FWaitAwaiter Wait(const double Seconds) { return {*this, Seconds}; }
+
+    // Picks one of GetOptions() by index. Resumes a coroutine waiting in PresentOptions.
+    void SelectOption(int32 OptionIndex);
+
+    EYarnDialogueEvent GetEvent() const { return Event; }
+    const FYarnLine& GetLine() const { return Line; }
+    const TArray<FYarnOption>& GetOptions() const { return Options; }
+    const FString& GetCommand() const { return Command; }
+    const TArray<FString>& GetCommandParameters() const { return CommandParameters; }
+
+    FYarnCoroutineArena& GetArena() { return Arena; }
+
+    // Commands skipped over by NextLine
+    TFunction<void(const FString& Command, const TArray<FString>& Parameters)> CommandHandler;
+
+private:
+    enum class EWaitingFor : uint8
+    {
+        Nothing,
+        Content,
+        Selection,
+        Time
+    };
+
+    TWeakObjectPtr<UYarnProject> YarnProject;
+    const UYarnLibraryRegistry* LibraryRegistry;
+    FYarnDialogueScheduler* Scheduler;
+    FYarnLatentScheduler* LatentScheduler;
+
+    TUniquePtr<Yarn::VirtualMachine> VirtualMachine;
+    FYarnLineTextCache LineTextCache;
+
+    // Declared before Task, so it outlives the coroutine frames it holds
+    FYarnCoroutineArena Arena;
+    FYarnDialogueTask Task;
+
+    EWaitingFor WaitingFor = EWaitingFor::Nothing;
+    bool bSkipCommands = false;
+    bool bIsContinueQueued = false;
+    bool bIsDialogueComplete = false;
+    bool bIsResuming = false;
+    FYarnLatentHandle WaitHandle;
+
+    // Identifies the async function call being waited on. Bumped when its result or timeout arrives, or the dialogue
+    // stops, so whichever comes later is ignored.
+    uint32 AsyncFunctionSerial = 0;
+    FYarnLatentHandle AsyncFunctionTimeout;
+
+    EYarnDialogueEvent Event = EYarnDialogueEvent::None;
+    FYarnLine Line;
+    TArray<FYarnOption> Options;
+    FString Command;
+    TArray<FString> CommandParameters;
+    int32 SelectedOption = INDEX_NONE;
+
+    void RequestContinue();
+    // Runs the VM until it has something for the coroutine. Returns false if it was suspended, or is waiting for an
+    // async function, and has to carry on later.
+    bool RunVirtualMachine(int32 MaxInstructions);
+    void Resume();
+    void ReceiveFunctionResult(uint32 Serial, const Yarn::FValue& Result);
+
+    // IDialogueSink
+    virtual void HandleLine(const Yarn::Line& YarnLine) override;
+    virtual void HandleOptions(const Yarn::OptionSet& OptionSet) override;
+    virtual void HandleCommand(const Yarn::Command& YarnCommand) override;
+    virtual void HandleDialogueComplete() override;
+    virtual bool IsCommandBlocking(FName Name) override;
+    virtual bool HasFunction(FName Name) override;
+    virtual int GetExpectedFunctionParamCount(FName Name) override;
+    virtual Yarn::FValue HandleFunctionCall(FName Name, const TArray<Yarn::FValue>& Parameters) override;
+    virtual bool IsAsyncFunction(FName Name) override;
+    virtual void HandleAsyncFunctionCall(FName Name, const TArray<Yarn::FValue>& Parameters) override;
+    virtual bool IsPureFunction(FName Name) override;
+};
+
+
+template <typename... ArgTypes>
+void* FYarnDialogueTask::promise_type::operator new(const SIZE_T Size, FYarnDialogueDriver& Driver, ArgTypes&&...)
+{
+    return Driver.GetArena().Allocate(Size);
+}
+
+
+template <typename ObjectType, typename... ArgTypes>
+void* FYarnDialogueTask::promise_type::operator new(const SIZE_T Size, ObjectType&, FYarnDialogueDriver& Driver, ArgTypes&&...)
+{
+    return Driver.GetArena().Allocate(Size);
+}
+
+#endif
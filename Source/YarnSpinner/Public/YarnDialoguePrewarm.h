@@ -0,0 +1,149 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Line.h"
+#include "Option.h"
+
+THIRD_PARTY_INCLUDES_START
+#include "YarnSpinnerCore/VirtualMachine.h"
+THIRD_PARTY_INCLUDES_END
+
+class FYarnLineTextCache;
+class UYarnLibraryRegistry;
+class UYarnProject;
+
+
+/**
+ * Variable storage that keeps writes to itself and leaves the storage underneath untouched. Every variable read from
+ * underneath is remembered with the value it had, so IsUpToDate can tell whether anything that was read has changed
+ * since. Commit writes everything that was set or cleared through to the storage underneath.
+ */
+class YARNSPINNER_API FYarnSpeculativeVariableStorage final : public Yarn::IVariableStorage
+{
+public:
+    explicit FYarnSpeculativeVariableStorage(Yarn::IVariableStorage& InBase) : Base(InBase) {}
+
+    // IVariableStorage
+    virtual void SetValue(const FString& Name, bool bValue) override;
+    virtual void SetValue(const FString& Name, float Value) override;
+    virtual void SetValue(const FString& Name, const FString& Value) override;
+    virtual bool HasValue(const FString& Name) override;
+    virtual Yarn::FValue GetValue(const FString& Name) override;
+    virtual void ClearValue(const FString& Name) override;
+
+    // Whether every variable read from underneath still has the value it had then
+    bool IsUpToDate() const;
+
+    void Commit();
+    void Reset();
+
+private:
+    Yarn::IVariableStorage& Base;
+
+    // Set values, or unset for variables that were cleared
+    TMap<FString, TOptional<Yarn::FValue>> Writes;
+
+    // Values read from underneath, or unset for variables that weren't there
+    TMap<FString, TOptional<Yarn::FValue>> Reads;
+
+    const TOptional<Yarn::FValue>& Read(const FString& Name);
+};
+
+
+/**
+ * Runs a node ahead of time, up to its first line, set of options or the end of the dialogue, so that the content
+ * is ready the moment the dialogue starts. It runs against an FYarnSpeculativeVariableStorage, so nothing it sets is
+ * seen until it's committed, and anything it read can be checked before then.
+ *
+ * Running a function could have side effects that can't be taken back, so only pure functions (the standard library and
+ * native functions flagged bIsPure) are called; any other function, or any command, ends the prewarm as failed. The real dialogue then runs the node as usual.
+ */
+class YARNSPINNER_API FYarnDialoguePrewarm final : private Yarn::IDialogueSink
+{
+public:
+    enum class EState : uint8
+    {
+        Running,
+        Ready,
+        Failed
+    };
+
+    enum class EContent : uint8
+    {
+        None,
+        Line,
+        Options,
+        DialogueComplete
+    };
+
+    // Node events the VM sent on the way to the content, for the host to pass on when it commits
+    struct FNodeEvent
+    {
+        FString NodeName;
+        bool bIsStart;
+    };
+
+    FYarnDialoguePrewarm(UYarnProject* InYarnProject, const TSharedRef<const Yarn::RuntimeContext>& Context, Yarn::IVariableStorage& Variables, const UYarnLibraryRegistry* InLibraryRegistry, FYarnLineTextCache& InLineTextCache);
+    ~FYarnDialoguePrewarm();
+
+    // RandomSeed is where the host's random numbers are up to, so the prewarm draws the ones the node would have
+    bool Start(const FString& InNodeName, int32 RandomSeed);
+
+    // Runs at most MaxInstructions (zero for no limit). Returns true while there's more to run.
+    bool Run(int32 MaxInstructions);
+
+    EState GetState() const { return State; }
+    const FString& GetNodeName() const { return NodeName; }
+    int32 GetStartingRandomSeed() const { return StartingRandomSeed; }
+
+    // Whether Commit would work: the prewarm has reached its content, and nothing it read has changed since
+    bool CanCommit() const { return State == EState::Ready && Variables.IsUpToDate(); }
+
+    // Writes through what the node set on the way to its content, and hands over the VM, waiting just after that
+    // content, to carry on with the real storage. The prewarm can't be used again afterwards.
+    TUniquePtr<Yarn::VirtualMachine> Commit(Yarn::IVariableStorage& Storage);
+
+    EContent GetContent() const { return Content; }
+    const FYarnLine& GetLine() const { return Line; }
+    const Yarn::Line& GetYarnLine() const { return YarnLine; }
+    const TArray<TSoftObjectPtr<UObject>>& GetLineAssets() const { return LineAssets; }
+    const TArray<FYarnOption>& GetOptions() const { return Options; }
+    const TArray<FNodeEvent>& GetNodeEvents() const { return NodeEvents; }
+
+    SIZE_T GetAllocatedSize() const;
+
+private:
+    TWeakObjectPtr<UYarnProject> YarnProject;
+    const UYarnLibraryRegistry* LibraryRegistry;
+    FYarnLineTextCache& LineTextCache;
+
+    FYarnSpeculativeVariableStorage Variables;
+    TUniquePtr<Yarn::VirtualMachine> VirtualMachine;
+
+    FString NodeName;
+    int32 StartingRandomSeed = 0;
+    EState State = EState::Failed;
+
+    EContent Content = EContent::None;
+    FYarnLine Line;
+    Yarn::Line YarnLine;
+    TArray<TSoftObjectPtr<UObject>> LineAssets;
+    TArray<FYarnOption> Options;
+    TArray<FNodeEvent> NodeEvents;
+
+    void Fail(const TCHAR* Reason);
+
+    // IDialogueSink
+    virtual void HandleLine(const Yarn::Line& InYarnLine) override;
+    virtual void HandleOptions(const Yarn::OptionSet& OptionSet) override;
+    virtual void HandleCommand(const Yarn::Command& Command) override;
+    virtual void HandleNodeStart(const FString& StartedNode) override;
+    virtual void HandleNodeComplete(const FString& CompletedNode) override;
+    virtual void HandleDialogueComplete() override;
+    virtual bool HasFunction(FName Name) override;
+    virtual int GetExpectedFunctionParamCount(FName Name) override;
+    virtual Yarn::FValue HandleFunctionCall(FName Name, const TArray<Yarn::FValue>& Parameters) override;
+    virtual bool IsAsyncFunction(FName Name) override;
+    virtual void HandleAsyncFunctionCall(FName Name, const TArray<Yarn::FValue>& Parameters) override;
+    virtual bool IsPureFunction(FName Name) override;
+};
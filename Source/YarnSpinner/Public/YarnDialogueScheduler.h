@@ -0,0 +1,110 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "YarnDialogueScheduler.generated.h"
+
+
+// Decides which dialogue gets to run first when there's more than fits in a frame
+UENUM(BlueprintType)
+enum class EYarnDialoguePriority : uint8
+{
+    // Conversations the player is part of
+    Player,
+
+    // Conversations that should run soon, but can wait for the player's
+    Normal,
+
+    // Barks and other background chatter
+    Ambient,
+
+    MAX UMETA(Hidden)
+};
+
+
+USTRUCT(BlueprintType)
+struct YARNSPINNER_API FYarnDialogueSchedulerStats
+{
+    GENERATED_BODY()
+
+    // Requests waiting after the last frame's work
+    UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+    int32 QueueDepth = 0;
+
+    // Requests run in the last frame
+    UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+    int32 Executed = 0;
+
+    // Microseconds spent running requests in the last frame
+    UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+    float FrameMicroseconds = 0;
+
+    // Longest a request run in the last frame had been waiting, in milliseconds
+    UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+    float MaxLatencyMs = 0;
+
+    // Moving average of how long requests wait before they run, in milliseconds
+    UPROPERTY(BlueprintReadOnly, Category="Yarn Spinner")
+    float AverageLatencyMs = 0;
+};
+
+
+/**
+ * Runs requests to continue dialogue within a per-frame time budget (yarn.DialogueFrameBudget), highest priority first.
+ * Requests run straight away while there's budget left, and whatever doesn't fit carries over to the next frame, in the
+ * order it was requested.
+ *
+ * At least one request runs every frame, so dialogue keeps moving even when a single request is over budget. To keep
+ * any one request short, VMs run at most GetInstructionSlice() instructions per request and queue another request if
+ * they still have more to do.
+ */
+class YARNSPINNER_API FYarnDialogueScheduler
+{
+public:
+    // Queues work to run during the next RunFrame. Work queued by running work still runs this frame if there's time.
+    void Enqueue(EYarnDialoguePriority Priority, TUniqueFunction<void()>&& Work);
+
+    // Runs Work straight away if the budget has room and nothing of the same or higher priority is waiting, so that
+    // dialogue doesn't pick up a frame of latency when the scheduler is idle. Time spent here counts against the next
+    // RunFrame's budget. Returns false without running Work if it should be queued instead, including when called
+    // from work that's already running.
+    bool TryRunNow(EYarnDialoguePriority Priority, TFunctionRef<void()> Work);
+
+    void RunFrame();
+
+    // Drops everything that's waiting
+    void Reset();
+
+    int32 Num() const;
+
+    const FYarnDialogueSchedulerStats& GetStats() const { return Stats; }
+
+    // Instructions a VM should run per request before suspending (yarn.InstructionSlice). Zero means no limit.
+    static int32 GetInstructionSlice();
+
+private:
+    static constexpr int32 NumPriorities = static_cast<int32>(EYarnDialoguePriority::MAX);
+
+    struct FRequest
+    {
+        TUniqueFunction<void()> Work;
+        double EnqueueTime;
+    };
+
+    // FIFO per priority; requests before QueueHeads have already run and are trimmed at the end of the frame
+    TArray<FRequest> Queues[NumPriorities];
+    int32 QueueHeads[NumPriorities] = {};
+
+    FYarnDialogueSchedulerStats Stats;
+
+    // Time spent and requests run by TryRunNow since the last RunFrame
+    uint64 ImmediateCycles = 0;
+    int32 ImmediateExecuted = 0;
+
+    // Set while work is running, so that work continuing itself is queued rather than run inside its own call
+    bool bIsRunningWork = false;
+
+    static uint64 GetBudgetCycles();
+
+    bool PopNext(FRequest& OutRequest);
+};
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "UObject/ObjectKey.h"
+
+#include "YarnLatentScheduler.generated.h"
+
+
+// Identifies a callback waiting in an FYarnLatentScheduler. Safe to use after the callback has run or been cancelled.
+USTRUCT(BlueprintType)
+struct YARNSPINNER_API FYarnLatentHandle
+{
+    GENERATED_BODY()
+
+    int32 Index = INDEX_NONE;
+    uint32 Serial = 0;
+
+    bool IsValid() const { return Index != INDEX_NONE; }
+};
+
+
+/**
+ * Runs callbacks once some game time has passed, for commands like <<wait>> that hold dialogue up for a while.
+ *
+ * Waits are kept in a hierarchical timer wheel: four levels of 64 slots, each slot on a level covering 64 times as
+ * long as one on the level below. Scheduling and cancelling take constant time, and advancing only touches the slot
+ * that's due plus, every 64 ticks, one slot of a higher level whose waits are moved closer to the bottom. Delays are
+ * rounded up to whole ticks of TickSeconds; anything longer than the wheel's range (about 46 hours) is moved down
+ * when the top level comes round.
+ *
+ * Callbacks can be given an owner, so that everything an object is waiting on can be cancelled together, e.g. when
+ * a dialogue runner stops. Everything here is for the game thread.
+ */
+class YARNSPINNER_API FYarnLatentScheduler
+{
+public:
+    // Length of one tick of the wheel
+    static constexpr double TickSeconds = 0.01;
+
+    FYarnLatentScheduler();
+
+    // Runs Callback after DelaySeconds more of Advance. A callback always waits at least one tick.
+    FYarnLatentHandle Schedule(double DelaySeconds, const UObject* Owner, TUniqueFunction<void()>&& Callback);
+
+    // Returns false if the callback has already run or been cancelled
+    bool Cancel(FYarnLatentHandle Handle);
+
+    // Cancels every callback Owner scheduled. Returns how many there were.
+    int32 CancelAll(const UObject* Owner);
+
+    bool IsPending(FYarnLatentHandle Handle) const;
+
+    // Moves time on, running callbacks as they come due. Callbacks can schedule and cancel others.
+    void Advance(double DeltaSeconds);
+
+    // Cancels everything without running it
+    void Reset();
+
+    int32 Num() const { return NumPending; }
+
+private:
+    static constexpr int32 SlotBits = 6;
+    static constexpr int32 SlotsPerLevel = 1 << SlotBits;
+    static constexpr int32 NumLevels = 4;
+    static constexpr int32 NumBuckets = NumLevels * SlotsPerLevel;
+
+    struct FEntry
+    {
+        TUniqueFunction<void()> Callback;
+        uint64 DueTick = 0;
+        FObjectKey Owner;
+        uint32 Serial = 0;
+
+        // INDEX_NONE while the entry is free
+        int32 Bucket = INDEX_NONE;
+
+        // Neighbours in the bucket, in the order they were added
+        int32 Prev = INDEX_NONE;
+        int32 Next = INDEX_NONE;
+
+        // Neighbours among the owner's entries
+        int32 OwnerPrev = INDEX_NONE;
+        int32 OwnerNext = INDEX_NONE;
+    };
+
+    TArray<FEntry> Entries;
+    TArray<int32> FreeEntries;
+
+    int32 BucketHeads[NumBuckets];
+    int32 BucketTails[NumBuckets];
+
+    TMap<FObjectKey, int32> OwnerHeads;
+
+    uint64 CurrentTick = 0;
+
+    // Time passed that doesn't make up a whole tick yet
+    double PendingSeconds = 0;
+
+    int32 NumPending = 0;
+    uint32 NextSerial = 1;
+
+    void Link(int32 Index);
+    void Unlink(int32 Index);
+    void LinkOwner(int32 Index);
+    void UnlinkOwner(int32 Index);
+    void Release(int32 Index);
+    void Cascade(int32 Level);
+};
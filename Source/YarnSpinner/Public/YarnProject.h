@@ -4,6 +4,7 @@
 
 #include "CoreMinimal.h"
 #include "YarnSpinnerCore/yarn_spinner.pb.h"
+#include "YarnSpinnerCore/RuntimeContext.h"
 #include "YarnProject.generated.h"
 
 
@@ -74,6 +75,9 @@ public:
 	
 	UE_NODISCARD TSharedPtr<Yarn::Program> GetProgram();
 
+	// The program prepared for running, shared by every dialogue runner using this project
+	UE_NODISCARD TSharedPtr<const Yarn::RuntimeContext> GetRuntimeContext();
+
 protected:
 	UPROPERTY()
 	TArray<uint8> ProgramData;
@@ -96,6 +100,8 @@ protected:
 	// Re-hydrated project instance
 	TSharedPtr<Yarn::Program> Program = nullptr;
 
+	TSharedPtr<const Yarn::RuntimeContext> RuntimeContext = nullptr;
+
 	// Assets that are utilized in lines
 	// Map is from Line Id -> Soft Object Ptr
     TMap<FName, TArray<TSoftObjectPtr<>>> LineAssets;
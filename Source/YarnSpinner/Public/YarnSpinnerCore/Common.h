@@ -19,7 +19,9 @@ namespace Yarn
             int i = 0;
             for (const FFormatArgumentValue& Sub : AddedLine.Substitutions)
             {
-                OutputStream << ", {" << i << "} :" << TCHAR_TO_UTF8(*Sub.GetTextValue().ToString());
+                FString SubString;
+                Sub.ToFormattedString(false, false, SubString);
+                OutputStream << ", {" << i << "} :" << TCHAR_TO_UTF8(*SubString);
                 i++;
             }
             return OutputStream;
@@ -43,4 +45,21 @@ namespace Yarn
     {
         FString Text;
     };
+
+    // A line or command collected into a batch, for hosts that take content in batches
+    struct ContentItem
+    {
+        enum class EType : uint8
+        {
+            Line,
+            Command
+        };
+
+        EType Type = EType::Line;
+        Line Line;
+        Command Command;
+    };
+
+    // Writes or reads a line, substitutions included, for VM snapshots and hosts saving what they're showing
+    YARNSPINNER_API FArchive& operator<<(FArchive& archive, Line& line);
 }
\ No newline at end of file
@@ -63,6 +63,9 @@ namespace Yarn
 
         void LoadStandardLibrary();
 
+        // Every node's visit variable is this followed by the node's name
+        static constexpr const TCHAR* VisitedVariablePrefix = TEXT("$Yarn.Internal.Visiting.");
+
         static FString GenerateUniqueVisitedVariableForNode(const FString& NodeName);
     };
 
@@ -0,0 +1,181 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/CriticalSection.h"
+#include "YarnSpinnerCore/yarn_spinner.pb.h"
+
+#include "YarnSpinnerCore/State.h"
+#include "Value.h"
+
+namespace Yarn
+{
+    // Yarn names are case-sensitive, unlike FString's default map keys
+    template <typename ValueType>
+    struct CaseSensitiveKeyFuncs : BaseKeyFuncs<TPair<FString, ValueType>, FString, false>
+    {
+        static const FString& GetSetKey(const TPair<FString, ValueType>& element) { return element.Key; }
+        static bool Matches(const FString& a, const FString& b) { return a.Equals(b, ESearchCase::CaseSensitive); }
+        static uint32 GetKeyHash(const FString& key) { return FCrc::StrCrc32(*key); }
+    };
+
+    template <typename ValueType>
+    using CaseSensitiveMap = TMap<FString, ValueType, FDefaultSetAllocator, CaseSensitiveKeyFuncs<ValueType>>;
+
+    // Functions the VirtualMachine answers itself instead of asking its host: visit counts and Yarn's standard library
+    enum class Intrinsic : uint8
+    {
+        None,
+        Visited,
+        VisitedCount,
+        Random,
+        RandomRange,
+        Dice,
+        Round,
+        RoundPlaces,
+        Floor,
+        Ceil,
+        Inc,
+        Dec,
+        Decimal,
+        Int,
+        FormatInvariant
+    };
+
+    // An instruction with its operands decoded, labels resolved and names interned
+    struct PreparedInstruction
+    {
+        Instruction_OpCode opcode = Instruction_OpCode_STOP;
+
+        // Line ID for RUN_LINE and ADD_OPTION; function name for CALL_FUNC; command name for RUN_COMMAND, if it has
+        // no substitutions in it
+        FName name;
+
+        // Index into the string pool: command text, option destination, jump label or function name
+        int32 stringIndex = INDEX_NONE;
+
+        // Instruction index to jump to, or INDEX_NONE if the label doesn't exist
+        int32 target = INDEX_NONE;
+
+        // Variable slot for PUSH_VARIABLE and STORE_VARIABLE; call site for CALL_FUNC
+        int32 slot = INDEX_NONE;
+
+        // Number of substitutions for lines, options and commands; parameters for intrinsics
+        int32 count = 0;
+
+        // ADD_OPTION: whether a condition result is waiting on the stack
+        bool hasCondition = false;
+
+        Intrinsic intrinsic = Intrinsic::None;
+
+        // Intrinsics: the node asked about, if it's a string literal naming a node in this program
+        int32 node = INDEX_NONE;
+
+        // PUSH_STRING, PUSH_FLOAT and PUSH_BOOL
+        FValue literal;
+
+        // The instruction this was prepared from, for tracing
+        const Instruction* source = nullptr;
+    };
+
+    struct PreparedNode
+    {
+        FString name;
+
+        // Where the node is in its RuntimeContext
+        int32 index = INDEX_NONE;
+
+        // Variable that counts how many times this node has been visited
+        FString visitVariable;
+
+        // Whether the node's own instructions store to its visit variable, as older compilers' output does, in which
+        // case the VM leaves counting visits to them
+        bool countsOwnVisits = false;
+
+        // Computes the smart variable the node is named after, rather than being dialogue
+        bool isSmartVariable = false;
+
+        TArray<PreparedInstruction> instructions;
+
+        // Label name to instruction index, for JUMP
+        CaseSensitiveMap<int32> labels;
+
+        const Node* source = nullptr;
+    };
+
+    /**
+     * Everything about a program that doesn't change while it runs, prepared once and shared by every VirtualMachine
+     * running it. Also keeps a pool of States so that starting a conversation doesn't have to allocate one.
+     */
+    class YARNSPINNER_API RuntimeContext
+    {
+    public:
+        explicit RuntimeContext(const TSharedRef<const Program>& program);
+        ~RuntimeContext();
+
+        const Program& GetProgram() const { return *program; }
+
+        int32 FindNode(const FString& nodeName) const;
+
+        // Like FindNode, but INDEX_NONE for smart variables' nodes, which are only run to compute their variable
+        int32 FindDialogueNode(const FString& nodeName) const;
+        const PreparedNode& GetNode(int32 nodeIndex) const { return nodes[nodeIndex]; }
+        int32 GetNumNodes() const { return nodes.Num(); }
+
+        const FString& GetString(int32 stringIndex) const { return strings[stringIndex]; }
+        int32 GetNumStrings() const { return strings.Num(); }
+
+        // INDEX_NONE if the string isn't in the program's string pool
+        int32 FindString(const FString& string) const;
+
+        // Identifies the prepared program: its nodes, instructions and strings. Node and string indices are the same
+        // in every context with the same hash, so they can be saved and used again later.
+        uint32 GetProgramHash() const { return programHash; }
+
+        const FString& GetVariableName(int32 slot) const { return variableNames[slot]; }
+        int32 GetNumVariables() const { return variableNames.Num(); }
+        int32 FindVariableSlot(const FString& variableName) const;
+
+        // The value a variable has before anything is stored in it, or null if the program doesn't declare one
+        const FValue* GetInitialValue(int32 slot) const;
+
+        int32 GetNumCallSites() const { return numCallSites; }
+
+        // Smart variables are computed whenever they're read, by a node of their own
+        int32 GetNumSmartVariables() const { return smartVariableNodes.Num(); }
+        const PreparedNode& GetSmartVariableNode(int32 smartVariable) const { return nodes[smartVariableNodes[smartVariable]]; }
+
+        // INDEX_NONE unless the variable in this slot is a smart variable
+        int32 FindSmartVariable(int32 slot) const { return smartVariablesBySlot.IsValidIndex(slot) ? smartVariablesBySlot[slot] : INDEX_NONE; }
+
+        TUniquePtr<State> AcquireState() const;
+        void ReleaseState(TUniquePtr<State>&& state) const;
+
+    private:
+        TSharedRef<const Program> program;
+
+        TArray<PreparedNode> nodes;
+        CaseSensitiveMap<int32> nodeIndices;
+
+        TArray<FString> strings;
+        CaseSensitiveMap<int32> stringIndices;
+
+        uint32 programHash = 0;
+
+        TArray<FString> variableNames;
+        TArray<TOptional<FValue>> initialValues;
+        CaseSensitiveMap<int32> variableSlots;
+
+        int32 numCallSites = 0;
+
+        TArray<int32> smartVariableNodes;
+        TArray<int32> smartVariablesBySlot;
+
+        mutable FCriticalSection statePoolLock;
+        mutable TArray<TUniquePtr<State>> statePool;
+
+        int32 InternString(const std::string& string);
+        int32 InternVariable(const FString& variableName);
+        void PrepareNode(PreparedNode& node, const Node& sourceNode);
+        uint32 HashProgram() const;
+    };
+}
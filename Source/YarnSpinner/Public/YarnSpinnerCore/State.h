@@ -35,5 +35,8 @@ namespace Yarn
         FValue& PeekValue();
 
         void ClearStack();
+
+        // Clears everything for a new conversation, keeping allocations
+        void Reset();
     };
 }
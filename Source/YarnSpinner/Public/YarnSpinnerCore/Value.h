@@ -3,6 +3,8 @@
 #include <string>
 #include <cmath>
 
+#include "Misc/StringBuilder.h"
+
 namespace Yarn
 {
     class YARNSPINNER_API FValue
@@ -114,10 +116,9 @@ namespace Yarn
                 return Data.Get<FString>();
             case Number:
                 {
-                    const double& NumberValue = Data.Get<double>();
-                    return trunc(NumberValue) == NumberValue ?
-                        FString::FromInt(static_cast<int>(NumberValue)) :
-                    FString::SanitizeFloat(NumberValue);
+                    TStringBuilder<32> Builder;
+                    AppendNumber(Builder, Data.Get<double>());
+                    return FString(Builder.ToString());
                 }
             case Bool:
                 return Data.Get<bool>() ? "True" : "False";
@@ -126,6 +127,17 @@ namespace Yarn
             }
         }
         
+        // Converts the value into a format argument without going through a
+        // string, so that numbers keep their type for plural/ordinal rules and
+        // culture-aware formatting.
+        UE_NODISCARD FFormatArgumentValue ConvertToFormatArgument() const;
+
+        // Appends the shortest decimal representation of Number that parses
+        // back to the same value: the same float if Number is exactly one, as
+        // Yarn's numbers usually are, otherwise the same double. Integral
+        // values skip the floating point formatter entirely.
+        static void AppendNumber(FStringBuilderBase& Builder, double Number);
+
         UE_NODISCARD double ConvertToNumber() const
         {
             switch (GetType())
@@ -140,6 +152,27 @@ namespace Yarn
                 return 0;
             }
         }
+
+        // Same type and same value. Strings are compared case-sensitively, unlike FString's own operator==.
+        UE_NODISCARD bool operator==(const FValue& Other) const
+        {
+            if (GetType() != Other.GetType())
+            {
+                return false;
+            }
+
+            switch (GetType())
+            {
+            case String:
+                return Data.Get<FString>().Equals(Other.Data.Get<FString>(), ESearchCase::CaseSensitive);
+            case Bool:
+                return Data.Get<bool>() == Other.Data.Get<bool>();
+            default:
+                return Data.Get<double>() == Other.Data.Get<double>();
+            }
+        }
+
+        UE_NODISCARD bool operator!=(const FValue& Other) const { return !(*this == Other); }
         
     protected:
         TVariant<FString, double, bool> Data;
@@ -168,6 +201,43 @@ namespace Yarn
             Data.Get<FString>() :
             FString();
     }
+
+    // Writes or reads a value: its type, then the value itself
+    FORCEINLINE FArchive& operator<<(FArchive& Archive, FValue& Value)
+    {
+        uint8 Type = static_cast<uint8>(Value.GetType());
+        Archive << Type;
+
+        switch (static_cast<FValue::EValueType>(Type))
+        {
+        case FValue::EValueType::String:
+            {
+                FString String = Value.GetValue<FString>();
+                Archive << String;
+                Value = FValue(String);
+                break;
+            }
+        case FValue::EValueType::Bool:
+            {
+                bool bBool = Value.GetValue<bool>();
+                Archive << bBool;
+                Value = FValue(bBool);
+                break;
+            }
+        case FValue::EValueType::Number:
+            {
+                double Number = Value.GetValue<double>();
+                Archive << Number;
+                Value = FValue(Number);
+                break;
+            }
+        default:
+            Archive.SetError();
+            break;
+        }
+
+        return Archive;
+    }
 }
 
 // String value conversion
@@ -2,11 +2,13 @@
 
 #include <string>
 #include <memory>
+#include "Math/RandomStream.h"
 #include "YarnSpinnerCore/yarn_spinner.pb.h"
 
 #include "YarnSpinnerCore/Common.h"
-#include "YarnSpinnerCore/Library.h"
+#include "YarnSpinnerCore/RuntimeContext.h"
 #include "YarnSpinnerCore/State.h"
+#include "YarnSpinnerCore/VisitCounters.h"
 #include "Value.h"
 
 namespace Yarn
@@ -25,6 +27,64 @@ namespace Yarn
         virtual FValue GetValue(const FString& name) = 0;
 
         virtual void ClearValue(const FString& name) = 0;
+
+        // Adds delta to a number variable, treating one that isn't set or isn't a number as zero, and returns the new
+        // value. Storage that's shared between threads should do it atomically; by default it's a GetValue and a
+        // SetValue.
+        virtual double AddToNumber(const FString& name, double delta);
+
+        // Lets storage keep some of the program's variables itself, by the slot the VM knows them by, rather than by
+        // name. Return true if the slot's variable is kept here, setting outValue if it has a value; return false to
+        // have the VM use the methods above.
+        virtual bool GetSlotValue(int32 slot, TOptional<FValue>& outValue) { return false; }
+        virtual bool SetSlotValue(int32 slot, const FValue& value) { return false; }
+
+        // Counters for the program's visit counts, for storage shared by many VMs to hand out. The VM adds visits to the
+        // counters instead of the visit variables, and the storage is responsible for writing them to the variables.
+        // Return null to have the VM count visits in the variables.
+        virtual TSharedPtr<VisitCounters> GetVisitCounters(const TSharedRef<const RuntimeContext>& context) { return nullptr; }
+
+        // A number that changes whenever any variable does, so the VM can tell nothing has changed without reading
+        // anything, e.g. before using a smart variable's last value. Unset if the storage can't tell.
+        virtual TOptional<uint64> GetChangeCount() { return {}; }
+    };
+
+    // Receives content and function calls straight from the VirtualMachine. Hosts written in C++ should implement this
+    // and pass it to SetDialogueSink rather than binding the delegates below.
+    class YARNSPINNER_API IDialogueSink
+    {
+    public:
+        virtual ~IDialogueSink() = default;
+
+        virtual void HandleLine(const Line& line) = 0;
+        virtual void HandleOptions(const OptionSet& options) = 0;
+        virtual void HandleCommand(const Command& command) = 0;
+        virtual void HandleNodeStart(const FString& nodeName) {}
+        virtual void HandleNodeComplete(const FString& nodeName) {}
+        virtual void HandleDialogueComplete() = 0;
+
+        // Called instead of HandleLine and HandleCommand when content batching is on. Calling Continue acknowledges the
+        // whole batch. By default, items are passed to HandleLine and HandleCommand in turn without waiting in between.
+        virtual void HandleContentBatch(const TArray<ContentItem>& batch);
+
+        // Whether the VM should wait for Continue after a command with this name. Non-blocking commands are passed to
+        // HandleCommand and the VM carries straight on, so their handlers mustn't call Continue. Commands whose name
+        // isn't known until the script runs are always blocking.
+        virtual bool IsCommandBlocking(FName name) { return true; }
+
+        virtual bool HasFunction(FName name) = 0;
+        virtual int GetExpectedFunctionParamCount(FName name) = 0;
+        virtual FValue HandleFunctionCall(FName name, const TArray<FValue>& parameters) = 0;
+
+        // Functions that can't return straight away. The VM calls HandleAsyncFunctionCall instead of
+        // HandleFunctionCall, then waits in WAITING_FOR_FUNCTION_RESULT until SetFunctionResult is called. Setting the
+        // result from inside HandleAsyncFunctionCall carries on without waiting.
+        virtual bool IsAsyncFunction(FName name) { return false; }
+        virtual void HandleAsyncFunctionCall(FName name, const TArray<FValue>& parameters) {}
+
+        // Whether a function's result depends only on its parameters, so that the smart variables that call it can
+        // be kept until something they read changes
+        virtual bool IsPureFunction(FName name) { return false; }
     };
 
     // Function handler delegate definitions
@@ -62,25 +122,117 @@ namespace Yarn
             RUNNING,
 
             /// The VirtualMachine has encountered an error and cannot continue executing.
-            ERROR
+            ERROR,
+
+            /// The VirtualMachine ran out of instructions for this slice in
+            /// the middle of executing code. Call Continue to resume.
+            SUSPENDED,
+
+            /// The VirtualMachine is waiting for an async function to return.
+            /// Call SetFunctionResult before calling Continue.
+            WAITING_FOR_FUNCTION_RESULT
         };
 
+        // Instructions a VirtualMachine may run without delivering any content before it decides it's stuck in a loop
+        static constexpr int32 DefaultRunawayInstructionLimit = 1000000;
+
+        // Most lines and commands collected into one batch before it's delivered anyway
+        static constexpr int32 MaxContentBatchSize = 64;
+
     private:
-        TSharedRef<Program> Program;
+        // Forwards everything to the delegates, for hosts that haven't provided a sink of their own
+        class DelegateSink final : public IDialogueSink
+        {
+        public:
+            explicit DelegateSink(VirtualMachine& vm) : vm(vm) {}
 
-        Node currentNode;
+            virtual void HandleLine(const Line& line) override;
+            virtual void HandleOptions(const OptionSet& options) override;
+            virtual void HandleCommand(const Command& command) override;
+            virtual void HandleNodeStart(const FString& nodeName) override;
+            virtual void HandleNodeComplete(const FString& nodeName) override;
+            virtual void HandleDialogueComplete() override;
+
+            virtual bool HasFunction(FName name) override;
+            virtual int GetExpectedFunctionParamCount(FName name) override;
+            virtual FValue HandleFunctionCall(FName name, const TArray<FValue>& parameters) override;
+
+            bool IsReady() const;
+
+        private:
+            VirtualMachine& vm;
+        };
 
-        FString currentNodeName;
+        TSharedRef<const RuntimeContext> context;
 
-        State state;
+        // Null until SetNode is called
+        const PreparedNode* currentNode = nullptr;
+
+        // Borrowed from the context's pool for as long as this VirtualMachine exists
+        TUniquePtr<State> state;
 
         ExecutionState executionState;
 
-        Library &library;
-        IVariableStorage &variableStorage;
+        IVariableStorage* variableStorage;
+
+        // From the variable storage, if it keeps them
+        TSharedPtr<VisitCounters> visitCounters;
+
+        // What random(), random_range() and dice() draw from
+        FRandomStream randomStream;
+
+        struct SmartVariableRead
+        {
+            // A variable, or INDEX_NONE if this is a node's visit count
+            int32 slot;
+            int32 node;
+            TOptional<FValue> value;
+        };
+
+        // A smart variable's last value, kept until something it read changes
+        struct SmartVariableMemo
+        {
+            TOptional<FValue> value;
+            TArray<SmartVariableRead> reads;
+
+            // The storage's change count when the reads were last known to be current
+            TOptional<uint64> changeCount;
+
+            bool isEvaluating = false;
+        };
+
+        TArray<SmartVariableMemo> smartVariables;
+
+        // Set while a smart variable is being evaluated, to collect what it reads and whether it can be kept
+        TArray<SmartVariableRead>* smartVariableReads = nullptr;
+        bool isSmartVariablePure = true;
+
+        // Instructions run since content was last delivered, across slices
+        int32 instructionsSinceContent = 0;
+        int32 runawayInstructionLimit;
+
+        // Call sites whose function has already been found and had its parameter count checked
+        TBitArray<> checkedCallSites;
+
+        bool batchContent = false;
+
+        // Lines and commands collected since the last blocking point, when batching content
+        TArray<ContentItem> contentBatch;
+        TArray<ContentItem> spareContentBatch;
+
+        DelegateSink delegateSink;
+        IDialogueSink* sink;
 
     public:
-        VirtualMachine(const TSharedRef<Yarn::Program>& Program, Library &Library, IVariableStorage &VariableStorage);
+        VirtualMachine(const TSharedRef<const RuntimeContext>& Context, IVariableStorage &VariableStorage);
+        ~VirtualMachine();
+
+        // delegateSink refers back to this VirtualMachine and sink may point at it, so a copy or move would leave
+        // both pointing into the original
+        VirtualMachine(const VirtualMachine&) = delete;
+        VirtualMachine(VirtualMachine&&) = delete;
+        VirtualMachine& operator=(const VirtualMachine&) = delete;
+        VirtualMachine& operator=(VirtualMachine&&) = delete;
 
         bool SetNode(const FString& NodeName);
         const char *GetCurrentNodeName();
@@ -90,7 +242,52 @@ namespace Yarn
         // Begins or continues execution of the virtual machine.
         bool Continue();
 
-        // Function handlers
+        // Like Continue, but stops in the SUSPENDED state after running maxInstructions instructions without reaching
+        // any content. Zero means no limit.
+        bool Continue(int32 maxInstructions);
+
+        // Collects consecutive lines into one HandleContentBatch call instead of stopping after each of them. A batch ends
+        // at a command, options or the end of the dialogue, which are held back until the batch has been acknowledged.
+        void SetContentBatching(bool enabled) { batchContent = enabled; }
+
+        // Abandons the node without completing it; nothing more is delivered. Safe to call from inside a handler.
+        void Stop();
+
+        // Stops with an error after this many instructions without any content, which almost always means a script
+        // is stuck in a loop. Zero means no limit.
+        void SetRunawayInstructionLimit(int32 limit) { runawayInstructionLimit = limit; }
+
+        // The seed random(), random_range() and dice() draw from next, which moves on with every draw. Each VM starts
+        // with a seed of its own; setting one makes them return the same sequence every time, e.g. for replays.
+        // Snapshots save it too.
+        void SetRandomSeed(int32 seed) { randomStream.Initialize(seed); }
+        int32 GetRandomSeed() const { return randomStream.GetCurrentSeed(); }
+
+        const TSharedRef<const RuntimeContext>& GetContext() const { return context; }
+
+        // Reads and writes variables somewhere else from now on, e.g. after running ahead against a copy of them
+        void SetVariableStorage(IVariableStorage& newVariableStorage);
+
+        // Sends content and function calls to the given sink instead of the delegates. Pass null to go back to the
+        // delegates.
+        void SetDialogueSink(IDialogueSink* newSink);
+
+        // Heap memory owned by this VirtualMachine and its State, not counting the shared context
+        SIZE_T GetAllocatedSize() const;
+
+        // Writes where the VM is up to, i.e. its node, program counter, stack, options and random seed, so that
+        // LoadSnapshot can carry on from the same place later, e.g. from a save game. Strings from the program are
+        // written as indices into its string pool. Only works while stopped or waiting, with no batched content left
+        // to deliver.
+        bool SaveSnapshot(FArchive& archive) const;
+
+        // Carries on from a snapshot written by SaveSnapshot. Nothing is delivered; the host presents whatever the VM
+        // is waiting on itself. Fails, leaving the VM as it was, if the snapshot was written by a different program.
+        bool LoadSnapshot(FArchive& archive);
+
+        const TArray<Option>& GetCurrentOptions() const { return state->currentOptions; }
+
+        // Function handlers, used when no sink has been set
         FOnLine OnLine;
         FOnOptions OnOptions;
         FOnCommand OnCommand;
@@ -103,12 +300,36 @@ namespace Yarn
 
         void SetSelectedOption(int selectedOptionIndex);
 
+        // Supplies the value the async function being waited on returned
+        void SetFunctionResult(const FValue& result);
+
         static FString ExpandSubstitutions(const FString& TemplateString, const TArray<FString>& Substitutions);
 
     private:
         void SetCurrentExecutionState(ExecutionState state);
         bool CheckCanContinue() const;
-        bool RunInstruction(Instruction&instruction);
+        bool DeliverContentBatch();
+        void CompleteNode();
+
+        // Counts a visit to the current node as it completes
+        void RecordVisit();
+        bool RunInstruction(const PreparedInstruction& instruction);
+        bool CallFunction(const PreparedInstruction& instruction, bool async);
+        bool CallIntrinsic(const PreparedInstruction& instruction, int actualParamCount);
+        bool PushVariable(int32 slot);
+
+        // The variable's value from storage, or its initial value, or unset if it has neither
+        TOptional<FValue> ReadVariable(int32 slot);
+
+        bool PushSmartVariable(int32 smartVariable);
+        bool IsSmartVariableCurrent(SmartVariableMemo& memo);
+
+        // The storage's change count, moved on by every visit too when visits are counted apart from the variables
+        TOptional<uint64> GetChangeCount() const;
+
+        // Runs a smart variable's node, in the middle of whatever read it, and takes the value it leaves on the stack
+        bool EvaluateSmartVariable(const PreparedNode& node, FValue& outValue);
+        double GetVisitCount(int32 nodeIndex, const FString& nodeName);
         int FindInstructionPointForLabel(const FString& Label);
     };
 }
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+
+#include "CoreMinimal.h"
+#include "YarnSpinnerCore/RuntimeContext.h"
+
+namespace Yarn
+{
+    /**
+     * How many times each node in a program has been visited, in an array by node index. Storage that keeps counters
+     * (see IVariableStorage::GetVisitCounters) keeps visit counts here rather than in the nodes' visit variables: the
+     * VM adds a visit with one atomic increment, and visited() and visited_count() calls whose node is known when the
+     * program is linked are a single load. The storage collects the visits now and then and writes them to the visit
+     * variables, which are what gets saved, and sets counts here when a visit variable is changed any other way.
+     * Counts can be read and incremented on any thread.
+     */
+    class YARNSPINNER_API VisitCounters
+    {
+    public:
+        explicit VisitCounters(const TSharedRef<const RuntimeContext>& context);
+
+        const RuntimeContext& GetContext() const { return *context; }
+
+        double Get(int32 nodeIndex) const { return counts[nodeIndex].load(std::memory_order_relaxed); }
+
+        void AddVisit(int32 nodeIndex);
+
+        // Sets a node's count from its visit variable, or from the program's initial value if value is null. The count
+        // agrees with the variable again, so visits before this aren't collected.
+        void Set(int32 nodeIndex, const FValue* value);
+
+        // The node a visit variable belongs to, or INDEX_NONE if it isn't one of this program's
+        int32 FindNodeForVariable(const FString& variableName) const;
+
+        // Whether the node's count is ahead of its visit variable
+        bool IsUncollected(int32 nodeIndex) const { return uncollected[nodeIndex].load(std::memory_order_acquire); }
+        bool HasUncollectedVisits() const { return anyUncollected.load(std::memory_order_acquire); }
+
+        // Calls collect with each node visited since the last time and its count, e.g. to write them to the visit
+        // variables. A visit made while this runs is collected now or next time, never lost.
+        void CollectVisits(TFunctionRef<void(int32 nodeIndex, double count)> collect);
+
+        // Goes up whenever any count changes
+        uint64 GetChangeCount() const { return changeCount.load(std::memory_order_acquire); }
+
+    private:
+        TSharedRef<const RuntimeContext> context;
+        TUniquePtr<std::atomic<double>[]> counts;
+        TUniquePtr<std::atomic<bool>[]> uncollected;
+        std::atomic<bool> anyUncollected{false};
+        std::atomic<uint64> changeCount{0};
+    };
+}
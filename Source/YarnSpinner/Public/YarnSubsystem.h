@@ -7,20 +7,66 @@
 
 #include "Engine/DataTable.h"
 #include "Engine/ObjectLibrary.h"
+#include "Misc/ScopeRWLock.h"
+#include "Misc/YarnConcurrentVariables.h"
+#include "Misc/YarnVariableJournal.h"
+#include "Misc/YarnVariableMap.h"
+#include "Tickable.h"
+#include "YarnBarkRuntime.h"
+#include "YarnDialogueScheduler.h"
+#include "YarnLatentScheduler.h"
 #include "YarnSpinnerCore/VirtualMachine.h"
 
 #include "YarnSubsystem.generated.h"
 
+class UYarnProject;
+
+
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FOnYarnBarkLines, const TArray<FYarnBarkLine>&, Lines);
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FOnYarnBarkCommands, const TArray<FYarnBarkCommand>&, Commands);
+DECLARE_DYNAMIC_DELEGATE(FYarnLatentDelegate);
+DECLARE_DYNAMIC_DELEGATE_OneParam(FYarnVariableChangedDelegate, const FString&, Name);
+
+
+// Every variable in the subsystem at one moment. Snapshots share memory with each other and the live variables, so
+// they're cheap to take and to keep; see FYarnVariableMap.
+USTRUCT(BlueprintType)
+struct YARNSPINNER_API FYarnVariableSnapshot
+{
+    GENERATED_BODY()
+
+    FYarnVariableMap Variables;
+};
+
+
+USTRUCT(BlueprintType)
+struct YARNSPINNER_API FYarnVariableWatchHandle
+{
+    GENERATED_BODY()
+
+    uint32 ID = 0;
+
+    bool IsValid() const { return ID != 0; }
+};
+
+
 /**
  * 
  */
 UCLASS()
-class YARNSPINNER_API UYarnSubsystem : public UGameInstanceSubsystem, public Yarn::IVariableStorage
+class YARNSPINNER_API UYarnSubsystem : public UGameInstanceSubsystem, public FTickableGameObject, public Yarn::IVariableStorage
 {
     GENERATED_BODY()
 public:
     UYarnSubsystem();
 
+    virtual void Deinitialize() override;
+
+    // FTickableGameObject
+    virtual void Tick(float DeltaTime) override;
+    virtual bool IsTickable() const override;
+    virtual TStatId GetStatId() const override;
+
     virtual void SetValue(const FString& name, bool value) override;
     virtual void SetValue(const FString& name, float value) override;
     virtual void SetValue(const FString& name, const FString& value) override;
@@ -30,8 +76,110 @@ public:
 
     virtual void ClearValue(const FString& name) override;
 
+    virtual double AddToNumber(const FString& name, double delta) override;
+    virtual TOptional<uint64> GetChangeCount() override;
+
+    // One set of counters per program, shared by every VM running it. Visits are written to the visit variables once a
+    // frame, and whenever the variables are snapshotted or journalled, rather than as each node completes.
+    virtual TSharedPtr<Yarn::VisitCounters> GetVisitCounters(const TSharedRef<const Yarn::RuntimeContext>& Context) override;
+
+    // Called with a variable's new value, or null if it was cleared
+    using FVariableChangedCallback = TFunction<void(const FString& Name, const Yarn::FValue* Value)>;
+
+    // Calls Callback whenever the variable changes. Changes are gathered up and passed on at the end of each burst of
+    // dialogue and once a frame, so a variable set several times in between is only passed on once, with its last
+    // value, and not at all if it ends up back where it was.
+    FYarnVariableWatchHandle WatchVariable(const FString& Name, FVariableChangedCallback&& Callback);
+
+    // Like WatchVariable, for every variable whose name starts with Prefix, e.g. "$quest_"
+    FYarnVariableWatchHandle WatchVariablePrefix(const FString& Prefix, FVariableChangedCallback&& Callback);
+
+    // Blueprint version of WatchVariable and WatchVariablePrefix
+    UFUNCTION(BlueprintCallable, Category="Yarn Spinner|Variables")
+    FYarnVariableWatchHandle WatchVariables(const FString& NameOrPrefix, bool bIsPrefix, FYarnVariableChangedDelegate Callback);
+
+    // Returns false if the handle wasn't watching anything
+    UFUNCTION(BlueprintCallable, Category="Yarn Spinner|Variables")
+    bool UnwatchVariables(FYarnVariableWatchHandle Handle);
+
+    // Passes on every change since the last time to the watchers straight away. Called by dialogue runners after
+    // each burst of dialogue, and by the subsystem every frame.
+    void DispatchVariableChanges();
+
+    // Keeps variables in Directory from now on, journalling every change so that saving costs next to nothing; see
+    // FYarnVariableJournal. Replaces the variables with those recovered from Directory, so call it before any dialogue
+    // runs. Returns false, leaving the variables as they are, if the journal can't be opened. An empty Directory means
+    // Saved/YarnSpinner/Variables.
+    UFUNCTION(BlueprintCallable, Category="Yarn Spinner|Variables")
+    bool EnableVariableJournal(const FString& Directory);
+
+    UFUNCTION(BlueprintCallable, Category="Yarn Spinner|Variables")
+    void DisableVariableJournal();
+
+    // Writes changes to the journal now instead of at the end of the frame, e.g. at an autosave
+    UFUNCTION(BlueprintCallable, Category="Yarn Spinner|Variables")
+    bool FlushVariableJournal();
+
+    // Takes O(1) time however many variables there are, so it can be done for every line, e.g. for rewind
+    UFUNCTION(BlueprintCallable, Category="Yarn Spinner|Variables")
+    FYarnVariableSnapshot SnapshotVariables() const;
+
+    // Puts every variable back as it was when Snapshot was taken, also in O(1)
+    UFUNCTION(BlueprintCallable, Category="Yarn Spinner|Variables")
+    void RestoreVariables(const FYarnVariableSnapshot& Snapshot);
+
+    // Names of the variables that were set, changed or cleared between two snapshots
+    UFUNCTION(BlueprintPure, Category="Yarn Spinner|Variables")
+    static TArray<FString> DiffVariableSnapshots(const FYarnVariableSnapshot& From, const FYarnVariableSnapshot& To);
+
     UE_NODISCARD FORCEINLINE const UYarnLibraryRegistry* GetYarnLibraryRegistry() const { return YarnFunctionRegistry; }
 
+    // Runs continue requests from every dialogue runner and bark within a per-frame budget
+    FYarnDialogueScheduler& GetDialogueScheduler() { return DialogueScheduler; }
+
+    UFUNCTION(BlueprintPure, Category="Yarn Spinner")
+    FYarnDialogueSchedulerStats GetDialogueSchedulerStats() const { return DialogueScheduler.GetStats(); }
+
+    // Runs callbacks after a delay of game time, which stops while the game is paused. Used by <<wait>> and
+    // ADialogueRunner::ContinueDialogueAfter.
+    FYarnLatentScheduler& GetLatentScheduler() { return LatentScheduler; }
+
+    // Calls Callback after DelaySeconds of game time. Commands can use this to carry on later without a timer of their
+    // own; pass the dialogue runner as Owner and it's cancelled when the runner's dialogue stops.
+    UFUNCTION(BlueprintCallable, Category="Yarn Spinner|Latent")
+    FYarnLatentHandle ScheduleLatent(UObject* Owner, float DelaySeconds, FYarnLatentDelegate Callback);
+
+    UFUNCTION(BlueprintCallable, Category="Yarn Spinner|Latent")
+    bool CancelLatent(FYarnLatentHandle Handle);
+
+    // Cancels everything scheduled for Owner. Returns how many callbacks were cancelled.
+    UFUNCTION(BlueprintCallable, Category="Yarn Spinner|Latent")
+    int32 CancelAllLatent(UObject* Owner);
+
+    // Runs barks: short conversations for NPCs that don't need a dialogue runner. Created on first use.
+    FYarnBarkRuntime& GetBarkRuntime();
+
+    // Starts a bark. With a positive LineDuration, each line continues by itself after that many seconds; otherwise call ContinueBark.
+    UFUNCTION(BlueprintCallable, Category="Yarn Spinner|Barks")
+    FYarnBarkHandle StartBark(UYarnProject* YarnProject, FName NodeName, float LineDuration = 3.0f);
+
+    UFUNCTION(BlueprintCallable, Category="Yarn Spinner|Barks")
+    void ContinueBark(FYarnBarkHandle Bark);
+
+    UFUNCTION(BlueprintCallable, Category="Yarn Spinner|Barks")
+    void StopBark(FYarnBarkHandle Bark);
+
+    UFUNCTION(BlueprintPure, Category="Yarn Spinner|Barks")
+    bool IsBarkRunning(FYarnBarkHandle Bark) const;
+
+    // Lines from every running bark, delivered once per frame
+    UPROPERTY(BlueprintAssignable, Category="Yarn Spinner|Barks")
+    FOnYarnBarkLines OnBarkLines;
+
+    // Commands from every running bark other than <<wait>>, delivered once per frame
+    UPROPERTY(BlueprintAssignable, Category="Yarn Spinner|Barks")
+    FOnYarnBarkCommands OnBarkCommands;
+
 private:
     // UPROPERTY()
     // TMap<UYarnProjectAsset*, TMap<FName, UDataTable*>> LocTextDataTables;
@@ -44,7 +192,54 @@ private:
     UPROPERTY()
     UObjectLibrary* YarnCommandObjectLibrary;
     
-    TMap<FString, Yarn::FValue> Variables;
+    // Read and written by workers running dialogue too. Reads never wait; see FYarnConcurrentVariables.
+    FYarnConcurrentVariables Variables;
+
+    void SetVariable(const FString& Name, const Yarn::FValue& Value);
+
+    // Visit counters by program hash. Counts are set from inside a variable update, so a visit variable that's changed
+    // directly always wins, but visits are added to the counters by VMs on any thread and are only in the variables
+    // once they've been collected. Added to under the write lock, which readers outside an update take to read.
+    TMap<uint32, TSharedRef<Yarn::VisitCounters>> VisitCountersByProgram;
+    mutable FRWLock VisitCountersLock;
+
+    // Called with the variables after Name has changed
+    void UpdateVisitCounter(const FString& Name, const FYarnVariableMap& Map);
+    static void SeedVisitCounters(Yarn::VisitCounters& Counters, const FYarnVariableMap& Map);
+
+    // Writes visits the counters have that the variables don't yet to the visit variables
+    void CollectVisits();
+    void CollectVisits(FYarnVariableMap& Map);
+
+    // A visit variable's count if its counter is ahead of it, i.e. the value it will have once visits are collected
+    TOptional<Yarn::FValue> FindUncollectedVisits(const FString& Name) const;
+
+    struct FVariableWatcher
+    {
+        FString NameOrPrefix;
+        bool bIsPrefix = false;
+        FVariableChangedCallback Callback;
+    };
+
+    TMap<uint32, FVariableWatcher> VariableWatchers;
+    TMultiMap<FString, uint32> VariableWatchersByName;
+    TArray<uint32> PrefixVariableWatchers;
+    uint32 LastVariableWatcherID = 0;
+
+    // The variables as the watchers last heard about them
+    FYarnVariableMap DispatchedVariables;
+    bool bIsDispatchingVariableChanges = false;
+
+    FYarnVariableWatchHandle AddVariableWatcher(const FString& NameOrPrefix, bool bIsPrefix, FVariableChangedCallback&& Callback);
+
+    // Set while variables are kept on disk. Only used from inside a variable update, so changes are journalled in the
+    // order they're made.
+    TUniquePtr<FYarnVariableJournal> VariableJournal;
+
+    FYarnDialogueScheduler DialogueScheduler;
+    FYarnLatentScheduler LatentScheduler;
+
+    TUniquePtr<FYarnBarkRuntime> BarkRuntime;
     
     FDelegateHandle OnAssetRegistryFilesLoadedHandle;
     FDelegateHandle OnLevelAddedToWorldHandle;
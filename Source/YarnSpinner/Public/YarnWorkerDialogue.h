@@ -0,0 +1,91 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Async/TaskGraphInterfaces.h"
+#include "Containers/Queue.h"
+
+#include <atomic>
+
+THIRD_PARTY_INCLUDES_START
+#include "YarnSpinnerCore/VirtualMachine.h"
+THIRD_PARTY_INCLUDES_END
+
+class UYarnLibraryRegistry;
+
+
+/**
+ * Runs a Yarn::VirtualMachine on task graph worker threads instead of the game thread.
+ *
+ * The VM's lines, options and commands go into a single-producer, single-consumer queue, and Drain passes them to a
+ * sink on the game thread. Functions the library registry knows are thread-safe (the standard library, and native and
+ * async functions flagged bIsThreadSafe) run inline on the worker. Anything else, including Blueprint functions, runs
+ * on the game thread while the worker waits for its result; other async functions are started there and waited for on
+ * the worker. Variables are read and written from the worker, so the variable storage must be thread-safe.
+ *
+ * Continue and SetSelectedOption queue a request and return straight away; the worker handles requests one at a time,
+ * in order. Apart from that, everything here is for the game thread. Call Wait before destroying the variable storage
+ * or library registry.
+ */
+class YARNSPINNER_API FYarnWorkerDialogue : public TSharedFromThis<FYarnWorkerDialogue, ESPMode::ThreadSafe>
+{
+public:
+    FYarnWorkerDialogue(const TSharedRef<const Yarn::RuntimeContext>& Context, Yarn::IVariableStorage& VariableStorage, const UYarnLibraryRegistry* InLibraryRegistry);
+    ~FYarnWorkerDialogue();
+
+    // Only while the worker is idle, e.g. before the first Continue
+    bool SetNode(const FString& NodeName);
+
+    void Continue();
+    void SetSelectedOption(int32 OptionID);
+
+    // Passes everything the VM has produced so far to Sink, in order. Returns how many items were delivered.
+    int32 Drain(Yarn::IDialogueSink& Sink);
+
+    // Blocks until the worker has handled every request, running any game thread work it's waiting on meanwhile
+    void Wait();
+
+    bool IsIdle() const { return PendingRequests.load() == 0; }
+
+private:
+    class FWorkerSink;
+
+    struct FRequest
+    {
+        // INDEX_NONE just continues
+        int32 OptionID = INDEX_NONE;
+    };
+
+    struct FContent
+    {
+        enum class EType : uint8
+        {
+            Line,
+            Options,
+            Command,
+            NodeStart,
+            NodeComplete,
+            DialogueComplete
+        };
+
+        EType Type = EType::Line;
+        Yarn::Line Line;
+        Yarn::OptionSet Options;
+        Yarn::Command Command;
+        FString NodeName;
+    };
+
+    const UYarnLibraryRegistry* LibraryRegistry;
+    TUniquePtr<FWorkerSink> WorkerSink;
+    TUniquePtr<Yarn::VirtualMachine> VirtualMachine;
+
+    // Game thread to worker
+    TQueue<FRequest, EQueueMode::Spsc> Requests;
+    std::atomic<int32> PendingRequests{0};
+    FGraphEventRef WorkerTask;
+
+    // Worker to game thread
+    TQueue<FContent, EQueueMode::Spsc> Content;
+
+    void Post(const FRequest& Request);
+    void ProcessRequests();
+};
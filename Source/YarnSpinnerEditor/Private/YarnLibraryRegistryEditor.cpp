@@ -139,6 +139,11 @@ void UYarnLibraryRegistryEditor::ExtractFunctionDataFromBlueprintGraph(UBlueprin
                 FuncMeta.bIsConst = true;
                 // YS_LOG("CONST FUNCTION")
             }
+            // Commands that don't continue the dialogue runner themselves are marked with a 'NonBlocking' keyword
+            if (EntryNode->MetaData.Keywords.ToString().Contains(TEXT("NonBlocking")))
+            {
+                FuncDetails.bIsBlocking = false;
+            }
 
             YS_LOG("Node is a function entry node with %d pins", Node->Pins.Num())
             for (auto Pin : Node->Pins)
@@ -273,6 +278,7 @@ void UYarnLibraryRegistryEditor::AddToYSLSData(FYarnBlueprintLibFunction FuncDet
             Action.Parameters.Add(Parameter);
             Action.Signature += " " + Parameter.Name;
         }
+        Action.IsBlocking = FuncDetails.bIsBlocking;
         YSLSData.Commands.Add(Action);
     }
     else